@@ -0,0 +1,436 @@
+// Measures load time, time to first token, serial decode and sequence prefill throughput, and peak memory usage of a model.
+// Results are printed to stdout as JSON or CSV, so that they can be compared across ggml versions and machines.
+// Progress and errors are printed to stderr.
+
+#include "rwkv.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+// Maps GetProcessMemoryInfo to kernel32, so that psapi does not need to be linked.
+#define PSAPI_VERSION 2
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+#define MAX_LIST_LEN 32
+
+struct options {
+    const char * model_path;
+    const char * format;
+    uint32_t threads[MAX_LIST_LEN];
+    size_t threads_count;
+    size_t lengths[MAX_LIST_LEN];
+    size_t lengths_count;
+    size_t decode_tokens;
+    size_t prompt_tokens;
+    size_t warmup;
+    size_t reps;
+    bool csv;
+};
+
+struct result {
+    const char * benchmark;
+    uint32_t threads;
+    size_t tokens;
+    double median_ms;
+    double min_ms;
+    double max_ms;
+};
+
+// Returns monotonic time in milliseconds.
+double time_ms(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart * 1000.0 / (double) frequency.QuadPart;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec * 1000.0 + (double) time.tv_nsec / 1000000.0;
+#endif
+}
+
+// Returns peak resident set size of the process in bytes, or 0 if it is not available.
+size_t peak_rss_bytes(void) {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? (size_t) counters.PeakWorkingSetSize : 0;
+#else
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+
+#ifdef __APPLE__
+    return (size_t) usage.ru_maxrss;
+#else
+    // Linux and BSDs report kilobytes.
+    return (size_t) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Parses a comma-separated list of positive integers. Returns the number of parsed values, or 0 on error.
+size_t parse_list(const char * string, size_t * values) {
+    size_t count = 0;
+
+    while (*string) {
+        char * end;
+        unsigned long value = strtoul(string, &end, 10);
+
+        if (end == string || value == 0 || count == MAX_LIST_LEN || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+
+        values[count++] = (size_t) value;
+        string = *end ? end + 1 : end;
+    }
+
+    return count;
+}
+
+int compare_doubles(const void * a, const void * b) {
+    const double x = *(const double *) a;
+    const double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Fills the result with statistics of repetition durations; sorts durations in place.
+void summarize(struct result * result, double * durations, const size_t reps) {
+    qsort(durations, reps, sizeof(double), compare_doubles);
+    result->median_ms = reps % 2 ? durations[reps / 2] : (durations[reps / 2 - 1] + durations[reps / 2]) / 2.0;
+    result->min_ms = durations[0];
+    result->max_ms = durations[reps - 1];
+}
+
+double tokens_per_second(const struct result * result) {
+    return result->median_ms > 0.0 ? (double) result->tokens * 1000.0 / result->median_ms : 0.0;
+}
+
+void print_usage(const char * program) {
+    fprintf(
+        stderr,
+        "Usage: %s MODEL [options]\n\n"
+        "Options:\n"
+        "  --threads LIST   comma-separated thread counts to sweep, default 1,2,4\n"
+        "  --lengths LIST   comma-separated sequence lengths for prefill, default 1,16,64,256\n"
+        "  --decode N       tokens evaluated one by one for decode throughput, default 64\n"
+        "  --prompt N       prompt length for time to first token, default 64\n"
+        "  --warmup N       untimed repetitions before measuring, default 1\n"
+        "  --reps N         timed repetitions, default 3\n"
+        "  --format FORMAT  format to convert the model into while loading, see rwkv_init_from_file_ex\n"
+        "  --csv            print CSV instead of JSON\n",
+        program
+    );
+}
+
+bool parse_options(int argc, char * argv[], struct options * options) {
+    size_t threads[MAX_LIST_LEN];
+
+    options->model_path = NULL;
+    options->format = NULL;
+    options->threads_count = parse_list("1,2,4", threads);
+    options->lengths_count = parse_list("1,16,64,256", options->lengths);
+    options->decode_tokens = 64;
+    options->prompt_tokens = 64;
+    options->warmup = 1;
+    options->reps = 3;
+    options->csv = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char * arg = argv[i];
+        const char * value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--csv") == 0) {
+            options->csv = true;
+            continue;
+        }
+
+        if (arg[0] != '-') {
+            if (options->model_path) {
+                return false;
+            }
+
+            options->model_path = arg;
+            continue;
+        }
+
+        if (!value) {
+            return false;
+        }
+
+        i++;
+
+        if (strcmp(arg, "--threads") == 0) {
+            options->threads_count = parse_list(value, threads);
+        } else if (strcmp(arg, "--lengths") == 0) {
+            options->lengths_count = parse_list(value, options->lengths);
+        } else if (strcmp(arg, "--decode") == 0) {
+            options->decode_tokens = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--prompt") == 0) {
+            options->prompt_tokens = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--warmup") == 0) {
+            options->warmup = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--reps") == 0) {
+            options->reps = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--format") == 0) {
+            options->format = value;
+        } else {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < options->threads_count; i++) {
+        options->threads[i] = (uint32_t) threads[i];
+    }
+
+    return options->model_path && options->threads_count && options->lengths_count &&
+        options->decode_tokens && options->prompt_tokens && options->reps;
+}
+
+// Time to first token: evaluates the prompt with a context that has never built a sequence graph, like a freshly started server would.
+bool bench_ttft(struct rwkv_context * base_ctx, const struct options * options, const uint32_t n_threads,
+    const uint32_t * tokens, float * logits, double * durations, struct result * result) {
+    for (size_t rep = 0; rep < options->warmup + options->reps; rep++) {
+        struct rwkv_context * ctx = rwkv_clone_context(base_ctx, n_threads);
+
+        if (!ctx) {
+            return false;
+        }
+
+        double start = time_ms();
+        bool success = rwkv_eval_sequence(ctx, tokens, options->prompt_tokens, NULL, NULL, logits);
+        double end = time_ms();
+
+        rwkv_free(ctx);
+
+        if (!success) {
+            return false;
+        }
+
+        if (rep >= options->warmup) {
+            durations[rep - options->warmup] = end - start;
+        }
+    }
+
+    result->benchmark = "ttft";
+    result->threads = n_threads;
+    result->tokens = options->prompt_tokens;
+    summarize(result, durations, options->reps);
+    return true;
+}
+
+// Decode: evaluates tokens one by one, carrying the state, and computing logits for each token.
+bool bench_decode(struct rwkv_context * ctx, const struct options * options, const uint32_t * tokens,
+    float * state, float * logits, double * durations, struct result * result) {
+    for (size_t rep = 0; rep < options->warmup + options->reps; rep++) {
+        rwkv_init_state(ctx, state);
+
+        double start = time_ms();
+
+        for (size_t i = 0; i < options->decode_tokens; i++) {
+            if (!rwkv_eval(ctx, tokens[i], state, state, logits)) {
+                return false;
+            }
+        }
+
+        double end = time_ms();
+
+        if (rep >= options->warmup) {
+            durations[rep - options->warmup] = end - start;
+        }
+    }
+
+    result->benchmark = "decode";
+    result->tokens = options->decode_tokens;
+    summarize(result, durations, options->reps);
+    return true;
+}
+
+// Prefill: evaluates a whole sequence at once. The graph for the sequence length is built during warmup, or during the first repetition.
+bool bench_prefill(struct rwkv_context * ctx, const struct options * options, const size_t sequence_len, const uint32_t * tokens,
+    float * state, float * logits, double * durations, struct result * result) {
+    for (size_t rep = 0; rep < options->warmup + options->reps; rep++) {
+        rwkv_init_state(ctx, state);
+
+        double start = time_ms();
+        bool success = rwkv_eval_sequence(ctx, tokens, sequence_len, state, state, logits);
+        double end = time_ms();
+
+        if (!success) {
+            return false;
+        }
+
+        if (rep >= options->warmup) {
+            durations[rep - options->warmup] = end - start;
+        }
+    }
+
+    result->benchmark = "prefill";
+    result->tokens = sequence_len;
+    summarize(result, durations, options->reps);
+    return true;
+}
+
+void print_json_string(const char * string) {
+    putchar('"');
+
+    for (; *string; string++) {
+        if (*string == '"' || *string == '\\') {
+            printf("\\%c", *string);
+        } else if ((unsigned char) *string < 0x20) {
+            printf("\\u%04x", (unsigned int) (unsigned char) *string);
+        } else {
+            putchar(*string);
+        }
+    }
+
+    putchar('"');
+}
+
+void print_json(const struct options * options, struct rwkv_context * ctx, const double load_ms, const size_t peak_rss,
+    const struct result * results, const size_t results_count) {
+    printf("{\n  \"model\": ");
+    print_json_string(options->model_path);
+    printf(",\n  \"format\": ");
+
+    if (options->format) {
+        print_json_string(options->format);
+    } else {
+        printf("null");
+    }
+
+    printf(",\n  \"system_info\": ");
+    print_json_string(rwkv_get_system_info_string());
+    printf(",\n");
+    printf("  \"n_vocab\": %zu,\n  \"n_embed\": %zu,\n  \"n_layer\": %zu,\n", rwkv_get_n_vocab(ctx), rwkv_get_n_embed(ctx), rwkv_get_n_layer(ctx));
+    printf("  \"warmup\": %zu,\n  \"reps\": %zu,\n", options->warmup, options->reps);
+    printf("  \"load_ms\": %.3f,\n  \"peak_rss_bytes\": %zu,\n  \"results\": [\n", load_ms, peak_rss);
+
+    for (size_t i = 0; i < results_count; i++) {
+        const struct result * result = &results[i];
+        printf(
+            "    {\"benchmark\": \"%s\", \"threads\": %u, \"tokens\": %zu, \"median_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, \"tokens_per_second\": %.2f}%s\n",
+            result->benchmark, result->threads, result->tokens, result->median_ms, result->min_ms, result->max_ms,
+            tokens_per_second(result), i + 1 < results_count ? "," : ""
+        );
+    }
+
+    printf("  ]\n}\n");
+}
+
+void print_csv(const struct options * options, const double load_ms, const size_t peak_rss, const struct result * results, const size_t results_count) {
+    // Commas and quotes in the model path would break naive parsers, so the path is always quoted.
+    printf("model,format,benchmark,threads,tokens,median_ms,min_ms,max_ms,tokens_per_second,peak_rss_bytes\n");
+    printf("\"%s\",%s,load,%u,0,%.3f,%.3f,%.3f,0,%zu\n", options->model_path, options->format ? options->format : "", options->threads[0],
+        load_ms, load_ms, load_ms, peak_rss);
+
+    for (size_t i = 0; i < results_count; i++) {
+        const struct result * result = &results[i];
+        printf(
+            "\"%s\",%s,%s,%u,%zu,%.3f,%.3f,%.3f,%.2f,%zu\n",
+            options->model_path, options->format ? options->format : "", result->benchmark, result->threads, result->tokens,
+            result->median_ms, result->min_ms, result->max_ms, tokens_per_second(result), peak_rss
+        );
+    }
+}
+
+int main(int argc, char * argv[]) {
+    struct options options;
+
+    if (!parse_options(argc, argv, &options)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Loading %s\n", options.model_path);
+
+    double load_start = time_ms();
+    struct rwkv_context * base_ctx = rwkv_init_from_file_ex(options.model_path, options.threads[0], RWKV_INIT_NONE, options.format);
+    double load_ms = time_ms() - load_start;
+
+    if (!base_ctx) {
+        fprintf(stderr, "Failed to load the model: 0x%.8X\n", rwkv_get_last_error(NULL));
+        return EXIT_FAILURE;
+    }
+
+    size_t max_tokens = options.decode_tokens > options.prompt_tokens ? options.decode_tokens : options.prompt_tokens;
+
+    for (size_t i = 0; i < options.lengths_count; i++) {
+        max_tokens = options.lengths[i] > max_tokens ? options.lengths[i] : max_tokens;
+    }
+
+    // Token values do not affect speed; use deterministic pseudo-random tokens so that runs are reproducible.
+    const size_t n_vocab = rwkv_get_n_vocab(base_ctx);
+    uint32_t * tokens = malloc(max_tokens * sizeof(uint32_t));
+    float * state = malloc(rwkv_get_state_len(base_ctx) * sizeof(float));
+    float * logits = malloc(rwkv_get_logits_len(base_ctx) * sizeof(float));
+    double * durations = malloc(options.reps * sizeof(double));
+    const size_t max_results = options.threads_count * (2 + options.lengths_count);
+    struct result * results = calloc(max_results, sizeof(struct result));
+    size_t results_count = 0;
+    bool success = tokens && state && logits && durations && results;
+
+    if (tokens) {
+        uint32_t seed = 42;
+
+        for (size_t i = 0; i < max_tokens; i++) {
+            seed = seed * 1664525 + 1013904223;
+            tokens[i] = (uint32_t) ((seed >> 8) % n_vocab);
+        }
+    }
+
+    for (size_t t = 0; success && t < options.threads_count; t++) {
+        const uint32_t n_threads = options.threads[t];
+        struct rwkv_context * ctx = rwkv_clone_context(base_ctx, n_threads);
+
+        if (!ctx) {
+            success = false;
+            break;
+        }
+
+        fprintf(stderr, "Measuring with %u threads\n", n_threads);
+
+        results[results_count].threads = n_threads;
+        success = bench_ttft(base_ctx, &options, n_threads, tokens, logits, durations, &results[results_count++]);
+
+        results[results_count].threads = n_threads;
+        success = success && bench_decode(ctx, &options, tokens, state, logits, durations, &results[results_count++]);
+
+        for (size_t i = 0; success && i < options.lengths_count; i++) {
+            results[results_count].threads = n_threads;
+            success = bench_prefill(ctx, &options, options.lengths[i], tokens, state, logits, durations, &results[results_count++]);
+        }
+
+        rwkv_free(ctx);
+    }
+
+    if (success) {
+        const size_t peak_rss = peak_rss_bytes();
+
+        if (options.csv) {
+            print_csv(&options, load_ms, peak_rss, results, results_count);
+        } else {
+            print_json(&options, base_ctx, load_ms, peak_rss, results, results_count);
+        }
+    } else {
+        fprintf(stderr, "Benchmark failed\n");
+    }
+
+    free(tokens);
+    free(state);
+    free(logits);
+    free(durations);
+    free(results);
+    rwkv_free(base_ctx);
+
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
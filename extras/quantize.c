@@ -31,21 +31,66 @@ enum ggml_type type_from_string(const char* string) {
     return GGML_TYPE_COUNT;
 }
 
+// Reads the whole file into a NUL-terminated string, which must be freed by the caller.
+char * read_file(const char * path) {
+    FILE * file = fopen(path, "rb");
+
+    if (!file) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char * buffer = size >= 0 ? malloc(size + 1) : NULL;
+
+    if (buffer) {
+        buffer[fread(buffer, 1, size, file)] = '\0';
+    }
+
+    fclose(file);
+    return buffer;
+}
+
 int main(int argc, char * argv[]) {
-    if (argc != 4 || type_from_string(argv[3]) == GGML_TYPE_COUNT) {
-        fprintf(stderr, "Usage: %s INPUT OUTPUT FORMAT\n\nAvailable formats: Q4_0 Q4_1 Q5_0 Q5_1 Q8_0\n", argv[0]);
+    // Anything with '=' or a list separator is a recipe and is validated by rwkv.cpp.
+    bool is_recipe = argc >= 4 && (argv[3][0] == '@' || strpbrk(argv[3], "=,;") != NULL);
+
+    if ((argc != 4 && argc != 5) || (!is_recipe && type_from_string(argv[3]) == GGML_TYPE_COUNT)) {
+        fprintf(
+            stderr,
+            "Usage: %s INPUT OUTPUT FORMAT [THREADS]\n\n"
+            "Available formats: Q4_0 Q4_1 Q5_0 Q5_1 Q8_0\n"
+            "FORMAT may also be a quantization recipe like \"Q5_1,*.ffn.key.weight=Q4_0,blocks.{0,-1}.*=Q8_0\",\n"
+            "or @FILE to read the recipe from a file; see rwkv_quantize_model_file_ex in rwkv.h for syntax\n"
+            "THREADS defaults to 0, which uses all hardware threads\n",
+            argv[0]
+        );
+        return EXIT_FAILURE;
+    }
+
+    char * recipe_file = argv[3][0] == '@' ? read_file(argv[3] + 1) : NULL;
+    const char * recipe = argv[3][0] == '@' ? recipe_file : argv[3];
+
+    if (!recipe) {
+        fprintf(stderr, "Failed to read recipe file %s\n", argv[3] + 1);
         return EXIT_FAILURE;
     }
 
+    uint32_t n_threads = argc == 5 ? (uint32_t) strtoul(argv[4], NULL, 10) : 0;
+
     time_t freq, start, end;
     time_calibrate(freq);
 
     fprintf(stderr, "Quantizing...\n");
 
     time_measure(start);
-    bool success = rwkv_quantize_model_file(argv[1], argv[2], argv[3]);
+    bool success = rwkv_quantize_model_file_ex(argv[1], argv[2], recipe, n_threads);
     time_measure(end);
 
+    free(recipe_file);
+
     double diff = TIME_DIFF(freq, start, end);
 
     if (success) {
@@ -0,0 +1,1039 @@
+// Serves one model to many clients over a Unix domain socket, keeping a state per session.
+// Weights are loaded once and shared by a few worker contexts, which are driven by rwkv_scheduler: every iteration
+// evaluates one step for a batch of sessions on the workers in parallel, single tokens of sessions that are decoding first,
+// then prompt chunks of sessions that are in prefill, within a budget of tokens per iteration.
+// Long prompts are split into chunks, so they never block decoding sessions for longer than one chunk.
+// New requests and disconnects are handled between iterations.
+//
+// Clients send token ids; tokenization is left to them. All integers and floats are in host byte order.
+// Every frame starts with a uint32 size of the rest of the frame.
+//
+// Request frame:
+//   uint32 size
+//   uint32 type          REQUEST_GENERATE, REQUEST_SCORE, REQUEST_EMBED, REQUEST_RESET or REQUEST_FREE
+//   uint32 n_tokens
+//   uint64 session_id    sessions are created by their first request
+//   uint32 max_tokens    GENERATE: count of tokens to sample
+//   float  temperature   GENERATE: 0 samples the most likely token
+//   float  top_p         GENERATE: nucleus sampling threshold, 1 disables it
+//   uint32 tokens[n_tokens]
+//
+// Response frame:
+//   uint32 size
+//   uint32 type          RESPONSE_*
+//   uint32 count         count of elements in the payload
+//   uint64 session_id
+//   payload
+//
+// GENERATE evaluates the tokens, then streams RESPONSE_TOKEN frames with one sampled token each, followed by RESPONSE_DONE.
+// Generation stops after max_tokens tokens, or after token 0, which ends the text in RWKV vocabularies.
+// With no tokens, generation continues from the last evaluated token of the session.
+// SCORE evaluates the tokens and responds with RESPONSE_SCORES holding the log-probability of each token;
+// the first one is NaN if the session has not evaluated any token before.
+// EMBED evaluates the tokens and responds with RESPONSE_EMBEDDING holding the n_embed values of the final hidden state
+// of the last token, normalized by ln_out; the head of the model is not evaluated.
+// RESET returns the session to the initial state, FREE removes it; both respond with RESPONSE_DONE.
+// Evaluated tokens and sampled tokens become part of the session state, so following requests continue the text.
+// When --max-sessions sessions exist, a new session replaces the least recently used session without an active request;
+// a request to the replaced session starts over from the initial state.
+// Failed requests are answered with RESPONSE_ERROR holding a message of count bytes.
+
+#include "rwkv.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#define REQUEST_GENERATE 1
+#define REQUEST_SCORE 2
+#define REQUEST_EMBED 3
+#define REQUEST_RESET 4
+#define REQUEST_FREE 5
+
+#define RESPONSE_TOKEN 1
+#define RESPONSE_DONE 2
+#define RESPONSE_SCORES 3
+#define RESPONSE_EMBEDDING 4
+#define RESPONSE_ERROR 5
+
+// Sizes of frames after the size field, without tokens or payload.
+#define REQUEST_HEADER_SIZE 28
+#define RESPONSE_HEADER_SIZE 16
+
+// Larger frames are considered a protocol error, and the client is disconnected.
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+#define END_OF_TEXT 0
+
+struct options {
+    const char * model_path;
+    const char * socket_path;
+    const char * format;
+    uint32_t n_threads;
+    uint32_t n_workers;
+    size_t batch_tokens;
+    size_t chunk_len;
+    size_t max_sessions;
+    bool verbose;
+};
+
+#ifndef _WIN32
+
+struct buffer {
+    uint8_t * data;
+    size_t len;
+    size_t capacity;
+};
+
+struct client {
+    int fd;
+    struct buffer in;
+    struct buffer out;
+    bool closed;
+};
+
+struct session {
+    uint64_t id;
+    float * state;
+    float * logits;
+    // EMBED: embedding of the last evaluated token; allocated by the first EMBED request.
+    float * embedding;
+    // Whether logits belong to the last evaluated token.
+    bool has_logits;
+    // A sampled token that was sent to the client, but not evaluated yet. It is evaluated before the tokens of the next request.
+    bool has_pending_token;
+    uint32_t pending_token;
+    // Value of server->clock at the last request, to replace the least recently used session.
+    uint64_t last_used;
+
+    // The active request, if type is not 0.
+    struct client * client;
+    uint32_t type;
+    // Tokens to evaluate are tokens[position..len).
+    uint32_t * tokens;
+    size_t len;
+    size_t capacity;
+    size_t position;
+    // Count of tokens submitted to the scheduler, starting at position.
+    size_t submitted;
+    uint32_t max_tokens;
+    uint32_t generated;
+    float temperature;
+    float top_p;
+    // SCORE: score of tokens[i] is scores[i - first_scored].
+    float * scores;
+    size_t first_scored;
+    // SCORE: logits after every submitted token, up to chunk_len rows.
+    float * token_logits;
+};
+
+struct server {
+    struct options options;
+    size_t n_vocab;
+    size_t n_embed;
+    size_t state_len;
+
+    struct rwkv_context ** workers;
+    struct rwkv_thread_budget * budget;
+    struct rwkv_scheduler * scheduler;
+
+    int listen_fd;
+    struct client ** clients;
+    size_t n_clients;
+    struct session ** sessions;
+    size_t n_sessions;
+    // Count of requests started so far.
+    uint64_t clock;
+
+    uint64_t rng;
+};
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop_signal(int signal_number) {
+    (void) signal_number;
+    stop_requested = 1;
+}
+
+// --- Buffers and frames ---
+
+bool buffer_reserve(struct buffer * buffer, const size_t len) {
+    if (buffer->len + len <= buffer->capacity) {
+        return true;
+    }
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+
+    while (capacity < buffer->len + len) {
+        capacity *= 2;
+    }
+
+    uint8_t * data = realloc(buffer->data, capacity);
+
+    if (!data) {
+        return false;
+    }
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+void buffer_append(struct buffer * buffer, const void * data, const size_t len) {
+    if (len == 0) {
+        return;
+    }
+
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+void buffer_consume(struct buffer * buffer, const size_t len) {
+    memmove(buffer->data, buffer->data + len, buffer->len - len);
+    buffer->len -= len;
+}
+
+// Queues a response frame; it is written when the socket accepts more data.
+void respond(struct client * client, const uint32_t type, const uint64_t session_id, const void * payload, const uint32_t count, const size_t element_size) {
+    if (!client || client->closed) {
+        return;
+    }
+
+    const uint32_t size = RESPONSE_HEADER_SIZE + count * (uint32_t) element_size;
+
+    if (!buffer_reserve(&client->out, sizeof(size) + size)) {
+        fprintf(stderr, "Failed to allocate a response, disconnecting the client\n");
+        client->closed = true;
+        return;
+    }
+
+    buffer_append(&client->out, &size, sizeof(size));
+    buffer_append(&client->out, &type, sizeof(type));
+    buffer_append(&client->out, &count, sizeof(count));
+    buffer_append(&client->out, &session_id, sizeof(session_id));
+    buffer_append(&client->out, payload, count * element_size);
+}
+
+void respond_error(struct client * client, const uint64_t session_id, const char * message) {
+    respond(client, RESPONSE_ERROR, session_id, message, (uint32_t) strlen(message), 1);
+}
+
+void flush_client(struct client * client) {
+    while (client->out.len > 0 && !client->closed) {
+        const ssize_t written = send(client->fd, client->out.data, client->out.len, 0);
+
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                client->closed = true;
+            }
+
+            return;
+        }
+
+        buffer_consume(&client->out, (size_t) written);
+    }
+}
+
+// --- Scoring ---
+
+float log_softmax(const float * logits, const size_t n_vocab, const uint32_t token) {
+    float max = logits[0];
+
+    for (size_t i = 1; i < n_vocab; i++) {
+        max = logits[i] > max ? logits[i] : max;
+    }
+
+    double sum = 0.0;
+
+    for (size_t i = 0; i < n_vocab; i++) {
+        sum += exp((double) (logits[i] - max));
+    }
+
+    return logits[token] - max - (float) log(sum);
+}
+
+// --- Sessions ---
+
+struct session * find_session(struct server * server, const uint64_t id) {
+    for (size_t i = 0; i < server->n_sessions; i++) {
+        if (server->sessions[i]->id == id) {
+            return server->sessions[i];
+        }
+    }
+
+    return NULL;
+}
+
+void free_session(struct server * server, struct session * session);
+
+// Frees the least recently used session without an active request. Returns false if every session has an active request.
+bool evict_session(struct server * server) {
+    struct session * oldest = NULL;
+
+    for (size_t i = 0; i < server->n_sessions; i++) {
+        struct session * session = server->sessions[i];
+
+        if (session->type == 0 && (!oldest || session->last_used < oldest->last_used)) {
+            oldest = session;
+        }
+    }
+
+    if (!oldest) {
+        return false;
+    }
+
+    if (server->options.verbose) {
+        fprintf(stderr, "Replacing idle session %llu\n", (unsigned long long) oldest->id);
+    }
+
+    free_session(server, oldest);
+    return true;
+}
+
+struct session * create_session(struct server * server, const uint64_t id) {
+    if (server->n_sessions == server->options.max_sessions && !evict_session(server)) {
+        return NULL;
+    }
+
+    struct session * session = calloc(1, sizeof(struct session));
+
+    if (!session) {
+        return NULL;
+    }
+
+    session->id = id;
+    session->state = malloc(server->state_len * sizeof(float));
+    session->logits = malloc(server->n_vocab * sizeof(float));
+
+    if (!session->state || !session->logits) {
+        free(session->state);
+        free(session->logits);
+        free(session);
+        return NULL;
+    }
+
+    rwkv_init_state(server->workers[0], session->state);
+    server->sessions[server->n_sessions++] = session;
+    return session;
+}
+
+void free_session(struct server * server, struct session * session) {
+    rwkv_scheduler_cancel(server->scheduler, session->id);
+
+    for (size_t i = 0; i < server->n_sessions; i++) {
+        if (server->sessions[i] == session) {
+            server->sessions[i] = server->sessions[--server->n_sessions];
+            break;
+        }
+    }
+
+    free(session->state);
+    free(session->logits);
+    free(session->embedding);
+    free(session->tokens);
+    free(session->scores);
+    free(session->token_logits);
+    free(session);
+}
+
+void end_request(struct server * server, struct session * session) {
+    // Tokens evaluated so far stay in the session state.
+    rwkv_scheduler_cancel(server->scheduler, session->id);
+    session->client = NULL;
+    session->type = 0;
+    session->len = 0;
+    session->position = 0;
+    free(session->scores);
+    session->scores = NULL;
+    free(session->token_logits);
+    session->token_logits = NULL;
+}
+
+void fail_request(struct server * server, struct session * session, const char * message) {
+    respond_error(session->client, session->id, message);
+    end_request(server, session);
+}
+
+bool push_token(struct session * session, const uint32_t token) {
+    if (session->len == session->capacity) {
+        const size_t capacity = session->capacity ? session->capacity * 2 : 64;
+        uint32_t * tokens = realloc(session->tokens, capacity * sizeof(uint32_t));
+
+        if (!tokens) {
+            return false;
+        }
+
+        session->tokens = tokens;
+        session->capacity = capacity;
+    }
+
+    session->tokens[session->len++] = token;
+    return true;
+}
+
+bool is_runnable(const struct session * session) {
+    return session->type != 0 && session->position < session->len;
+}
+
+// Continues the request of the session after its tokens were evaluated up to session->position.
+void advance_request(struct server * server, struct session * session) {
+    const uint64_t id = session->id;
+
+    switch (session->type) {
+        case REQUEST_SCORE:
+            // Scores were set by start_request and score_chunk.
+            if (session->position == session->len) {
+                respond(session->client, RESPONSE_SCORES, id, session->scores, (uint32_t) (session->len - session->first_scored), sizeof(float));
+                end_request(server, session);
+            }
+
+            break;
+        case REQUEST_EMBED:
+            if (session->len == 0) {
+                fail_request(server, session, "Nothing to embed, send at least one token");
+            } else if (session->position == session->len) {
+                respond(session->client, RESPONSE_EMBEDDING, id, session->embedding, (uint32_t) server->n_embed, sizeof(float));
+                end_request(server, session);
+            }
+
+            break;
+        case REQUEST_GENERATE:
+            if (session->position < session->len) {
+                break;
+            }
+
+            if (session->generated == session->max_tokens) {
+                respond(session->client, RESPONSE_DONE, id, NULL, 0, 0);
+                end_request(server, session);
+                break;
+            }
+
+            if (!session->has_logits) {
+                fail_request(server, session, "Nothing to generate from, send at least one token");
+                break;
+            }
+
+            struct rwkv_sampler_params params = { session->temperature, session->top_p, 0, 0.0F, 0.0F, 0 };
+            const uint32_t token = rwkv_sample_logits(session->logits, server->n_vocab, &params, &server->rng);
+            respond(session->client, RESPONSE_TOKEN, id, &token, 1, sizeof(token));
+            session->generated++;
+
+            if (token == END_OF_TEXT || session->generated == session->max_tokens) {
+                session->has_pending_token = true;
+                session->pending_token = token;
+                respond(session->client, RESPONSE_DONE, id, NULL, 0, 0);
+                end_request(server, session);
+            } else if (!push_token(session, token)) {
+                fail_request(server, session, "Out of memory");
+            }
+
+            break;
+    }
+}
+
+// Advances the request, then submits its next tokens to the scheduler.
+void continue_request(struct server * server, struct session * session) {
+    advance_request(server, session);
+
+    if (!is_runnable(session)) {
+        return;
+    }
+
+    const uint32_t * tokens = session->tokens + session->position;
+    session->submitted = session->len - session->position;
+    bool submitted;
+
+    if (session->type == REQUEST_SCORE) {
+        // Scoring needs logits of every token, so its tokens are submitted in chunks that fit token_logits.
+        session->submitted = session->submitted < server->options.chunk_len ? session->submitted : server->options.chunk_len;
+        submitted = rwkv_scheduler_submit_per_token(server->scheduler, session->id, tokens, session->submitted, session->state, session->token_logits);
+    } else if (session->type == REQUEST_EMBED) {
+        // Embeddings do not need logits.
+        submitted = rwkv_scheduler_submit_embed(server->scheduler, session->id, tokens, session->submitted, session->state, session->embedding);
+    } else {
+        submitted = rwkv_scheduler_submit(server->scheduler, session->id, tokens, session->submitted, session->state, session->logits);
+    }
+
+    if (!submitted) {
+        fail_request(server, session, "Failed to schedule the request");
+    }
+}
+
+void start_request(struct server * server, struct client * client, const uint32_t type, const uint64_t id,
+    const uint32_t * tokens, const uint32_t n_tokens, const uint32_t max_tokens, const float temperature, const float top_p) {
+    struct session * session = find_session(server, id);
+
+    if (session && session->type != 0) {
+        respond_error(client, id, "Session already has an active request");
+        return;
+    }
+
+    if (type == REQUEST_FREE) {
+        if (session) {
+            free_session(server, session);
+        }
+
+        respond(client, RESPONSE_DONE, id, NULL, 0, 0);
+        return;
+    }
+
+    if (type < REQUEST_GENERATE || type > REQUEST_RESET) {
+        respond_error(client, id, "Unknown request type");
+        return;
+    }
+
+    if (!session && !(session = create_session(server, id))) {
+        respond_error(client, id, "Too many sessions with active requests");
+        return;
+    }
+
+    session->last_used = ++server->clock;
+
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        if (tokens[i] >= server->n_vocab) {
+            respond_error(client, id, "Token is out of range");
+            return;
+        }
+    }
+
+    if (type == REQUEST_RESET) {
+        rwkv_init_state(server->workers[0], session->state);
+        session->has_logits = false;
+        session->has_pending_token = false;
+        respond(client, RESPONSE_DONE, id, NULL, 0, 0);
+        return;
+    }
+
+    session->client = client;
+    session->type = type;
+    session->len = 0;
+    session->position = 0;
+    session->max_tokens = max_tokens;
+    session->generated = 0;
+    session->temperature = temperature;
+    session->top_p = top_p;
+    session->first_scored = 0;
+
+    bool success = true;
+
+    if (session->has_pending_token) {
+        success = push_token(session, session->pending_token);
+        session->first_scored = 1;
+        session->has_pending_token = false;
+    }
+
+    for (uint32_t i = 0; success && i < n_tokens; i++) {
+        success = push_token(session, tokens[i]);
+    }
+
+    if (success && type == REQUEST_SCORE) {
+        const size_t rows = session->len < server->options.chunk_len ? session->len : server->options.chunk_len;
+        session->scores = malloc((n_tokens ? n_tokens : 1) * sizeof(float));
+        session->token_logits = malloc((rows ? rows : 1) * server->n_vocab * sizeof(float));
+        success = session->scores && session->token_logits;
+
+        if (success && n_tokens > 0) {
+            session->scores[0] = session->has_logits && session->first_scored == 0 ? log_softmax(session->logits, server->n_vocab, tokens[0]) : NAN;
+        }
+    }
+
+    if (success && type == REQUEST_EMBED && !session->embedding) {
+        session->embedding = malloc(server->n_embed * sizeof(float));
+        success = session->embedding != NULL;
+    }
+
+    if (!success) {
+        fail_request(server, session, "Out of memory");
+        return;
+    }
+
+    // Requests without tokens to evaluate are answered right away.
+    continue_request(server, session);
+}
+
+// --- Scheduler ---
+
+// Scores tokens that follow the submitted tokens, and keeps the logits of the last one for the next request.
+void score_chunk(struct server * server, struct session * session) {
+    const size_t n_vocab = server->n_vocab;
+    // Row i holds logits after token first + i, which score the token after it.
+    const size_t first = session->position - session->submitted;
+
+    for (size_t i = 0; i < session->submitted && first + i + 1 < session->len; i++) {
+        const size_t scored = first + i + 1;
+        session->scores[scored - session->first_scored] = log_softmax(session->token_logits + i * n_vocab, n_vocab, session->tokens[scored]);
+    }
+
+    memcpy(session->logits, session->token_logits + (session->submitted - 1) * n_vocab, n_vocab * sizeof(float));
+}
+
+// Called by rwkv_scheduler_step when submitted tokens of the session were evaluated.
+void on_session_evaluated(const uint64_t session_id, const bool success, void * user_data) {
+    struct server * server = user_data;
+    struct session * session = find_session(server, session_id);
+
+    if (!session || session->type == 0) {
+        return;
+    }
+
+    if (!success) {
+        // The state may be partially updated, so the session can not be continued.
+        rwkv_init_state(server->workers[0], session->state);
+        session->has_logits = false;
+        fail_request(server, session, "Evaluation failed, the session was reset");
+        return;
+    }
+
+    session->position += session->submitted;
+    session->has_logits = session->type != REQUEST_EMBED;
+
+    if (session->type == REQUEST_SCORE) {
+        score_chunk(server, session);
+    }
+
+    // Clients that disconnected during the iteration do not need results anymore.
+    if (session->client->closed) {
+        end_request(server, session);
+    } else {
+        continue_request(server, session);
+    }
+}
+
+void run_iteration(struct server * server) {
+    struct rwkv_scheduler_stats stats;
+    rwkv_scheduler_step(server->scheduler, &stats);
+
+    if (server->options.verbose) {
+        fprintf(
+            stderr,
+            "Iteration: %zu decode, %zu prefill, %zu tokens, %zu waiting, %.3f ms\n",
+            stats.decode_sessions,
+            stats.prefill_sessions,
+            stats.tokens,
+            stats.waiting_sessions,
+            (double) stats.duration_us / 1000.0
+        );
+    }
+}
+
+// --- Clients ---
+
+// Parses all complete frames received from the client. Returns false on a protocol error.
+bool process_input(struct server * server, struct client * client) {
+    while (client->in.len >= sizeof(uint32_t)) {
+        uint32_t size;
+        memcpy(&size, client->in.data, sizeof(size));
+
+        if (size < REQUEST_HEADER_SIZE || size > MAX_FRAME_SIZE) {
+            return false;
+        }
+
+        if (client->in.len < sizeof(size) + size) {
+            return true;
+        }
+
+        const uint8_t * frame = client->in.data + sizeof(size);
+        uint32_t type, n_tokens, max_tokens;
+        uint64_t session_id;
+        float temperature, top_p;
+        memcpy(&type, frame, sizeof(type));
+        memcpy(&n_tokens, frame + 4, sizeof(n_tokens));
+        memcpy(&session_id, frame + 8, sizeof(session_id));
+        memcpy(&max_tokens, frame + 16, sizeof(max_tokens));
+        memcpy(&temperature, frame + 20, sizeof(temperature));
+        memcpy(&top_p, frame + 24, sizeof(top_p));
+
+        if ((size - REQUEST_HEADER_SIZE) / sizeof(uint32_t) != n_tokens || (size - REQUEST_HEADER_SIZE) % sizeof(uint32_t) != 0) {
+            return false;
+        }
+
+        uint32_t * tokens = malloc((n_tokens ? n_tokens : 1) * sizeof(uint32_t));
+
+        if (!tokens) {
+            respond_error(client, session_id, "Out of memory");
+        } else {
+            memcpy(tokens, frame + REQUEST_HEADER_SIZE, n_tokens * sizeof(uint32_t));
+            start_request(server, client, type, session_id, tokens, n_tokens, max_tokens, temperature, top_p);
+            free(tokens);
+        }
+
+        buffer_consume(&client->in, sizeof(size) + size);
+    }
+
+    return true;
+}
+
+void read_client(struct server * server, struct client * client) {
+    while (!client->closed) {
+        if (!buffer_reserve(&client->in, 4096)) {
+            client->closed = true;
+            return;
+        }
+
+        const ssize_t received = recv(client->fd, client->in.data + client->in.len, client->in.capacity - client->in.len, 0);
+
+        if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            client->closed = true;
+            return;
+        }
+
+        if (received < 0) {
+            return;
+        }
+
+        client->in.len += (size_t) received;
+
+        if (!process_input(server, client)) {
+            fprintf(stderr, "Protocol error, disconnecting the client\n");
+            client->closed = true;
+        }
+    }
+}
+
+void accept_clients(struct server * server) {
+    for (;;) {
+        const int fd = accept(server->listen_fd, NULL, NULL);
+
+        if (fd < 0) {
+            return;
+        }
+
+        struct client * client = calloc(1, sizeof(struct client));
+        struct client ** clients = realloc(server->clients, (server->n_clients + 1) * sizeof(struct client *));
+
+        if (!client || !clients) {
+            free(client);
+            server->clients = clients ? clients : server->clients;
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        client->fd = fd;
+        server->clients = clients;
+        server->clients[server->n_clients++] = client;
+    }
+}
+
+void remove_closed_clients(struct server * server) {
+    for (size_t i = 0; i < server->n_clients;) {
+        struct client * client = server->clients[i];
+
+        if (!client->closed) {
+            i++;
+            continue;
+        }
+
+        // Requests of the client are dropped.
+        for (size_t j = 0; j < server->n_sessions; j++) {
+            if (server->sessions[j]->client == client) {
+                end_request(server, server->sessions[j]);
+            }
+        }
+
+        close(client->fd);
+        free(client->in.data);
+        free(client->out.data);
+        free(client);
+        server->clients[i] = server->clients[--server->n_clients];
+    }
+}
+
+// Waits for socket events, or only checks for them if sessions are waiting to be evaluated.
+void poll_clients(struct server * server, const bool busy) {
+    struct pollfd * fds = malloc((server->n_clients + 1) * sizeof(struct pollfd));
+
+    if (!fds) {
+        return;
+    }
+
+    fds[0].fd = server->listen_fd;
+    fds[0].events = POLLIN;
+
+    for (size_t i = 0; i < server->n_clients; i++) {
+        fds[i + 1].fd = server->clients[i]->fd;
+        fds[i + 1].events = (short) (POLLIN | (server->clients[i]->out.len > 0 ? POLLOUT : 0));
+    }
+
+    const size_t n_clients = server->n_clients;
+
+    if (poll(fds, n_clients + 1, busy ? 0 : -1) > 0) {
+        for (size_t i = 0; i < n_clients; i++) {
+            struct client * client = server->clients[i];
+
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_client(server, client);
+            }
+
+            if (fds[i + 1].revents & POLLOUT) {
+                flush_client(client);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            accept_clients(server);
+        }
+    }
+
+    free(fds);
+}
+
+// --- Setup ---
+
+int open_socket(const char * path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path is too long\n");
+        return -1;
+    }
+
+    strcpy(address.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // A socket file left by a previous run would make bind fail.
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+bool init_server(struct server * server) {
+    const struct options * options = &server->options;
+
+    fprintf(stderr, "Loading %s\n", options->model_path);
+
+    struct rwkv_context * ctx = rwkv_init_from_file_ex(options->model_path, options->n_threads, RWKV_INIT_NONE, options->format);
+
+    if (!ctx) {
+        fprintf(stderr, "Failed to load the model: 0x%.8X\n", rwkv_get_last_error(NULL));
+        return false;
+    }
+
+    server->n_vocab = rwkv_get_n_vocab(ctx);
+    server->n_embed = rwkv_get_n_embed(ctx);
+    server->state_len = rwkv_get_state_len(ctx);
+
+    server->workers = calloc(options->n_workers, sizeof(struct rwkv_context *));
+    server->sessions = calloc(options->max_sessions, sizeof(struct session *));
+
+    if (!server->workers || !server->sessions) {
+        rwkv_free(ctx);
+        return false;
+    }
+
+    // Every worker may use all threads when it runs alone, but together they never exceed n_threads.
+    server->budget = rwkv_thread_budget_new(options->n_threads);
+    server->workers[0] = ctx;
+
+    if (!server->budget) {
+        return false;
+    }
+
+    rwkv_set_thread_budget(ctx, server->budget);
+
+    for (uint32_t i = 1; i < options->n_workers; i++) {
+        if (!(server->workers[i] = rwkv_clone_context(ctx, options->n_threads))) {
+            fprintf(stderr, "Failed to create worker context %u\n", i);
+            return false;
+        }
+    }
+
+    server->scheduler = rwkv_scheduler_new(server->workers, options->n_workers, options->batch_tokens, options->chunk_len, on_session_evaluated, server);
+
+    if (!server->scheduler) {
+        fprintf(stderr, "Failed to create the scheduler: 0x%.8X\n", rwkv_get_last_error(NULL));
+        return false;
+    }
+
+    server->listen_fd = open_socket(options->socket_path);
+    server->rng = (uint64_t) time(NULL) | 1;
+    return server->listen_fd >= 0;
+}
+
+void free_server(struct server * server) {
+    while (server->n_clients > 0) {
+        server->clients[0]->closed = true;
+        remove_closed_clients(server);
+    }
+
+    while (server->n_sessions > 0) {
+        free_session(server, server->sessions[0]);
+    }
+
+    if (server->scheduler) {
+        rwkv_scheduler_free(server->scheduler);
+    }
+
+    for (uint32_t i = 0; server->workers && i < server->options.n_workers; i++) {
+        if (server->workers[i]) {
+            rwkv_free(server->workers[i]);
+        }
+    }
+
+    if (server->budget) {
+        rwkv_thread_budget_free(server->budget);
+    }
+
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+        unlink(server->options.socket_path);
+    }
+
+    free(server->workers);
+    free(server->clients);
+    free(server->sessions);
+}
+
+#endif
+
+void print_usage(const char * program) {
+    fprintf(
+        stderr,
+        "Usage: %s MODEL SOCKET [options]\n\n"
+        "Options:\n"
+        "  --threads N       total count of threads computing graphs, default 4\n"
+        "  --workers N       count of sessions evaluated in parallel, default 4\n"
+        "  --batch-tokens N  count of tokens evaluated in one iteration, default 256\n"
+        "  --chunk N         largest count of prompt tokens of one session in one iteration, default 64\n"
+        "  --max-sessions N  count of sessions kept in memory, default 1024\n"
+        "  --format FORMAT   format to convert the model into while loading, see rwkv_init_from_file_ex\n"
+        "  --verbose         print occupancy of every iteration\n",
+        program
+    );
+}
+
+bool parse_options(int argc, char * argv[], struct options * options) {
+    options->model_path = NULL;
+    options->socket_path = NULL;
+    options->format = NULL;
+    options->n_threads = 4;
+    options->n_workers = 4;
+    options->batch_tokens = 256;
+    options->chunk_len = 64;
+    options->max_sessions = 1024;
+    options->verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char * arg = argv[i];
+        const char * value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (arg[0] != '-') {
+            if (!options->model_path) {
+                options->model_path = arg;
+            } else if (!options->socket_path) {
+                options->socket_path = arg;
+            } else {
+                return false;
+            }
+
+            continue;
+        }
+
+        if (strcmp(arg, "--verbose") == 0) {
+            options->verbose = true;
+            continue;
+        }
+
+        if (!value) {
+            return false;
+        }
+
+        i++;
+
+        if (strcmp(arg, "--threads") == 0) {
+            options->n_threads = (uint32_t) strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--workers") == 0) {
+            options->n_workers = (uint32_t) strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--batch-tokens") == 0) {
+            options->batch_tokens = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--chunk") == 0) {
+            options->chunk_len = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--max-sessions") == 0) {
+            options->max_sessions = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--format") == 0) {
+            options->format = value;
+        } else {
+            return false;
+        }
+    }
+
+    return options->model_path && options->socket_path && options->n_threads && options->n_workers &&
+        options->batch_tokens && options->chunk_len && options->max_sessions;
+}
+
+int main(int argc, char * argv[]) {
+    struct options options;
+
+    if (!parse_options(argc, argv, &options)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+#ifdef _WIN32
+    fprintf(stderr, "Unix domain sockets are not supported on Windows\n");
+    return EXIT_FAILURE;
+#else
+    struct server server;
+    memset(&server, 0, sizeof(server));
+    server.options = options;
+    server.listen_fd = -1;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_stop_signal);
+    signal(SIGTERM, handle_stop_signal);
+
+    if (!init_server(&server)) {
+        free_server(&server);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Listening on %s\n", options.socket_path);
+
+    while (!stop_requested) {
+        const bool busy = rwkv_scheduler_get_n_sessions(server.scheduler) > 0;
+
+        poll_clients(&server, busy);
+
+        if (busy) {
+            run_iteration(&server);
+        }
+
+        for (size_t i = 0; i < server.n_clients; i++) {
+            flush_client(server.clients[i]);
+        }
+
+        remove_closed_clients(&server);
+    }
+
+    fprintf(stderr, "Stopping\n");
+    free_server(&server);
+    return EXIT_SUCCESS;
+#endif
+}
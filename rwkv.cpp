@@ -8,12 +8,26 @@
 #include <string>
 #include <vector>
 #include <cstring>
+#include <cstdlib>
+#include <cctype>
 #include <cinttypes>
 #include <cmath>
 #include <fstream>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <utility>
+#include <algorithm>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <functional>
+#include <chrono>
+#include <cerrno>
 
 #define _FILE_OFFSET_BITS 64
 // Puts an optional break point, if debug is enabled.
@@ -38,6 +52,19 @@
 #endif
 #endif
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#elif !defined(_WIN32)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 static_assert(sizeof(stat::st_size) >= 8, "File offsets should be 64-bit or else rwkv.cpp will not be able to load model files over 2GB");
 static_assert(sizeof(decltype(ftell(NULL))) >= 8, "File offsets should be 64-bit or else rwkv.cpp will not be able to load model files over 2GB");
 
@@ -383,6 +410,13 @@ bool rwkv_fwrite_tensor(FILE * file, const struct rwkv_tensor & tensor) {
 
 // --- Model definition ---
 
+// Low-rank adapter of a weight matrix W, which turns W x into W x + B (A x).
+// A has shape (n_in, rank) and B has shape (rank, n_out) in ggml order; both are NULL when there is no adapter.
+struct rwkv_lora_pair {
+    struct ggml_tensor * a = NULL;
+    struct ggml_tensor * b = NULL;
+};
+
 struct rwkv_layer {
     struct ggml_tensor * ln1_weight;
     struct ggml_tensor * ln1_bias;
@@ -407,6 +441,15 @@ struct rwkv_layer {
     struct ggml_tensor * ffn_key;
     struct ggml_tensor * ffn_value;
     struct ggml_tensor * ffn_receptance;
+
+    // Low-rank adapters of weight matrices, only set in models with an adapter applied.
+    struct rwkv_lora_pair att_key_lora;
+    struct rwkv_lora_pair att_value_lora;
+    struct rwkv_lora_pair att_receptance_lora;
+    struct rwkv_lora_pair att_output_lora;
+    struct rwkv_lora_pair ffn_key_lora;
+    struct rwkv_lora_pair ffn_value_lora;
+    struct rwkv_lora_pair ffn_receptance_lora;
 };
 
 struct rwkv_model {
@@ -417,12 +460,16 @@ struct rwkv_model {
     struct ggml_tensor * ln0_weight;
     struct ggml_tensor * ln0_bias;
 
+    // Whether blocks.0.ln0 was applied to every row of emb at load time, so that graphs can skip it.
+    bool ln0_folded = false;
+
     std::unique_ptr<struct rwkv_layer[]> layers;
 
     struct ggml_tensor * ln_out_weight;
     struct ggml_tensor * ln_out_bias;
 
     struct ggml_tensor * head;
+    struct rwkv_lora_pair head_lora;
 };
 
 // --- Operators ---
@@ -473,6 +520,17 @@ struct ggml_tensor * rwkv_layer_norm(ggml_context * ctx, struct ggml_tensor * x,
     return ggml_add_inplace(ctx, ggml_mul_inplace(ctx, ggml_norm(ctx, x), weight), bias);
 }
 
+// Computes W x, plus B (A x) if there is a low-rank adapter.
+struct ggml_tensor * rwkv_mul_mat(ggml_context * ctx, struct ggml_tensor * weight, const struct rwkv_lora_pair & lora, struct ggml_tensor * x) {
+    struct ggml_tensor * result = ggml_mul_mat(ctx, weight, x);
+
+    if (lora.a) {
+        result = ggml_add_inplace(ctx, result, ggml_mul_mat(ctx, lora.b, ggml_mul_mat(ctx, lora.a, x)));
+    }
+
+    return result;
+}
+
 // --- Implementation ---
 
 // Used as a helper during rwkv_ctx_size calculation.
@@ -515,6 +573,11 @@ struct rwkv_future_ctx {
         }
     }
 
+    // Bytes of memory that a rwkv_ggml_context created from this estimate allocates, including scratch.
+    size_t total_size() const {
+        return this->objects_count * GGML_OBJECT_SIZE + this->memory_size + this->scratch_size;
+    }
+
     struct rwkv_future_tensor declare(const enum ggml_type type, const uint64_t width, const uint64_t height = 1);
 
     struct rwkv_future_tensor alloc(const enum ggml_type type, const uint64_t width, const uint64_t height = 1, const bool use_scratch = true);
@@ -609,15 +672,43 @@ struct rwkv_future_tensor rwkv_future_ctx::alloc(const enum ggml_type type, cons
     return this->declare(type, width, height).alloc(*this, use_scratch);
 }
 
+// Frees scratch buffers, which are either allocated with new[], or mapped by rwkv_weights_context.
+struct rwkv_scratch_deleter {
+    // Non-zero if the buffer was mapped.
+    size_t mapped_size = 0;
+    // Non-zero if the buffer was locked in memory, see RWKV_INIT_MLOCK.
+    size_t locked_size = 0;
+
+    void operator()(uint8_t * data) const {
+#if !defined(_WIN32)
+        if (locked_size) {
+            munlock(data, locked_size);
+        }
+
+        if (mapped_size) {
+            munmap(data, mapped_size);
+            return;
+        }
+#endif
+        delete[] data;
+    }
+};
+
+typedef std::unique_ptr<uint8_t[], struct rwkv_scratch_deleter> rwkv_scratch;
+
 struct rwkv_ggml_context {
-    std::unique_ptr<uint8_t[]> scratch;
+    rwkv_scratch scratch;
     struct ggml_context * ctx;
 
-    rwkv_ggml_context(): ctx(NULL) {}
+    // Bytes allocated for the context and its scratch.
+    size_t size;
 
-    rwkv_ggml_context(const struct rwkv_future_ctx future_ctx): ctx(NULL) {
-        scratch.reset(new(std::nothrow) uint8_t[future_ctx.scratch_size]);
+    rwkv_ggml_context(): ctx(NULL), size(0) {}
 
+    rwkv_ggml_context(const struct rwkv_future_ctx future_ctx): rwkv_ggml_context(future_ctx, rwkv_scratch(new(std::nothrow) uint8_t[future_ctx.scratch_size])) {}
+
+    // Uses the given buffer of at least future_ctx.scratch_size bytes as the scratch.
+    rwkv_ggml_context(const struct rwkv_future_ctx future_ctx, rwkv_scratch && buffer): scratch(std::move(buffer)), ctx(NULL), size(0) {
         if (!scratch) {
             return;
         }
@@ -629,11 +720,13 @@ struct rwkv_ggml_context {
         }
 
         ggml_set_scratch(ctx, { 0, future_ctx.scratch_size, scratch.get() });
+        size = future_ctx.total_size();
     }
 
     struct rwkv_ggml_context & operator=(struct rwkv_ggml_context && source) {
-        scratch.reset(source.scratch.release());
+        std::swap(scratch, source.scratch);
         std::swap(ctx, source.ctx);
+        std::swap(size, source.size);
         return *this;
     }
 
@@ -644,6 +737,184 @@ struct rwkv_ggml_context {
     }
 };
 
+// --- CPU and memory placement ---
+
+// Parses a list of CPUs or NUMA nodes in the format of /sys/devices/system, like "0-3,8,10-11".
+bool rwkv_parse_cpu_list(const char * list, std::vector<uint32_t> & values) {
+    values.clear();
+
+    while (*list && *list != '\n') {
+        char * end;
+        const unsigned long first = strtoul(list, &end, 10);
+        RWKV_ENSURE_OR_FALSE(end != list);
+        unsigned long last = first;
+
+        if (*end == '-') {
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+            RWKV_ENSURE_OR_FALSE(end != list && last >= first);
+        }
+
+        for (unsigned long value = first; value <= last; value++) {
+            values.push_back((uint32_t) value);
+        }
+
+        list = *end == ',' ? end + 1 : end;
+    }
+
+    return !values.empty();
+}
+
+bool rwkv_read_cpu_list(const char * path, std::vector<uint32_t> & values) {
+    std::ifstream file(path);
+    std::string line;
+    return std::getline(file, line) && rwkv_parse_cpu_list(line.c_str(), values);
+}
+
+#if defined(__linux__)
+// Pins the calling thread to the given CPUs, and restores its previous affinity when destroyed.
+// Threads that ggml_graph_compute creates inherit the affinity of the calling thread, so graphs computed in scope are pinned too.
+struct rwkv_affinity_guard {
+    cpu_set_t previous;
+    bool pinned = false;
+
+    rwkv_affinity_guard(const std::vector<uint32_t> & cpus) {
+        if (cpus.empty() || sched_getaffinity(0, sizeof(previous), &previous) != 0) {
+            return;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        for (const uint32_t cpu : cpus) {
+            if (cpu >= CPU_SETSIZE) {
+                return;
+            }
+
+            CPU_SET(cpu, &set);
+        }
+
+        pinned = sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+
+    ~rwkv_affinity_guard() {
+        if (pinned) {
+            sched_setaffinity(0, sizeof(previous), &previous);
+        }
+    }
+};
+
+// Value of MPOL_INTERLEAVE from linux/mempolicy.h, which is not installed everywhere.
+#define RWKV_MPOL_INTERLEAVE 3
+
+// Spreads pages of the buffer round-robin between all online NUMA nodes. Must be called before the pages are first touched.
+bool rwkv_numa_interleave(void * data, const size_t size) {
+    std::vector<uint32_t> nodes;
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, rwkv_read_cpu_list("/sys/devices/system/node/online", nodes), "Failed to read NUMA nodes");
+
+    const size_t bits = sizeof(unsigned long) * 8;
+    std::vector<unsigned long> mask(*std::max_element(nodes.begin(), nodes.end()) / bits + 1);
+
+    for (const uint32_t node : nodes) {
+        mask[node / bits] |= 1UL << (node % bits);
+    }
+
+    // mbind works with whole pages: skip partial pages at both ends of the buffer.
+    const uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t start = ((uintptr_t) data + page_size - 1) / page_size * page_size;
+    const uintptr_t end = ((uintptr_t) data + size) / page_size * page_size;
+
+    if (end > start) {
+        RWKV_ASSERT_FALSE_MSG(
+            RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED,
+            syscall(SYS_mbind, start, end - start, RWKV_MPOL_INTERLEAVE, mask.data(), mask.size() * bits + 1, 0) == 0,
+            "Failed to interleave model weights between NUMA nodes: %s", strerror(errno)
+        );
+    }
+
+    return true;
+}
+#else
+struct rwkv_affinity_guard {
+    bool pinned = false;
+
+    rwkv_affinity_guard(const std::vector<uint32_t> &) {}
+};
+
+bool rwkv_numa_interleave(void *, const size_t) {
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, false, "NUMA placement is only supported on Linux");
+}
+#endif
+
+// Reads the default size of explicit huge pages from /proc/meminfo.
+size_t rwkv_huge_page_size() {
+    std::ifstream file("/proc/meminfo");
+    std::string line;
+
+    while (std::getline(file, line)) {
+        unsigned long size_kb;
+
+        if (sscanf(line.c_str(), "Hugepagesize: %lu kB", &size_kb) == 1) {
+            return (size_t) size_kb * 1024;
+        }
+    }
+
+    return 2 * 1024 * 1024;
+}
+
+// Creates a context for model weights. Tensor data goes to the scratch buffer, which is backed by huge pages
+// if requested by RWKV_INIT_HUGE_PAGES or RWKV_INIT_HUGETLB.
+bool rwkv_weights_context(const struct rwkv_future_ctx & future_ctx, const uint32_t flags, struct rwkv_ggml_context & ctx) {
+    if (!(flags & (RWKV_INIT_HUGE_PAGES | RWKV_INIT_HUGETLB))) {
+        ctx = future_ctx;
+        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, ctx.ctx, "Failed to allocate model context");
+        return true;
+    }
+
+#if defined(__linux__)
+    const bool explicit_pages = flags & RWKV_INIT_HUGETLB;
+
+    // The length of a mapping with explicit huge pages must be a multiple of their size, or munmap fails.
+    const size_t page_size = explicit_pages ? rwkv_huge_page_size() : (size_t) sysconf(_SC_PAGESIZE);
+    const size_t mapped_size = std::max((future_ctx.scratch_size + page_size - 1) / page_size * page_size, page_size);
+
+    void * data = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | (explicit_pages ? MAP_HUGETLB : 0), -1, 0);
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, data != MAP_FAILED, "Failed to map %zu bytes for model weights%s: %s",
+        mapped_size, explicit_pages ? " with explicit huge pages" : "", strerror(errno));
+
+    struct rwkv_scratch_deleter deleter;
+    deleter.mapped_size = mapped_size;
+    rwkv_scratch scratch((uint8_t *) data, deleter);
+
+    if (!explicit_pages) {
+        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, madvise(data, mapped_size, MADV_HUGEPAGE) == 0,
+            "Failed to enable transparent huge pages for model weights: %s", strerror(errno));
+    }
+
+    ctx = rwkv_ggml_context(future_ctx, std::move(scratch));
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, ctx.ctx, "Failed to allocate model context");
+    return true;
+#else
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, false, "Huge pages are only supported on Linux");
+#endif
+}
+
+// Locks tensor data of the weights context in memory, if requested by RWKV_INIT_MLOCK.
+bool rwkv_lock_weights(struct rwkv_ggml_context & ctx, const size_t size, const uint32_t flags) {
+    if (!(flags & RWKV_INIT_MLOCK) || size == 0) {
+        return true;
+    }
+
+#if !defined(_WIN32)
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, mlock(ctx.scratch.get(), size) == 0,
+        "Failed to lock %zu bytes of model weights in memory: %s; check RLIMIT_MEMLOCK (ulimit -l)", size, strerror(errno));
+    ctx.scratch.get_deleter().locked_size = size;
+    return true;
+#else
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, false, "Locking model weights in memory is not supported on Windows");
+#endif
+}
+
 // An instance of an RWKV model loaded into memory.
 // Contains all the model weights.
 // Shared by one or more contexts.
@@ -659,6 +930,52 @@ struct rwkv_instance {
     // this may become outdated. We need to find a way not to hardcode a specific tensor, but to calculate accurately.
     // This may come out of a ggml issue: https://github.com/ggerganov/ggml/issues/214
     size_t ffn_key_size;
+
+    // All tensors of the model by name, used to look up parameters replaced by adapters.
+    std::unordered_map<std::string, struct ggml_tensor *> parameters;
+
+    // rwkv_init_flags the instance was loaded with.
+    uint32_t flags;
+
+    // Identifies the model in serialized states, see rwkv_model_fingerprint.
+    uint64_t fingerprint;
+
+    // Identifies the loaded weights for adapters, see rwkv_next_instance_id.
+    uint64_t id;
+};
+
+// Ids of instances are never reused, so that an adapter can not be applied to an instance
+// that was allocated at the address of a freed one.
+std::atomic<uint64_t> rwkv_last_instance_id(0);
+
+uint64_t rwkv_next_instance_id() {
+    return ++rwkv_last_instance_id;
+}
+
+// A low-rank adapter loaded from a file, see rwkv_lora_from_file.
+// Tensors are stored in FP32, so that adapter products do not need a work buffer, regardless of the model format.
+struct rwkv_lora {
+    // Id of the instance the adapter was validated against; it stays valid after the instance is freed.
+    uint64_t instance_id;
+
+    struct rwkv_ggml_context ctx;
+
+    // Low-rank matrices are named after the adapted weight matrix with .lora_A or .lora_B suffix;
+    // other tensors replace model parameters with the same name.
+    std::unordered_map<std::string, struct ggml_tensor *> tensors;
+};
+
+// The model with an adapter applied, as used by graphs of a context.
+// Adapter tensors are referenced through views, so that switching to another adapter with the same tensor names and shapes
+// only needs to update the data pointers of the views, and graphs do not need to be rebuilt.
+struct rwkv_adapted_model {
+    const struct rwkv_lora * lora = NULL;
+
+    struct rwkv_ggml_context ctx;
+    struct rwkv_model model;
+
+    // Views of adapter tensors with corresponding tensor names.
+    std::vector<std::pair<struct ggml_tensor *, std::string>> views;
 };
 
 // The hidden state of a single RWKV layer.
@@ -673,6 +990,34 @@ struct rwkv_layer_state {
     struct ggml_tensor * att_pp;
 };
 
+// Offsets into the memory of a graph context that separate tensors created for different parts of the model.
+// Tensors are allocated in creation order, so these attribute graph nodes to layers when profiling, see rwkv_profile_attribute_nodes.
+struct rwkv_graph_marks {
+    size_t embedding_end = 0;
+
+    // End of each layer; nodes created after the last layer belong to the head.
+    std::vector<size_t> layer_ends;
+
+    // Begin and end of the WKV block of each layer.
+    std::vector<std::pair<size_t, size_t>> wkv;
+};
+
+// Layer and category of a graph node, see rwkv_profile_entry.
+struct rwkv_profile_node {
+    int32_t layer;
+    enum rwkv_profile_category category;
+};
+
+// Outputs of the sequence graph besides the state after the sequence.
+enum rwkv_sequence_outputs {
+    // Logits of the last token, see rwkv_eval_sequence.
+    RWKV_SEQUENCE_LOGITS = 0,
+    // Logits and state after every token, see rwkv_eval_sequence_per_token.
+    RWKV_SEQUENCE_PER_TOKEN,
+    // Hidden state of every token after ln_out, without the head, see rwkv_eval_sequence_embed.
+    RWKV_SEQUENCE_EMBEDDINGS
+};
+
 // Holds a single computation graph and its ggml context.
 // Graphs each have their own context so that they can be individually freed and rebuilt.
 // Graphs read hidden state from the rwkv_context and then write it back to the rwkv_context.
@@ -688,6 +1033,49 @@ struct rwkv_graph {
     size_t pre_logits_leafs;
     size_t post_logits_nodes;
     size_t post_logits_leafs;
+
+    // Logits and state after every token, see rwkv_eval_sequence_per_token; NULL unless the graph computes them.
+    struct ggml_tensor * token_logits;
+    struct ggml_tensor * token_states;
+    // Hidden state of every token after ln_out, see rwkv_eval_sequence_embed; NULL unless the graph computes it.
+    struct ggml_tensor * token_embeddings;
+
+    // Count of threads that the graph is computed with, unless fewer are available in the thread budget of the context.
+    uint32_t n_threads;
+
+    struct rwkv_graph_marks marks;
+
+    // Attribution of nodes for profiling; filled on the first profiled evaluation of the graph.
+    std::vector<struct rwkv_profile_node> profile_nodes;
+};
+
+// Count of sequence graphs that a context keeps besides the current one, see rwkv_use_sequence_graph.
+#define RWKV_MAX_SPARE_SEQUENCE_GRAPHS 3
+
+// A sequence graph that was replaced by a graph for another length or outputs, kept to be reused later.
+struct rwkv_spare_sequence_graph {
+    size_t sequence_len;
+    enum rwkv_sequence_outputs outputs;
+    struct rwkv_graph graph;
+};
+
+// A single evaluation or graph node execution, recorded for rwkv_dump_profile_trace.
+struct rwkv_trace_event {
+    const char * name;
+    const char * category;
+    // Layer of the node, or number of tokens of the evaluation.
+    int64_t arg;
+    int64_t start_us;
+    int64_t duration_us;
+};
+
+struct rwkv_profile {
+    uint32_t flags = RWKV_PROFILE_NONE;
+
+    // Aggregated by layer and category: entry for layer L and category C is at (L + 1) * RWKV_PROFILE_CATEGORY_COUNT + C.
+    std::vector<struct rwkv_profile_entry> entries;
+
+    std::vector<struct rwkv_trace_event> trace;
 };
 
 // RWKV context for a specific instance.
@@ -703,20 +1091,50 @@ struct rwkv_context {
     std::unique_ptr<struct rwkv_layer_state[]> output_layers;
     struct ggml_tensor * logits;
 
+    // Count of threads that the work buffer of the serial graph is sized for.
     uint32_t n_threads;
 
+    // Counts of threads that graphs are computed with, see rwkv_set_n_threads. The serial one never exceeds n_threads.
+    uint32_t serial_n_threads;
+    uint32_t sequence_n_threads;
+
     // The serial graph implements the traditional RNN mode that processes only one token at a time (serial mode).
     struct rwkv_graph serial_graph;
+    // Layers that the serial graph evaluates; empty if it evaluates all of them. Skipped layers keep their state.
+    std::vector<bool> layer_mask;
 
     // The sequence graph implements the "sequence mode" (or transformer/GPT mode) that processes multiple tokens at a time.
     // This can be an order of magnitude or so faster than serial execution if used properly.
     size_t sequence_len;
     struct rwkv_graph sequence_graph;
+    enum rwkv_sequence_outputs sequence_outputs;
+    // Sequence graphs used before the current one, least recently used first.
+    std::list<struct rwkv_spare_sequence_graph> spare_sequence_graphs;
+
+    // The currently applied adapter, if any. Graphs use this model instead of the instance model when an adapter is set.
+    struct rwkv_adapted_model adapted;
+
+    struct rwkv_profile profile;
+
+    // Limit of bytes allocated by the context, see rwkv_set_memory_limit; 0 if there is no limit.
+    size_t memory_limit;
+
+    // Whether an asynchronous evaluation of the context has not reached a final state yet.
+    std::atomic<bool> async_busy;
+
+    // Shared with other contexts, see rwkv_set_thread_budget; NULL if the context computes with its own thread count.
+    struct rwkv_thread_budget * thread_budget;
+
+    // CPUs that graphs are computed on, see rwkv_set_cpu_affinity; empty if threads are not pinned.
+    std::vector<uint32_t> cpu_affinity;
 
     enum rwkv_error_flags last_error;
     bool print_errors;
 
     size_t gpu_layers;
+
+    // Clone that drafts tokens with a subset of layers for RWKV_SPECULATION_LAYER_SKIP; NULL until it is first needed.
+    std::unique_ptr<struct rwkv_context> layer_skip_draft;
 };
 
 // https://stackoverflow.com/a/6458689
@@ -765,6 +1183,29 @@ bool rwkv_set_params(struct rwkv_model & model, F callback) {
     return true;
 }
 
+// Same as rwkv_set_params, but for low-rank adapters of weight matrices. Keys are names of the adapted weight matrices.
+// Model layers must already be allocated.
+template<typename F>
+bool rwkv_set_lora_pairs(struct rwkv_model & model, F callback) {
+    for (uint32_t i = 0; i < model.header.n_layer; i++) {
+        char buffer[128];
+        size_t offset = sprintf(buffer, "blocks.%" PRId32 ".", i);
+
+        rwkv_layer & layer = model.layers[i];
+        RWKV_ENSURE_OR_FALSE(callback((strcpy(&buffer[offset], "att.key.weight"), buffer), layer.att_key_lora));
+        RWKV_ENSURE_OR_FALSE(callback((strcpy(&buffer[offset], "att.value.weight"), buffer), layer.att_value_lora));
+        RWKV_ENSURE_OR_FALSE(callback((strcpy(&buffer[offset], "att.receptance.weight"), buffer), layer.att_receptance_lora));
+        RWKV_ENSURE_OR_FALSE(callback((strcpy(&buffer[offset], "att.output.weight"), buffer), layer.att_output_lora));
+
+        RWKV_ENSURE_OR_FALSE(callback((strcpy(&buffer[offset], "ffn.key.weight"), buffer), layer.ffn_key_lora));
+        RWKV_ENSURE_OR_FALSE(callback((strcpy(&buffer[offset], "ffn.value.weight"), buffer), layer.ffn_value_lora));
+        RWKV_ENSURE_OR_FALSE(callback((strcpy(&buffer[offset], "ffn.receptance.weight"), buffer), layer.ffn_receptance_lora));
+    }
+
+    RWKV_ENSURE_OR_FALSE(callback("head.weight", model.head_lora));
+    return true;
+}
+
 void rwkv_future_carry_x(struct rwkv_future_ctx & ctx,
     const struct rwkv_future_tensor weight,
     const struct rwkv_future_tensor bias,
@@ -870,11 +1311,11 @@ void rwkv_att_rkv(
     );
 
     // r = torch.sigmoid(rw @ xr)
-    r = rwkv_sigmoid(ctx, ggml_mul_mat(ctx, layer.att_receptance, xr));
+    r = rwkv_sigmoid(ctx, rwkv_mul_mat(ctx, layer.att_receptance, layer.att_receptance_lora, xr));
     // k = kw @ xk
-    k = ggml_mul_mat(ctx, layer.att_key, xk);
+    k = rwkv_mul_mat(ctx, layer.att_key, layer.att_key_lora, xk);
     // v = vw @ xv
-    v = ggml_mul_mat(ctx, layer.att_value, xv);
+    v = rwkv_mul_mat(ctx, layer.att_value, layer.att_value_lora, xv);
 }
 
 struct rwkv_future_tensor rwkv_future_att_wkv(struct rwkv_future_ctx & ctx,
@@ -982,17 +1423,19 @@ struct rwkv_future_tensor rwkv_future_att(struct rwkv_future_ctx & ctx,
     return att_output.mul_mat(ctx, r.combine(ctx, wkv));
 }
 
-struct ggml_tensor * rwkv_att(struct ggml_context * ctx, struct ggml_tensor * x, struct rwkv_layer layer, struct rwkv_layer_state & state) {
+struct ggml_tensor * rwkv_att(struct ggml_context * ctx, struct ggml_tensor * x, struct rwkv_layer layer, struct rwkv_layer_state & state, struct rwkv_graph_marks & marks) {
     struct ggml_tensor * x_prev;
     rwkv_carry_x(ctx, layer.ln1_weight, layer.ln1_bias, x, x_prev, state.att_xx);
 
     struct ggml_tensor * r, * k, * v;
     rwkv_att_rkv(ctx, layer, x, x_prev, r, k, v);
 
+    const size_t wkv_begin = ggml_used_mem(ctx);
     struct ggml_tensor * wkv = rwkv_att_wkv(ctx, layer.att_time_first, layer.att_time_decay, k, v, state.att_aa, state.att_bb, state.att_pp);
+    marks.wkv.push_back(std::make_pair(wkv_begin, ggml_used_mem(ctx)));
 
     // ow @ (r * xx)
-    return ggml_mul_mat(ctx, layer.att_output, ggml_mul(ctx, r, wkv));
+    return rwkv_mul_mat(ctx, layer.att_output, layer.att_output_lora, ggml_mul(ctx, r, wkv));
 }
 
 struct rwkv_future_tensor rwkv_future_ffn(struct rwkv_future_ctx & ctx,
@@ -1018,10 +1461,15 @@ struct rwkv_future_tensor rwkv_future_ffn(struct rwkv_future_ctx & ctx,
     return r.consume(ctx, ffn_v.mul_mat(ctx, k));
 }
 
-struct ggml_tensor * rwkv_ffn(struct ggml_context * ctx, struct ggml_tensor * x, struct rwkv_layer layer, struct rwkv_layer_state & state) {
+// If x_normalized is non-NULL, it receives x after the layer norm, whose rows are the values of ffn_xx after each token.
+struct ggml_tensor * rwkv_ffn(struct ggml_context * ctx, struct ggml_tensor * x, struct rwkv_layer layer, struct rwkv_layer_state & state, struct ggml_tensor ** x_normalized = NULL) {
     struct ggml_tensor * x_prev;
     rwkv_carry_x(ctx, layer.ln2_weight, layer.ln2_bias, x, x_prev, state.ffn_xx);
 
+    if (x_normalized) {
+        *x_normalized = x;
+    }
+
     // xk = x * time_mix_k + state[5 * i + 1] * (1 - time_mix_k)
     // xk = x * time_mix_k + state[5 * i + 0] * (1 - time_mix_k)
     struct ggml_tensor * xk = ggml_add_inplace(
@@ -1038,13 +1486,22 @@ struct ggml_tensor * rwkv_ffn(struct ggml_context * ctx, struct ggml_tensor * x,
     );
 
     // r = torch.sigmoid(rw @ xr)
-    struct ggml_tensor * r = rwkv_sigmoid(ctx, ggml_mul_mat(ctx, layer.ffn_receptance, xr));
+    struct ggml_tensor * r = rwkv_sigmoid(ctx, rwkv_mul_mat(ctx, layer.ffn_receptance, layer.ffn_receptance_lora, xr));
 
     // k = torch.square(torch.relu(kw @ xk))
-    struct ggml_tensor * k = ggml_sqr_inplace(ctx, ggml_relu_inplace(ctx, ggml_mul_mat(ctx, layer.ffn_key, xk)));
+    struct ggml_tensor * k = ggml_sqr_inplace(ctx, ggml_relu_inplace(ctx, rwkv_mul_mat(ctx, layer.ffn_key, layer.ffn_key_lora, xk)));
 
     // r * (vw @ k)
-    return ggml_mul_inplace(ctx, r, ggml_mul_mat(ctx, layer.ffn_value, k));
+    return ggml_mul_inplace(ctx, r, rwkv_mul_mat(ctx, layer.ffn_value, layer.ffn_value_lora, k));
+}
+
+size_t rwkv_graph_work_size(const enum ggml_type type, const size_t ffn_key_height, const size_t n_threads, const size_t sequence_len = 1) {
+#ifdef GGML_USE_CUBLAS
+    enum ggml_type mul_mat_type = type == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16;
+#else
+    enum ggml_type mul_mat_type = ggml_is_quantized(type) ? GGML_TYPE_Q8_1 : type;
+#endif
+    return rwkv_future_tensor::size(mul_mat_type, ffn_key_height, sequence_len) * n_threads + 64 * (n_threads - 1);
 }
 
 struct rwkv_future_tensor rwkv_future_graph_work(struct rwkv_future_ctx & ctx,
@@ -1053,12 +1510,21 @@ struct rwkv_future_tensor rwkv_future_graph_work(struct rwkv_future_ctx & ctx,
     const size_t n_threads,
     const size_t sequence_len = 1
 ) {
-#ifdef GGML_USE_CUBLAS
-    enum ggml_type mul_mat_type = type == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16;
-#else
-    enum ggml_type mul_mat_type = ggml_is_quantized(type) ? GGML_TYPE_Q8_1 : type;
-#endif
-    return ctx.alloc(GGML_TYPE_I8, rwkv_future_tensor::size(mul_mat_type, ffn_key_height, sequence_len) * n_threads + 64 * (n_threads - 1));
+    return ctx.alloc(GGML_TYPE_I8, rwkv_graph_work_size(type, ffn_key_height, n_threads, sequence_len));
+}
+
+// Accounts for low-rank adapter products in a graph that processes sequence_len tokens, see rwkv_mul_mat.
+void rwkv_future_lora(struct rwkv_future_ctx & ctx, struct rwkv_model & model, const size_t sequence_len, const bool head_per_token = false) {
+    rwkv_set_lora_pairs(model, [&](const char * key, struct rwkv_lora_pair & lora) {
+        if (lora.a) {
+            // Logits are computed only for the last token, unless they are computed for every token.
+            const size_t height = strcmp(key, "head.weight") == 0 && !head_per_token ? 1 : sequence_len;
+            ctx.alloc(GGML_TYPE_F32, lora.a->ne[1], height);
+            ctx.alloc(GGML_TYPE_F32, lora.b->ne[1], height).view(ctx);
+        }
+
+        return true;
+    });
 }
 
 struct rwkv_future_tensor rwkv_future_serial_graph(struct rwkv_future_ctx & ctx,
@@ -1068,6 +1534,7 @@ struct rwkv_future_tensor rwkv_future_serial_graph(struct rwkv_future_ctx & ctx,
     const struct rwkv_future_tensor emb,
     const struct rwkv_future_tensor ln0_weight,
     const struct rwkv_future_tensor ln0_bias,
+    const bool ln0_folded,
 
     const size_t n_layer,
 
@@ -1100,7 +1567,11 @@ struct rwkv_future_tensor rwkv_future_serial_graph(struct rwkv_future_ctx & ctx,
     const struct rwkv_future_tensor ln_out_bias,
     const struct rwkv_future_tensor head
 ) {
-    struct rwkv_future_tensor x = emb.get_rows(ctx, tokens).layer_norm(ctx, ln0_weight, ln0_bias);
+    struct rwkv_future_tensor x = emb.get_rows(ctx, tokens);
+
+    if (!ln0_folded) {
+        x = x.layer_norm(ctx, ln0_weight, ln0_bias);
+    }
 
     for (size_t i = 0; i < n_layer; i++) {
         x = x.consume(ctx, rwkv_future_att(ctx,
@@ -1124,6 +1595,8 @@ struct rwkv_future_tensor rwkv_future_serial_graph(struct rwkv_future_ctx & ctx,
     return head.mul_mat(ctx, x).view(ctx);
 }
 
+// Layers i with layer_mask[i] == false are skipped: x passes them unchanged, and their output state is their input state.
+// An empty mask evaluates all layers.
 bool rwkv_build_serial_graph(
     struct ggml_context * ctx,
     struct rwkv_model & model,
@@ -1131,25 +1604,38 @@ bool rwkv_build_serial_graph(
     struct rwkv_layer_state * inputs,
     struct rwkv_layer_state * outputs,
     struct ggml_tensor * logits,
+    const std::vector<bool> & layer_mask,
     struct ggml_cgraph * cgraph,
 
     size_t * const pre_logits_nodes,
     size_t * const pre_logits_leafs,
     size_t * const post_logits_nodes,
-    size_t * const post_logits_leafs
+    size_t * const post_logits_leafs,
+    struct rwkv_graph_marks & marks
 ) {
     // x = self.w.emb.weight[token]
+    // If the embedding is quantized, only the row of the token gets dequantized.
     struct ggml_tensor * x = ggml_get_rows(ctx, model.emb, tokens);
 
-    // x = self.layer_norm(x, self.w.blocks[0].ln0)
-    x = rwkv_layer_norm(ctx, x, model.ln0_weight, model.ln0_bias);
+    if (!model.ln0_folded) {
+        // x = self.layer_norm(x, self.w.blocks[0].ln0)
+        x = rwkv_layer_norm(ctx, x, model.ln0_weight, model.ln0_bias);
+    }
+
+    marks.embedding_end = ggml_used_mem(ctx);
 
     for (size_t i = 0; i < model.header.n_layer; i++) {
         struct rwkv_layer & layer = model.layers[i];
 
         struct rwkv_layer_state state = inputs[i];
-        x = ggml_add_inplace(ctx, x, rwkv_att(ctx, x, layer, state));
-        x = ggml_add_inplace(ctx, x, rwkv_ffn(ctx, x, layer, state));
+
+        if (layer_mask.empty() || layer_mask[i]) {
+            x = ggml_add_inplace(ctx, x, rwkv_att(ctx, x, layer, state, marks));
+            x = ggml_add_inplace(ctx, x, rwkv_ffn(ctx, x, layer, state));
+        } else {
+            // Keep wkv marks aligned with layers for profiling.
+            marks.wkv.push_back(std::make_pair(ggml_used_mem(ctx), ggml_used_mem(ctx)));
+        }
 
         struct rwkv_layer_state & output = outputs[i];
         ggml_build_forward_expand(cgraph, ggml_cpy(ctx, state.ffn_xx, output.ffn_xx));
@@ -1157,6 +1643,8 @@ bool rwkv_build_serial_graph(
         ggml_build_forward_expand(cgraph, ggml_cpy(ctx, state.att_aa, output.att_aa));
         ggml_build_forward_expand(cgraph, ggml_cpy(ctx, state.att_bb, output.att_bb));
         ggml_build_forward_expand(cgraph, ggml_cpy(ctx, state.att_pp, output.att_pp));
+
+        marks.layer_ends.push_back(ggml_used_mem(ctx));
     }
 
     *pre_logits_nodes = cgraph->n_nodes;
@@ -1166,7 +1654,7 @@ bool rwkv_build_serial_graph(
     x = rwkv_layer_norm(ctx, x, model.ln_out_weight, model.ln_out_bias);
 
     // x = (self.w.head.weight @ x).float()
-    ggml_build_forward_expand(cgraph, ggml_cpy(ctx, ggml_mul_mat(ctx, model.head, x), logits));
+    ggml_build_forward_expand(cgraph, ggml_cpy(ctx, rwkv_mul_mat(ctx, model.head, model.head_lora, x), logits));
 
     *post_logits_nodes = cgraph->n_nodes;
     *post_logits_leafs = cgraph->n_leafs;
@@ -1181,6 +1669,7 @@ struct rwkv_future_tensor rwkv_future_sequence_graph(struct rwkv_future_ctx & ct
     const struct rwkv_future_tensor emb,
     const struct rwkv_future_tensor ln0_weight,
     const struct rwkv_future_tensor ln0_bias,
+    const bool ln0_folded,
 
     const size_t n_layer,
 
@@ -1214,7 +1703,10 @@ struct rwkv_future_tensor rwkv_future_sequence_graph(struct rwkv_future_ctx & ct
     const struct rwkv_future_tensor head
 ) {
     struct rwkv_future_tensor x = emb.get_rows(ctx, tokens);
-    x = x.layer_norm(ctx, ln0_weight.repeat(ctx, x), ln0_bias.repeat(ctx, x));
+
+    if (!ln0_folded) {
+        x = x.layer_norm(ctx, ln0_weight.repeat(ctx, x), ln0_bias.repeat(ctx, x));
+    }
 
     for (size_t i = 0; i < n_layer; i++) {
         struct rwkv_future_tensor x0 = x, x_prev;
@@ -1248,6 +1740,24 @@ struct rwkv_future_tensor rwkv_future_sequence_graph(struct rwkv_future_ctx & ct
     return head.mul_mat(ctx, x).view(ctx);
 }
 
+// Copies a part of the state of a layer after token t into the per-token states of the sequence graph.
+void rwkv_copy_token_state(
+    struct ggml_context * ctx,
+    struct ggml_cgraph * cgraph,
+    struct ggml_tensor * token_states,
+    struct ggml_tensor * part,
+    const size_t t,
+    const size_t layer,
+    const size_t index
+) {
+    const size_t n_embed = part->ne[0];
+    const size_t offset = t * token_states->ne[0] + (layer * 5 + index) * n_embed;
+    ggml_build_forward_expand(cgraph, ggml_cpy(ctx, part, ggml_view_1d(ctx, token_states, n_embed, offset * sizeof(float))));
+}
+
+// If token_logits and token_states are non-NULL, the graph also writes logits and state after every token into them,
+// and does not compute logits of the last token separately. If token_embeddings is non-NULL, the graph writes the hidden state
+// of every token after ln_out into it instead of computing logits.
 bool rwkv_build_sequence_graph(
     struct ggml_context * ctx,
     struct rwkv_model & model,
@@ -1255,19 +1765,29 @@ bool rwkv_build_sequence_graph(
     struct rwkv_layer_state * inputs,
     struct rwkv_layer_state * outputs,
     struct ggml_tensor * logits,
+    struct ggml_tensor * token_logits,
+    struct ggml_tensor * token_states,
+    struct ggml_tensor * token_embeddings,
     struct ggml_cgraph * cgraph,
 
     size_t * const pre_logits_nodes,
     size_t * const pre_logits_leafs,
     size_t * const post_logits_nodes,
-    size_t * const post_logits_leafs
+    size_t * const post_logits_leafs,
+    struct rwkv_graph_marks & marks
 ) {
     const uint32_t n_embed = model.header.n_embed;
     const size_t sequence_len = tokens->ne[0];
 
+    // If the embedding is quantized, only the rows of the tokens get dequantized.
     struct ggml_tensor * x = ggml_get_rows(ctx, model.emb, tokens);
-    x = rwkv_layer_norm(ctx, x, ggml_repeat(ctx, model.ln0_weight, x), ggml_repeat(ctx, model.ln0_bias, x));
-    
+
+    if (!model.ln0_folded) {
+        x = rwkv_layer_norm(ctx, x, ggml_repeat(ctx, model.ln0_weight, x), ggml_repeat(ctx, model.ln0_bias, x));
+    }
+
+    marks.embedding_end = ggml_used_mem(ctx);
+
     for (size_t i = 0; i < model.header.n_layer; i++) {
         struct rwkv_layer & layer = model.layers[i];
         struct rwkv_layer_state state = inputs[i];
@@ -1280,16 +1800,36 @@ bool rwkv_build_sequence_graph(
 
         ggml_build_forward_expand(cgraph, r);
 
+        const size_t wkv_begin = ggml_used_mem(ctx);
+
         for (uint32_t t = 0; t < sequence_len; t++) {
             struct ggml_tensor * kt = ggml_view_1d(ctx, k, n_embed, n_embed * sizeof(float) * t);
             struct ggml_tensor * vt = ggml_view_1d(ctx, v, n_embed, n_embed * sizeof(float) * t);
             struct ggml_tensor * xt = ggml_view_1d(ctx, x_prev, n_embed, n_embed * sizeof(float) * t);
             struct ggml_tensor * wkv = rwkv_att_wkv(ctx, layer.att_time_first, layer.att_time_decay, kt, vt, state.att_aa, state.att_bb, state.att_pp);
             ggml_build_forward_expand(cgraph, ggml_cpy(ctx, wkv, xt));
+
+            if (token_states) {
+                // Rows of the normalized input are the values of att_xx after each token.
+                rwkv_copy_token_state(ctx, cgraph, token_states, ggml_view_1d(ctx, x0, n_embed, n_embed * sizeof(float) * t), t, i, 1);
+                rwkv_copy_token_state(ctx, cgraph, token_states, state.att_aa, t, i, 2);
+                rwkv_copy_token_state(ctx, cgraph, token_states, state.att_bb, t, i, 3);
+                rwkv_copy_token_state(ctx, cgraph, token_states, state.att_pp, t, i, 4);
+            }
         }
 
-        x = ggml_add_inplace(ctx, x, ggml_mul_mat(ctx, layer.att_output, ggml_mul(ctx, r, x_prev)));
-        x = ggml_add_inplace(ctx, x, rwkv_ffn(ctx, x, layer, state));
+        marks.wkv.push_back(std::make_pair(wkv_begin, ggml_used_mem(ctx)));
+
+        x = ggml_add_inplace(ctx, x, rwkv_mul_mat(ctx, layer.att_output, layer.att_output_lora, ggml_mul(ctx, r, x_prev)));
+
+        struct ggml_tensor * ffn_x;
+        x = ggml_add_inplace(ctx, x, rwkv_ffn(ctx, x, layer, state, &ffn_x));
+
+        if (token_states) {
+            for (uint32_t t = 0; t < sequence_len; t++) {
+                rwkv_copy_token_state(ctx, cgraph, token_states, ggml_view_1d(ctx, ffn_x, n_embed, n_embed * sizeof(float) * t), t, i, 0);
+            }
+        }
 
         struct rwkv_layer_state & output = outputs[i];
         ggml_build_forward_expand(cgraph, ggml_cpy(ctx, state.ffn_xx, output.ffn_xx));
@@ -1297,16 +1837,28 @@ bool rwkv_build_sequence_graph(
         ggml_build_forward_expand(cgraph, ggml_cpy(ctx, state.att_aa, output.att_aa));
         ggml_build_forward_expand(cgraph, ggml_cpy(ctx, state.att_bb, output.att_bb));
         ggml_build_forward_expand(cgraph, ggml_cpy(ctx, state.att_pp, output.att_pp));
+
+        marks.layer_ends.push_back(ggml_used_mem(ctx));
     }
 
     *pre_logits_nodes = cgraph->n_nodes;
     *pre_logits_leafs = cgraph->n_leafs;
 
-    // x = self.layer_norm(x[-1,:], self.w.ln_out)
-    x = rwkv_layer_norm(ctx, ggml_view_1d(ctx, x, n_embed, n_embed * sizeof(float) * (sequence_len - 1)), model.ln_out_weight, model.ln_out_bias);
+    if (token_logits) {
+        // Logits of every token; the last column is the logits of the last token.
+        x = rwkv_layer_norm(ctx, x, ggml_repeat(ctx, model.ln_out_weight, x), ggml_repeat(ctx, model.ln_out_bias, x));
+        ggml_build_forward_expand(cgraph, ggml_cpy(ctx, rwkv_mul_mat(ctx, model.head, model.head_lora, x), token_logits));
+    } else if (token_embeddings) {
+        // The head is skipped entirely.
+        x = rwkv_layer_norm(ctx, x, ggml_repeat(ctx, model.ln_out_weight, x), ggml_repeat(ctx, model.ln_out_bias, x));
+        ggml_build_forward_expand(cgraph, ggml_cpy(ctx, x, token_embeddings));
+    } else {
+        // x = self.layer_norm(x[-1,:], self.w.ln_out)
+        x = rwkv_layer_norm(ctx, ggml_view_1d(ctx, x, n_embed, n_embed * sizeof(float) * (sequence_len - 1)), model.ln_out_weight, model.ln_out_bias);
 
-    // x = (self.w.head.weight @ x).float()
-    ggml_build_forward_expand(cgraph, ggml_cpy(ctx, ggml_mul_mat(ctx, model.head, x), logits));
+        // x = (self.w.head.weight @ x).float()
+        ggml_build_forward_expand(cgraph, ggml_cpy(ctx, rwkv_mul_mat(ctx, model.head, model.head_lora, x), logits));
+    }
 
     *post_logits_nodes = cgraph->n_nodes;
     *post_logits_leafs = cgraph->n_leafs;
@@ -1314,60 +1866,507 @@ bool rwkv_build_sequence_graph(
     return true;
 }
 
-void rwkv_set_print_errors(struct rwkv_context * ctx, bool print_errors) {
-    bool * ptr = ctx ? &ctx->print_errors : &global_print_errors;
-    *ptr = print_errors;
-}
-
-bool rwkv_get_print_errors(struct rwkv_context * ctx) {
-    return ctx ? ctx->print_errors : global_print_errors;
-}
+// --- Quantization ---
 
-enum rwkv_error_flags rwkv_get_last_error(struct rwkv_context * ctx) {
-    enum rwkv_error_flags * ptr = ctx ? &ctx->last_error : &global_last_error;
-    enum rwkv_error_flags value = *ptr;
-    *ptr = RWKV_ERROR_NONE;
-    return value;
-}
+// A single rule of a quantization recipe: 2D tensors with names matching the pattern are stored in the given type.
+struct rwkv_quantize_rule {
+    std::string pattern;
+    enum rwkv_type type;
+};
 
-struct rwkv_file {
-    FILE * file;
+// Describes which data type each tensor of a model is quantized into.
+// A recipe is a list of items separated by commas, semicolons or new lines. Text after '#' up to the end of line is ignored.
+// Each item is either a format name, which sets the default type; or PATTERN=FORMAT, which overrides the type of matching tensors.
+// When multiple rules match a tensor, the last one wins.
+// Example: "Q5_1, *.ffn.key.weight=Q4_0, blocks.{0,-1}.*=Q8_0, *.att.output.weight=Q8_0, head.weight=Q8_0"
+struct rwkv_quantize_recipe {
+    enum rwkv_type default_type = TYPE_UNKNOWN;
+    // Whether an FP32 or FP16 default type also applies to emb.weight and head.weight. Set when converting while loading.
+    bool float_default_converts_all = false;
+    std::vector<struct rwkv_quantize_rule> rules;
+};
 
-    rwkv_file(FILE * file): file(file) {}
+// Checks whether value is in the set of numbers between start and end, which is a comma-separated list of numbers and A..B ranges.
+// Negative numbers count from n_layer, so that -1 is the last layer.
+// Returns false if the set is malformed.
+bool rwkv_match_number_set(const char * start, const char * end, const int64_t value, const int64_t n_layer, bool & matched) {
+    matched = false;
+
+    while (start < end) {
+        char * next;
+        int64_t from = strtoll(start, &next, 10);
+        RWKV_ENSURE_OR_FALSE(next != start && next <= end);
+        int64_t to = from;
+        start = next;
+
+        if (end - start >= 2 && start[0] == '.' && start[1] == '.') {
+            to = strtoll(start + 2, &next, 10);
+            RWKV_ENSURE_OR_FALSE(next != start + 2 && next <= end);
+            start = next;
+        }
 
-    ~rwkv_file() {
-        if (file) {
-            fclose(file);
+        if (start < end) {
+            RWKV_ENSURE_OR_FALSE(*start == ',');
+            start++;
         }
+
+        from = from < 0 ? n_layer + from : from;
+        to = to < 0 ? n_layer + to : to;
+        matched = matched || (value >= from && value <= to);
     }
-};
 
-bool rwkv_instance_from_file(const char * file_path, struct rwkv_instance & instance) {
-    struct stat file_stat;
-    struct rwkv_model model;
-    struct rwkv_ggml_context ctx;
-    size_t ffn_key_size = 0;
+    return true;
+}
 
-    std::unordered_map<std::string, struct ggml_tensor *> parameters;
+// Matches a tensor name against a pattern, where '*' matches any substring, '?' matches any single character,
+// and '{...}' matches a decimal number from the set, see rwkv_match_number_set.
+bool rwkv_match_pattern(const char * pattern, const char * name, const int64_t n_layer) {
+    switch (*pattern) {
+        case '\0':
+            return *name == '\0';
+        case '*':
+            for (const char * rest = name; ; rest++) {
+                if (rwkv_match_pattern(pattern + 1, rest, n_layer)) {
+                    return true;
+                }
+
+                if (*rest == '\0') {
+                    return false;
+                }
+            }
+        case '?':
+            return *name != '\0' && rwkv_match_pattern(pattern + 1, name + 1, n_layer);
+        case '{': {
+            const char * end = strchr(pattern, '}');
+            char * rest;
+            bool matched;
+
+            if (!end || !isdigit((unsigned char) *name)) {
+                return false;
+            }
 
-    {
-        rwkv_file file(fopen(file_path, "rb"));
+            int64_t value = strtoll(name, &rest, 10);
+            return rwkv_match_number_set(pattern + 1, end, value, n_layer, matched) && matched && rwkv_match_pattern(end + 1, rest, n_layer);
+        }
+        default:
+            return *pattern == *name && rwkv_match_pattern(pattern + 1, name + 1, n_layer);
+    }
+}
 
-        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_OPEN, file.file, "Failed to open file %s", file_path);
-        // Be very careful when changing this code. It must support files larger than 2 GB by using 64-bit functions to get the file length.
-        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_STAT, fstat(fileno(file.file), &file_stat) == 0, "Failed to stat file %s", file_path);
-        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE, rwkv_fread_file_header(file.file, model.header), "Invalid file header");
+// Returns true if the pattern is well-formed.
+bool rwkv_validate_pattern(const std::string & pattern) {
+    for (size_t start = pattern.find('{'); start != std::string::npos; start = pattern.find('{', start + 1)) {
+        size_t end = pattern.find('}', start);
+        bool matched;
+        RWKV_ENSURE_OR_FALSE(end != std::string::npos && end > start + 1);
+        RWKV_ENSURE_OR_FALSE(rwkv_match_number_set(pattern.c_str() + start + 1, pattern.c_str() + end, 0, 0, matched));
+    }
+
+    return !pattern.empty();
+}
+
+std::string rwkv_trim(const std::string & value) {
+    const char * whitespace = " \t\r\n";
+    size_t start = value.find_first_not_of(whitespace);
+    return start == std::string::npos ? "" : value.substr(start, value.find_last_not_of(whitespace) - start + 1);
+}
+
+bool rwkv_parse_quantize_recipe(const char * str, struct rwkv_quantize_recipe & recipe) {
+    std::string item;
+    bool in_braces = false;
+
+    for (const char * c = str; ; c++) {
+        if (*c == '#') {
+            while (*c != '\0' && *c != '\n') {
+                c++;
+            }
+        }
+
+        // Commas inside of braces separate numbers of a set, not recipe items.
+        if (*c != '\0' && *c != '\n' && ((*c != ',' && *c != ';') || in_braces)) {
+            in_braces = *c == '{' || (in_braces && *c != '}');
+            item += *c;
+            continue;
+        }
+
+        in_braces = false;
+
+        size_t separator = item.find('=');
+        std::string pattern = rwkv_trim(item.substr(0, separator));
+        std::string type_name = separator == std::string::npos ? pattern : rwkv_trim(item.substr(separator + 1));
+        item.clear();
+
+        if (!type_name.empty()) {
+            enum rwkv_type type = rwkv_type_from_string(type_name.c_str());
+            RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ARGS | RWKV_ERROR_DATA_TYPE, rwkv_type_to_ggml[type] != GGML_TYPE_UNKNOWN, "Unsupported data type %s in quantization recipe", type_name.c_str());
+
+            if (separator == std::string::npos) {
+                recipe.default_type = type;
+            } else {
+                RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ARGS, rwkv_validate_pattern(pattern), "Invalid pattern '%s' in quantization recipe", pattern.c_str());
+                recipe.rules.push_back({ pattern, type });
+            }
+        }
+
+        if (*c == '\0') {
+            break;
+        }
+    }
+
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ARGS, recipe.default_type != TYPE_UNKNOWN || !recipe.rules.empty(), "Quantization recipe is empty");
+    return true;
+}
+
+// Returns the type a tensor should be stored in according to the recipe.
+// Only 2D tensors are affected. By default, embedding and head matrices are not quantized:
+// they take not too much space, especially in bigger models; but they significantly increase perplexity when quantized.
+// The embedding can still be quantized with an explicit rule, which saves memory on models with large vocabularies:
+// ggml_get_rows dequantizes only the rows of requested tokens.
+enum rwkv_type rwkv_quantize_recipe_type(const struct rwkv_quantize_recipe & recipe, const struct rwkv_tensor_header & header, const std::string & name, const uint32_t n_layer) {
+    enum rwkv_type type = (enum rwkv_type) header.data_type;
+
+    if (header.dim_count != 2 || (type != TYPE_FP32 && type != TYPE_FP16)) {
+        return type;
+    }
+
+    if (recipe.default_type != TYPE_UNKNOWN) {
+        const bool convert_all = recipe.float_default_converts_all && !ggml_is_quantized(rwkv_type_to_ggml[recipe.default_type]);
+
+        if (convert_all || (name != "emb.weight" && name != "head.weight")) {
+            type = recipe.default_type;
+        }
+    }
+
+    for (const struct rwkv_quantize_rule & rule : recipe.rules) {
+        if (rwkv_match_pattern(rule.pattern.c_str(), name.c_str(), n_layer)) {
+            type = rule.type;
+        }
+    }
+
+    return type;
+}
+
+// A single tensor moving through the quantization pipeline: it is read on the calling thread,
+// quantized by worker threads, and then written by a separate writer thread.
+struct rwkv_quantize_slot {
+    struct rwkv_tensor tensor;
+    enum rwkv_type in_type;
+    enum rwkv_type out_type;
+    size_t orig_size;
+    size_t new_size;
+    int64_t hist[16];
+
+    std::unique_ptr<uint8_t[]> in_buf;
+    std::unique_ptr<uint8_t[]> out_buf;
+};
+
+// Count of rows converted from FP16 to FP32 at once, bounds the temporary buffer of each quantization thread.
+#define RWKV_QUANTIZE_FP16_ROWS 64
+
+// Converts rows [row_start, row_end) of the slot tensor into the output type and buffer.
+// Rows are independent, so multiple threads can process different row ranges of the same tensor concurrently.
+bool rwkv_quantize_rows(const struct rwkv_quantize_slot & slot, const size_t row_start, const size_t row_end, int64_t * hist) {
+    const enum ggml_type out_type = rwkv_type_to_ggml[slot.out_type];
+    const size_t width = slot.tensor.header.width;
+    const size_t out_row_size = rwkv_future_tensor::size(out_type, width, 1);
+    const size_t n_rows = row_end - row_start;
+    uint8_t * out = slot.out_buf.get() + row_start * out_row_size;
+
+    if (slot.in_type == TYPE_FP32) {
+        const float * src = (const float *) slot.in_buf.get() + row_start * width;
+
+        if (out_type == GGML_TYPE_F16) {
+            ggml_fp32_to_fp16_row(src, (ggml_fp16_t *) out, n_rows * width);
+        } else {
+            ggml_quantize_chunk(out_type, src, out, 0, n_rows * width, hist);
+        }
+
+        return true;
+    }
+
+    const ggml_fp16_t * src = (const ggml_fp16_t *) slot.in_buf.get() + row_start * width;
+
+    if (out_type == GGML_TYPE_F32) {
+        ggml_fp16_to_fp32_row(src, (float *) out, n_rows * width);
+        return true;
+    }
+
+    std::unique_ptr<float[]> f32(new(std::nothrow) float[RWKV_QUANTIZE_FP16_ROWS * width]);
+
+    if (!f32) {
+        return false;
+    }
+
+    for (size_t row = 0; row < n_rows; row += RWKV_QUANTIZE_FP16_ROWS) {
+        const size_t batch_rows = row + RWKV_QUANTIZE_FP16_ROWS < n_rows ? RWKV_QUANTIZE_FP16_ROWS : n_rows - row;
+        ggml_fp16_to_fp32_row(src + row * width, f32.get(), batch_rows * width);
+        ggml_quantize_chunk(out_type, f32.get(), out + row * out_row_size, 0, batch_rows * width, hist);
+    }
+
+    return true;
+}
+
+// Converts the slot tensor, splitting its rows between up to n_threads threads, one of which is the calling thread.
+bool rwkv_quantize_slot_data(struct rwkv_quantize_slot & slot, const size_t n_threads) {
+    const size_t height = slot.tensor.header.height;
+    const size_t n_workers = n_threads < height ? n_threads : height;
+    const size_t rows_per_worker = (height + n_workers - 1) / n_workers;
+
+    std::unique_ptr<int64_t[]> hists(new(std::nothrow) int64_t[n_workers * 16]());
+    std::unique_ptr<bool[]> results(new(std::nothrow) bool[n_workers]());
+
+    if (!hists || !results) {
+        return false;
+    }
+
+    std::vector<std::thread> workers;
+
+    for (size_t i = 0; i < n_workers; i++) {
+        const size_t row_start = i * rows_per_worker;
+        const size_t row_end = row_start + rows_per_worker < height ? row_start + rows_per_worker : height;
+
+        if (row_start >= row_end) {
+            results[i] = true;
+            continue;
+        }
+
+        if (i == n_workers - 1) {
+            results[i] = rwkv_quantize_rows(slot, row_start, row_end, &hists[i * 16]);
+        } else {
+            workers.emplace_back([&slot, &hists, &results, row_start, row_end, i]() {
+                results[i] = rwkv_quantize_rows(slot, row_start, row_end, &hists[i * 16]);
+            });
+        }
+    }
+
+    for (std::thread & worker : workers) {
+        worker.join();
+    }
+
+    bool success = true;
+
+    for (size_t i = 0; i < n_workers; i++) {
+        success = success && results[i];
+
+        for (int j = 0; j < 16; j++) {
+            slot.hist[j] += hists[i * 16 + j];
+        }
+    }
+
+    slot.tensor.header.data_type = slot.out_type;
+    slot.new_size = slot.tensor.header.size();
+    slot.tensor.data = slot.out_buf.get();
+    return success;
+}
+
+void rwkv_set_print_errors(struct rwkv_context * ctx, bool print_errors) {
+    bool * ptr = ctx ? &ctx->print_errors : &global_print_errors;
+    *ptr = print_errors;
+}
+
+bool rwkv_get_print_errors(struct rwkv_context * ctx) {
+    return ctx ? ctx->print_errors : global_print_errors;
+}
+
+enum rwkv_error_flags rwkv_get_last_error(struct rwkv_context * ctx) {
+    enum rwkv_error_flags * ptr = ctx ? &ctx->last_error : &global_last_error;
+    enum rwkv_error_flags value = *ptr;
+    *ptr = RWKV_ERROR_NONE;
+    return value;
+}
+
+struct rwkv_file {
+    FILE * file;
+
+    rwkv_file(FILE * file): file(file) {}
+
+    ~rwkv_file() {
+        if (file) {
+            fclose(file);
+        }
+    }
+};
+
+// Reads the tensor into ctx, converting it into the type specified by the recipe.
+// The slot provides buffers for the original data and the result, which need to fit the largest converted tensor.
+bool rwkv_fread_ggml_tensor_converted(
+    FILE * file,
+    const struct rwkv_quantize_recipe & recipe,
+    const uint32_t n_layer,
+    struct rwkv_quantize_slot & slot,
+    const size_t n_threads,
+    struct ggml_context * ctx,
+    std::string & name,
+    struct ggml_tensor *& tensor
+) {
+    struct rwkv_tensor_header & header = slot.tensor.header;
+    RWKV_ENSURE_OR_FALSE_MSG(rwkv_fread_tensor_header(file, header), "Invalid tensor header");
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_FILE_READ, rwkv_fread_string(file, header.key_length, name), "Failed to read tensor name");
+
+    slot.in_type = (enum rwkv_type) header.data_type;
+    slot.out_type = rwkv_quantize_recipe_type(recipe, header, name, n_layer);
+
+    enum ggml_type ggml_type = rwkv_type_to_ggml[slot.out_type];
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_UNSUPPORTED, ggml_type != GGML_TYPE_UNKNOWN, "Unsupported tensor data type %s from %s", rwkv_type_to_string[slot.out_type], name.c_str());
+
+    tensor = header.dim_count == 1
+        ? ggml_new_tensor_1d(ctx, ggml_type, header.width)
+        : ggml_new_tensor_2d(ctx, ggml_type, header.width, header.height);
+
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ALLOC, tensor, "Failed to allocate tensor");
+    ggml_set_name(tensor, name.c_str());
+
+    if (slot.out_type == slot.in_type) {
+        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_FILE_READ, rwkv_fread_data(file, ggml_nbytes(tensor), tensor->data), "Failed to read tensor data from %s", name.c_str());
+        return true;
+    }
+
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_FILE_READ, rwkv_fread_data(file, header.size(), slot.in_buf.get()), "Failed to read tensor data from %s", name.c_str());
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ALLOC, rwkv_quantize_slot_data(slot, n_threads), "Failed to convert tensor %s", name.c_str());
+    memcpy(tensor->data, slot.out_buf.get(), ggml_nbytes(tensor));
+    return true;
+}
+
+// Applies blocks.0.ln0 to every row of the embedding matrix in place, so that it does not need to be computed per token.
+bool rwkv_fold_ln0(struct rwkv_model & model) {
+    struct ggml_tensor * emb = model.emb;
+    RWKV_ASSERT_FALSE_MSG(
+        RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_UNSUPPORTED,
+        emb->type == GGML_TYPE_F32 || emb->type == GGML_TYPE_F16,
+        "Folding ln0 into emb.weight requires it to be FP32 or FP16, not %s",
+        rwkv_type_to_string[rwkv_type_from_ggml[emb->type]]
+    );
+
+    const size_t n_embed = emb->ne[0];
+    const size_t n_vocab = emb->ne[1];
+
+    std::unique_ptr<float[]> weight(new(std::nothrow) float[n_embed]);
+    std::unique_ptr<float[]> bias(new(std::nothrow) float[n_embed]);
+    std::unique_ptr<float[]> row(new(std::nothrow) float[n_embed]);
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ALLOC, weight && bias && row, "Failed to allocate buffers for folding ln0");
+
+    for (size_t i = 0; i < n_embed; i++) {
+        weight[i] = ggml_get_f32_1d(model.ln0_weight, i);
+        bias[i] = ggml_get_f32_1d(model.ln0_bias, i);
+    }
+
+    for (size_t token = 0; token < n_vocab; token++) {
+        float * dest = (float *) ((uint8_t *) emb->data + token * emb->nb[1]);
+
+        if (emb->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) dest, row.get(), n_embed);
+        } else {
+            memcpy(row.get(), dest, n_embed * sizeof(float));
+        }
+
+        // Same as ggml_norm followed by weight & bias, see rwkv_layer_norm.
+        double sum = 0.0;
+
+        for (size_t i = 0; i < n_embed; i++) {
+            sum += row[i];
+        }
+
+        const double mean = sum / n_embed;
+        double sum2 = 0.0;
+
+        for (size_t i = 0; i < n_embed; i++) {
+            sum2 += (row[i] - mean) * (row[i] - mean);
+        }
+
+        const double scale = 1.0 / sqrt(sum2 / n_embed + 1e-5);
+
+        for (size_t i = 0; i < n_embed; i++) {
+            row[i] = (float) ((row[i] - mean) * scale) * weight[i] + bias[i];
+        }
+
+        if (emb->type == GGML_TYPE_F16) {
+            ggml_fp32_to_fp16_row(row.get(), (ggml_fp16_t *) dest, n_embed);
+        } else {
+            memcpy(dest, row.get(), n_embed * sizeof(float));
+        }
+    }
+
+    model.ln0_folded = true;
+    return true;
+}
+
+// Hashes dimensions and time_decay/time_first of all layers with 64-bit FNV-1a. These parameters are always stored in FP32
+// and are specific to each trained model, so the fingerprint does not depend on the data type the model is loaded in.
+uint64_t rwkv_model_fingerprint(const struct rwkv_model & model) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    auto update = [&](const void * data, const size_t size) {
+        const uint8_t * bytes = (const uint8_t *) data;
+
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+        }
+    };
+
+    update(&model.header.n_vocab, sizeof(model.header.n_vocab));
+    update(&model.header.n_embed, sizeof(model.header.n_embed));
+    update(&model.header.n_layer, sizeof(model.header.n_layer));
+
+    for (uint32_t i = 0; i < model.header.n_layer; i++) {
+        const struct rwkv_layer & layer = model.layers[i];
+        update(layer.att_time_decay->data, ggml_nbytes(layer.att_time_decay));
+        update(layer.att_time_first->data, ggml_nbytes(layer.att_time_first));
+    }
+
+    return hash;
+}
+
+bool rwkv_instance_from_file(const char * file_path, struct rwkv_instance & instance, const uint32_t flags, const char * format) {
+    struct stat file_stat;
+    struct rwkv_model model;
+    struct rwkv_ggml_context ctx;
+    size_t ffn_key_size = 0;
+
+    struct rwkv_quantize_recipe recipe;
+
+    if (format && *format) {
+        RWKV_ENSURE_OR_FALSE(rwkv_parse_quantize_recipe(format, recipe));
+        // Embedding and head are only kept as is when quantizing; "FP32" upcasts the whole model.
+        recipe.float_default_converts_all = true;
+    }
+
+    std::unordered_map<std::string, struct ggml_tensor *> parameters;
+
+    {
+        rwkv_file file(fopen(file_path, "rb"));
+
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_OPEN, file.file, "Failed to open file %s", file_path);
+        // Be very careful when changing this code. It must support files larger than 2 GB by using 64-bit functions to get the file length.
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_STAT, fstat(fileno(file.file), &file_stat) == 0, "Failed to stat file %s", file_path);
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE, rwkv_fread_file_header(file.file, model.header), "Invalid file header");
 
         struct rwkv_tensor_header tensor_header;
         std::string name;
         struct rwkv_future_ctx future_ctx;
+        size_t max_in_size = 0;
+        size_t max_out_size = 0;
 
         while ((size_t) ftell(file.file) < (size_t) file_stat.st_size) {
             RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_tensor_header(file.file, tensor_header), "Invalid tensor header");
             RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_string(file.file, tensor_header.key_length, name), "Failed to read tensor name");
             RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_READ, fseek(file.file, tensor_header.size(), SEEK_CUR) == 0, "Failed to read tensor data");
 
-            future_ctx.alloc(rwkv_type_to_ggml[tensor_header.data_type], tensor_header.width, tensor_header.height);
+            enum rwkv_type type = rwkv_quantize_recipe_type(recipe, tensor_header, name, model.header.n_layer);
+            enum ggml_type ggml_type = rwkv_type_to_ggml[type];
+
+            if (type != tensor_header.data_type) {
+                RWKV_ASSERT_NULL_MSG(
+                    RWKV_ERROR_ARGS | RWKV_ERROR_SHAPE,
+                    tensor_header.width % ggml_blck_size(ggml_type) == 0,
+                    "Width of %s (%" PRId32 ") is not divisible by block size of %s",
+                    name.c_str(), tensor_header.width, rwkv_type_to_string[type]
+                );
+
+                max_in_size = std::max(max_in_size, tensor_header.size());
+                max_out_size = std::max(max_out_size, rwkv_future_tensor::size(ggml_type, tensor_header.width, tensor_header.height));
+            }
+
+            future_ctx.alloc(ggml_type, tensor_header.width, tensor_header.height);
 
             if (ffn_key_size == 0 && name == "blocks.0.ffn.key.weight") {
                 ffn_key_size = tensor_header.height;
@@ -1377,15 +2376,39 @@ bool rwkv_instance_from_file(const char * file_path, struct rwkv_instance & inst
         RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_PARAM_MISSING, ffn_key_size, "Model is missing parameter blocks.0.ffn.key.weight");
         RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_READ, fseek(file.file, sizeof(struct rwkv_file_header), SEEK_SET) == 0, "Failed to seek in file");
 
-        ctx = future_ctx;
-        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, ctx.ctx, "Failed to allocate model context");
+        RWKV_ENSURE_OR_NULL(rwkv_weights_context(future_ctx, flags, ctx));
+
+        // Tensor data is allocated in the scratch buffer, which is not touched until tensors are read.
+        if (flags & RWKV_INIT_NUMA_INTERLEAVE) {
+            RWKV_ENSURE_OR_NULL(rwkv_numa_interleave(ctx.scratch.get(), future_ctx.scratch_size));
+        }
+
+        // Converted tensors are read into a buffer first, and then converted using all available threads.
+        struct rwkv_quantize_slot slot;
+        const size_t n_convert_threads = std::max(std::thread::hardware_concurrency(), 1U);
+
+        if (max_out_size > 0) {
+            slot.in_buf.reset(new(std::nothrow) uint8_t[max_in_size]);
+            slot.out_buf.reset(new(std::nothrow) uint8_t[max_out_size]);
+            RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ALLOC, slot.in_buf && slot.out_buf, "Failed to allocate conversion buffers");
+        }
 
         struct ggml_tensor * tensor;
 
         while ((size_t) ftell(file.file) < (size_t) file_stat.st_size) {
-            RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_ggml_tensor(file.file, ctx.ctx, name, tensor), "Failed to read model params");
+            RWKV_ASSERT_NULL_MSG(
+                RWKV_ERROR_MODEL_PARAMS,
+                rwkv_fread_ggml_tensor_converted(file.file, recipe, model.header.n_layer, slot, n_convert_threads, ctx.ctx, name, tensor),
+                "Failed to read model params"
+            );
             parameters[std::move(name)] = tensor;
         }
+
+        RWKV_ENSURE_OR_NULL(rwkv_lock_weights(ctx, future_ctx.scratch_size, flags));
+    }
+
+    if (recipe.default_type != TYPE_UNKNOWN) {
+        model.header.data_type = recipe.default_type;
     }
 
     std::unordered_map<std::string, struct ggml_tensor *> & parameters_ref = parameters;
@@ -1402,71 +2425,35 @@ bool rwkv_instance_from_file(const char * file_path, struct rwkv_instance & inst
     RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_DIMENSION, emb->ne[0] == model.header.n_embed, "Unexpected dimension of embedding matrix %" PRId64, emb->ne[0]);
     RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_DIMENSION, emb->ne[1] == model.header.n_vocab, "Unexpected dimension of embedding matrix %" PRId64, emb->ne[1]);
 
+    if (flags & RWKV_INIT_FOLD_LN0) {
+        RWKV_ENSURE_OR_FALSE(rwkv_fold_ln0(model));
+    }
+
     instance.ctx = std::move(ctx);
     instance.model = std::move(model);
     instance.ffn_key_size = ffn_key_size;
+    instance.fingerprint = rwkv_model_fingerprint(instance.model);
+    instance.id = rwkv_next_instance_id();
+    instance.parameters = std::move(parameters);
+    instance.flags = flags;
     return true;
 }
 
-struct rwkv_context * rwkv_new_context_impl(std::shared_ptr<struct rwkv_instance> instance, const uint32_t n_threads) {
-    global_last_error = RWKV_ERROR_NONE;
-
-    struct rwkv_file_header & header = instance->model.header;
-    const size_t n_vocab = header.n_vocab;
-    const size_t n_embed = header.n_embed;
-    const size_t n_layer = header.n_layer;
-
-    struct rwkv_future_ctx future_ctx;
-    const struct rwkv_future_tensor future_input = future_ctx.alloc(GGML_TYPE_F32, n_embed * 5 * n_layer);
-    const struct rwkv_future_tensor future_output = future_ctx.alloc(GGML_TYPE_F32, n_embed * 5 * n_layer);
-    const struct rwkv_future_tensor future_logits = future_ctx.alloc(GGML_TYPE_F32, n_vocab);
-
-    for (size_t i = 0; i < n_layer; i++) {
-        /* ffn_xx */ future_input.subview(future_ctx, n_embed); future_output.subview(future_ctx, n_embed);
-        /* att_xx */ future_input.subview(future_ctx, n_embed); future_output.subview(future_ctx, n_embed);
-        /* att_aa */ future_input.subview(future_ctx, n_embed); future_output.subview(future_ctx, n_embed);
-        /* att_bb */ future_input.subview(future_ctx, n_embed); future_output.subview(future_ctx, n_embed);
-        /* att_pp */ future_input.subview(future_ctx, n_embed); future_output.subview(future_ctx, n_embed);
-    }
-
-    struct rwkv_ggml_context ctx(future_ctx);
-    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, ctx.ctx, "Failed to allocate model context");
-
-    struct ggml_tensor * input = ggml_new_tensor_1d(ctx.ctx, GGML_TYPE_F32, n_embed * 5 * n_layer);
-    struct ggml_tensor * output = ggml_new_tensor_1d(ctx.ctx, GGML_TYPE_F32, n_embed * 5 * n_layer);
-
-    // We collect parts of input state here. Each part is (n_embed) vector.
-    std::unique_ptr<struct rwkv_layer_state[]> inputs(new(std::nothrow) struct rwkv_layer_state[n_layer]);
-    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ALLOC, inputs.get(), "Failed to allocate input state parts");
-
-    // We collect parts of output state here. Each part is (n_embed) vector.
-    std::unique_ptr<struct rwkv_layer_state[]> outputs(new(std::nothrow) struct rwkv_layer_state[n_layer]);
-    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ALLOC, outputs.get(), "Failed to allocate output state parts");
-
-    for (size_t i = 0; i < n_layer; i++) {
-        struct rwkv_layer_state & input_state = inputs[i];
-        input_state.ffn_xx = ggml_view_1d(ctx.ctx, input, n_embed, n_embed * (i * 5 + 0) * sizeof(float));
-        input_state.att_xx = ggml_view_1d(ctx.ctx, input, n_embed, n_embed * (i * 5 + 1) * sizeof(float));
-        input_state.att_aa = ggml_view_1d(ctx.ctx, input, n_embed, n_embed * (i * 5 + 2) * sizeof(float));
-        input_state.att_bb = ggml_view_1d(ctx.ctx, input, n_embed, n_embed * (i * 5 + 3) * sizeof(float));
-        input_state.att_pp = ggml_view_1d(ctx.ctx, input, n_embed, n_embed * (i * 5 + 4) * sizeof(float));
-
-        struct rwkv_layer_state & output_state = outputs[i];
-        output_state.ffn_xx = ggml_view_1d(ctx.ctx, output, n_embed, n_embed * (i * 5 + 0) * sizeof(float));
-        output_state.att_xx = ggml_view_1d(ctx.ctx, output, n_embed, n_embed * (i * 5 + 1) * sizeof(float));
-        output_state.att_aa = ggml_view_1d(ctx.ctx, output, n_embed, n_embed * (i * 5 + 2) * sizeof(float));
-        output_state.att_bb = ggml_view_1d(ctx.ctx, output, n_embed, n_embed * (i * 5 + 3) * sizeof(float));
-        output_state.att_pp = ggml_view_1d(ctx.ctx, output, n_embed, n_embed * (i * 5 + 4) * sizeof(float));
-    }
+// Returns the model that graphs of the context are built from: the instance model, or the model with an adapter applied.
+struct rwkv_model & rwkv_context_model(struct rwkv_context * ctx) {
+    return ctx->adapted.lora ? ctx->adapted.model : ctx->instance->model;
+}
 
-    struct ggml_tensor * logits = ggml_new_tensor_1d(ctx.ctx, GGML_TYPE_F32, n_vocab);
+// Estimates the memory of the serial graph of the context, if it was built for n_threads.
+struct rwkv_future_ctx rwkv_measure_serial_graph(struct rwkv_context * ctx, const uint32_t n_threads) {
+    struct rwkv_model & model = rwkv_context_model(ctx);
+    const size_t n_layer = model.header.n_layer;
 
     struct rwkv_future_ctx graph_future_ctx;
     const struct rwkv_future_tensor future_token = graph_future_ctx.alloc(GGML_TYPE_I32, 1, 1, false);
 
-    const struct rwkv_model & model = instance->model;
     const struct rwkv_layer & layer = model.layers[0];
-    const struct rwkv_layer_state & state = inputs[0];
+    const struct rwkv_layer_state & state = ctx->input_layers[0];
     struct rwkv_future_tensor ffn_xx = state.ffn_xx;
     struct rwkv_future_tensor att_xx = state.att_xx;
     struct rwkv_future_tensor att_aa = state.att_aa;
@@ -1475,7 +2462,7 @@ struct rwkv_context * rwkv_new_context_impl(std::shared_ptr<struct rwkv_instance
 
     const struct rwkv_future_tensor future_graph = rwkv_future_serial_graph(graph_future_ctx, future_token, n_threads,
         model.emb,
-        model.ln0_weight, model.ln0_bias,
+        model.ln0_weight, model.ln0_bias, model.ln0_folded,
 
         n_layer,
         layer.ln1_weight, layer.ln1_bias,
@@ -1493,266 +2480,3289 @@ struct rwkv_context * rwkv_new_context_impl(std::shared_ptr<struct rwkv_instance
         model.head
     );
 
-    struct rwkv_graph serial_graph;
-    serial_graph.ctx = graph_future_ctx;
-    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, serial_graph.ctx.ctx, "Failed to allocate serial graph context");
-    serial_graph.tokens = ggml_new_i32(serial_graph.ctx.ctx, 0);
-    serial_graph.cgraph.reset(new(std::nothrow) struct ggml_cgraph());
-    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ALLOC, serial_graph.cgraph, "Failed to allocate serial graph");
-    serial_graph.cgraph->n_threads = n_threads;
+    rwkv_future_lora(graph_future_ctx, model, 1);
+    return graph_future_ctx;
+}
+
+// Estimates the memory of the sequence graph of the context for the given sequence length.
+struct rwkv_future_ctx rwkv_measure_sequence_graph(
+    struct rwkv_context * ctx,
+    const size_t sequence_len,
+    const enum rwkv_sequence_outputs outputs = RWKV_SEQUENCE_LOGITS
+) {
+    struct rwkv_model & model = rwkv_context_model(ctx);
+    const size_t n_embed = model.header.n_embed;
+    const size_t n_layer = model.header.n_layer;
+
+    struct rwkv_future_ctx graph_future_ctx;
+    const struct rwkv_future_tensor future_tokens = graph_future_ctx.alloc(GGML_TYPE_I32, sequence_len);
+
+    const struct rwkv_layer & layer = model.layers[0];
+    const struct rwkv_layer_state & state = ctx->input_layers[0];
+    struct rwkv_future_tensor ffn_xx = state.ffn_xx;
+    struct rwkv_future_tensor att_xx = state.att_xx;
+    struct rwkv_future_tensor att_aa = state.att_aa;
+    struct rwkv_future_tensor att_bb = state.att_bb;
+    struct rwkv_future_tensor att_pp = state.att_pp;
+
+    const struct rwkv_future_tensor future_graph = rwkv_future_sequence_graph(graph_future_ctx, future_tokens, ctx->sequence_n_threads,
+        model.emb,
+        model.ln0_weight, model.ln0_bias, model.ln0_folded,
+
+        n_layer,
+        layer.ln1_weight, layer.ln1_bias,
+        layer.att_time_mix_k, layer.att_time_mix_v, layer.att_time_mix_r,
+        layer.att_time_first, layer.att_time_decay,
+        layer.att_receptance, layer.att_key, layer.att_value, layer.att_output,
+        att_xx, att_aa, att_bb, att_pp,
+
+        layer.ln2_weight, layer.ln2_bias,
+        layer.ffn_time_mix_k, layer.ffn_time_mix_r,
+        layer.ffn_key, layer.ffn_value, layer.ffn_receptance,
+        ffn_xx,
+
+        model.ln_out_weight, model.ln_out_weight,
+        model.head
+    );
+
+    if (outputs == RWKV_SEQUENCE_PER_TOKEN) {
+        const struct rwkv_future_tensor token_states = graph_future_ctx.alloc(GGML_TYPE_F32, n_embed * 5 * n_layer, sequence_len);
+        graph_future_ctx.alloc(GGML_TYPE_F32, model.header.n_vocab, sequence_len);
+
+        // A row of a state part or of the normalized input, its place in token_states, and the copy.
+        for (size_t i = 0; i < n_layer * sequence_len * 5; i++) {
+            token_states.subview(graph_future_ctx, n_embed);
+            token_states.subview(graph_future_ctx, n_embed).view(graph_future_ctx);
+        }
+
+        struct rwkv_future_tensor x(GGML_TYPE_F32, n_embed, sequence_len);
+        const struct rwkv_future_tensor ln_out_weight = model.ln_out_weight;
+        const struct rwkv_future_tensor ln_out_bias = model.ln_out_bias;
+        const struct rwkv_future_tensor head = model.head;
+        x = x.layer_norm(graph_future_ctx, ln_out_weight.repeat(graph_future_ctx, x), ln_out_bias.repeat(graph_future_ctx, x));
+        head.mul_mat(graph_future_ctx, x).view(graph_future_ctx);
+    }
+
+    if (outputs == RWKV_SEQUENCE_EMBEDDINGS) {
+        graph_future_ctx.alloc(GGML_TYPE_F32, n_embed, sequence_len);
+
+        struct rwkv_future_tensor x(GGML_TYPE_F32, n_embed, sequence_len);
+        const struct rwkv_future_tensor ln_out_weight = model.ln_out_weight;
+        const struct rwkv_future_tensor ln_out_bias = model.ln_out_bias;
+        x.layer_norm(graph_future_ctx, ln_out_weight.repeat(graph_future_ctx, x), ln_out_bias.repeat(graph_future_ctx, x)).view(graph_future_ctx);
+    }
+
+    rwkv_future_lora(graph_future_ctx, model, sequence_len, outputs == RWKV_SEQUENCE_PER_TOKEN);
+    return graph_future_ctx;
+}
+
+// Bytes allocated for a graph, including the ggml_cgraph.
+size_t rwkv_graph_size(const struct rwkv_future_ctx & future_ctx) {
+    return future_ctx.total_size() + sizeof(struct ggml_cgraph);
+}
+
+size_t rwkv_graph_size(const struct rwkv_graph & graph) {
+    return graph.cgraph ? graph.ctx.size + sizeof(struct ggml_cgraph) : 0;
+}
+
+// Bytes allocated by the context regardless of sequence length, excluding the serial graph.
+size_t rwkv_context_base_size(const struct rwkv_context * ctx) {
+    return ctx->ctx.size + ctx->adapted.ctx.size;
+}
+
+// Builds the serial graph of the context, replacing the existing one.
+bool rwkv_measure_and_build_serial_graph(struct rwkv_context * ctx) {
+    struct rwkv_model & model = rwkv_context_model(ctx);
+    const struct rwkv_future_ctx graph_future_ctx = rwkv_measure_serial_graph(ctx, ctx->n_threads);
+
+    // The sequence graph is not counted, because it is rebuilt after the serial graph is rebuilt.
+    const size_t graph_size = rwkv_graph_size(graph_future_ctx);
+    const size_t base_size = rwkv_context_base_size(ctx);
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, !ctx->memory_limit || base_size + graph_size <= ctx->memory_limit,
+        "Serial graph needs %zu bytes, which exceeds the memory limit of %zu bytes with %zu bytes already used", graph_size, ctx->memory_limit, base_size);
+
+    struct rwkv_graph serial_graph;
+    serial_graph.ctx = graph_future_ctx;
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, serial_graph.ctx.ctx, "Failed to allocate serial graph context");
+    serial_graph.tokens = ggml_new_i32(serial_graph.ctx.ctx, 0);
+    serial_graph.cgraph.reset(new(std::nothrow) struct ggml_cgraph());
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ALLOC, serial_graph.cgraph, "Failed to allocate serial graph");
+    serial_graph.n_threads = ctx->serial_n_threads;
+
+    RWKV_ASSERT_FALSE(RWKV_ERROR_GRAPH, rwkv_build_serial_graph(
+        serial_graph.ctx.ctx, model,
+        serial_graph.tokens, ctx->input_layers.get(), ctx->output_layers.get(), ctx->logits,
+        ctx->layer_mask,
+        serial_graph.cgraph.get(),
+        &serial_graph.pre_logits_nodes, &serial_graph.pre_logits_leafs, &serial_graph.post_logits_nodes, &serial_graph.post_logits_leafs,
+        serial_graph.marks
+    ));
+
+    // ggml allocates the work buffer on the first computation, sized for the thread count it is computed with.
+    // Allocate it for the full thread count now, so that computing with fewer threads first does not make it too small later.
+    const struct rwkv_layer & layer = model.layers[0];
+    serial_graph.cgraph->work_size = rwkv_graph_work_size(layer.ffn_key->type, layer.ffn_key->ne[1], ctx->n_threads);
+    serial_graph.cgraph->work = ggml_new_tensor_1d(serial_graph.ctx.ctx, GGML_TYPE_I8, serial_graph.cgraph->work_size);
+
+    ctx->serial_graph = std::move(serial_graph);
+    return true;
+}
+
+// Moves the sequence graph of the context to the spare graphs, freeing the least recently used one if there are too many.
+void rwkv_keep_spare_sequence_graph(struct rwkv_context * ctx) {
+    if (ctx->sequence_len == 0) {
+        return;
+    }
+
+    ctx->spare_sequence_graphs.emplace_back();
+    struct rwkv_spare_sequence_graph & spare = ctx->spare_sequence_graphs.back();
+    spare.sequence_len = ctx->sequence_len;
+    spare.outputs = ctx->sequence_outputs;
+    spare.graph = std::move(ctx->sequence_graph);
+
+    ctx->sequence_len = 0;
+    ctx->sequence_graph = rwkv_graph();
+
+    if (ctx->spare_sequence_graphs.size() > RWKV_MAX_SPARE_SEQUENCE_GRAPHS) {
+        ctx->spare_sequence_graphs.pop_front();
+    }
+}
+
+// Frees the sequence graph and the spare ones, for example because they refer to tensors of a replaced model.
+void rwkv_clear_sequence_graphs(struct rwkv_context * ctx) {
+    ctx->sequence_len = 0;
+    ctx->sequence_graph = rwkv_graph();
+    ctx->spare_sequence_graphs.clear();
+}
+
+// Builds the sequence graph of the context for the given sequence length and outputs; the existing one becomes a spare graph.
+bool rwkv_measure_and_build_sequence_graph(
+    struct rwkv_context * ctx,
+    const size_t sequence_len,
+    const enum rwkv_sequence_outputs outputs = RWKV_SEQUENCE_LOGITS
+) {
+    struct rwkv_model & model = rwkv_context_model(ctx);
+    const struct rwkv_future_ctx graph_future_ctx = rwkv_measure_sequence_graph(ctx, sequence_len, outputs);
+
+    const size_t graph_size = rwkv_graph_size(graph_future_ctx);
+    const size_t base_size = rwkv_context_base_size(ctx) + rwkv_graph_size(ctx->serial_graph);
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, !ctx->memory_limit || base_size + graph_size <= ctx->memory_limit,
+        "Sequence graph of length %zu needs %zu bytes, which exceeds the memory limit of %zu bytes with %zu bytes already used",
+        sequence_len, graph_size, ctx->memory_limit, base_size);
+
+    rwkv_keep_spare_sequence_graph(ctx);
+
+    // Spare graphs are freed before the new graph is allocated, if they would exceed the memory limit together.
+    size_t spare_size = 0;
+
+    for (const struct rwkv_spare_sequence_graph & spare : ctx->spare_sequence_graphs) {
+        spare_size += rwkv_graph_size(spare.graph);
+    }
+
+    while (ctx->memory_limit && base_size + graph_size + spare_size > ctx->memory_limit) {
+        spare_size -= rwkv_graph_size(ctx->spare_sequence_graphs.front().graph);
+        ctx->spare_sequence_graphs.pop_front();
+    }
+
+    struct rwkv_graph sequence_graph;
+    sequence_graph.ctx = graph_future_ctx;
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, sequence_graph.ctx.ctx, "Failed to allocate sequence graph context");
+    sequence_graph.tokens = ggml_new_tensor_1d(sequence_graph.ctx.ctx, GGML_TYPE_I32, sequence_len);
+    sequence_graph.cgraph.reset(new(std::nothrow) struct ggml_cgraph());
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ALLOC, sequence_graph.cgraph, "Failed to allocate sequence graph");
+    sequence_graph.n_threads = ctx->sequence_n_threads;
+    sequence_graph.token_logits = NULL;
+    sequence_graph.token_states = NULL;
+    sequence_graph.token_embeddings = NULL;
+
+    if (outputs == RWKV_SEQUENCE_PER_TOKEN) {
+        sequence_graph.token_states = ggml_new_tensor_2d(sequence_graph.ctx.ctx, GGML_TYPE_F32, ctx->input_state->ne[0], sequence_len);
+        sequence_graph.token_logits = ggml_new_tensor_2d(sequence_graph.ctx.ctx, GGML_TYPE_F32, model.header.n_vocab, sequence_len);
+    } else if (outputs == RWKV_SEQUENCE_EMBEDDINGS) {
+        sequence_graph.token_embeddings = ggml_new_tensor_2d(sequence_graph.ctx.ctx, GGML_TYPE_F32, model.header.n_embed, sequence_len);
+    }
+
+    RWKV_ASSERT_FALSE(RWKV_ERROR_GRAPH, rwkv_build_sequence_graph(
+        sequence_graph.ctx.ctx, model,
+        sequence_graph.tokens, ctx->input_layers.get(), ctx->output_layers.get(), ctx->logits,
+        sequence_graph.token_logits, sequence_graph.token_states, sequence_graph.token_embeddings,
+        sequence_graph.cgraph.get(),
+        &sequence_graph.pre_logits_nodes, &sequence_graph.pre_logits_leafs, &sequence_graph.post_logits_nodes, &sequence_graph.post_logits_leafs,
+        sequence_graph.marks
+    ));
+
+    // Like the work buffer of the serial graph, it is allocated for the full thread count, since the thread budget
+    // may compute the graph with fewer threads first. Its size is already included in the measured graph size.
+    const struct rwkv_layer & layer = model.layers[0];
+    sequence_graph.cgraph->work_size = rwkv_graph_work_size(layer.ffn_key->type, layer.ffn_key->ne[1], ctx->sequence_n_threads, sequence_len);
+    sequence_graph.cgraph->work = ggml_new_tensor_1d(sequence_graph.ctx.ctx, GGML_TYPE_I8, sequence_graph.cgraph->work_size);
+
+    ctx->sequence_len = sequence_len;
+    ctx->sequence_outputs = outputs;
+    ctx->sequence_graph = std::move(sequence_graph);
+    return true;
+}
+
+// Whether the context has a graph for the given sequence length and outputs, either in use or spare.
+bool rwkv_has_sequence_graph(const struct rwkv_context * ctx, const size_t sequence_len, const enum rwkv_sequence_outputs outputs) {
+    if (ctx->sequence_len == sequence_len && ctx->sequence_outputs == outputs) {
+        return true;
+    }
+
+    for (const struct rwkv_spare_sequence_graph & spare : ctx->spare_sequence_graphs) {
+        if (spare.sequence_len == sequence_len && spare.outputs == outputs) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Makes the graph for the given sequence length and outputs the sequence graph of the context, reusing a spare graph if there is one.
+// Alternating between a few lengths and outputs, like full chunks and the last chunk of a sequence, does not rebuild graphs then.
+bool rwkv_use_sequence_graph(struct rwkv_context * ctx, const size_t sequence_len, const enum rwkv_sequence_outputs outputs) {
+    if (ctx->sequence_len == sequence_len && ctx->sequence_outputs == outputs) {
+        return true;
+    }
+
+    auto spare = ctx->spare_sequence_graphs.begin();
+
+    while (spare != ctx->spare_sequence_graphs.end() && (spare->sequence_len != sequence_len || spare->outputs != outputs)) {
+        ++spare;
+    }
+
+    if (spare == ctx->spare_sequence_graphs.end()) {
+        return rwkv_measure_and_build_sequence_graph(ctx, sequence_len, outputs);
+    }
+
+    struct rwkv_graph graph;
+    graph = std::move(spare->graph);
+    ctx->spare_sequence_graphs.erase(spare);
+    rwkv_keep_spare_sequence_graph(ctx);
+
+    ctx->sequence_len = sequence_len;
+    ctx->sequence_outputs = outputs;
+    ctx->sequence_graph = std::move(graph);
+    return true;
+}
+
+struct rwkv_context * rwkv_new_context_impl(std::shared_ptr<struct rwkv_instance> instance, const uint32_t n_threads) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    struct rwkv_file_header & header = instance->model.header;
+    const size_t n_vocab = header.n_vocab;
+    const size_t n_embed = header.n_embed;
+    const size_t n_layer = header.n_layer;
+
+    struct rwkv_future_ctx future_ctx;
+    const struct rwkv_future_tensor future_input = future_ctx.alloc(GGML_TYPE_F32, n_embed * 5 * n_layer);
+    const struct rwkv_future_tensor future_output = future_ctx.alloc(GGML_TYPE_F32, n_embed * 5 * n_layer);
+    const struct rwkv_future_tensor future_logits = future_ctx.alloc(GGML_TYPE_F32, n_vocab);
+
+    for (size_t i = 0; i < n_layer; i++) {
+        /* ffn_xx */ future_input.subview(future_ctx, n_embed); future_output.subview(future_ctx, n_embed);
+        /* att_xx */ future_input.subview(future_ctx, n_embed); future_output.subview(future_ctx, n_embed);
+        /* att_aa */ future_input.subview(future_ctx, n_embed); future_output.subview(future_ctx, n_embed);
+        /* att_bb */ future_input.subview(future_ctx, n_embed); future_output.subview(future_ctx, n_embed);
+        /* att_pp */ future_input.subview(future_ctx, n_embed); future_output.subview(future_ctx, n_embed);
+    }
+
+    struct rwkv_ggml_context ctx(future_ctx);
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, ctx.ctx, "Failed to allocate model context");
+
+    struct ggml_tensor * input = ggml_new_tensor_1d(ctx.ctx, GGML_TYPE_F32, n_embed * 5 * n_layer);
+    struct ggml_tensor * output = ggml_new_tensor_1d(ctx.ctx, GGML_TYPE_F32, n_embed * 5 * n_layer);
+
+    // We collect parts of input state here. Each part is (n_embed) vector.
+    std::unique_ptr<struct rwkv_layer_state[]> inputs(new(std::nothrow) struct rwkv_layer_state[n_layer]);
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ALLOC, inputs.get(), "Failed to allocate input state parts");
+
+    // We collect parts of output state here. Each part is (n_embed) vector.
+    std::unique_ptr<struct rwkv_layer_state[]> outputs(new(std::nothrow) struct rwkv_layer_state[n_layer]);
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ALLOC, outputs.get(), "Failed to allocate output state parts");
+
+    for (size_t i = 0; i < n_layer; i++) {
+        struct rwkv_layer_state & input_state = inputs[i];
+        input_state.ffn_xx = ggml_view_1d(ctx.ctx, input, n_embed, n_embed * (i * 5 + 0) * sizeof(float));
+        input_state.att_xx = ggml_view_1d(ctx.ctx, input, n_embed, n_embed * (i * 5 + 1) * sizeof(float));
+        input_state.att_aa = ggml_view_1d(ctx.ctx, input, n_embed, n_embed * (i * 5 + 2) * sizeof(float));
+        input_state.att_bb = ggml_view_1d(ctx.ctx, input, n_embed, n_embed * (i * 5 + 3) * sizeof(float));
+        input_state.att_pp = ggml_view_1d(ctx.ctx, input, n_embed, n_embed * (i * 5 + 4) * sizeof(float));
+
+        struct rwkv_layer_state & output_state = outputs[i];
+        output_state.ffn_xx = ggml_view_1d(ctx.ctx, output, n_embed, n_embed * (i * 5 + 0) * sizeof(float));
+        output_state.att_xx = ggml_view_1d(ctx.ctx, output, n_embed, n_embed * (i * 5 + 1) * sizeof(float));
+        output_state.att_aa = ggml_view_1d(ctx.ctx, output, n_embed, n_embed * (i * 5 + 2) * sizeof(float));
+        output_state.att_bb = ggml_view_1d(ctx.ctx, output, n_embed, n_embed * (i * 5 + 3) * sizeof(float));
+        output_state.att_pp = ggml_view_1d(ctx.ctx, output, n_embed, n_embed * (i * 5 + 4) * sizeof(float));
+    }
+
+    struct ggml_tensor * logits = ggml_new_tensor_1d(ctx.ctx, GGML_TYPE_F32, n_vocab);
+
+    std::unique_ptr<struct rwkv_context> rwkv_ctx(new(std::nothrow) struct rwkv_context());
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, rwkv_ctx, "Failed to allocate rwkv_context");
+    rwkv_ctx->instance = std::move(instance);
+    rwkv_ctx->ctx = std::move(ctx);
+    rwkv_ctx->input_state = input;
+    rwkv_ctx->input_layers = std::move(inputs);
+    rwkv_ctx->output_state = output;
+    rwkv_ctx->output_layers = std::move(outputs);
+    rwkv_ctx->logits = logits;
+    rwkv_ctx->n_threads = n_threads;
+    rwkv_ctx->serial_n_threads = n_threads;
+    rwkv_ctx->sequence_n_threads = 1;
+    rwkv_ctx->last_error = RWKV_ERROR_NONE;
+    rwkv_ctx->print_errors = global_print_errors;
+    rwkv_ctx->memory_limit = 0;
+    rwkv_ctx->async_busy = false;
+    rwkv_ctx->thread_budget = NULL;
+
+    RWKV_ENSURE_OR_NULL(rwkv_measure_and_build_serial_graph(rwkv_ctx.get()));
+    return rwkv_ctx.release();
+}
+
+struct rwkv_context * rwkv_init_from_file(const char * file_path, const uint32_t n_threads) {
+    return rwkv_init_from_file_ex(file_path, n_threads, RWKV_INIT_NONE, NULL);
+}
+
+struct rwkv_context * rwkv_init_from_file_ex(const char * file_path, const uint32_t n_threads, const uint32_t flags, const char * format) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    std::shared_ptr<struct rwkv_instance> instance(new(std::nothrow) struct rwkv_instance());
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, instance, "Failed to allocate instance");
+    RWKV_ENSURE_OR_NULL(rwkv_instance_from_file(file_path, *instance.get(), flags, format));
+    return rwkv_new_context_impl(instance, n_threads);
+}
+
+struct rwkv_context * rwkv_clone_context(struct rwkv_context * ctx, const uint32_t n_threads) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    if (ctx->memory_limit) {
+        const size_t clone_size = rwkv_get_context_size(ctx, n_threads);
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, clone_size <= ctx->memory_limit,
+            "Cloned context needs %zu bytes, which exceeds the memory limit of %zu bytes", clone_size, ctx->memory_limit);
+    }
+
+    struct rwkv_context * clone = rwkv_new_context_impl(ctx->instance, n_threads);
+
+    if (clone) {
+        clone->print_errors = ctx->print_errors;
+        clone->memory_limit = ctx->memory_limit;
+        clone->thread_budget = ctx->thread_budget;
+        clone->sequence_n_threads = ctx->sequence_n_threads;
+        clone->cpu_affinity = ctx->cpu_affinity;
+
+        if (ctx->adapted.lora && !rwkv_set_lora(clone, ctx->adapted.lora)) {
+            rwkv_free(clone);
+            return NULL;
+        }
+    }
+
+    return clone;
+}
+
+bool rwkv_gpu_offload_layers(struct rwkv_context * ctx, const uint32_t n_layers) {
+#ifdef GGML_USE_CUBLAS
+    const auto offload = [&](struct ggml_tensor * tensor) {
+        // TODO support multi-GPU
+        tensor->backend = GGML_BACKEND_GPU;
+        ggml_cuda_transform_tensor(tensor->data, tensor);
+    };
+
+    const size_t n_gpu = std::min(n_layers, ctx->instance->model.header.n_layer);
+
+    if (ctx->gpu_layers < n_gpu) {
+        for (size_t & i = ctx->gpu_layers; i < n_gpu; i++) {
+            const struct rwkv_layer & layer = ctx->instance->model.layers[i];
+
+            // TODO also offload other operations to GPU with ggml_cuda_assign_buffers
+            offload(layer.att_key);
+            offload(layer.att_value);
+            offload(layer.att_receptance);
+            offload(layer.att_output);
+
+            offload(layer.ffn_key);
+            offload(layer.ffn_value);
+            offload(layer.ffn_receptance);
+        }
+
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Creates a model that uses tensors of the adapter through views, and the instance tensors for everything else.
+bool rwkv_adapt_model(const struct rwkv_instance & instance, const struct rwkv_lora & lora, struct rwkv_adapted_model & adapted) {
+    struct rwkv_future_ctx future_ctx;
+
+    for (const auto & entry : lora.tensors) {
+        rwkv_future_tensor(entry.second).view(future_ctx);
+    }
+
+    adapted.ctx = future_ctx;
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, adapted.ctx.ctx, "Failed to allocate adapter context");
+    adapted.views.clear();
+
+    const auto view = [&](const std::string & name) -> struct ggml_tensor * {
+        const auto found = lora.tensors.find(name);
+
+        if (found == lora.tensors.end()) {
+            return NULL;
+        }
+
+        struct ggml_tensor * tensor = ggml_view_tensor(adapted.ctx.ctx, found->second);
+        adapted.views.emplace_back(tensor, name);
+        return tensor;
+    };
+
+    adapted.model.header = instance.model.header;
+    adapted.model.ln0_folded = instance.model.ln0_folded;
+
+    RWKV_ENSURE_OR_FALSE(rwkv_set_params(adapted.model, [&](const char * key, struct ggml_tensor *& dest) {
+        struct ggml_tensor * replacement = view(key);
+        dest = replacement ? replacement : instance.parameters.at(key);
+        return true;
+    }));
+
+    RWKV_ENSURE_OR_FALSE(rwkv_set_lora_pairs(adapted.model, [&](const char * key, struct rwkv_lora_pair & dest) {
+        dest.a = view(std::string(key) + ".lora_A");
+        dest.b = view(std::string(key) + ".lora_B");
+        return true;
+    }));
+
+    // Every tensor of the adapter gets exactly one view when it is used.
+    RWKV_ASSERT_FALSE_MSG(
+        RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_UNSUPPORTED,
+        adapted.views.size() == lora.tensors.size(),
+        "Adapter contains low-rank matrices for parameters that can not be adapted"
+    );
+
+    adapted.lora = &lora;
+    return true;
+}
+
+// Returns true if both adapters have tensors with the same names and shapes, so that views of one adapter can point to the other.
+bool rwkv_lora_same_layout(const struct rwkv_lora & a, const struct rwkv_lora & b) {
+    if (a.tensors.size() != b.tensors.size()) {
+        return false;
+    }
+
+    for (const auto & entry : a.tensors) {
+        const auto other = b.tensors.find(entry.first);
+
+        if (other == b.tensors.end() || other->second->ne[0] != entry.second->ne[0] || other->second->ne[1] != entry.second->ne[1]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct rwkv_lora * rwkv_lora_from_file(struct rwkv_context * ctx, const char * file_path, const float scale) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    const struct rwkv_instance & instance = *ctx->instance;
+    const struct rwkv_file_header & model_header = instance.model.header;
+
+    struct stat file_stat;
+    struct rwkv_file file(fopen(file_path, "rb"));
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_OPEN, file.file, "Failed to open file %s", file_path);
+    // Be very careful when changing this code. It must support files larger than 2 GB by using 64-bit functions to get the file length.
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_STAT, fstat(fileno(file.file), &file_stat) == 0, "Failed to stat file %s", file_path);
+
+    struct rwkv_file_header header;
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE, rwkv_fread_file_header(file.file, header), "Invalid file header");
+    RWKV_ASSERT_NULL_MSG(
+        RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_DIMENSION,
+        header.n_vocab == model_header.n_vocab && header.n_embed == model_header.n_embed && header.n_layer == model_header.n_layer,
+        "Adapter was made for another model (n_vocab = %" PRId32 ", n_embed = %" PRId32 ", n_layer = %" PRId32 ")",
+        header.n_vocab, header.n_embed, header.n_layer
+    );
+
+    struct rwkv_tensor_header tensor_header;
+    std::string name;
+    struct rwkv_future_ctx future_ctx;
+
+    while ((size_t) ftell(file.file) < (size_t) file_stat.st_size) {
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_tensor_header(file.file, tensor_header), "Invalid tensor header");
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_string(file.file, tensor_header.key_length, name), "Failed to read tensor name");
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_READ, fseek(file.file, tensor_header.size(), SEEK_CUR) == 0, "Failed to read tensor data");
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_DATA_TYPE, tensor_header.data_type == TYPE_FP32, "Adapter tensor %s is not FP32", name.c_str());
+
+        future_ctx.alloc(GGML_TYPE_F32, tensor_header.width, tensor_header.height);
+    }
+
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_READ, fseek(file.file, sizeof(struct rwkv_file_header), SEEK_SET) == 0, "Failed to seek in file");
+
+    std::unique_ptr<struct rwkv_lora> lora(new(std::nothrow) struct rwkv_lora());
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ALLOC, lora, "Failed to allocate adapter");
+    lora->instance_id = instance.id;
+    lora->ctx = future_ctx;
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, lora->ctx.ctx, "Failed to allocate adapter context");
+
+    while ((size_t) ftell(file.file) < (size_t) file_stat.st_size) {
+        struct ggml_tensor * tensor;
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_ggml_tensor(file.file, lora->ctx.ctx, name, tensor), "Failed to read adapter tensors");
+        lora->tensors[std::move(name)] = tensor;
+    }
+
+    const size_t suffix_length = strlen(".lora_A");
+
+    for (const auto & entry : lora->tensors) {
+        const std::string & key = entry.first;
+        struct ggml_tensor * tensor = entry.second;
+        const bool is_a = key.size() > suffix_length && key.compare(key.size() - suffix_length, suffix_length, ".lora_A") == 0;
+        const bool is_b = key.size() > suffix_length && key.compare(key.size() - suffix_length, suffix_length, ".lora_B") == 0;
+        const std::string param_key = is_a || is_b ? key.substr(0, key.size() - suffix_length) : key;
+
+        const auto param = instance.parameters.find(param_key);
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_KEY, param != instance.parameters.end(), "Adapter tensor %s does not match any model parameter", key.c_str());
+        const struct ggml_tensor * weight = param->second;
+
+        if (!is_a && !is_b) {
+            RWKV_ASSERT_NULL_MSG(
+                RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_SHAPE,
+                tensor->n_dims == weight->n_dims && tensor->ne[0] == weight->ne[0] && tensor->ne[1] == weight->ne[1],
+                "Adapter tensor %s has a different shape than the model parameter", key.c_str()
+            );
+            RWKV_ASSERT_NULL_MSG(
+                RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_UNSUPPORTED,
+                !instance.model.ln0_folded || (key != "emb.weight" && key.compare(0, strlen("blocks.0.ln0."), "blocks.0.ln0.") != 0),
+                "Adapter can not replace %s, because ln0 was folded into the embedding", key.c_str()
+            );
+            continue;
+        }
+
+        const auto other = lora->tensors.find(param_key + (is_a ? ".lora_B" : ".lora_A"));
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_PARAM_MISSING, other != lora->tensors.end(), "Adapter tensor %s has no pair", key.c_str());
+
+        const struct ggml_tensor * a = is_a ? tensor : other->second;
+        const struct ggml_tensor * b = is_a ? other->second : tensor;
+        RWKV_ASSERT_NULL_MSG(
+            RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_SHAPE,
+            a->n_dims == 2 && b->n_dims == 2 && a->ne[0] == weight->ne[0] && a->ne[1] == b->ne[0] && b->ne[1] == weight->ne[1],
+            "Low-rank matrices of %s have invalid shapes", param_key.c_str()
+        );
+
+        if (is_b && scale != 1.0F) {
+            float * data = (float *) tensor->data;
+
+            for (int64_t i = 0; i < tensor->ne[0] * tensor->ne[1]; i++) {
+                data[i] *= scale;
+            }
+        }
+    }
+
+    // Check that all low-rank matrices belong to matrices that are adapted in graphs.
+    struct rwkv_adapted_model adapted;
+    RWKV_ENSURE_OR_NULL(rwkv_adapt_model(instance, *lora, adapted));
+
+    return lora.release();
+}
+
+bool rwkv_set_lora(struct rwkv_context * ctx, const struct rwkv_lora * lora) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    if (lora == ctx->adapted.lora) {
+        return true;
+    }
+
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, !lora || lora->instance_id == ctx->instance->id, "Adapter was loaded for another model");
+
+    if (lora && ctx->adapted.lora && rwkv_lora_same_layout(*lora, *ctx->adapted.lora)) {
+        for (const auto & view : ctx->adapted.views) {
+            view.first->data = lora->tensors.at(view.second)->data;
+        }
+
+        ctx->adapted.lora = lora;
+        return true;
+    }
+
+    struct rwkv_adapted_model adapted;
+
+    if (lora) {
+        RWKV_CTX_ASSERT_FALSE(ctx, RWKV_ERROR_CTX, rwkv_adapt_model(*ctx->instance, *lora, adapted));
+    }
+
+    // Keep the previous model alive until the new serial graph is built, so that the context stays usable on failure.
+    struct rwkv_adapted_model previous;
+    previous = std::move(ctx->adapted);
+    ctx->adapted = std::move(adapted);
+
+    if (!rwkv_measure_and_build_serial_graph(ctx)) {
+        ctx->adapted = std::move(previous);
+        RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_GRAPH, false, "Failed to build graphs with the adapter");
+    }
+
+    // Sequence graphs refer to tensors of the previous model; they are rebuilt on the next call.
+    rwkv_clear_sequence_graphs(ctx);
+    return true;
+}
+
+void rwkv_lora_free(struct rwkv_lora * lora) {
+    std::unique_ptr<struct rwkv_lora> rwkv_lora(lora);
+}
+
+// Attributes nodes of the graph to layers and categories, using marks recorded while building the graph.
+void rwkv_profile_attribute_nodes(struct rwkv_graph & graph) {
+    const char * base = (const char *) ggml_get_mem_buffer(graph.ctx.ctx);
+    const std::vector<size_t> & layer_ends = graph.marks.layer_ends;
+    const std::vector<std::pair<size_t, size_t>> & wkv = graph.marks.wkv;
+
+    // Layer norm is ggml_norm, followed by in-place multiplication by weight and in-place addition of bias.
+    std::unordered_set<const struct ggml_tensor *> layer_norm_nodes;
+
+    graph.profile_nodes.resize(graph.post_logits_nodes);
+
+    for (size_t i = 0; i < graph.post_logits_nodes; i++) {
+        const struct ggml_tensor * node = graph.cgraph->nodes[i];
+        const size_t offset = (const char *) node - base;
+        struct rwkv_profile_node & info = graph.profile_nodes[i];
+
+        info.layer = offset < graph.marks.embedding_end ? -1 : (int32_t) (std::upper_bound(layer_ends.begin(), layer_ends.end(), offset) - layer_ends.begin());
+
+        const bool in_wkv = info.layer >= 0 && (size_t) info.layer < wkv.size() && offset >= wkv[info.layer].first && offset < wkv[info.layer].second;
+
+        if (node->op == GGML_OP_MUL_MAT) {
+            info.category = RWKV_PROFILE_MATMUL;
+        } else if (in_wkv) {
+            info.category = RWKV_PROFILE_WKV;
+        } else if (node->op == GGML_OP_NORM || ((node->op == GGML_OP_MUL || node->op == GGML_OP_ADD) && layer_norm_nodes.count(node->src0))) {
+            info.category = RWKV_PROFILE_LAYER_NORM;
+            layer_norm_nodes.insert(node);
+        } else {
+            info.category = RWKV_PROFILE_OTHER;
+        }
+    }
+}
+
+// Names of operations used by rwkv.cpp graphs, for the trace.
+const char * rwkv_profile_op_name(const enum ggml_op op) {
+    switch (op) {
+        case GGML_OP_ADD: return "add";
+        case GGML_OP_SUB: return "sub";
+        case GGML_OP_MUL: return "mul";
+        case GGML_OP_DIV: return "div";
+        case GGML_OP_REPEAT: return "repeat";
+        case GGML_OP_NORM: return "norm";
+        case GGML_OP_MUL_MAT: return "mul_mat";
+        case GGML_OP_SET: return "set";
+        case GGML_OP_CPY: return "cpy";
+        case GGML_OP_GET_ROWS: return "get_rows";
+        case GGML_OP_MAP_UNARY: return "map_unary";
+        case GGML_OP_MAP_BINARY: return "map_binary";
+        default: return "other";
+    }
+}
+
+const char * rwkv_profile_category_names[RWKV_PROFILE_CATEGORY_COUNT] = { "matmul", "wkv", "layer_norm", "other" };
+
+// Clears perf counters of graph nodes, which ggml accumulates on every computation.
+void rwkv_profile_clear_nodes(struct rwkv_graph & graph) {
+    if (!graph.cgraph) {
+        return;
+    }
+
+    for (size_t i = 0; i < graph.post_logits_nodes; i++) {
+        struct ggml_tensor * node = graph.cgraph->nodes[i];
+        node->perf_runs = 0;
+        node->perf_cycles = 0;
+        node->perf_time_us = 0;
+    }
+}
+
+// Limits the total count of threads that attached contexts compute graphs with at the same time.
+struct rwkv_thread_budget {
+    std::mutex mutex;
+    std::condition_variable released;
+    uint32_t available;
+};
+
+// Takes up to n_threads threads from the budget, waiting until at least one is available. Returns the count of taken threads.
+uint32_t rwkv_thread_budget_acquire(struct rwkv_thread_budget * budget, const uint32_t n_threads) {
+    std::unique_lock<std::mutex> lock(budget->mutex);
+    budget->released.wait(lock, [&] { return budget->available > 0; });
+
+    const uint32_t taken = std::min(n_threads, budget->available);
+    budget->available -= taken;
+    return taken;
+}
+
+void rwkv_thread_budget_release(struct rwkv_thread_budget * budget, const uint32_t n_threads) {
+    {
+        std::lock_guard<std::mutex> lock(budget->mutex);
+        budget->available += n_threads;
+    }
+
+    budget->released.notify_all();
+}
+
+// Runs ggml on the graph, with threads taken from the thread budget of the context if it has one.
+void rwkv_graph_run(struct rwkv_context * ctx, struct rwkv_graph & graph) {
+    struct rwkv_thread_budget * budget = ctx->thread_budget;
+    const struct rwkv_affinity_guard affinity(ctx->cpu_affinity);
+
+    if (!budget) {
+        graph.cgraph->n_threads = graph.n_threads;
+        ggml_graph_compute(graph.ctx.ctx, graph.cgraph.get());
+        return;
+    }
+
+    const uint32_t n_threads = rwkv_thread_budget_acquire(budget, graph.n_threads);
+    graph.cgraph->n_threads = n_threads;
+    ggml_graph_compute(graph.ctx.ctx, graph.cgraph.get());
+    rwkv_thread_budget_release(budget, n_threads);
+}
+
+// Computes the graph, and collects perf counters of its nodes if profiling is enabled.
+void rwkv_graph_compute(struct rwkv_context * ctx, struct rwkv_graph & graph, const char * name, const size_t n_tokens) {
+    struct rwkv_profile & profile = ctx->profile;
+
+    if (!profile.flags) {
+        rwkv_graph_run(ctx, graph);
+        return;
+    }
+
+    const int64_t start_us = ggml_time_us();
+    rwkv_graph_run(ctx, graph);
+    const int64_t end_us = ggml_time_us();
+
+    if (graph.profile_nodes.empty()) {
+        rwkv_profile_attribute_nodes(graph);
+    }
+
+    if (profile.flags & RWKV_PROFILE_TRACE) {
+        profile.trace.push_back({ name, "eval", (int64_t) n_tokens, start_us, end_us - start_us });
+    }
+
+    // ggml computes nodes one after another, so node start times can be reconstructed from durations.
+    int64_t node_start_us = start_us;
+    const int64_t cycles_per_ms = std::max(ggml_cycles_per_ms(), (int64_t) 1);
+
+    for (int i = 0; i < graph.cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = graph.cgraph->nodes[i];
+        const struct rwkv_profile_node & info = graph.profile_nodes[i];
+        struct rwkv_profile_entry & entry = profile.entries[(info.layer + 1) * RWKV_PROFILE_CATEGORY_COUNT + info.category];
+
+        entry.calls += node->perf_runs;
+        entry.wall_us += node->perf_time_us;
+        entry.cpu_us += node->perf_cycles * 1000 / cycles_per_ms;
+
+        // Without GGML_PERF, node durations are not measured, and only evaluations are traced.
+        if ((profile.flags & RWKV_PROFILE_TRACE) && node->perf_time_us > 0) {
+            profile.trace.push_back({ rwkv_profile_op_name(node->op), rwkv_profile_category_names[info.category], info.layer, node_start_us, node->perf_time_us });
+            node_start_us += node->perf_time_us;
+        }
+    }
+
+    rwkv_profile_clear_nodes(graph);
+}
+
+void rwkv_set_profiling(struct rwkv_context * ctx, const uint32_t flags) {
+    if (flags && !ctx->profile.flags) {
+        // Discard counters accumulated while profiling was disabled.
+        rwkv_profile_clear_nodes(ctx->serial_graph);
+        rwkv_profile_clear_nodes(ctx->sequence_graph);
+
+        for (struct rwkv_spare_sequence_graph & spare : ctx->spare_sequence_graphs) {
+            rwkv_profile_clear_nodes(spare.graph);
+        }
+    }
+
+    ctx->profile.flags = flags;
+
+    if (ctx->profile.entries.empty()) {
+        rwkv_reset_profile(ctx);
+    }
+}
+
+size_t rwkv_get_profile(const struct rwkv_context * ctx, struct rwkv_profile_entry * entries, const size_t max_entries) {
+    const std::vector<struct rwkv_profile_entry> & profile_entries = ctx->profile.entries;
+
+    if (entries) {
+        memcpy(entries, profile_entries.data(), std::min(max_entries, profile_entries.size()) * sizeof(struct rwkv_profile_entry));
+    }
+
+    return profile_entries.size();
+}
+
+void rwkv_reset_profile(struct rwkv_context * ctx) {
+    const int32_t n_layer = (int32_t) ctx->instance->model.header.n_layer;
+    std::vector<struct rwkv_profile_entry> & entries = ctx->profile.entries;
+    entries.resize((n_layer + 2) * RWKV_PROFILE_CATEGORY_COUNT);
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].layer = (int32_t) (i / RWKV_PROFILE_CATEGORY_COUNT) - 1;
+        entries[i].category = (enum rwkv_profile_category) (i % RWKV_PROFILE_CATEGORY_COUNT);
+        entries[i].calls = 0;
+        entries[i].wall_us = 0;
+        entries[i].cpu_us = 0;
+    }
+
+    ctx->profile.trace.clear();
+}
+
+bool rwkv_dump_profile_trace(struct rwkv_context * ctx, const char * path) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    struct rwkv_file file(fopen(path, "wb"));
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_FILE | RWKV_ERROR_FILE_OPEN, file.file, "Failed to open %s for writing", path);
+
+    fprintf(file.file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+    const std::vector<struct rwkv_trace_event> & trace = ctx->profile.trace;
+
+    for (size_t i = 0; i < trace.size(); i++) {
+        const struct rwkv_trace_event & event = trace[i];
+        const bool is_eval = strcmp(event.category, "eval") == 0;
+
+        fprintf(
+            file.file,
+            "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %" PRId64 ", \"dur\": %" PRId64 ", \"pid\": 1, \"tid\": 1, \"args\": {\"%s\": %" PRId64 "}}%s\n",
+            event.name, event.category, event.start_us, event.duration_us, is_eval ? "tokens" : "layer", event.arg, i + 1 < trace.size() ? "," : ""
+        );
+    }
+
+    fprintf(file.file, "]}\n");
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_FILE | RWKV_ERROR_FILE_WRITE, !ferror(file.file), "Failed to write %s", path);
+    return true;
+}
+
+void rwkv_set_inputs(const struct rwkv_context * ctx, const float * state_in) {
+    if (state_in) {
+        memcpy(ctx->input_state->data, state_in, ggml_nbytes(ctx->input_state));
+    } else {
+        rwkv_init_state(ctx, (float *) ctx->input_state->data);
+    }
+}
+
+void rwkv_get_outputs(const struct rwkv_context * ctx, float * state_out, float * logits_out) {
+    if (state_out) {
+        memcpy(state_out, ctx->output_state->data, ggml_nbytes(ctx->output_state));
+    }
+
+    if (logits_out) {
+        memcpy(logits_out, ctx->logits->data, ggml_nbytes(ctx->logits));
+    }
+}
+
+bool rwkv_eval(struct rwkv_context * ctx, const uint32_t token, const float * state_in, float * state_out, float * logits_out) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    const struct rwkv_file_header & header = ctx->instance->model.header;
+    const size_t n_vocab = header.n_vocab;
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, token < n_vocab, "Token (%" PRId32 ") is out of range (0 .. %zu)", token, n_vocab - 1);
+
+    rwkv_set_inputs(ctx, state_in);
+    ggml_set_i32(ctx->serial_graph.tokens, token);
+
+    // Short circuit computation of logits if nobody actually cares
+    if (!logits_out) {
+        ctx->serial_graph.cgraph->n_nodes = ctx->serial_graph.pre_logits_nodes;
+        ctx->serial_graph.cgraph->n_leafs = ctx->serial_graph.pre_logits_leafs;
+    } else {
+        ctx->serial_graph.cgraph->n_nodes = ctx->serial_graph.post_logits_nodes;
+        ctx->serial_graph.cgraph->n_leafs = ctx->serial_graph.post_logits_leafs;
+    }
+
+    rwkv_graph_compute(ctx, ctx->serial_graph, "rwkv_eval", 1);
+    rwkv_get_outputs(ctx, state_out, logits_out);
+
+    return true;
+}
+
+bool rwkv_eval_sequence(struct rwkv_context * ctx, const uint32_t * sequence, const size_t sequence_len, const float * state_in, float * state_out, float * logits_out) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    const struct rwkv_file_header & header = ctx->instance->model.header;
+    const size_t n_vocab = header.n_vocab;
+    const size_t n_embed = header.n_embed;
+
+    if (sequence) {
+        for (size_t i = 0; i < sequence_len; i++) {
+            const uint32_t token = sequence[i];
+            RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, token < n_vocab, "Token at index %zu (%" PRId32 ") is out of range (0 .. %zu)", i, token, n_vocab - 1);
+        }
+    }
+
+    RWKV_ENSURE_OR_FALSE(rwkv_use_sequence_graph(ctx, sequence_len, RWKV_SEQUENCE_LOGITS));
+
+    // Allow building the sequence graph without actually evaluating, by specifying sequence = NULL.
+    if (sequence) {
+        rwkv_set_inputs(ctx, state_in);
+        memcpy(ctx->sequence_graph.tokens->data, sequence, sequence_len * sizeof(uint32_t));
+
+        // Short circuit computation of logits if nobody actually cares
+        if (!logits_out) {
+            ctx->sequence_graph.cgraph->n_nodes = ctx->sequence_graph.pre_logits_nodes;
+            ctx->sequence_graph.cgraph->n_leafs = ctx->sequence_graph.pre_logits_leafs;
+        } else {
+            ctx->sequence_graph.cgraph->n_nodes = ctx->sequence_graph.post_logits_nodes;
+            ctx->sequence_graph.cgraph->n_leafs = ctx->sequence_graph.post_logits_leafs;
+        }
+
+        rwkv_graph_compute(ctx, ctx->sequence_graph, "rwkv_eval_sequence", sequence_len);
+        rwkv_get_outputs(ctx, state_out, logits_out);
+    }
+
+    return true;
+}
+
+bool rwkv_eval_sequence_per_token(
+    struct rwkv_context * ctx,
+    const uint32_t * sequence,
+    const size_t sequence_len,
+    const float * state_in,
+    float * logits_out,
+    float * states_out
+) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    const size_t n_vocab = ctx->instance->model.header.n_vocab;
+
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, sequence && sequence_len > 0, "Sequence must not be empty");
+
+    for (size_t i = 0; i < sequence_len; i++) {
+        const uint32_t token = sequence[i];
+        RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, token < n_vocab, "Token at index %zu (%" PRId32 ") is out of range (0 .. %zu)", i, token, n_vocab - 1);
+    }
+
+    RWKV_ENSURE_OR_FALSE(rwkv_use_sequence_graph(ctx, sequence_len, RWKV_SEQUENCE_PER_TOKEN));
+
+    rwkv_set_inputs(ctx, state_in);
+    memcpy(ctx->sequence_graph.tokens->data, sequence, sequence_len * sizeof(uint32_t));
+
+    // Per-token states are copied before the logits are computed.
+    if (!logits_out) {
+        ctx->sequence_graph.cgraph->n_nodes = ctx->sequence_graph.pre_logits_nodes;
+        ctx->sequence_graph.cgraph->n_leafs = ctx->sequence_graph.pre_logits_leafs;
+    } else {
+        ctx->sequence_graph.cgraph->n_nodes = ctx->sequence_graph.post_logits_nodes;
+        ctx->sequence_graph.cgraph->n_leafs = ctx->sequence_graph.post_logits_leafs;
+    }
+
+    rwkv_graph_compute(ctx, ctx->sequence_graph, "rwkv_eval_sequence_per_token", sequence_len);
+
+    if (logits_out) {
+        memcpy(logits_out, ctx->sequence_graph.token_logits->data, ggml_nbytes(ctx->sequence_graph.token_logits));
+    }
+
+    if (states_out) {
+        memcpy(states_out, ctx->sequence_graph.token_states->data, ggml_nbytes(ctx->sequence_graph.token_states));
+    }
+
+    return true;
+}
+
+// Evaluates the tokens with the graph computing embeddings, adds embeddings of the first n_used tokens to sum
+// and copies the embedding of token n_used - 1 to last. Both may be NULL. Tokens must be validated by the caller.
+bool rwkv_eval_embeddings(
+    struct rwkv_context * ctx,
+    const uint32_t * sequence,
+    const size_t sequence_len,
+    const size_t n_used,
+    const float * state_in,
+    float * sum,
+    float * last
+) {
+    RWKV_ENSURE_OR_FALSE(rwkv_use_sequence_graph(ctx, sequence_len, RWKV_SEQUENCE_EMBEDDINGS));
+
+    rwkv_set_inputs(ctx, state_in);
+    memcpy(ctx->sequence_graph.tokens->data, sequence, sequence_len * sizeof(uint32_t));
+
+    ctx->sequence_graph.cgraph->n_nodes = ctx->sequence_graph.post_logits_nodes;
+    ctx->sequence_graph.cgraph->n_leafs = ctx->sequence_graph.post_logits_leafs;
+
+    rwkv_graph_compute(ctx, ctx->sequence_graph, "rwkv_eval_sequence_embed", sequence_len);
+
+    const size_t n_embed = ctx->instance->model.header.n_embed;
+    const float * embeddings = (const float *) ctx->sequence_graph.token_embeddings->data;
+
+    if (sum) {
+        for (size_t t = 0; t < n_used; t++) {
+            for (size_t i = 0; i < n_embed; i++) {
+                sum[i] += embeddings[t * n_embed + i];
+            }
+        }
+    }
+
+    if (last) {
+        memcpy(last, embeddings + (n_used - 1) * n_embed, n_embed * sizeof(float));
+    }
+
+    return true;
+}
+
+bool rwkv_validate_embedding_tokens(struct rwkv_context * ctx, const uint32_t * sequence, const size_t sequence_len) {
+    const size_t n_vocab = ctx->instance->model.header.n_vocab;
+
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, sequence && sequence_len > 0, "Sequence must not be empty");
+
+    for (size_t i = 0; i < sequence_len; i++) {
+        const uint32_t token = sequence[i];
+        RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, token < n_vocab, "Token at index %zu (%" PRId32 ") is out of range (0 .. %zu)", i, token, n_vocab - 1);
+    }
+
+    return true;
+}
+
+bool rwkv_eval_sequence_embed(
+    struct rwkv_context * ctx,
+    const uint32_t * sequence,
+    const size_t sequence_len,
+    const float * state_in,
+    float * state_out,
+    float * embedding_out,
+    const bool mean_pool
+) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    RWKV_ENSURE_OR_FALSE(rwkv_validate_embedding_tokens(ctx, sequence, sequence_len));
+
+    const size_t n_embed = ctx->instance->model.header.n_embed;
+
+    if (embedding_out && mean_pool) {
+        memset(embedding_out, 0, n_embed * sizeof(float));
+    }
+
+    RWKV_ENSURE_OR_FALSE(rwkv_eval_embeddings(
+        ctx,
+        sequence,
+        sequence_len,
+        sequence_len,
+        state_in,
+        mean_pool ? embedding_out : NULL,
+        mean_pool ? NULL : embedding_out
+    ));
+
+    if (embedding_out && mean_pool) {
+        for (size_t i = 0; i < n_embed; i++) {
+            embedding_out[i] /= (float) sequence_len;
+        }
+    }
+
+    rwkv_get_outputs(ctx, state_out, NULL);
+
+    return true;
+}
+
+// Chunk length of rwkv_eval_sequence_embed_batch when the caller passes 0.
+#define RWKV_DEFAULT_EMBED_CHUNK_LEN 64
+
+bool rwkv_eval_sequence_embed_batch(
+    struct rwkv_context * ctx,
+    const uint32_t * const * sequences,
+    const size_t * sequence_lens,
+    const size_t n_sequences,
+    const size_t chunk_len,
+    const float * state_in,
+    const bool mean_pool,
+    float * embeddings_out
+) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, sequences && sequence_lens && embeddings_out, "Sequences, their lengths and the output must not be NULL");
+
+    size_t longest = 0;
+
+    for (size_t i = 0; i < n_sequences; i++) {
+        RWKV_ENSURE_OR_FALSE(rwkv_validate_embedding_tokens(ctx, sequences[i], sequence_lens[i]));
+        longest = std::max(longest, sequence_lens[i]);
+    }
+
+    // Padding to the longest sequence would make a single long document multiply the work for all short ones.
+    const size_t step = chunk_len != 0 ? chunk_len : std::min(longest, (size_t) RWKV_DEFAULT_EMBED_CHUNK_LEN);
+
+    const size_t n_embed = ctx->instance->model.header.n_embed;
+
+    // The last chunk of every sequence is padded, so all chunks are evaluated with the same cached graph.
+    // Padding tokens follow the used ones and do not change their embeddings.
+    std::vector<uint32_t> chunk(step, 0);
+
+    for (size_t i = 0; i < n_sequences; i++) {
+        const uint32_t * sequence = sequences[i];
+        const size_t sequence_len = sequence_lens[i];
+        float * embedding = embeddings_out + i * n_embed;
+
+        if (mean_pool) {
+            memset(embedding, 0, n_embed * sizeof(float));
+        }
+
+        for (size_t processed = 0; processed < sequence_len; processed += step) {
+            const size_t len = std::min(step, sequence_len - processed);
+            const bool last = processed + len == sequence_len;
+
+            std::fill(chunk.begin(), chunk.end(), 0);
+            memcpy(chunk.data(), sequence + processed, len * sizeof(uint32_t));
+
+            // The output state of the previous chunk is the input of the next one.
+            const float * chunk_state_in = processed == 0 ? state_in : (const float *) ctx->output_state->data;
+
+            RWKV_ENSURE_OR_FALSE(rwkv_eval_embeddings(
+                ctx,
+                chunk.data(),
+                step,
+                len,
+                chunk_state_in,
+                mean_pool ? embedding : NULL,
+                mean_pool || !last ? NULL : embedding
+            ));
+        }
+
+        if (mean_pool) {
+            for (size_t j = 0; j < n_embed; j++) {
+                embedding[j] /= (float) sequence_len;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Count of measured evaluations per candidate thread count in rwkv_tune_n_threads.
+#define RWKV_TUNE_RUNS 3
+
+int64_t rwkv_time_us(void) {
+    return (int64_t) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool rwkv_eval_sequence_chunked(
+    struct rwkv_context * ctx,
+    const uint32_t * tokens,
+    const size_t sequence_len,
+    const size_t chunk_len,
+    const float * state_in,
+    float * state_out,
+    float * logits_out,
+    const int64_t deadline_us,
+    rwkv_abort_callback abort_callback,
+    void * abort_user_data,
+    size_t * processed_len
+) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    if (processed_len) {
+        *processed_len = 0;
+    }
+
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, tokens && sequence_len > 0, "Sequence must not be empty");
+
+    const size_t step = chunk_len == 0 ? sequence_len : chunk_len;
+    size_t processed = 0;
+
+    while (processed < sequence_len) {
+        if ((deadline_us != 0 && rwkv_time_us() >= deadline_us) || (abort_callback && abort_callback(abort_user_data))) {
+            // Leave the state of the last evaluated chunk. Outputs of the context are only valid if at least one chunk was evaluated.
+            if (state_out && processed == 0) {
+                if (state_in) {
+                    memmove(state_out, state_in, ggml_nbytes(ctx->output_state));
+                } else {
+                    rwkv_init_state(ctx, state_out);
+                }
+            }
+
+            ctx->last_error = (enum rwkv_error_flags) (RWKV_ERROR_CTX | RWKV_ERROR_CANCELLED);
+            return false;
+        }
+
+        const size_t len = std::min(step, sequence_len - processed);
+        const bool last = processed + len == sequence_len;
+
+        // The output state of the previous chunk is the input of the next one; it is copied to the input tensor before evaluation.
+        const float * chunk_state_in = processed == 0 ? state_in : (const float *) ctx->output_state->data;
+
+        RWKV_ENSURE_OR_FALSE(rwkv_eval_sequence(ctx, tokens + processed, len, chunk_state_in, state_out, last ? logits_out : NULL));
+
+        processed += len;
+
+        if (processed_len) {
+            *processed_len = processed;
+        }
+    }
+
+    return true;
+}
+
+// --- Generation ---
+
+// xorshift64*; returns a float in [0, 1).
+float rwkv_random_float(uint64_t & rng) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (float) ((rng * 0x2545F4914F6CDD1DULL) >> 40) / (float) (1 << 24);
+}
+
+// Selects the tokens that may be sampled from logits, and writes their unnormalized probabilities into probs.
+// Returns the sum of the probabilities. Buffers are reused between calls to avoid allocations per token.
+float rwkv_sampling_candidates(
+    const float * logits,
+    const size_t n_vocab,
+    const struct rwkv_sampler_params & params,
+    std::vector<uint32_t> & candidates,
+    std::vector<float> & probs
+) {
+    uint32_t best = 0;
+
+    for (uint32_t i = 1; i < n_vocab; i++) {
+        best = logits[i] > logits[best] ? i : best;
+    }
+
+    if (params.temperature <= 0.0F) {
+        candidates.assign(1, best);
+        probs.assign(1, 1.0F);
+        return 1.0F;
+    }
+
+    candidates.resize(n_vocab);
+
+    for (uint32_t i = 0; i < n_vocab; i++) {
+        candidates[i] = i;
+    }
+
+    auto more_likely = [&](const uint32_t a, const uint32_t b) { return logits[a] > logits[b]; };
+
+    if (params.top_k > 0 && params.top_k < n_vocab) {
+        std::nth_element(candidates.begin(), candidates.begin() + params.top_k, candidates.end(), more_likely);
+        candidates.resize(params.top_k);
+    }
+
+    const bool nucleus = params.top_p > 0.0F && params.top_p < 1.0F;
+
+    if (nucleus) {
+        std::sort(candidates.begin(), candidates.end(), more_likely);
+    }
+
+    probs.resize(candidates.size());
+    float sum = 0.0F;
+
+    for (size_t i = 0; i < candidates.size(); i++) {
+        probs[i] = expf((logits[candidates[i]] - logits[best]) / params.temperature);
+        sum += probs[i];
+    }
+
+    // Drop the tail of sorted candidates, so that the remaining ones cover top_p of the probability.
+    if (nucleus) {
+        float cumulative = 0.0F;
+        size_t kept = 0;
+
+        while (kept < candidates.size() && cumulative < params.top_p * sum) {
+            cumulative += probs[kept++];
+        }
+
+        candidates.resize(kept);
+        probs.resize(kept);
+        sum = cumulative;
+    }
+
+    return sum;
+}
+
+// Samples a token from logits.
+uint32_t rwkv_sample_token(
+    const float * logits,
+    const size_t n_vocab,
+    const struct rwkv_sampler_params & params,
+    uint64_t & rng,
+    std::vector<uint32_t> & candidates,
+    std::vector<float> & probs
+) {
+    const float sum = rwkv_sampling_candidates(logits, n_vocab, params, candidates, probs);
+
+    if (params.temperature <= 0.0F) {
+        return candidates[0];
+    }
+
+    float target = rwkv_random_float(rng) * sum;
+
+    for (size_t i = 0; i < candidates.size(); i++) {
+        target -= probs[i];
+
+        if (target <= 0.0F) {
+            return candidates[i];
+        }
+    }
+
+    // Rounding left the target above the sum.
+    return candidates.back();
+}
+
+// Writes the normalized distribution that rwkv_sample_token samples from into dist of n_vocab floats.
+void rwkv_token_distribution(
+    const float * logits,
+    const size_t n_vocab,
+    const struct rwkv_sampler_params & params,
+    std::vector<uint32_t> & candidates,
+    std::vector<float> & probs,
+    float * dist
+) {
+    const float sum = rwkv_sampling_candidates(logits, n_vocab, params, candidates, probs);
+    std::fill(dist, dist + n_vocab, 0.0F);
+
+    for (size_t i = 0; i < candidates.size(); i++) {
+        dist[candidates[i]] = probs[i] / sum;
+    }
+}
+
+// Samples a token from n_vocab probabilities that add up to sum.
+uint32_t rwkv_sample_distribution(const float * dist, const size_t n_vocab, const float sum, uint64_t & rng) {
+    float target = rwkv_random_float(rng) * sum;
+    uint32_t last = 0;
+
+    for (uint32_t i = 0; i < n_vocab; i++) {
+        if (dist[i] > 0.0F) {
+            last = i;
+            target -= dist[i];
+
+            if (target <= 0.0F) {
+                return i;
+            }
+        }
+    }
+
+    return last;
+}
+
+// Subtracts presence and frequency penalties of already generated tokens from logits.
+void rwkv_apply_penalties(float * logits, const struct rwkv_sampler_params & params, const std::unordered_map<uint32_t, uint32_t> & counts) {
+    if (params.presence_penalty != 0.0F || params.frequency_penalty != 0.0F) {
+        for (const std::pair<const uint32_t, uint32_t> & count : counts) {
+            logits[count.first] -= params.presence_penalty + (float) count.second * params.frequency_penalty;
+        }
+    }
+}
+
+// Returns whether the last len generated tokens are equal to the first len tokens of the sequence.
+bool rwkv_ends_with(const std::vector<uint32_t> & generated, const uint32_t * tokens, const size_t len) {
+    return generated.size() >= len && std::equal(tokens, tokens + len, generated.end() - len);
+}
+
+// Sampled tokens of rwkv_generate and rwkv_generate_speculative. Emits them to the caller,
+// holding back tokens that may start a stop sequence.
+struct rwkv_generation {
+    const struct rwkv_stop_sequence * stop_sequences;
+    size_t n_stop_sequences;
+    uint32_t * tokens_out;
+    size_t * generated_len;
+    rwkv_token_callback callback;
+    void * user_data;
+
+    std::vector<uint32_t> generated;
+    // Count of each sampled token, for penalties.
+    std::unordered_map<uint32_t, uint32_t> counts;
+    size_t emitted;
+    // Set once a stop sequence was sampled, or the callback asked to stop.
+    bool stopped;
+
+    rwkv_generation(
+        const struct rwkv_stop_sequence * stop_sequences,
+        const size_t n_stop_sequences,
+        uint32_t * tokens_out,
+        size_t * generated_len,
+        rwkv_token_callback callback,
+        void * user_data
+    ): stop_sequences(stop_sequences), n_stop_sequences(n_stop_sequences), tokens_out(tokens_out), generated_len(generated_len),
+        callback(callback), user_data(user_data), emitted(0), stopped(false) {}
+
+    // Adds a sampled token. If last is true, no more tokens will be sampled, so held back tokens are emitted.
+    void push(const uint32_t token, const bool last) {
+        generated.push_back(token);
+        counts[token]++;
+
+        // Tokens that end with a complete stop sequence, or that may start one, are not emitted yet.
+        size_t held = 0;
+
+        for (size_t j = 0; j < n_stop_sequences && !stopped; j++) {
+            const struct rwkv_stop_sequence & stop = stop_sequences[j];
+
+            if (rwkv_ends_with(generated, stop.tokens, stop.len)) {
+                stopped = true;
+                held = stop.len;
+                break;
+            }
+
+            for (size_t len = std::min(stop.len - 1, generated.size()); len > held; len--) {
+                if (rwkv_ends_with(generated, stop.tokens, len)) {
+                    held = len;
+                    break;
+                }
+            }
+        }
+
+        const size_t end = last && !stopped ? generated.size() : generated.size() - held;
+
+        for (; emitted < end; emitted++) {
+            if (tokens_out) {
+                tokens_out[emitted] = generated[emitted];
+            }
+
+            if (generated_len) {
+                *generated_len = emitted + 1;
+            }
+
+            if (callback && callback(generated[emitted], user_data)) {
+                // Tokens held back after this one are dropped.
+                stopped = true;
+                emitted++;
+                break;
+            }
+        }
+    }
+};
+
+// Checks arguments shared by rwkv_generate and rwkv_generate_speculative.
+bool rwkv_validate_generation(
+    struct rwkv_context * ctx,
+    const uint32_t * prompt_tokens,
+    const size_t prompt_len,
+    const struct rwkv_stop_sequence * stop_sequences,
+    const size_t n_stop_sequences
+) {
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, prompt_tokens && prompt_len > 0, "Prompt must not be empty");
+
+    for (size_t i = 0; i < n_stop_sequences; i++) {
+        RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, stop_sequences[i].tokens && stop_sequences[i].len > 0, "Stop sequence %zu is empty", i);
+    }
+
+    return true;
+}
+
+// Sampler parameters with defaults for NULL, and the initial state of the random generator.
+struct rwkv_sampler_params rwkv_sampler_or_greedy(const struct rwkv_sampler_params * params, uint64_t & rng) {
+    struct rwkv_sampler_params sampler = {};
+
+    if (params) {
+        sampler = *params;
+    }
+
+    // A zero state would make the generator return zeros forever.
+    rng = sampler.seed ? sampler.seed : 0x853C49E6748FEA9BULL;
+    return sampler;
+}
+
+uint32_t rwkv_sample_logits(const float * logits, const size_t n_vocab, const struct rwkv_sampler_params * params, uint64_t * rng) {
+    // Buffers are reused between calls, so that sampling does not allocate per token.
+    thread_local std::vector<uint32_t> candidates;
+    thread_local std::vector<float> probs;
+
+    uint64_t seeded_rng;
+    const struct rwkv_sampler_params sampler = rwkv_sampler_or_greedy(params, seeded_rng);
+
+    if (*rng == 0) {
+        *rng = seeded_rng;
+    }
+
+    return rwkv_sample_token(logits, n_vocab, sampler, *rng, candidates, probs);
+}
+
+bool rwkv_generate(
+    struct rwkv_context * ctx,
+    const uint32_t * prompt_tokens,
+    const size_t prompt_len,
+    const size_t max_tokens,
+    const struct rwkv_sampler_params * params,
+    const struct rwkv_stop_sequence * stop_sequences,
+    const size_t n_stop_sequences,
+    const float * state_in,
+    float * state_out,
+    uint32_t * tokens_out,
+    size_t * generated_len,
+    rwkv_token_callback callback,
+    void * user_data
+) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    if (generated_len) {
+        *generated_len = 0;
+    }
+
+    RWKV_ENSURE_OR_FALSE(rwkv_validate_generation(ctx, prompt_tokens, prompt_len, stop_sequences, n_stop_sequences));
+
+    uint64_t rng;
+    const struct rwkv_sampler_params sampler = rwkv_sampler_or_greedy(params, rng);
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    std::vector<float> logits(n_vocab);
+    std::vector<uint32_t> candidates;
+    std::vector<float> probs;
+    struct rwkv_generation generation(stop_sequences, n_stop_sequences, tokens_out, generated_len, callback, user_data);
+
+    // Following tokens are evaluated from the output state of the context, so that the state is not copied for each token.
+    if (prompt_len == 1) {
+        RWKV_ENSURE_OR_FALSE(rwkv_eval(ctx, prompt_tokens[0], state_in, NULL, max_tokens ? logits.data() : NULL));
+    } else {
+        RWKV_ENSURE_OR_FALSE(rwkv_eval_sequence(ctx, prompt_tokens, prompt_len, state_in, NULL, max_tokens ? logits.data() : NULL));
+    }
+
+    for (size_t i = 0; i < max_tokens && !generation.stopped; i++) {
+        rwkv_apply_penalties(logits.data(), sampler, generation.counts);
+
+        const uint32_t token = rwkv_sample_token(logits.data(), n_vocab, sampler, rng, candidates, probs);
+        generation.push(token, i + 1 == max_tokens);
+
+        // The last token is only evaluated if its state is needed.
+        const bool done = i + 1 == max_tokens || generation.stopped;
+
+        if (!done || state_out) {
+            RWKV_ENSURE_OR_FALSE(rwkv_eval(ctx, token, (const float *) ctx->output_state->data, NULL, done ? NULL : logits.data()));
+        }
+    }
+
+    if (state_out) {
+        memcpy(state_out, ctx->output_state->data, ggml_nbytes(ctx->output_state));
+    }
+
+    return true;
+}
+
+// Evaluates all tokens of the prompt but the last one, whose logits are computed when it is verified with the drafted tokens.
+bool rwkv_eval_prompt_prefix(struct rwkv_context * ctx, const uint32_t * prompt_tokens, const size_t prompt_len, const float * state_in, float * state_out) {
+    if (prompt_len > 1) {
+        return rwkv_eval_sequence(ctx, prompt_tokens, prompt_len - 1, state_in, state_out, NULL);
+    }
+
+    if (state_in) {
+        memcpy(state_out, state_in, ggml_nbytes(ctx->output_state));
+    } else {
+        rwkv_init_state(ctx, state_out);
+    }
+
+    return true;
+}
+
+// Finds earlier occurrences of the last tokens of a token stream, to propose the tokens that followed them.
+// For each n-gram length, maps a hash of every n-gram to the end of its last occurrence that has a following token.
+struct rwkv_ngram_index {
+    size_t max_len;
+    std::vector<uint32_t> tokens;
+    std::vector<std::unordered_map<uint64_t, size_t>> ends;
+
+    rwkv_ngram_index(const size_t max_len): max_len(max_len), ends(max_len) {}
+
+    // FNV-1a of the len tokens that end at end.
+    uint64_t hash(const size_t end, const size_t len) const {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+
+        for (size_t i = end + 1 - len; i <= end; i++) {
+            hash = (hash ^ tokens[i]) * 0x100000001B3ULL;
+        }
+
+        return hash;
+    }
+
+    void push(const uint32_t token) {
+        // N-grams that end with the previous token now have a following token.
+        if (!tokens.empty()) {
+            const size_t end = tokens.size() - 1;
+
+            for (size_t len = 1; len <= std::min(max_len, tokens.size()); len++) {
+                ends[len - 1][hash(end, len)] = end;
+            }
+        }
+
+        tokens.push_back(token);
+    }
+
+    // Writes up to max_tokens tokens that followed the most recent occurrence of the longest matching suffix into out.
+    // Returns the count of written tokens, which is 0 if no suffix occurred before.
+    size_t propose(const size_t max_tokens, uint32_t * out) const {
+        const size_t last = tokens.size() - 1;
+
+        for (size_t len = std::min(max_len, tokens.size() - 1); len > 0; len--) {
+            const std::unordered_map<uint64_t, size_t> & len_ends = ends[len - 1];
+            const auto it = len_ends.find(hash(last, len));
+
+            // Hashes may collide, so the tokens are compared.
+            if (it == len_ends.end() || !std::equal(tokens.begin() + (it->second + 1 - len), tokens.begin() + (it->second + 1), tokens.end() - len)) {
+                continue;
+            }
+
+            const size_t count = std::min(max_tokens, last - it->second);
+            std::copy(tokens.begin() + (it->second + 1), tokens.begin() + (it->second + 1 + count), out);
+            return count;
+        }
+
+        return 0;
+    }
+};
+
+// Prepares the clone of the context that evaluates only the layers in the mask; NULL selects every other layer.
+bool rwkv_prepare_layer_skip_draft(struct rwkv_context * ctx, const bool * mask) {
+    const size_t n_layer = ctx->instance->model.header.n_layer;
+    std::vector<bool> layer_mask(n_layer);
+
+    for (size_t i = 0; i < n_layer; i++) {
+        layer_mask[i] = mask ? mask[i] : i % 2 == 0;
+    }
+
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, std::find(layer_mask.begin(), layer_mask.end(), true) != layer_mask.end(), "Layer mask must not be empty");
+
+    std::unique_ptr<struct rwkv_context> & draft = ctx->layer_skip_draft;
+
+    // The clone shares weights with the context, but not the adapter, which may have changed since it was created.
+    if (draft && draft->adapted.lora != ctx->adapted.lora) {
+        draft.reset();
+    }
+
+    if (!draft) {
+        draft.reset(rwkv_clone_context(ctx, ctx->n_threads));
+        RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, draft, "Failed to clone the context for drafting");
+    }
+
+    draft->print_errors = ctx->print_errors;
+    draft->thread_budget = ctx->thread_budget;
+    draft->cpu_affinity = ctx->cpu_affinity;
+
+    if (draft->layer_mask != layer_mask) {
+        draft->layer_mask = std::move(layer_mask);
+        RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_GRAPH, rwkv_measure_and_build_serial_graph(draft.get()), "Failed to build the draft graph");
+    }
+
+    return true;
+}
+
+bool rwkv_generate_speculative(
+    struct rwkv_context * ctx,
+    const struct rwkv_speculation_params * speculation,
+    struct rwkv_speculation_stats * stats,
+    const uint32_t * prompt_tokens,
+    const size_t prompt_len,
+    const size_t max_tokens,
+    const struct rwkv_sampler_params * params,
+    const struct rwkv_stop_sequence * stop_sequences,
+    const size_t n_stop_sequences,
+    const float * state_in,
+    float * state_out,
+    uint32_t * tokens_out,
+    size_t * generated_len,
+    rwkv_token_callback callback,
+    void * user_data
+) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    if (generated_len) {
+        *generated_len = 0;
+    }
+
+    if (stats) {
+        *stats = {};
+    }
+
+    RWKV_ENSURE_OR_FALSE(rwkv_validate_generation(ctx, prompt_tokens, prompt_len, stop_sequences, n_stop_sequences));
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, speculation && speculation->n_draft > 0, "At least one token must be drafted");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    struct rwkv_context * draft = NULL;
+
+    switch (speculation->mode) {
+        case RWKV_SPECULATION_DRAFT_MODEL:
+            draft = speculation->draft_ctx;
+            RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, draft && draft != ctx, "Draft model needs its own context");
+            RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_DIMENSION, rwkv_get_logits_len(draft) == n_vocab,
+                "Draft model has %zu tokens in its vocabulary, but the model has %zu", rwkv_get_logits_len(draft), n_vocab);
+            break;
+        case RWKV_SPECULATION_PROMPT_LOOKUP:
+            RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, speculation->ngram_len > 0, "N-grams must not be empty");
+            break;
+        case RWKV_SPECULATION_LAYER_SKIP:
+            RWKV_ENSURE_OR_FALSE(rwkv_prepare_layer_skip_draft(ctx, speculation->layer_mask));
+            draft = ctx->layer_skip_draft.get();
+            break;
+        default:
+            RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, false, "Unknown speculation mode %d", (int) speculation->mode);
+    }
+
+    uint64_t rng;
+    const struct rwkv_sampler_params sampler = rwkv_sampler_or_greedy(params, rng);
+
+    const size_t n_draft = speculation->n_draft;
+    const size_t state_len = rwkv_get_state_len(ctx);
+    const size_t draft_state_len = draft ? rwkv_get_state_len(draft) : 0;
+
+    // The state of each model is kept before the pending token, which is the last token of the prompt or the last sampled token.
+    std::vector<float> state(state_len);
+    std::vector<float> draft_state(draft_state_len);
+    uint32_t pending = prompt_tokens[prompt_len - 1];
+
+    RWKV_ENSURE_OR_FALSE(rwkv_eval_prompt_prefix(ctx, prompt_tokens, prompt_len, state_in, state.data()));
+
+    if (speculation->mode == RWKV_SPECULATION_LAYER_SKIP) {
+        // The draft starts from the full state, then tracks its own state of fewer layers, so the prompt is evaluated once.
+        draft_state = state;
+    } else if (draft) {
+        RWKV_ENSURE_OR_FALSE(rwkv_eval_prompt_prefix(draft, prompt_tokens, prompt_len, speculation->draft_state_in, draft_state.data()));
+    }
+
+    // Continuations are looked up in the prompt and the sampled tokens.
+    struct rwkv_ngram_index index(draft ? 0 : speculation->ngram_len);
+
+    if (!draft) {
+        for (size_t i = 0; i < prompt_len; i++) {
+            index.push(prompt_tokens[i]);
+        }
+    }
+
+    // Drafted tokens follow the pending token, so that the target model verifies n_draft + 1 tokens at once.
+    // Fewer drafted tokens are padded, so that the cached graph of this length is reused.
+    std::vector<uint32_t> sequence(n_draft + 1);
+    std::vector<float> draft_states(n_draft * draft_state_len);
+    std::vector<float> draft_dists(n_draft * n_vocab);
+    std::vector<float> token_logits((n_draft + 1) * n_vocab);
+    std::vector<float> token_states((n_draft + 1) * state_len);
+    std::vector<float> logits(n_vocab);
+    std::vector<float> dist(n_vocab);
+    std::vector<uint32_t> candidates;
+    std::vector<float> probs;
+    std::vector<uint32_t> accepted;
+    struct rwkv_generation generation(stop_sequences, n_stop_sequences, tokens_out, generated_len, callback, user_data);
+
+    while (generation.generated.size() < max_tokens && !generation.stopped) {
+        // Verification counts only the tokens accepted so far, while drafting counts drafted tokens in a copy of its own.
+        std::unordered_map<uint32_t, uint32_t> counts = generation.counts;
+        size_t n_drafted = n_draft;
+        sequence[0] = pending;
+
+        if (draft) {
+            // Draft tokens with the draft model, counting them for penalties as if they were sampled.
+            std::unordered_map<uint32_t, uint32_t> draft_counts = generation.counts;
+
+            for (size_t i = 0; i < n_draft; i++) {
+                const float * input = i == 0 ? draft_state.data() : &draft_states[(i - 1) * draft_state_len];
+                RWKV_ENSURE_OR_FALSE(rwkv_eval(draft, sequence[i], input, &draft_states[i * draft_state_len], logits.data()));
+
+                float * draft_dist = &draft_dists[i * n_vocab];
+                rwkv_apply_penalties(logits.data(), sampler, draft_counts);
+                rwkv_token_distribution(logits.data(), n_vocab, sampler, candidates, probs, draft_dist);
+                sequence[i + 1] = rwkv_sample_distribution(draft_dist, n_vocab, 1.0F, rng);
+                draft_counts[sequence[i + 1]]++;
+            }
+        } else {
+            // Looked up tokens are drafted with certainty, so each of them is accepted with its probability under the model.
+            n_drafted = index.propose(n_draft, &sequence[1]);
+            std::fill(sequence.begin() + 1 + n_drafted, sequence.end(), pending);
+
+            for (size_t i = 0; i < n_drafted; i++) {
+                float * draft_dist = &draft_dists[i * n_vocab];
+                std::fill(draft_dist, draft_dist + n_vocab, 0.0F);
+                draft_dist[sequence[i + 1]] = 1.0F;
+            }
+        }
+
+        accepted.clear();
+
+        if (n_drafted == 0) {
+            // Nothing to verify, so the pending token is evaluated alone and one token is sampled.
+            RWKV_ENSURE_OR_FALSE(rwkv_eval(ctx, pending, state.data(), state.data(), logits.data()));
+            rwkv_apply_penalties(logits.data(), sampler, counts);
+            accepted.push_back(rwkv_sample_token(logits.data(), n_vocab, sampler, rng, candidates, probs));
+        } else {
+            RWKV_ENSURE_OR_FALSE(rwkv_eval_sequence_per_token(ctx, sequence.data(), n_draft + 1, state.data(), token_logits.data(), token_states.data()));
+
+            // Accept a drafted token with probability min(1, p / q); on rejection, sample from the normalized max(0, p - q),
+            // so that accepted tokens follow the distribution of the target model exactly.
+            for (size_t i = 0; i <= n_drafted; i++) {
+                float * target_logits = &token_logits[i * n_vocab];
+                rwkv_apply_penalties(target_logits, sampler, counts);
+                rwkv_token_distribution(target_logits, n_vocab, sampler, candidates, probs, dist.data());
+
+                if (i == n_drafted) {
+                    // All drafted tokens were accepted, and the target model gives one more token for free.
+                    accepted.push_back(rwkv_sample_distribution(dist.data(), n_vocab, 1.0F, rng));
+                    break;
+                }
+
+                const float * draft_dist = &draft_dists[i * n_vocab];
+                const uint32_t token = sequence[i + 1];
+
+                if (rwkv_random_float(rng) * draft_dist[token] < dist[token]) {
+                    accepted.push_back(token);
+                    counts[token]++;
+                    continue;
+                }
+
+                float sum = 0.0F;
+
+                for (size_t j = 0; j < n_vocab; j++) {
+                    dist[j] = std::max(0.0F, dist[j] - draft_dist[j]);
+                    sum += dist[j];
+                }
+
+                // Rounding may leave nothing of the residual when both distributions are almost equal.
+                accepted.push_back(sum > 0.0F ? rwkv_sample_distribution(dist.data(), n_vocab, sum, rng) : token);
+                break;
+            }
+
+            if (stats) {
+                stats->drafted += n_drafted;
+                stats->accepted += accepted.size() - 1;
+                stats->verifications++;
+            }
+        }
+
+        // Only the accepted drafted tokens and the last token are sampled, as far as max_tokens and stop sequences allow.
+        size_t n_sampled = 0;
+
+        while (n_sampled < accepted.size() && generation.generated.size() < max_tokens && !generation.stopped) {
+            if (!draft) {
+                index.push(accepted[n_sampled]);
+            }
+
+            generation.push(accepted[n_sampled++], generation.generated.size() + 1 == max_tokens);
+        }
+
+        // Sampled tokens but the last one were drafted, so both models have the state after them.
+        if (n_drafted > 0) {
+            memcpy(state.data(), &token_states[(n_sampled - 1) * state_len], sizeof(float) * state_len);
+        }
+
+        if (draft && n_sampled <= n_draft) {
+            memcpy(draft_state.data(), &draft_states[(n_sampled - 1) * draft_state_len], sizeof(float) * draft_state_len);
+        } else if (draft) {
+            RWKV_ENSURE_OR_FALSE(rwkv_eval(draft, sequence[n_draft], &draft_states[(n_draft - 1) * draft_state_len], draft_state.data(), NULL));
+        }
+
+        pending = accepted[n_sampled - 1];
+    }
+
+    if (state_out) {
+        RWKV_ENSURE_OR_FALSE(rwkv_eval(ctx, pending, state.data(), state_out, NULL));
+    }
+
+    if (draft && speculation->draft_state_out && speculation->mode == RWKV_SPECULATION_DRAFT_MODEL) {
+        RWKV_ENSURE_OR_FALSE(rwkv_eval(draft, pending, draft_state.data(), speculation->draft_state_out, NULL));
+    }
+
+    return true;
+}
+
+// --- Asynchronous evaluation ---
+
+// An asynchronous evaluation. Referenced by the caller until rwkv_async_free, and by the executor until it is done with it.
+struct rwkv_async {
+    struct rwkv_executor * executor;
+    struct rwkv_context * ctx;
+    std::function<bool()> eval;
+    rwkv_async_callback callback;
+    void * user_data;
+
+    // Holds rwkv_async_status. Whoever changes it from PENDING to RUNNING (a worker, or cancellation) completes the evaluation.
+    std::atomic<int> status;
+    std::atomic<int> references;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+};
+
+struct rwkv_executor {
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<struct rwkv_async *> queue;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    // Signaled on each completion, see rwkv_executor_get_fd. With eventfd both are the same descriptor.
+    int read_fd = -1;
+    int write_fd = -1;
+};
+
+void rwkv_async_release(struct rwkv_async * handle) {
+    if (--handle->references == 0) {
+        delete handle;
+    }
+}
+
+bool rwkv_async_claim(struct rwkv_async * handle) {
+    int expected = RWKV_ASYNC_PENDING;
+    return handle->status.compare_exchange_strong(expected, RWKV_ASYNC_RUNNING);
+}
+
+void rwkv_executor_signal(struct rwkv_executor * executor) {
+#if defined(__linux__)
+    const uint64_t value = 1;
+    // The counter only overflows after 2^64 unread completions, so the result can be ignored.
+    (void) !write(executor->write_fd, &value, sizeof(value));
+#elif !defined(_WIN32)
+    const char value = 1;
+    // A full pipe is still readable, so a failed write loses nothing.
+    (void) !write(executor->write_fd, &value, sizeof(value));
+#else
+    (void) executor;
+#endif
+}
+
+// Moves a claimed evaluation to a final state, and notifies everyone waiting for it.
+void rwkv_async_complete(struct rwkv_async * handle, const enum rwkv_async_status status) {
+    // Release the context first, so that the next evaluation can be submitted as soon as completion is observed.
+    handle->ctx->async_busy = false;
+
+    {
+        std::lock_guard<std::mutex> lock(handle->mutex);
+        handle->status = status;
+    }
+
+    handle->finished.notify_all();
+    rwkv_executor_signal(handle->executor);
+
+    if (handle->callback) {
+        handle->callback(handle, status, handle->user_data);
+    }
+}
+
+void rwkv_executor_work(struct rwkv_executor * executor) {
+    while (true) {
+        struct rwkv_async * handle;
+
+        {
+            std::unique_lock<std::mutex> lock(executor->mutex);
+            executor->condition.wait(lock, [&] { return executor->stopping || !executor->queue.empty(); });
+
+            if (executor->stopping) {
+                return;
+            }
+
+            handle = executor->queue.front();
+            executor->queue.pop_front();
+        }
+
+        // Skip evaluations that were cancelled while queued.
+        if (rwkv_async_claim(handle)) {
+            rwkv_async_complete(handle, handle->eval() ? RWKV_ASYNC_DONE : RWKV_ASYNC_FAILED);
+        }
+
+        rwkv_async_release(handle);
+    }
+}
+
+struct rwkv_executor * rwkv_executor_new(const uint32_t n_workers) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ARGS, n_workers > 0, "Executor needs at least one worker");
+
+    std::unique_ptr<struct rwkv_executor> executor(new(std::nothrow) struct rwkv_executor());
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ALLOC, executor, "Failed to allocate executor");
+
+#if defined(__linux__)
+    executor->read_fd = executor->write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX, executor->read_fd >= 0, "Failed to create eventfd");
+#elif !defined(_WIN32)
+    int fds[2];
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX, pipe(fds) == 0, "Failed to create pipe");
+    executor->read_fd = fds[0];
+    executor->write_fd = fds[1];
+
+    for (int fd : fds) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    for (uint32_t i = 0; i < n_workers; i++) {
+        executor->workers.push_back(std::thread(rwkv_executor_work, executor.get()));
+    }
+
+    return executor.release();
+}
+
+int rwkv_executor_get_fd(const struct rwkv_executor * executor) {
+    return executor->read_fd;
+}
+
+void rwkv_executor_free(struct rwkv_executor * executor) {
+    std::deque<struct rwkv_async *> queue;
+
+    {
+        std::lock_guard<std::mutex> lock(executor->mutex);
+        executor->stopping = true;
+        queue.swap(executor->queue);
+    }
+
+    executor->condition.notify_all();
+
+    for (struct rwkv_async * handle : queue) {
+        if (rwkv_async_claim(handle)) {
+            rwkv_async_complete(handle, RWKV_ASYNC_CANCELLED);
+        }
+
+        rwkv_async_release(handle);
+    }
+
+    for (std::thread & worker : executor->workers) {
+        worker.join();
+    }
+
+#if !defined(_WIN32)
+    if (executor->read_fd >= 0) {
+        close(executor->read_fd);
+    }
+
+    if (executor->write_fd >= 0 && executor->write_fd != executor->read_fd) {
+        close(executor->write_fd);
+    }
+#endif
+
+    delete executor;
+}
+
+struct rwkv_async * rwkv_async_submit(
+    struct rwkv_executor * executor,
+    struct rwkv_context * ctx,
+    std::function<bool()> && eval,
+    rwkv_async_callback callback,
+    void * user_data
+) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    bool busy = false;
+    RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_ARGS, NULL, ctx->async_busy.compare_exchange_strong(busy, true), "Context already has an asynchronous evaluation in progress");
+
+    struct rwkv_async * handle = new(std::nothrow) struct rwkv_async();
+
+    if (!handle) {
+        ctx->async_busy = false;
+        RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_ALLOC, NULL, false, "Failed to allocate asynchronous evaluation");
+    }
+
+    handle->executor = executor;
+    handle->ctx = ctx;
+    handle->eval = std::move(eval);
+    handle->callback = callback;
+    handle->user_data = user_data;
+    handle->status = RWKV_ASYNC_PENDING;
+    // One reference for the caller, one for the executor queue.
+    handle->references = 2;
+
+    {
+        std::lock_guard<std::mutex> lock(executor->mutex);
+
+        if (!executor->stopping) {
+            executor->queue.push_back(handle);
+            executor->condition.notify_one();
+            return handle;
+        }
+    }
+
+    // The executor is being freed; evaluations queued at this point would never run.
+    rwkv_async_claim(handle);
+    rwkv_async_complete(handle, RWKV_ASYNC_CANCELLED);
+    rwkv_async_release(handle);
+    return handle;
+}
+
+struct rwkv_async * rwkv_eval_async(
+    struct rwkv_executor * executor,
+    struct rwkv_context * ctx,
+    const uint32_t token,
+    const float * state_in,
+    float * state_out,
+    float * logits_out,
+    rwkv_async_callback callback,
+    void * user_data
+) {
+    return rwkv_async_submit(executor, ctx, [=]() {
+        return rwkv_eval(ctx, token, state_in, state_out, logits_out);
+    }, callback, user_data);
+}
+
+struct rwkv_async * rwkv_eval_sequence_async(
+    struct rwkv_executor * executor,
+    struct rwkv_context * ctx,
+    const uint32_t * tokens,
+    const size_t sequence_len,
+    const float * state_in,
+    float * state_out,
+    float * logits_out,
+    rwkv_async_callback callback,
+    void * user_data
+) {
+    // An empty vector means that only the graph is built, same as passing NULL to rwkv_eval_sequence.
+    std::vector<uint32_t> copy;
+
+    if (tokens) {
+        copy.assign(tokens, tokens + sequence_len);
+    }
+
+    return rwkv_async_submit(executor, ctx, [=]() {
+        return rwkv_eval_sequence(ctx, copy.empty() ? NULL : copy.data(), sequence_len, state_in, state_out, logits_out);
+    }, callback, user_data);
+}
+
+enum rwkv_async_status rwkv_async_get_status(const struct rwkv_async * handle) {
+    return (enum rwkv_async_status) handle->status.load();
+}
+
+enum rwkv_async_status rwkv_async_wait(struct rwkv_async * handle) {
+    std::unique_lock<std::mutex> lock(handle->mutex);
+    handle->finished.wait(lock, [&] { return handle->status >= RWKV_ASYNC_DONE; });
+    return (enum rwkv_async_status) handle->status.load();
+}
+
+bool rwkv_async_cancel(struct rwkv_async * handle) {
+    if (!rwkv_async_claim(handle)) {
+        return false;
+    }
+
+    rwkv_async_complete(handle, RWKV_ASYNC_CANCELLED);
+    return true;
+}
+
+void rwkv_async_free(struct rwkv_async * handle) {
+    rwkv_async_cancel(handle);
+    rwkv_async_release(handle);
+}
+
+// --- Scheduler ---
+
+struct rwkv_scheduled_session {
+    uint64_t id;
+    std::vector<uint32_t> tokens;
+    // Count of tokens already evaluated.
+    size_t position;
+    float * state;
+    float * logits;
+    // If true, logits has a row for every token, and every chunk writes its rows.
+    bool per_token;
+    // If non-NULL, the last chunk is evaluated with rwkv_eval_sequence_embed instead of computing logits.
+    float * embedding;
+};
+
+struct rwkv_scheduler {
+    std::vector<struct rwkv_context *> contexts;
+    // One worker per context, so that all steps of an iteration run in parallel.
+    struct rwkv_executor * executor = NULL;
+    size_t batch_tokens;
+    size_t chunk_len;
+    rwkv_scheduler_callback callback;
+    void * user_data;
+
+    // Sessions in round-robin order: stepped sessions move to the back, so sessions left out are considered first next time.
+    std::list<struct rwkv_scheduled_session> sessions;
+    std::unordered_map<uint64_t, std::list<struct rwkv_scheduled_session>::iterator> index;
+    // Whether the next iteration that can not fit both decoding and prefill gives its contexts to prefill.
+    bool prefill_turn = false;
+
+    ~rwkv_scheduler() {
+        if (executor) {
+            rwkv_executor_free(executor);
+        }
+    }
+};
+
+struct rwkv_scheduler_step_entry {
+    std::list<struct rwkv_scheduled_session>::iterator session;
+    size_t len;
+    bool decode;
+    struct rwkv_context * ctx;
+    struct rwkv_async * handle;
+};
+
+// Whether the step is evaluated with a sequence graph, and with which outputs; single tokens of logits sessions use the serial graph.
+bool rwkv_scheduler_step_graph(const struct rwkv_scheduled_session & session, const size_t len, enum rwkv_sequence_outputs & outputs) {
+    outputs = session.embedding ? RWKV_SEQUENCE_EMBEDDINGS : session.per_token ? RWKV_SEQUENCE_PER_TOKEN : RWKV_SEQUENCE_LOGITS;
+    return len > 1 || session.embedding;
+}
+
+struct rwkv_scheduler * rwkv_scheduler_new(
+    struct rwkv_context ** contexts,
+    const size_t n_contexts,
+    const size_t batch_tokens,
+    const size_t chunk_len,
+    rwkv_scheduler_callback callback,
+    void * user_data
+) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ARGS, contexts && n_contexts > 0, "Scheduler needs at least one context");
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ARGS, batch_tokens > 0 && chunk_len > 0, "Batch size and chunk length must be positive");
+
+    for (size_t i = 0; i < n_contexts; i++) {
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ARGS, contexts[i], "Context %zu is NULL", i);
+        RWKV_ASSERT_NULL_MSG(
+            RWKV_ERROR_ARGS | RWKV_ERROR_DIMENSION,
+            rwkv_get_state_len(contexts[i]) == rwkv_get_state_len(contexts[0]) && rwkv_get_logits_len(contexts[i]) == rwkv_get_logits_len(contexts[0]),
+            "Context %zu has a different model",
+            i
+        );
+    }
+
+    std::unique_ptr<struct rwkv_scheduler> scheduler(new(std::nothrow) struct rwkv_scheduler());
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ALLOC, scheduler, "Failed to allocate scheduler");
+
+    scheduler->contexts.assign(contexts, contexts + n_contexts);
+    scheduler->batch_tokens = batch_tokens;
+    // Chunks are never cut to fit the budget, so a longer chunk would never be scheduled.
+    scheduler->chunk_len = std::min(chunk_len, batch_tokens);
+    scheduler->callback = callback;
+    scheduler->user_data = user_data;
+
+    RWKV_ENSURE_OR_NULL(scheduler->executor = rwkv_executor_new((uint32_t) n_contexts));
+
+    return scheduler.release();
+}
+
+void rwkv_scheduler_free(struct rwkv_scheduler * scheduler) {
+    delete scheduler;
+}
+
+bool rwkv_scheduler_add(
+    struct rwkv_scheduler * scheduler,
+    const uint64_t session_id,
+    const uint32_t * tokens,
+    const size_t n_tokens,
+    float * state,
+    float * logits_out,
+    const bool per_token,
+    float * embedding_out
+) {
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ARGS, tokens && n_tokens > 0, "Session has no tokens");
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ARGS, state, "Session has no state buffer");
+    RWKV_ASSERT_FALSE_MSG(
+        RWKV_ERROR_ARGS | RWKV_ERROR_KEY,
+        scheduler->index.find(session_id) == scheduler->index.end(),
+        "Session %" PRIu64 " is already in the scheduler",
+        session_id
+    );
+
+    struct rwkv_scheduled_session session;
+    session.id = session_id;
+    session.tokens.assign(tokens, tokens + n_tokens);
+    session.position = 0;
+    session.state = state;
+    session.logits = logits_out;
+    session.per_token = per_token;
+    session.embedding = embedding_out;
+
+    scheduler->sessions.push_back(std::move(session));
+    scheduler->index[session_id] = std::prev(scheduler->sessions.end());
+
+    return true;
+}
+
+bool rwkv_scheduler_submit(
+    struct rwkv_scheduler * scheduler,
+    const uint64_t session_id,
+    const uint32_t * tokens,
+    const size_t n_tokens,
+    float * state,
+    float * logits_out
+) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    return rwkv_scheduler_add(scheduler, session_id, tokens, n_tokens, state, logits_out, false, NULL);
+}
+
+bool rwkv_scheduler_submit_per_token(
+    struct rwkv_scheduler * scheduler,
+    const uint64_t session_id,
+    const uint32_t * tokens,
+    const size_t n_tokens,
+    float * state,
+    float * logits_out
+) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ARGS, logits_out, "Session has no logits buffer");
+
+    return rwkv_scheduler_add(scheduler, session_id, tokens, n_tokens, state, logits_out, true, NULL);
+}
+
+bool rwkv_scheduler_submit_embed(
+    struct rwkv_scheduler * scheduler,
+    const uint64_t session_id,
+    const uint32_t * tokens,
+    const size_t n_tokens,
+    float * state,
+    float * embedding_out
+) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ARGS, embedding_out, "Session has no embedding buffer");
+
+    return rwkv_scheduler_add(scheduler, session_id, tokens, n_tokens, state, NULL, false, embedding_out);
+}
+
+bool rwkv_scheduler_cancel(struct rwkv_scheduler * scheduler, const uint64_t session_id) {
+    auto entry = scheduler->index.find(session_id);
+
+    if (entry == scheduler->index.end()) {
+        return false;
+    }
+
+    scheduler->sessions.erase(entry->second);
+    scheduler->index.erase(entry);
+    return true;
+}
+
+size_t rwkv_scheduler_get_n_sessions(const struct rwkv_scheduler * scheduler) {
+    return scheduler->sessions.size();
+}
+
+bool rwkv_scheduler_step(struct rwkv_scheduler * scheduler, struct rwkv_scheduler_stats * stats) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    const int64_t start_us = rwkv_time_us();
+
+    std::vector<struct rwkv_scheduler_step_entry> steps;
+    size_t budget = scheduler->batch_tokens;
+
+    bool decoding = false;
+    size_t prefill_len = 0;
+
+    for (const struct rwkv_scheduled_session & session : scheduler->sessions) {
+        const size_t remaining = session.tokens.size() - session.position;
+
+        if (remaining == 1) {
+            decoding = true;
+        } else if (prefill_len == 0) {
+            prefill_len = std::min(remaining, scheduler->chunk_len);
+        }
+    }
+
+    // Decoding sessions are taken first: a single token each keeps their latency low, whatever the prompts in flight.
+    // Prefill chunks fill the rest of the budget. A context and the first waiting chunk are kept for prefill, so that
+    // new prompts start while many sessions decode; when that would leave nothing for decoding, the two take turns.
+    size_t decode_contexts = scheduler->contexts.size();
+    size_t reserved = 0;
+
+    if (decoding && prefill_len > 0) {
+        if (scheduler->contexts.size() > 1 && budget > prefill_len) {
+            decode_contexts--;
+            reserved = prefill_len;
+        } else {
+            decode_contexts = scheduler->prefill_turn ? 0 : decode_contexts;
+            scheduler->prefill_turn = !scheduler->prefill_turn;
+        }
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        const bool decode = pass == 0;
+        const size_t max_steps = decode ? decode_contexts : scheduler->contexts.size();
+        const size_t min_budget = decode ? reserved : 0;
+
+        for (auto it = scheduler->sessions.begin(); it != scheduler->sessions.end(); ++it) {
+            if (steps.size() == max_steps || budget == min_budget) {
+                break;
+            }
+
+            const size_t remaining = it->tokens.size() - it->position;
+
+            if ((remaining == 1) != decode) {
+                continue;
+            }
+
+            // Chunks are not cut to fill the budget, so that every context sees few distinct lengths and reuses their graphs.
+            // A chunk that does not fit waits at the front of the order, while shorter ones may still fill the budget.
+            const size_t len = std::min(remaining, scheduler->chunk_len);
+
+            if (len > budget) {
+                continue;
+            }
+
+            steps.push_back({ it, len, decode, NULL, NULL });
+            budget -= len;
+        }
+    }
+
+    struct rwkv_scheduler_stats iteration = {};
+    iteration.waiting_sessions = scheduler->sessions.size() - steps.size();
+
+    // Steps go to contexts that already have a graph for them, then the rest to any free context.
+    std::vector<bool> busy(scheduler->contexts.size(), false);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (struct rwkv_scheduler_step_entry & step : steps) {
+            enum rwkv_sequence_outputs outputs;
+            const bool sequence = rwkv_scheduler_step_graph(*step.session, step.len, outputs);
+
+            for (size_t i = 0; i < scheduler->contexts.size() && !step.ctx; i++) {
+                if (!busy[i] && (pass == 1 || (sequence && rwkv_has_sequence_graph(scheduler->contexts[i], step.len, outputs)))) {
+                    busy[i] = true;
+                    step.ctx = scheduler->contexts[i];
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < steps.size(); i++) {
+        struct rwkv_context * ctx = steps[i].ctx;
+        const struct rwkv_scheduled_session & session = *steps[i].session;
+        const uint32_t * tokens = session.tokens.data() + session.position;
+        const size_t len = steps[i].len;
+        float * state = session.state;
+        const bool last = session.position + len == session.tokens.size();
+        const bool per_token = session.per_token;
+        // Logits of intermediate chunks are never read, unless every token has its row.
+        float * logits = per_token ? session.logits + session.position * rwkv_get_logits_len(ctx) : last ? session.logits : NULL;
+        // All chunks of embedding sessions use the embedding graph, so that their context does not switch graphs.
+        const bool embed = session.embedding != NULL;
+        float * embedding = last ? session.embedding : NULL;
+
+        // Tokens of the session are not modified until the step is waited for, so they are not copied.
+        steps[i].handle = rwkv_async_submit(scheduler->executor, ctx, [=]() {
+            if (embed) {
+                return rwkv_eval_sequence_embed(ctx, tokens, len, state, state, embedding, false);
+            }
+
+            if (per_token && len > 1) {
+                // The graph computing rows of every token also writes the state after the last one.
+                RWKV_ENSURE_OR_FALSE(rwkv_eval_sequence_per_token(ctx, tokens, len, state, logits, NULL));
+                rwkv_get_outputs(ctx, state, NULL);
+                return true;
+            }
+
+            return len == 1 ? rwkv_eval(ctx, tokens[0], state, state, logits) : rwkv_eval_sequence(ctx, tokens, len, state, state, logits);
+        }, NULL, NULL);
+    }
+
+    std::vector<std::pair<uint64_t, bool>> finished;
+    bool success = true;
+
+    for (struct rwkv_scheduler_step_entry & step : steps) {
+        const bool done = step.handle && rwkv_async_wait(step.handle) == RWKV_ASYNC_DONE;
+
+        if (step.handle) {
+            rwkv_async_free(step.handle);
+        }
+
+        struct rwkv_scheduled_session & session = *step.session;
+
+        if (done) {
+            session.position += step.len;
+            iteration.tokens += step.len;
+            (step.decode ? iteration.decode_sessions : iteration.prefill_sessions)++;
+        }
+
+        if (!done || session.position == session.tokens.size()) {
+            finished.push_back(std::make_pair(session.id, done));
+            scheduler->index.erase(session.id);
+            scheduler->sessions.erase(step.session);
+        } else {
+            scheduler->sessions.splice(scheduler->sessions.end(), scheduler->sessions, step.session);
+        }
+
+        success = success && done;
+    }
+
+    iteration.duration_us = rwkv_time_us() - start_us;
+
+    if (stats) {
+        *stats = iteration;
+    }
+
+    // Sessions are already removed, so the callback can submit them again.
+    if (scheduler->callback) {
+        for (const std::pair<uint64_t, bool> & session : finished) {
+            scheduler->callback(session.first, session.second, scheduler->user_data);
+        }
+    }
+
+    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX, success, "Evaluation of a scheduled session failed, see errors of its context");
+
+    return true;
+}
+
+// Provided for compatibility.
+extern "C" RWKV_API uint32_t rwkv_get_state_buffer_element_count(const struct rwkv_context * ctx) {
+    return rwkv_get_state_len(ctx);
+}
+
+// Provided for compatibility.
+extern "C" RWKV_API uint32_t rwkv_get_logits_buffer_element_count(const struct rwkv_context * ctx) {
+    return rwkv_get_logits_len(ctx);
+}
+
+size_t rwkv_get_n_vocab(const struct rwkv_context * ctx) {
+    return (size_t) ctx->instance->model.header.n_vocab;
+}
+
+size_t rwkv_get_n_embed(const struct rwkv_context * ctx) {
+    return (size_t) ctx->instance->model.header.n_embed;
+}
+
+size_t rwkv_get_n_layer(const struct rwkv_context * ctx) {
+    return (size_t) ctx->instance->model.header.n_layer;
+}
+
+size_t rwkv_get_state_len(const struct rwkv_context * ctx) {
+    const struct rwkv_file_header & header = ctx->instance->model.header;
+    return (size_t) header.n_embed * 5 * (size_t) header.n_layer;
+}
+
+size_t rwkv_get_logits_len(const struct rwkv_context * ctx) {
+    return (size_t) ctx->instance->model.header.n_vocab;
+}
+
+size_t rwkv_get_model_size(const struct rwkv_context * ctx) {
+    return ctx->instance->ctx.size;
+}
+
+size_t rwkv_get_context_size(const struct rwkv_context * ctx, const uint32_t n_threads) {
+    // Measuring does not modify the context, but walks adapters of the model with non-const helpers.
+    struct rwkv_context * mutable_ctx = const_cast<struct rwkv_context *>(ctx);
+    return rwkv_context_base_size(ctx) + rwkv_graph_size(rwkv_measure_serial_graph(mutable_ctx, n_threads));
+}
+
+size_t rwkv_get_sequence_graph_size(const struct rwkv_context * ctx, const size_t sequence_len) {
+    struct rwkv_context * mutable_ctx = const_cast<struct rwkv_context *>(ctx);
+    return rwkv_graph_size(rwkv_measure_sequence_graph(mutable_ctx, sequence_len));
+}
+
+void rwkv_set_memory_limit(struct rwkv_context * ctx, const size_t limit) {
+    ctx->memory_limit = limit;
+}
+
+bool rwkv_set_cpu_affinity(struct rwkv_context * ctx, const uint32_t * cpus, const size_t n_cpus) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    std::vector<uint32_t> affinity;
+
+    if (cpus) {
+        affinity.assign(cpus, cpus + n_cpus);
+    }
+
+#if defined(__linux__)
+    // Check that the CPUs can actually be used, so that errors are reported here and not ignored on each evaluation.
+    if (!affinity.empty()) {
+        const struct rwkv_affinity_guard guard(affinity);
+        RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, guard.pinned, "Failed to pin threads to the given %zu CPUs", n_cpus);
+    }
+#else
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, affinity.empty(), "CPU affinity is only supported on Linux");
+#endif
+
+    ctx->cpu_affinity = std::move(affinity);
+    return true;
+}
+
+// Copies all tensors of the source instance into a new weight buffer. Pages of the buffer are first touched by the calling thread.
+bool rwkv_instance_copy(const struct rwkv_instance & source, struct rwkv_instance & copy) {
+    struct rwkv_future_ctx future_ctx;
+
+    for (const auto & pair : source.parameters) {
+#ifdef GGML_USE_CUBLAS
+        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, pair.second->backend == GGML_BACKEND_CPU, "Model weights offloaded to GPU can not be copied");
+#endif
+        future_ctx.alloc(pair.second->type, pair.second->ne[0], pair.second->ne[1]);
+    }
+
+    // Interleaving would defeat the purpose of the copy, which is to keep all weights on a single node.
+    const uint32_t flags = source.flags & ~RWKV_INIT_NUMA_INTERLEAVE;
+
+    struct rwkv_ggml_context ctx;
+    RWKV_ENSURE_OR_FALSE(rwkv_weights_context(future_ctx, flags, ctx));
+
+    std::unordered_map<std::string, struct ggml_tensor *> parameters;
+
+    for (const auto & pair : source.parameters) {
+        const struct ggml_tensor * tensor = pair.second;
+        struct ggml_tensor * tensor_copy = ggml_new_tensor(ctx.ctx, tensor->type, tensor->n_dims, tensor->ne);
+        ggml_set_name(tensor_copy, pair.first.c_str());
+        memcpy(tensor_copy->data, tensor->data, ggml_nbytes(tensor));
+        parameters[pair.first] = tensor_copy;
+    }
+
+    struct rwkv_model model;
+    model.header = source.model.header;
+    model.ln0_folded = source.model.ln0_folded;
+
+    RWKV_ASSERT_FALSE(RWKV_ERROR_MODEL_PARAMS | RWKV_ERROR_PARAM_MISSING, rwkv_set_params(model, [&](const char * key, struct ggml_tensor *& dest) {
+        dest = parameters[key];
+        return dest != NULL;
+    }));
+
+    RWKV_ENSURE_OR_FALSE(rwkv_lock_weights(ctx, future_ctx.scratch_size, flags));
+
+    copy.ctx = std::move(ctx);
+    copy.model = std::move(model);
+    copy.ffn_key_size = source.ffn_key_size;
+    copy.parameters = std::move(parameters);
+    copy.flags = flags;
+    copy.fingerprint = source.fingerprint;
+    // The copy holds the same weights, so adapters validated against the source apply to it.
+    copy.id = source.id;
+    return true;
+}
+
+struct rwkv_context * rwkv_clone_context_to_numa_node(struct rwkv_context * ctx, const uint32_t n_threads, const uint32_t node) {
+    global_last_error = RWKV_ERROR_NONE;
+
+#if defined(__linux__)
+    if (ctx->memory_limit) {
+        // Checked before copying the weights, which are the largest allocation.
+        const size_t clone_size = rwkv_get_context_size(ctx, n_threads) + rwkv_get_model_size(ctx);
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, clone_size <= ctx->memory_limit,
+            "Cloned context and its copy of weights need %zu bytes, which exceeds the memory limit of %zu bytes", clone_size, ctx->memory_limit);
+    }
+
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%" PRIu32 "/cpulist", node);
+
+    std::vector<uint32_t> cpus;
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ARGS, rwkv_read_cpu_list(path, cpus), "Failed to read CPUs of NUMA node %" PRIu32, node);
+
+    std::shared_ptr<struct rwkv_instance> instance(new(std::nothrow) struct rwkv_instance());
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, instance, "Failed to allocate instance");
+
+    {
+        // With the default memory policy, pages are placed on the node of the thread that first touches them.
+        const struct rwkv_affinity_guard guard(cpus);
+        RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ARGS, guard.pinned, "Failed to pin the thread to CPUs of NUMA node %" PRIu32, node);
+        RWKV_ENSURE_OR_NULL(rwkv_instance_copy(*ctx->instance, *instance));
+    }
+
+    struct rwkv_context * clone = rwkv_new_context_impl(instance, n_threads);
+
+    if (clone) {
+        clone->print_errors = ctx->print_errors;
+        clone->memory_limit = ctx->memory_limit;
+        clone->thread_budget = ctx->thread_budget;
+        clone->sequence_n_threads = ctx->sequence_n_threads;
+        clone->cpu_affinity = std::move(cpus);
+
+        if (ctx->adapted.lora && !rwkv_set_lora(clone, ctx->adapted.lora)) {
+            rwkv_free(clone);
+            return NULL;
+        }
+    }
+
+    return clone;
+#else
+    (void) ctx;
+    (void) n_threads;
+    (void) node;
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, false, "NUMA placement is only supported on Linux");
+#endif
+}
+
+bool rwkv_set_n_threads(struct rwkv_context * ctx, const enum rwkv_eval_mode mode, const uint32_t n_threads) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, n_threads > 0, "Thread count must be positive");
+
+    switch (mode) {
+        case RWKV_EVAL_SERIAL:
+            // The work buffer of the serial graph is sized for ctx->n_threads, so only more threads need a new graph.
+            if (n_threads > ctx->n_threads) {
+                const uint32_t previous_n_threads = ctx->n_threads;
+                ctx->n_threads = n_threads;
+                ctx->serial_n_threads = n_threads;
+
+                if (!rwkv_measure_and_build_serial_graph(ctx)) {
+                    ctx->n_threads = previous_n_threads;
+                    ctx->serial_n_threads = ctx->serial_graph.n_threads;
+                    return false;
+                }
+            }
+
+            ctx->serial_n_threads = n_threads;
+            ctx->serial_graph.n_threads = n_threads;
+            return true;
+        case RWKV_EVAL_SEQUENCE:
+            // Work buffers of sequence graphs are allocated for the thread count they were built with.
+            // Graphs built for fewer threads are rebuilt on the next call.
+            if (n_threads > ctx->sequence_n_threads) {
+                rwkv_clear_sequence_graphs(ctx);
+            }
+
+            ctx->sequence_n_threads = n_threads;
+            ctx->sequence_graph.n_threads = n_threads;
+
+            for (struct rwkv_spare_sequence_graph & spare : ctx->spare_sequence_graphs) {
+                spare.graph.n_threads = n_threads;
+            }
+
+            return true;
+        default:
+            RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, false, "Unknown evaluation mode %d", mode);
+    }
+}
+
+uint32_t rwkv_get_n_threads(const struct rwkv_context * ctx, const enum rwkv_eval_mode mode) {
+    return mode == RWKV_EVAL_SERIAL ? ctx->serial_n_threads : ctx->sequence_n_threads;
+}
+
+bool rwkv_tune_n_threads(struct rwkv_context * ctx, const enum rwkv_eval_mode mode, const uint32_t max_threads, const size_t sequence_len) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, mode == RWKV_EVAL_SERIAL || sequence_len > 0, "Sequence length must be positive");
+
+    const uint32_t limit = max_threads ? max_threads : std::max(std::thread::hardware_concurrency(), 1U);
+
+    // Powers of two, and the limit itself.
+    std::vector<uint32_t> candidates;
+
+    for (uint32_t n_threads = 1; n_threads < limit; n_threads *= 2) {
+        candidates.push_back(n_threads);
+    }
+
+    candidates.push_back(limit);
+
+    // Token 0 is valid in every vocabulary; the values do not affect the speed.
+    const std::vector<uint32_t> tokens(mode == RWKV_EVAL_SERIAL ? 1 : sequence_len, 0);
+    std::vector<float> logits(ctx->instance->model.header.n_vocab);
+
+    uint32_t best_n_threads = 0;
+    int64_t best_us = INT64_MAX;
+
+    for (const uint32_t n_threads : candidates) {
+        RWKV_ENSURE_OR_FALSE(rwkv_set_n_threads(ctx, mode, n_threads));
+
+        int64_t fastest_us = INT64_MAX;
+
+        // The first run builds the graph and warms up caches, and is not measured.
+        for (size_t run = 0; run <= RWKV_TUNE_RUNS; run++) {
+            const int64_t start_us = rwkv_time_us();
+
+            if (mode == RWKV_EVAL_SERIAL) {
+                RWKV_ENSURE_OR_FALSE(rwkv_eval(ctx, tokens[0], NULL, NULL, logits.data()));
+            } else {
+                RWKV_ENSURE_OR_FALSE(rwkv_eval_sequence(ctx, tokens.data(), sequence_len, NULL, NULL, logits.data()));
+            }
+
+            if (run > 0) {
+                fastest_us = std::min(fastest_us, rwkv_time_us() - start_us);
+            }
+        }
+
+        if (fastest_us < best_us) {
+            best_us = fastest_us;
+            best_n_threads = n_threads;
+        }
+    }
+
+    return rwkv_set_n_threads(ctx, mode, best_n_threads);
+}
+
+struct rwkv_thread_budget * rwkv_thread_budget_new(const uint32_t n_threads) {
+    global_last_error = RWKV_ERROR_NONE;
+
+    struct rwkv_thread_budget * budget = new(std::nothrow) struct rwkv_thread_budget();
+    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_ALLOC, budget, "Failed to allocate thread budget");
+    budget->available = n_threads ? n_threads : std::max(std::thread::hardware_concurrency(), 1U);
+    return budget;
+}
+
+void rwkv_thread_budget_free(struct rwkv_thread_budget * budget) {
+    delete budget;
+}
+
+void rwkv_set_thread_budget(struct rwkv_context * ctx, struct rwkv_thread_budget * budget) {
+    ctx->thread_budget = budget;
+}
+
+void rwkv_init_state(const struct rwkv_context * ctx, float * state) {
+    const struct rwkv_file_header & header = ctx->instance->model.header;
+    const size_t layer_size = (size_t) header.n_embed * 5;
+    const size_t layer_zero = (size_t) header.n_embed * 4;
+    const size_t layers_size = (size_t) header.n_layer * layer_size;
+
+    for (size_t start = 0; start < layers_size; start += layer_size) {
+        for (size_t i = 0; i < layer_zero; i++) {
+            state[start + i] = 0.0F;
+        }
+
+        for (size_t i = layer_zero; i < layer_size; i++) {
+            state[start + i] = -1e30F;
+        }
+    }
+}
+
+// --- State serialization ---
 
-    RWKV_ASSERT_NULL(RWKV_ERROR_GRAPH, rwkv_build_serial_graph(
-        serial_graph.ctx.ctx, instance->model,
-        serial_graph.tokens, inputs.get(), outputs.get(), logits,
-        serial_graph.cgraph.get(),
-        &serial_graph.pre_logits_nodes, &serial_graph.pre_logits_leafs, &serial_graph.post_logits_nodes, &serial_graph.post_logits_leafs
-    ));
+#define RWKV_STATE_MAGIC 0x72777374
+#define RWKV_STATE_VERSION 1
+#define RWKV_STATE_BLOCK_SIZE 32
 
-    std::unique_ptr<struct rwkv_context> rwkv_ctx(new(std::nothrow) struct rwkv_context());
-    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, rwkv_ctx, "Failed to allocate rwkv_context");
-    rwkv_ctx->instance = std::move(instance);
-    rwkv_ctx->ctx = std::move(ctx);
-    rwkv_ctx->input_state = input;
-    rwkv_ctx->input_layers = std::move(inputs);
-    rwkv_ctx->output_state = output;
-    rwkv_ctx->output_layers = std::move(outputs);
-    rwkv_ctx->logits = logits;
-    rwkv_ctx->n_threads = n_threads;
-    rwkv_ctx->serial_graph = std::move(serial_graph);
-    rwkv_ctx->last_error = RWKV_ERROR_NONE;
-    rwkv_ctx->print_errors = global_print_errors;
-    return rwkv_ctx.release();
+struct rwkv_state_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_embed;
+    uint32_t n_layer;
+    uint32_t encoding;
+    uint32_t reserved;
+    uint64_t fingerprint;
+};
+
+// How a single part of a layer state is stored.
+enum rwkv_state_format {
+    STATE_FP32,
+    STATE_FP16,
+    // Blocks of RWKV_STATE_BLOCK_SIZE int8 values, each preceded by an FP32 scale; the last block may be shorter.
+    STATE_Q8
+};
+
+bool rwkv_state_encoding_is_valid(const uint32_t encoding) {
+    return encoding == RWKV_STATE_FP32 || encoding == RWKV_STATE_FP16 || encoding == RWKV_STATE_Q8;
 }
 
-struct rwkv_context * rwkv_init_from_file(const char * file_path, const uint32_t n_threads) {
-    global_last_error = RWKV_ERROR_NONE;
+// Parts of a layer state are ffn_xx, att_xx, att_aa, att_bb and att_pp, in this order.
+enum rwkv_state_format rwkv_state_part_format(const uint32_t encoding, const size_t part) {
+    switch (part) {
+        case 0:
+        case 1:
+            return encoding == RWKV_STATE_FP32 ? STATE_FP32 : STATE_FP16;
+        case 2:
+        case 3:
+            return encoding == RWKV_STATE_Q8 ? STATE_Q8 : STATE_FP32;
+        default:
+            return STATE_FP32;
+    }
+}
 
-    std::shared_ptr<struct rwkv_instance> instance(new(std::nothrow) struct rwkv_instance());
-    RWKV_ASSERT_NULL_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, instance, "Failed to allocate instance");
-    RWKV_ENSURE_OR_NULL(rwkv_instance_from_file(file_path, *instance.get()));
-    return rwkv_new_context_impl(instance, n_threads);
+size_t rwkv_state_part_size(const enum rwkv_state_format format, const size_t n_embed) {
+    switch (format) {
+        case STATE_FP16:
+            return n_embed * sizeof(ggml_fp16_t);
+        case STATE_Q8:
+            return (n_embed + RWKV_STATE_BLOCK_SIZE - 1) / RWKV_STATE_BLOCK_SIZE * sizeof(float) + n_embed;
+        default:
+            return n_embed * sizeof(float);
+    }
 }
 
-struct rwkv_context * rwkv_clone_context(struct rwkv_context * ctx, const uint32_t n_threads) {
-    struct rwkv_context * clone = rwkv_new_context_impl(ctx->instance, n_threads);
+size_t rwkv_state_payload_size(const struct rwkv_file_header & header, const uint32_t encoding) {
+    size_t size = 0;
 
-    if (clone) {
-        clone->print_errors = ctx->print_errors;
+    for (size_t part = 0; part < 5; part++) {
+        size += rwkv_state_part_size(rwkv_state_part_format(encoding, part), header.n_embed);
     }
 
-    return clone;
+    return size * header.n_layer;
 }
 
-bool rwkv_gpu_offload_layers(struct rwkv_context * ctx, const uint32_t n_layers) {
-#ifdef GGML_USE_CUBLAS
-    const auto offload = [&](struct ggml_tensor * tensor) {
-        // TODO support multi-GPU
-        tensor->backend = GGML_BACKEND_GPU;
-        ggml_cuda_transform_tensor(tensor->data, tensor);
-    };
+// Output is not aligned, so all values are written with memcpy.
+uint8_t * rwkv_state_encode(const enum rwkv_state_format format, const float * src, const size_t n, uint8_t * out) {
+    switch (format) {
+        case STATE_FP16:
+            for (size_t i = 0; i < n; i++) {
+                const ggml_fp16_t value = ggml_fp32_to_fp16(src[i]);
+                memcpy(out + i * sizeof(value), &value, sizeof(value));
+            }
 
-    const size_t n_gpu = std::min(n_layers, ctx->instance->model.header.n_layer);
+            break;
+        case STATE_Q8:
+            for (size_t start = 0; start < n; start += RWKV_STATE_BLOCK_SIZE) {
+                const size_t end = std::min(start + RWKV_STATE_BLOCK_SIZE, n);
+                float max = 0.0F;
 
-    if (ctx->gpu_layers < n_gpu) {
-        for (size_t & i = ctx->gpu_layers; i < n_gpu; i++) {
-            const struct rwkv_layer & layer = ctx->instance->model.layers[i];
+                for (size_t i = start; i < end; i++) {
+                    max = std::max(max, fabsf(src[i]));
+                }
 
-            // TODO also offload other operations to GPU with ggml_cuda_assign_buffers
-            offload(layer.att_key);
-            offload(layer.att_value);
-            offload(layer.att_receptance);
-            offload(layer.att_output);
+                const float scale = max / 127.0F;
+                const float inverse_scale = scale != 0.0F ? 1.0F / scale : 0.0F;
+                memcpy(out, &scale, sizeof(scale));
+                out += sizeof(scale);
 
-            offload(layer.ffn_key);
-            offload(layer.ffn_value);
-            offload(layer.ffn_receptance);
-        }
+                for (size_t i = start; i < end; i++) {
+                    *out++ = (uint8_t) (int8_t) roundf(src[i] * inverse_scale);
+                }
+            }
 
-        return true;
+            return out;
+        default:
+            memcpy(out, src, n * sizeof(float));
+            break;
     }
-#endif
-    return false;
+
+    return out + rwkv_state_part_size(format, n);
 }
 
-void rwkv_set_inputs(const struct rwkv_context * ctx, const float * state_in) {
-    if (state_in) {
-        memcpy(ctx->input_state->data, state_in, ggml_nbytes(ctx->input_state));
-    } else {
-        rwkv_init_state(ctx, (float *) ctx->input_state->data);
+const uint8_t * rwkv_state_decode(const enum rwkv_state_format format, const uint8_t * in, const size_t n, float * dest) {
+    switch (format) {
+        case STATE_FP16:
+            for (size_t i = 0; i < n; i++) {
+                ggml_fp16_t value;
+                memcpy(&value, in + i * sizeof(value), sizeof(value));
+                dest[i] = ggml_fp16_to_fp32(value);
+            }
+
+            break;
+        case STATE_Q8:
+            for (size_t start = 0; start < n; start += RWKV_STATE_BLOCK_SIZE) {
+                const size_t end = std::min(start + RWKV_STATE_BLOCK_SIZE, n);
+                float scale;
+                memcpy(&scale, in, sizeof(scale));
+                in += sizeof(scale);
+
+                for (size_t i = start; i < end; i++) {
+                    dest[i] = (float) (int8_t) *in++ * scale;
+                }
+            }
+
+            return in;
+        default:
+            memcpy(dest, in, n * sizeof(float));
+            break;
     }
+
+    return in + rwkv_state_part_size(format, n);
 }
 
-void rwkv_get_outputs(const struct rwkv_context * ctx, float * state_out, float * logits_out) {
-    if (state_out) {
-        memcpy(state_out, ctx->output_state->data, ggml_nbytes(ctx->output_state));
+size_t rwkv_state_serialized_size(const struct rwkv_context * ctx, const enum rwkv_state_encoding encoding) {
+    if (!rwkv_state_encoding_is_valid(encoding)) {
+        return 0;
     }
 
-    if (logits_out) {
-        memcpy(logits_out, ctx->logits->data, ggml_nbytes(ctx->logits));
-    }
+    return sizeof(struct rwkv_state_header) + rwkv_state_payload_size(ctx->instance->model.header, encoding);
 }
 
-bool rwkv_eval(struct rwkv_context * ctx, const uint32_t token, const float * state_in, float * state_out, float * logits_out) {
+bool rwkv_state_serialize(struct rwkv_context * ctx, const float * state, const enum rwkv_state_encoding encoding, void * buffer, const size_t buffer_size) {
     ctx->last_error = RWKV_ERROR_NONE;
 
-    const struct rwkv_file_header & header = ctx->instance->model.header;
-    const size_t n_vocab = header.n_vocab;
-    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, token < n_vocab, "Token (%" PRId32 ") is out of range (0 .. %zu)", token, n_vocab - 1);
+    const struct rwkv_file_header & file_header = ctx->instance->model.header;
+    const size_t n_embed = file_header.n_embed;
 
-    rwkv_set_inputs(ctx, state_in);
-    ggml_set_i32(ctx->serial_graph.tokens, token);
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_DATA_TYPE, rwkv_state_encoding_is_valid(encoding), "Unknown state encoding %d", (int) encoding);
 
-    // Short circuit computation of logits if nobody actually cares
-    if (!logits_out) {
-        ctx->serial_graph.cgraph->n_nodes = ctx->serial_graph.pre_logits_nodes;
-        ctx->serial_graph.cgraph->n_leafs = ctx->serial_graph.pre_logits_leafs;
-    } else {
-        ctx->serial_graph.cgraph->n_nodes = ctx->serial_graph.post_logits_nodes;
-        ctx->serial_graph.cgraph->n_leafs = ctx->serial_graph.post_logits_leafs;
-    }
+    const size_t size = rwkv_state_serialized_size(ctx, encoding);
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_SHAPE, buffer_size >= size, "Buffer of %zu bytes is too small for a state of %zu bytes", buffer_size, size);
 
-    ggml_graph_compute(ctx->serial_graph.ctx.ctx, ctx->serial_graph.cgraph.get());
-    rwkv_get_outputs(ctx, state_out, logits_out);
+    struct rwkv_state_header header;
+    header.magic = RWKV_STATE_MAGIC;
+    header.version = RWKV_STATE_VERSION;
+    header.n_embed = file_header.n_embed;
+    header.n_layer = file_header.n_layer;
+    header.encoding = encoding;
+    header.reserved = 0;
+    header.fingerprint = ctx->instance->fingerprint;
+
+    uint8_t * out = (uint8_t *) buffer;
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+
+    for (size_t i = 0; i < file_header.n_layer; i++) {
+        for (size_t part = 0; part < 5; part++) {
+            out = rwkv_state_encode(rwkv_state_part_format(encoding, part), state + (i * 5 + part) * n_embed, n_embed, out);
+        }
+    }
 
     return true;
 }
 
-bool rwkv_eval_sequence(struct rwkv_context * ctx, const uint32_t * sequence, const size_t sequence_len, const float * state_in, float * state_out, float * logits_out) {
+bool rwkv_state_deserialize(struct rwkv_context * ctx, const void * buffer, const size_t buffer_size, float * state_out) {
     ctx->last_error = RWKV_ERROR_NONE;
 
-    const struct rwkv_file_header & header = ctx->instance->model.header;
-    const size_t n_vocab = header.n_vocab;
-    const size_t n_embed = header.n_embed;
-    const size_t n_layer = header.n_layer;
+    const struct rwkv_file_header & file_header = ctx->instance->model.header;
+    const size_t n_embed = file_header.n_embed;
 
-    if (sequence) {
-        for (size_t i = 0; i < sequence_len; i++) {
-            const uint32_t token = sequence[i];
-            RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS, token < n_vocab, "Token at index %zu (%" PRId32 ") is out of range (0 .. %zu)", i, token, n_vocab - 1);
+    struct rwkv_state_header header;
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_SHAPE, buffer_size >= sizeof(header), "Buffer of %zu bytes is too small for a state header", buffer_size);
+
+    const uint8_t * in = (const uint8_t *) buffer;
+    memcpy(&header, in, sizeof(header));
+    in += sizeof(header);
+
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_FILE_MAGIC, header.magic == RWKV_STATE_MAGIC, "Buffer does not contain a serialized state");
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_FILE_VERSION, header.version == RWKV_STATE_VERSION, "Unsupported state version %" PRId32, header.version);
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_DATA_TYPE, rwkv_state_encoding_is_valid(header.encoding), "Unknown state encoding %" PRId32, header.encoding);
+    RWKV_CTX_ASSERT_FALSE_MSG(
+        ctx,
+        RWKV_ERROR_ARGS | RWKV_ERROR_DIMENSION,
+        header.n_embed == file_header.n_embed && header.n_layer == file_header.n_layer,
+        "State of a model with n_embed = %" PRId32 " and n_layer = %" PRId32 " does not fit this model with n_embed = %" PRId32 " and n_layer = %" PRId32,
+        header.n_embed, header.n_layer, file_header.n_embed, file_header.n_layer
+    );
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_KEY, header.fingerprint == ctx->instance->fingerprint, "State was serialized by a different model");
+
+    const size_t size = sizeof(header) + rwkv_state_payload_size(file_header, header.encoding);
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_SHAPE, buffer_size == size, "Unexpected size of a serialized state %zu, expected %zu", buffer_size, size);
+
+    for (size_t i = 0; i < file_header.n_layer; i++) {
+        for (size_t part = 0; part < 5; part++) {
+            in = rwkv_state_decode(rwkv_state_part_format(header.encoding, part), in, n_embed, state_out + (i * 5 + part) * n_embed);
         }
     }
 
-    if (ctx->sequence_len != sequence_len) {
-        // Build new sequence graph
+    return true;
+}
 
-        struct rwkv_future_ctx graph_future_ctx;
-        const struct rwkv_future_tensor future_tokens = graph_future_ctx.alloc(GGML_TYPE_I32, sequence_len);
+// --- Session store ---
 
-        const struct rwkv_model & model = ctx->instance->model;
-        const struct rwkv_layer & layer = model.layers[0];
-        const struct rwkv_layer_state & state = ctx->input_layers[0];
-        struct rwkv_future_tensor ffn_xx = state.ffn_xx;
-        struct rwkv_future_tensor att_xx = state.att_xx;
-        struct rwkv_future_tensor att_aa = state.att_aa;
-        struct rwkv_future_tensor att_bb = state.att_bb;
-        struct rwkv_future_tensor att_pp = state.att_pp;
+#define RWKV_SESSION_STORE_MAGIC 0x72777373
+#define RWKV_SESSION_STORE_VERSION 1
 
-        const struct rwkv_future_tensor future_graph = rwkv_future_sequence_graph(graph_future_ctx, future_tokens, 1,
-            model.emb,
-            model.ln0_weight, model.ln0_bias,
+// The file consists of this header, a table of rwkv_session_entry for all slots, and the slots.
+// The table and every slot start at a page boundary, so that slots can be written back and dropped one by one.
+struct rwkv_session_store_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t encoding;
+    uint32_t reserved;
+    uint64_t state_size;
+    uint64_t n_slots;
+};
 
-            n_layer,
-            layer.ln1_weight, layer.ln1_bias,
-            layer.att_time_mix_k, layer.att_time_mix_v, layer.att_time_mix_r,
-            layer.att_time_first, layer.att_time_decay,
-            layer.att_receptance, layer.att_key, layer.att_value, layer.att_output,
-            att_xx, att_aa, att_bb, att_pp,
+struct rwkv_session_entry {
+    uint64_t session_id;
+    // Non-zero if the slot holds a state of the session.
+    uint64_t used;
+};
 
-            layer.ln2_weight, layer.ln2_bias,
-            layer.ffn_time_mix_k, layer.ffn_time_mix_r,
-            layer.ffn_key, layer.ffn_value, layer.ffn_receptance,
-            ffn_xx,
+struct rwkv_session_store {
+    std::mutex mutex;
 
-            model.ln_out_weight, model.ln_out_weight,
-            model.head
-        );
+    int fd = -1;
+    uint8_t * data = NULL;
+    size_t size = 0;
 
-        struct rwkv_graph sequence_graph;
-        sequence_graph.ctx = graph_future_ctx;
-        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, sequence_graph.ctx.ctx, "Failed to allocate sequence graph context");
-        sequence_graph.tokens = ggml_new_tensor_1d(sequence_graph.ctx.ctx, GGML_TYPE_I32, sequence_len);
-        sequence_graph.cgraph.reset(new(std::nothrow) struct ggml_cgraph());
-        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ALLOC, sequence_graph.cgraph, "Failed to allocate sequence graph");
-        sequence_graph.cgraph->n_threads = 1;
+    enum rwkv_state_encoding encoding;
+    size_t state_size;
+    size_t slot_size;
+    size_t slots_offset;
+    size_t n_slots;
+    struct rwkv_session_entry * entries;
 
-        RWKV_ASSERT_FALSE(RWKV_ERROR_GRAPH, rwkv_build_sequence_graph(
-            sequence_graph.ctx.ctx, ctx->instance->model,
-            sequence_graph.tokens, ctx->input_layers.get(), ctx->output_layers.get(), ctx->logits,
-            sequence_graph.cgraph.get(),
-            &sequence_graph.pre_logits_nodes, &sequence_graph.pre_logits_leafs, &sequence_graph.post_logits_nodes, &sequence_graph.post_logits_leafs
-        ));
+    // Slot of each session, and slots without a session, in the order they are reused.
+    std::unordered_map<uint64_t, size_t> index;
+    std::vector<size_t> free_slots;
 
-        ctx->sequence_len = sequence_len;
-        ctx->sequence_graph = std::move(sequence_graph);
-    }
+    // Slots used since they were last dropped from RAM, most recently used first.
+    size_t max_resident;
+    std::list<size_t> resident;
+    std::unordered_map<size_t, std::list<size_t>::iterator> resident_positions;
 
-    // Allow building the sequence graph without actually evaluating, by specifying sequence = NULL.
-    if (sequence) {
-        rwkv_set_inputs(ctx, state_in);
-        memcpy(ctx->sequence_graph.tokens->data, sequence, sequence_len * sizeof(uint32_t));
+    uint8_t * slot(const size_t i) const {
+        return data + slots_offset + i * slot_size;
+    }
 
-        // Short circuit computation of logits if nobody actually cares
-        if (!logits_out) {
-            ctx->sequence_graph.cgraph->n_nodes = ctx->sequence_graph.pre_logits_nodes;
-            ctx->sequence_graph.cgraph->n_leafs = ctx->sequence_graph.pre_logits_leafs;
-        } else {
-            ctx->sequence_graph.cgraph->n_nodes = ctx->sequence_graph.post_logits_nodes;
-            ctx->sequence_graph.cgraph->n_leafs = ctx->sequence_graph.post_logits_leafs;
+#if !defined(_WIN32)
+    ~rwkv_session_store() {
+        if (data) {
+            msync(data, size, MS_SYNC);
+            munmap(data, size);
         }
 
-        ggml_graph_compute(ctx->sequence_graph.ctx.ctx, ctx->sequence_graph.cgraph.get());
-        rwkv_get_outputs(ctx, state_out, logits_out);
+        if (fd >= 0) {
+            close(fd);
+        }
     }
+#endif
+};
 
-    return true;
+#if !defined(_WIN32)
+// Writes the slot back to the file and drops its pages from RAM; the next access pages it in again.
+void rwkv_session_store_spill(struct rwkv_session_store * store, const size_t i) {
+    uint8_t * slot = store->slot(i);
+    msync(slot, store->slot_size, MS_SYNC);
+    madvise(slot, store->slot_size, MADV_DONTNEED);
+#if defined(__linux__)
+    // Dropping the mapping keeps the pages in the page cache, which is only freed by this.
+    posix_fadvise(store->fd, (off_t) (slot - store->data), (off_t) store->slot_size, POSIX_FADV_DONTNEED);
+#endif
 }
 
-// Provided for compatibility.
-extern "C" RWKV_API uint32_t rwkv_get_state_buffer_element_count(const struct rwkv_context * ctx) {
-    return rwkv_get_state_len(ctx);
+// Moves the slot to the front of the LRU list, and spills slots that fall out of it.
+void rwkv_session_store_touch(struct rwkv_session_store * store, const size_t i) {
+    if (!store->max_resident) {
+        return;
+    }
+
+    auto position = store->resident_positions.find(i);
+
+    if (position != store->resident_positions.end()) {
+        store->resident.erase(position->second);
+    }
+
+    store->resident.push_front(i);
+    store->resident_positions[i] = store->resident.begin();
+
+    while (store->resident.size() > store->max_resident) {
+        const size_t lru = store->resident.back();
+        rwkv_session_store_spill(store, lru);
+        store->resident_positions.erase(lru);
+        store->resident.pop_back();
+    }
 }
+#endif
 
-// Provided for compatibility.
-extern "C" RWKV_API uint32_t rwkv_get_logits_buffer_element_count(const struct rwkv_context * ctx) {
-    return rwkv_get_logits_len(ctx);
+struct rwkv_session_store * rwkv_session_store_open(
+    struct rwkv_context * ctx,
+    const char * path,
+    const enum rwkv_state_encoding encoding,
+    const size_t max_sessions,
+    const size_t max_resident
+) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+#if !defined(_WIN32)
+    const size_t state_size = rwkv_state_serialized_size(ctx, encoding);
+    RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_DATA_TYPE, NULL, state_size, "Unknown state encoding %d", (int) encoding);
+
+    std::unique_ptr<struct rwkv_session_store> store(new(std::nothrow) struct rwkv_session_store());
+    RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, NULL, store, "Failed to allocate session store");
+
+    store->fd = open(path, O_RDWR | O_CREAT, 0644);
+    RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_FILE | RWKV_ERROR_FILE_OPEN, NULL, store->fd >= 0, "Failed to open %s: %s", path, strerror(errno));
+
+    struct stat file_stat;
+    RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_FILE | RWKV_ERROR_FILE_STAT, NULL, fstat(store->fd, &file_stat) == 0, "Failed to stat %s", path);
+
+    struct rwkv_session_store_header header;
+    const bool created = file_stat.st_size == 0;
+
+    if (created) {
+        RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_ARGS, NULL, max_sessions > 0, "Session store needs at least one slot");
+        header.magic = RWKV_SESSION_STORE_MAGIC;
+        header.version = RWKV_SESSION_STORE_VERSION;
+        header.encoding = encoding;
+        header.reserved = 0;
+        header.state_size = state_size;
+        header.n_slots = max_sessions;
+    } else {
+        RWKV_CTX_ASSERT_MSG(
+            ctx,
+            RWKV_ERROR_FILE | RWKV_ERROR_FILE_READ,
+            NULL,
+            pread(store->fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header),
+            "Failed to read header of %s", path
+        );
+        RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_FILE | RWKV_ERROR_FILE_MAGIC, NULL, header.magic == RWKV_SESSION_STORE_MAGIC, "%s is not a session store", path);
+        RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_FILE | RWKV_ERROR_FILE_VERSION, NULL, header.version == RWKV_SESSION_STORE_VERSION, "Unsupported session store version %" PRId32, header.version);
+        RWKV_CTX_ASSERT_MSG(
+            ctx,
+            RWKV_ERROR_ARGS | RWKV_ERROR_DIMENSION,
+            NULL,
+            header.encoding == (uint32_t) encoding && header.state_size == state_size,
+            "Session store %s was created for a different model or encoding", path
+        );
+    }
+
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    auto align = [&](const size_t size) { return (size + page_size - 1) / page_size * page_size; };
+
+    store->encoding = encoding;
+    store->state_size = state_size;
+    store->slot_size = align(state_size);
+    store->n_slots = header.n_slots;
+    store->slots_offset = align(page_size + store->n_slots * sizeof(struct rwkv_session_entry));
+    store->size = store->slots_offset + store->n_slots * store->slot_size;
+    store->max_resident = max_resident;
+
+    if (created) {
+        // Slots are not allocated on disk until they are written.
+        RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_FILE | RWKV_ERROR_FILE_WRITE, NULL, ftruncate(store->fd, (off_t) store->size) == 0, "Failed to resize %s: %s", path, strerror(errno));
+    } else {
+        RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_FILE | RWKV_ERROR_FILE_STAT, NULL, (size_t) file_stat.st_size == store->size, "Unexpected size of session store %s", path);
+    }
+
+    void * data = mmap(NULL, store->size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+    RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, NULL, data != MAP_FAILED, "Failed to map %s: %s", path, strerror(errno));
+    store->data = (uint8_t *) data;
+    store->entries = (struct rwkv_session_entry *) (store->data + page_size);
+
+    if (created) {
+        memcpy(store->data, &header, sizeof(header));
+    }
+
+    // Free slots are taken from the back, so that slots at the start of the file are reused first.
+    for (size_t i = store->n_slots; i-- > 0;) {
+        if (store->entries[i].used) {
+            store->index[store->entries[i].session_id] = i;
+        } else {
+            store->free_slots.push_back(i);
+        }
+    }
+
+    return store.release();
+#else
+    (void) path;
+    (void) encoding;
+    (void) max_sessions;
+    (void) max_resident;
+    RWKV_CTX_ASSERT_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, NULL, false, "Session stores are not supported on Windows");
+#endif
 }
 
-size_t rwkv_get_n_vocab(const struct rwkv_context * ctx) {
-    return (size_t) ctx->instance->model.header.n_vocab;
+void rwkv_session_store_close(struct rwkv_session_store * store) {
+    std::unique_ptr<struct rwkv_session_store> store_ptr(store);
 }
 
-size_t rwkv_get_n_embed(const struct rwkv_context * ctx) {
-    return (size_t) ctx->instance->model.header.n_embed;
+bool rwkv_session_store_contains(struct rwkv_session_store * store, const uint64_t session_id) {
+    std::lock_guard<std::mutex> lock(store->mutex);
+    return store->index.count(session_id) > 0;
 }
 
-size_t rwkv_get_n_layer(const struct rwkv_context * ctx) {
-    return (size_t) ctx->instance->model.header.n_layer;
+size_t rwkv_session_store_get_count(struct rwkv_session_store * store) {
+    std::lock_guard<std::mutex> lock(store->mutex);
+    return store->index.size();
 }
 
-size_t rwkv_get_state_len(const struct rwkv_context * ctx) {
-    const struct rwkv_file_header & header = ctx->instance->model.header;
-    return (size_t) header.n_embed * 5 * (size_t) header.n_layer;
+bool rwkv_session_store_save(struct rwkv_session_store * store, struct rwkv_context * ctx, const uint64_t session_id, const float * state) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+#if !defined(_WIN32)
+    std::lock_guard<std::mutex> lock(store->mutex);
+
+    auto position = store->index.find(session_id);
+    const bool is_new = position == store->index.end();
+
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_ALLOC, !is_new || !store->free_slots.empty(), "Session store is full (%zu sessions)", store->n_slots);
+
+    const size_t i = is_new ? store->free_slots.back() : position->second;
+    RWKV_ENSURE_OR_FALSE(rwkv_state_serialize(ctx, state, store->encoding, store->slot(i), store->state_size));
+
+    if (is_new) {
+        store->free_slots.pop_back();
+        store->index[session_id] = i;
+        store->entries[i].session_id = session_id;
+        store->entries[i].used = 1;
+    }
+
+    rwkv_session_store_touch(store, i);
+    return true;
+#else
+    (void) store;
+    (void) session_id;
+    (void) state;
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, false, "Session stores are not supported on Windows");
+#endif
 }
 
-size_t rwkv_get_logits_len(const struct rwkv_context * ctx) {
-    return (size_t) ctx->instance->model.header.n_vocab;
+bool rwkv_session_store_load(struct rwkv_session_store * store, struct rwkv_context * ctx, const uint64_t session_id, float * state_out) {
+    ctx->last_error = RWKV_ERROR_NONE;
+
+#if !defined(_WIN32)
+    std::lock_guard<std::mutex> lock(store->mutex);
+
+    auto position = store->index.find(session_id);
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_ARGS | RWKV_ERROR_KEY, position != store->index.end(), "Session %" PRIu64 " is not in the store", session_id);
+
+    const size_t i = position->second;
+    RWKV_ENSURE_OR_FALSE(rwkv_state_deserialize(ctx, store->slot(i), store->state_size, state_out));
+
+    rwkv_session_store_touch(store, i);
+    return true;
+#else
+    (void) store;
+    (void) session_id;
+    (void) state_out;
+    RWKV_CTX_ASSERT_FALSE_MSG(ctx, RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED, false, "Session stores are not supported on Windows");
+#endif
 }
 
-void rwkv_init_state(const struct rwkv_context * ctx, float * state) {
-    const struct rwkv_file_header & header = ctx->instance->model.header;
-    const size_t layer_size = (size_t) header.n_embed * 5;
-    const size_t layer_zero = (size_t) header.n_embed * 4;
-    const size_t layers_size = (size_t) header.n_layer * layer_size;
+bool rwkv_session_store_remove(struct rwkv_session_store * store, const uint64_t session_id) {
+    std::lock_guard<std::mutex> lock(store->mutex);
 
-    for (size_t start = 0; start < layers_size; start += layer_size) {
-        for (size_t i = 0; i < layer_zero; i++) {
-            state[start + i] = 0.0F;
-        }
+    auto position = store->index.find(session_id);
 
-        for (size_t i = layer_zero; i < layer_size; i++) {
-            state[start + i] = -1e30F;
-        }
+    if (position == store->index.end()) {
+        return false;
+    }
+
+    const size_t i = position->second;
+    store->entries[i].used = 0;
+    store->index.erase(position);
+    store->free_slots.push_back(i);
+
+    auto resident_position = store->resident_positions.find(i);
+
+    if (resident_position != store->resident_positions.end()) {
+        store->resident.erase(resident_position->second);
+        store->resident_positions.erase(resident_position);
     }
+
+    return true;
 }
 
 void rwkv_free(struct rwkv_context * ctx) {
@@ -1760,10 +5770,16 @@ void rwkv_free(struct rwkv_context * ctx) {
 }
 
 bool rwkv_quantize_model_file(const char * in_path, const char * out_path, const char * type_name) {
+    return rwkv_quantize_model_file_ex(in_path, out_path, type_name, 1);
+}
+
+bool rwkv_quantize_model_file_ex(const char * in_path, const char * out_path, const char * recipe_str, const uint32_t n_threads) {
     global_last_error = RWKV_ERROR_NONE;
 
-    enum ggml_type out_type = rwkv_type_to_ggml[rwkv_type_from_string(type_name)];
-    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ARGS | RWKV_ERROR_DATA_TYPE, ggml_is_quantized(out_type), "Unsupported output data type (%s)", rwkv_type_to_string[rwkv_type_from_ggml[out_type]]);
+    struct rwkv_quantize_recipe recipe;
+    RWKV_ENSURE_OR_FALSE(rwkv_parse_quantize_recipe(recipe_str, recipe));
+
+    const size_t n_quantize_threads = n_threads ? n_threads : std::max(std::thread::hardware_concurrency(), 1U);
 
     RWKV_MSG("Loading model from '%s'\n", in_path);
 
@@ -1791,7 +5807,11 @@ bool rwkv_quantize_model_file(const char * in_path, const char * out_path, const
 
     struct rwkv_file_header out_header = in_header;
     out_header.version = RWKV_FILE_VERSION;
-    out_header.data_type = rwkv_type_from_ggml[out_type];
+
+    if (recipe.default_type != TYPE_UNKNOWN) {
+        out_header.data_type = recipe.default_type;
+    }
+
     RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_FILE, rwkv_fwrite_file_header(out_file.file, out_header), "Failed to write file header");
 
     // Process parameters
@@ -1805,39 +5825,29 @@ bool rwkv_quantize_model_file(const char * in_path, const char * out_path, const
     size_t max_in_size = 0;
     size_t max_out_size = 0;
     size_t max_key_length = 0;
+    size_t tensor_count = 0;
 
     while (ftell(in_file.file) < in_stat.st_size) {
         struct rwkv_tensor_header header;
-        RWKV_ASSERT_FALSE(RWKV_ERROR_FILE, rwkv_fread_tensor_header_and_skip(in_file.file, header));
-
-        size_t in_size = header.size();
-
-        if (in_size > max_in_size) {
-            max_in_size = in_size;
-        }
-
-        // f16 type tensors get relocated to out and then converted into f32 at in
-        if (header.data_type == TYPE_FP16) {
-            if (in_size > max_out_size) {
-                max_out_size = in_size;
-            }
-
-            size_t f32_size = rwkv_future_tensor::size(GGML_TYPE_F32, header.width, header.height);
-
-            if (f32_size > max_in_size) {
-                max_in_size = f32_size;
-            }
-        }
+        std::string name;
+        RWKV_ASSERT_FALSE(RWKV_ERROR_FILE, rwkv_fread_tensor_header(in_file.file, header));
+        RWKV_ASSERT_FALSE(RWKV_ERROR_FILE | RWKV_ERROR_FILE_READ, rwkv_fread_string(in_file.file, header.key_length, name));
+        RWKV_ASSERT_FALSE(RWKV_ERROR_FILE | RWKV_ERROR_FILE_READ, fseek(in_file.file, header.size(), SEEK_CUR) == 0);
 
-        size_t out_size = rwkv_future_tensor::size(out_type, header.width, header.height);
+        enum rwkv_type out_type = rwkv_quantize_recipe_type(recipe, header, name, in_header.n_layer);
+        enum ggml_type out_ggml_type = rwkv_type_to_ggml[out_type];
 
-        if (out_size > max_out_size) {
-            max_out_size = out_size;
-        }
+        RWKV_ASSERT_FALSE_MSG(
+            RWKV_ERROR_ARGS | RWKV_ERROR_SHAPE,
+            header.width % ggml_blck_size(out_ggml_type) == 0,
+            "Width of %s (%" PRId32 ") is not divisible by block size of %s",
+            name.c_str(), header.width, rwkv_type_to_string[out_type]
+        );
 
-        if (header.key_length > max_key_length) {
-            max_key_length = header.key_length;
-        }
+        max_in_size = std::max(max_in_size, header.size());
+        max_out_size = std::max(max_out_size, rwkv_future_tensor::size(out_ggml_type, header.width, header.height));
+        max_key_length = std::max(max_key_length, (size_t) header.key_length);
+        tensor_count++;
     }
 
     RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_FILE | RWKV_ERROR_FILE_READ, fseek(in_file.file, sizeof(struct rwkv_file_header), SEEK_SET) == 0, "Failed to seek in file");
@@ -1845,60 +5855,97 @@ bool rwkv_quantize_model_file(const char * in_path, const char * out_path, const
     // This is a histogram of quantized values. If it shows single 1.0, then all 0.0, something went very wrong!
     int64_t hist_all[16] {};
 
-    std::unique_ptr<uint8_t[]> scratch(new(std::nothrow) uint8_t[max_in_size + max_out_size]);
-    RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ALLOC, scratch.get(), "Failed to allocate buffer");
+    // Tensor i is read into slot i % 3 while tensor i - 1 is being quantized and tensor i - 2 is being written.
+    // This bounds memory usage to 3 tensors in flight, regardless of model size.
+    // Only one tensor is quantized at a time, so that no more than n_quantize_threads threads compete for cores;
+    // quantization overlaps with I/O only.
+    const size_t n_slots = 3;
+    struct rwkv_quantize_slot slots[n_slots];
+
+    for (size_t i = 0; i < n_slots; i++) {
+        slots[i].in_buf.reset(new(std::nothrow) uint8_t[max_in_size]);
+        slots[i].out_buf.reset(new(std::nothrow) uint8_t[max_out_size]);
+        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ALLOC, slots[i].in_buf && slots[i].out_buf, "Failed to allocate buffer");
+    }
 
-    uint8_t * in_buf = scratch.get();
-    uint8_t * out_buf = in_buf + max_in_size;
+    // Worker threads do not share thread-local error settings with the calling thread.
+    const bool print_errors = global_print_errors;
 
-    struct rwkv_tensor tensor;
-    struct rwkv_tensor_header & header = tensor.header;
-    std::string & name = tensor.name;
-    uint8_t *& data = tensor.data;
+    std::future<bool> quantized;
+    std::future<bool> written;
 
-    while (ftell(in_file.file) < in_stat.st_size) {
-        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_tensor_header(in_file.file, header), "Failed to read tensor header");
-        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_string(in_file.file, header.key_length, name), "Failed to read tensor name");
+    for (size_t i = 0; i <= tensor_count; i++) {
+        if (i < tensor_count) {
+            struct rwkv_quantize_slot & slot = slots[i % n_slots];
+            struct rwkv_tensor_header & header = slot.tensor.header;
+            std::string & name = slot.tensor.name;
 
-        const char * name_str = name.c_str();
-        RWKV_MSG("%*s - [%5" PRId32 ", %5" PRId32 "], type = %6s ", (int) max_key_length, name_str, header.width, header.height, rwkv_type_to_string[header.data_type]);
+            RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_tensor_header(in_file.file, header), "Failed to read tensor header");
+            RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_string(in_file.file, header.key_length, name), "Failed to read tensor name");
 
-        data = header.data_type == TYPE_FP16 ? out_buf : in_buf;
-        size_t orig_size = header.size(), new_size = orig_size;
-        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_data(in_file.file, orig_size, data), "\nFailed to read tensor data of %s", name_str);
+            slot.in_type = (enum rwkv_type) header.data_type;
+            slot.out_type = rwkv_quantize_recipe_type(recipe, header, name, in_header.n_layer);
+            slot.orig_size = header.size();
+            slot.new_size = slot.orig_size;
+            slot.tensor.data = slot.in_buf.get();
+            std::fill(slot.hist, slot.hist + 16, 0);
 
-        // Quantize only 2D tensors, except embedding and head matrices.
-        // Embedding and head take not too much space, especially in bigger models;
-        // but they significantly increase perplexity when quantized.
-        if ((header.data_type == TYPE_FP32 || header.data_type == TYPE_FP16) && header.dim_count == 2 && name != "emb.weight" && name != "head.weight") {
-            RWKV_MSG("quantizing... ");
+            RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_MODEL_PARAMS, rwkv_fread_data(in_file.file, slot.orig_size, slot.in_buf.get()), "Failed to read tensor data of %s", name.c_str());
+        }
 
-            size_t nelements = (size_t) header.width * (size_t) header.height;
+        if (i > 0) {
+            struct rwkv_quantize_slot & slot = slots[(i - 1) % n_slots];
+            const struct rwkv_tensor_header & header = slot.tensor.header;
+            const char * name_str = slot.tensor.name.c_str();
+            RWKV_MSG("%*s - [%5" PRId32 ", %5" PRId32 "], type = %6s ", (int) max_key_length, name_str, header.width, header.height, rwkv_type_to_string[slot.in_type]);
+
+            if (slot.out_type != slot.in_type) {
+                RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_ALLOC, quantized.get(), "\nFailed to quantize tensor %s", name_str);
+
+                if (ggml_is_quantized(rwkv_type_to_ggml[slot.out_type])) {
+                    const size_t nelements = (size_t) header.width * (size_t) header.height;
+                    RWKV_MSG("quantizing to %s... size = %8.2f MB -> %8.2f MB | hist: ", rwkv_type_to_string[slot.out_type], slot.orig_size / 1024.0 / 1024.0, slot.new_size / 1024.0 / 1024.0);
+
+                    for (int j = 0; j < 16; j++) {
+                        RWKV_MSG("%5.3f ", slot.hist[j] / (float) nelements);
+                        hist_all[j] += slot.hist[j];
+                    }
+
+                    RWKV_MSG("\n");
+                } else {
+                    RWKV_MSG("converting to %s... size = %8.2f MB -> %8.2f MB\n", rwkv_type_to_string[slot.out_type], slot.orig_size / 1024.0 / 1024.0, slot.new_size / 1024.0 / 1024.0);
+                }
+            } else {
+                RWKV_MSG("size = %8.3f MB\n", slot.orig_size / 1024.0 / 1024.0);
+            }
 
-            if (header.data_type == TYPE_FP16) {
-                ggml_fp16_to_fp32_row((const ggml_fp16_t *) out_buf, (float *) in_buf, nelements);
+            if (written.valid()) {
+                RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_FILE_WRITE, written.get(), "Failed to write tensor");
             }
 
-            int64_t hist_cur[16] {};
-            new_size = ggml_quantize_chunk(out_type, (const float *) in_buf, out_buf, 0, nelements, hist_cur);
-            header.data_type = rwkv_type_from_ggml[out_type];
-            data = out_buf;
+            FILE * out = out_file.file;
+            written = std::async(std::launch::async, [&slot, out, print_errors]() {
+                global_print_errors = print_errors;
+                return rwkv_fwrite_tensor(out, slot.tensor);
+            });
+
+            orig_total_size += slot.orig_size;
+            new_total_size += slot.new_size;
+        }
 
-            RWKV_MSG("size = %8.2f MB -> %8.2f MB | hist: ", orig_size / 1024.0 / 1024.0, new_size / 1024.0 / 1024.0);
+        if (i < tensor_count) {
+            struct rwkv_quantize_slot & slot = slots[i % n_slots];
 
-            for (int i = 0; i < 16; i++) {
-                RWKV_MSG("%5.3f ", hist_cur[i] / (float) nelements);
-                hist_all[i] += hist_cur[i];
+            if (slot.out_type != slot.in_type) {
+                quantized = std::async(std::launch::async, [&slot, n_quantize_threads]() {
+                    return rwkv_quantize_slot_data(slot, n_quantize_threads);
+                });
             }
-
-            RWKV_MSG("\n");
-        } else {
-            RWKV_MSG("size = %8.3f MB\n", orig_size / 1024.0 / 1024.0);
         }
+    }
 
-        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_FILE_WRITE, rwkv_fwrite_tensor(out_file.file, tensor), "Failed to write tensor %s", name_str);
-        orig_total_size += orig_size;
-        new_total_size += new_size;
+    if (written.valid()) {
+        RWKV_ASSERT_FALSE_MSG(RWKV_ERROR_FILE_WRITE, written.get(), "Failed to write tensor");
     }
 
     RWKV_MSG("original size     = %8.2f MB\n", orig_total_size / 1024.0 / 1024.0);
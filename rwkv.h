@@ -58,7 +58,36 @@ extern "C" {
         RWKV_ERROR_DIMENSION = 11,
         RWKV_ERROR_KEY = 12,
         RWKV_ERROR_DATA = 13,
-        RWKV_ERROR_PARAM_MISSING = 14
+        RWKV_ERROR_PARAM_MISSING = 14,
+        // Evaluation was stopped early by an abort callback or a deadline.
+        RWKV_ERROR_CANCELLED = 15
+    };
+
+    // Options that change how a model is prepared when it is loaded.
+    // These are flags, so multiple options can be combined.
+    enum rwkv_init_flags {
+        RWKV_INIT_NONE = 0,
+
+        // Applies blocks.0.ln0 to every row of emb.weight at load time, so that it is not computed on each eval.
+        // Requires emb.weight to be FP32 or FP16. Logits may differ slightly because of rounding.
+        RWKV_INIT_FOLD_LN0 = 1 << 0,
+
+        // Spreads pages of model weights round-robin between all NUMA nodes, so that contexts running on any node
+        // share the memory bandwidth of all nodes. Linux only; fails with RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED
+        // if the kernel does not allow it. See also rwkv_clone_context_to_numa_node.
+        RWKV_INIT_NUMA_INTERLEAVE = 1 << 1,
+
+        // Backs model weights with transparent huge pages, which reduces TLB misses when reading weights.
+        // Linux only; fails with RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED if transparent huge pages are disabled.
+        RWKV_INIT_HUGE_PAGES = 1 << 2,
+
+        // Backs model weights with explicit huge pages reserved in /proc/sys/vm/nr_hugepages.
+        // Linux only; fails with RWKV_ERROR_CTX | RWKV_ERROR_ALLOC if not enough huge pages are reserved.
+        RWKV_INIT_HUGETLB = 1 << 3,
+
+        // Locks model weights in memory, so that they are never swapped out.
+        // Fails with RWKV_ERROR_CTX | RWKV_ERROR_ALLOC if the weights exceed RLIMIT_MEMLOCK. Not supported on Windows.
+        RWKV_INIT_MLOCK = 1 << 4
     };
 
     // RWKV context that can be used for inference.
@@ -89,6 +118,15 @@ extern "C" {
     // - n_threads: count of threads to use, must be positive.
     RWKV_API struct rwkv_context * rwkv_init_from_file(const char * model_file_path, const uint32_t n_threads);
 
+    // Same as rwkv_init_from_file, but allows specifying load options.
+    // - flags: bitwise combination of rwkv_init_flags.
+    // - format: data type the model is converted into while loading, or NULL to use tensors as they are stored in the file.
+    //   This is either a format name, or a quantization recipe, see rwkv_quantize_model_file_ex for syntax.
+    //   For example, "Q5_1" quantizes an FP16 model in memory, and "FP32" upcasts it, which is faster on some machines, but uses twice the memory.
+    //   Unlike in rwkv_quantize_model_file_ex, a default FP32 or FP16 format also applies to emb.weight and head.weight.
+    //   Conversion uses all available threads. Only FP32 and FP16 tensors are converted; quantized tensors are kept as is.
+    RWKV_API struct rwkv_context * rwkv_init_from_file_ex(const char * model_file_path, const uint32_t n_threads, const uint32_t flags, const char * format);
+
     // Creates a new context from an existing one.
     // This can allow you to run multiple rwkv_eval's in parallel, without having to load a single model multiple times.
     // Each rwkv_context can have one eval running at a time.
@@ -102,6 +140,26 @@ extern "C" {
     // If rwkv.cpp was compiled without cuBLAS support, this function is a no-op and always returns false.
     RWKV_API bool rwkv_gpu_offload_layers(struct rwkv_context * ctx, const uint32_t n_layers);
 
+    // Low-rank adapter (LoRA) that is applied to the model at runtime, without merging it into the model weights.
+    // Contexts of the same model share a single copy of the model weights, and each of them can use a different adapter.
+    struct rwkv_lora;
+
+    // Loads an adapter from a file created by rwkv/convert_lora_to_ggml.py.
+    // The adapter can be used by the given context and all contexts cloned from it.
+    // Returns NULL on any error.
+    // - scale: multiplier of the adapter contribution; use 1.0 to apply the adapter as it was trained.
+    RWKV_API struct rwkv_lora * rwkv_lora_from_file(struct rwkv_context * ctx, const char * lora_file_path, const float scale);
+
+    // Sets the adapter used by following evaluations of the context, or disables it if lora is NULL.
+    // Switching between adapters that contain the same tensors with the same shapes (for example, trained with the same rank)
+    // only updates pointers, so it is cheap enough to do before every call. Otherwise, computation graphs are rebuilt.
+    // Cloned contexts start with the adapter of the original context.
+    // Returns false on any error; the context then keeps the previous adapter.
+    RWKV_API bool rwkv_set_lora(struct rwkv_context * ctx, const struct rwkv_lora * lora);
+
+    // Frees the adapter. It must not be set for any context when it is freed.
+    RWKV_API void rwkv_lora_free(struct rwkv_lora * lora);
+
     // Evaluates the model for a single token.
     // Not thread-safe. For parallel inference, call rwkv_clone_context to create one rwkv_context for each thread.
     // Returns false on any error.
@@ -116,6 +174,8 @@ extern "C" {
     // Evaluates the model for a sequence of tokens.
     // Uses a faster algorithm than rwkv_eval if you do not need the state and logits for every token. Best used with batch sizes of 64 or so.
     // Has to build a computation graph on the first call for a given sequence, but will use this cached graph for subsequent calls of the same sequence length.
+    // Besides the graph of the last call, a context keeps graphs of the last 3 other lengths and output kinds it evaluated,
+    // so alternating between a few lengths, or with rwkv_eval_sequence_per_token and rwkv_eval_sequence_embed, does not rebuild graphs.
     // Not thread-safe. For parallel inference, call rwkv_clone_context to create one rwkv_context for each thread.
     // Returns false on any error.
     // You can pass NULL to logits_out whenever logits are not needed. This can improve speed by ~10ms per iteration
@@ -127,6 +187,415 @@ extern "C" {
     // - logits_out: FP32 buffer of size rwkv_get_logits_len(). This buffer will be written to if non-NULL.
     RWKV_API bool rwkv_eval_sequence(struct rwkv_context * ctx, const uint32_t * tokens, size_t sequence_len, const float * state_in, float * state_out, float * logits_out);
 
+    // Same as rwkv_eval_sequence, but gives logits and state after every token of the sequence, as if each prefix was evaluated separately.
+    // This allows to verify several guessed tokens at once, and to continue from the state after the last correct one.
+    // Uses its own cached graph, which is kept next to the graph of rwkv_eval_sequence.
+    // Returns false on any error.
+    // - tokens: pointer to an array of sequence_len tokens; must not be empty.
+    // - state_in: FP32 buffer of size rwkv_get_state_len(), or NULL if this is a first pass.
+    // - logits_out: FP32 buffer of size sequence_len * rwkv_get_logits_len(); row i receives logits after token i. May be NULL.
+    // - states_out: FP32 buffer of size sequence_len * rwkv_get_state_len(); row i receives the state after token i. May be NULL.
+    RWKV_API bool rwkv_eval_sequence_per_token(
+        struct rwkv_context * ctx,
+        const uint32_t * tokens,
+        const size_t sequence_len,
+        const float * state_in,
+        float * logits_out,
+        float * states_out
+    );
+
+    // Evaluates the model for a sequence of tokens and gives its embedding instead of logits: the final hidden state normalized by ln_out.
+    // The head is not computed, which saves most of the work for models with large vocabularies.
+    // Uses its own cached graph, which is kept next to the graph of rwkv_eval_sequence.
+    // Returns false on any error.
+    // - tokens: pointer to an array of sequence_len tokens; must not be empty.
+    // - state_in: FP32 buffer of size rwkv_get_state_len(), or NULL if this is a first pass.
+    // - state_out: FP32 buffer of size rwkv_get_state_len(). This buffer will be written to if non-NULL.
+    // - embedding_out: FP32 buffer of size rwkv_get_n_embed(). This buffer will be written to if non-NULL.
+    // - mean_pool: if true, gives the mean of embeddings of all tokens; otherwise, the embedding of the last token.
+    RWKV_API bool rwkv_eval_sequence_embed(
+        struct rwkv_context * ctx,
+        const uint32_t * tokens,
+        const size_t sequence_len,
+        const float * state_in,
+        float * state_out,
+        float * embedding_out,
+        const bool mean_pool
+    );
+
+    // Same as rwkv_eval_sequence_embed, but for several independent sequences, each starting from state_in.
+    // Sequences are evaluated in chunks of chunk_len tokens; the last chunk of every sequence is padded, so that all chunks
+    // reuse a single cached graph regardless of sequence lengths.
+    // Returns false on any error.
+    // - sequences: n_sequences pointers to arrays of tokens; no sequence may be empty.
+    // - sequence_lens: n_sequences lengths of the sequences.
+    // - chunk_len: count of tokens per chunk, or 0 for 64 tokens, or the length of the longest sequence if it is shorter.
+    //   Every sequence is padded to a multiple of it, so one long sequence does not make all others evaluate its length.
+    // - state_in: FP32 buffer of size rwkv_get_state_len(), or NULL to start every sequence from the initial state.
+    // - embeddings_out: FP32 buffer of size n_sequences * rwkv_get_n_embed(); row i receives the embedding of sequence i.
+    RWKV_API bool rwkv_eval_sequence_embed_batch(
+        struct rwkv_context * ctx,
+        const uint32_t * const * sequences,
+        const size_t * sequence_lens,
+        const size_t n_sequences,
+        const size_t chunk_len,
+        const float * state_in,
+        const bool mean_pool,
+        float * embeddings_out
+    );
+
+    // Called between chunks by rwkv_eval_sequence_chunked. Returning true stops the evaluation.
+    // May be called from any thread that runs the evaluation, so it must be thread-safe if the evaluation is asynchronous.
+    typedef bool (* rwkv_abort_callback)(void * user_data);
+
+    // Returns current time of a monotonic clock in microseconds, for computing deadlines of rwkv_eval_sequence_chunked.
+    RWKV_API int64_t rwkv_time_us(void);
+
+    // Same as rwkv_eval_sequence, but evaluates the sequence in chunks of chunk_len tokens, and checks the deadline
+    // and the abort callback before each chunk. This allows to stop evaluation of a long sequence which is no longer needed.
+    // If evaluation was stopped, returns false with RWKV_ERROR_CTX | RWKV_ERROR_CANCELLED; no error message is printed.
+    // In that case state_out contains the state after the last fully evaluated chunk (or state_in, if no chunk was evaluated),
+    // so evaluation can be resumed from tokens + *processed_len; logits_out is written only if the whole sequence was evaluated.
+    // Chunks reuse the cached sequence graph; a sequence_len that is not a multiple of chunk_len uses a second graph for the last chunk,
+    // which is kept next to the first one, so following calls build no graphs.
+    // Returns false with RWKV_ERROR_ARGS if the sequence is empty.
+    // - chunk_len: count of tokens per chunk, or 0 to evaluate the sequence as a single chunk.
+    // - deadline_us: rwkv_time_us value after which evaluation stops, or 0 for no deadline.
+    // - abort_callback: checked before each chunk; may be NULL.
+    // - abort_user_data: passed to the abort callback.
+    // - processed_len: if non-NULL, receives the count of evaluated tokens, also on failure.
+    RWKV_API bool rwkv_eval_sequence_chunked(
+        struct rwkv_context * ctx,
+        const uint32_t * tokens,
+        const size_t sequence_len,
+        const size_t chunk_len,
+        const float * state_in,
+        float * state_out,
+        float * logits_out,
+        const int64_t deadline_us,
+        rwkv_abort_callback abort_callback,
+        void * abort_user_data,
+        size_t * processed_len
+    );
+
+    // Parameters of token sampling in rwkv_generate.
+    struct rwkv_sampler_params {
+        // Logits are divided by the temperature before softmax; 0 always picks the most likely token.
+        float temperature;
+        // Only the most likely tokens whose probabilities add up to top_p are kept; 1 disables nucleus sampling.
+        float top_p;
+        // Only the top_k most likely tokens are kept; 0 disables it.
+        uint32_t top_k;
+        // Subtracted from logits of every token that was already generated.
+        float presence_penalty;
+        // Subtracted from logits of every token once for each time it was already generated.
+        float frequency_penalty;
+        // Seed of the random generator. The same seed, inputs and parameters give the same tokens.
+        uint64_t seed;
+    };
+
+    // A sequence of tokens that ends generation, for example { 0 } for the end of text in RWKV vocabularies.
+    struct rwkv_stop_sequence {
+        const uint32_t * tokens;
+        size_t len;
+    };
+
+    // Called by rwkv_generate for every generated token. Returning true stops the generation.
+    typedef bool (* rwkv_token_callback)(const uint32_t token, void * user_data);
+
+    // Evaluates the prompt as a sequence, then samples up to max_tokens tokens, evaluating each of them to get the logits of the next one.
+    // Sampling and stop sequence checks run in the library, so there is no per-token overhead outside of the model.
+    // Generation stops after a stop sequence was generated; tokens of the stop sequence are not returned. Tokens that may
+    // start a stop sequence are held back until it is known that they do not, so the callback never sees a stop sequence.
+    // Returns false on any error.
+    // - prompt_tokens: tokens to evaluate before sampling; at least one.
+    // - params: sampling parameters; or NULL to always pick the most likely token.
+    // - stop_sequences: array of n_stop_sequences non-empty sequences; may be NULL if n_stop_sequences is 0.
+    // - state_in: FP32 buffer of size rwkv_get_state_len(); or NULL, if this is a first pass.
+    // - state_out: FP32 buffer of size rwkv_get_state_len(), receives the state after the prompt and all sampled tokens,
+    //   including stop sequences; may be NULL.
+    // - tokens_out: buffer of max_tokens tokens that receives the generated tokens; may be NULL.
+    // - generated_len: if non-NULL, receives the count of generated tokens, also on failure.
+    // - callback: called for every generated token, in order, as soon as it is known not to start a stop sequence; may be NULL.
+    RWKV_API bool rwkv_generate(
+        struct rwkv_context * ctx,
+        const uint32_t * prompt_tokens,
+        const size_t prompt_len,
+        const size_t max_tokens,
+        const struct rwkv_sampler_params * params,
+        const struct rwkv_stop_sequence * stop_sequences,
+        const size_t n_stop_sequences,
+        const float * state_in,
+        float * state_out,
+        uint32_t * tokens_out,
+        size_t * generated_len,
+        rwkv_token_callback callback,
+        void * user_data
+    );
+
+    // Samples a token from n_vocab logits in the same way as rwkv_generate, for callers that evaluate tokens themselves,
+    // for example with rwkv_scheduler. Penalties of params are not applied, since they depend on the generated tokens.
+    // - params: sampling parameters; or NULL to always pick the most likely token.
+    // - rng: state of the random generator, updated by every call. If it is 0, it is started from params->seed as in rwkv_generate.
+    RWKV_API uint32_t rwkv_sample_logits(
+        const float * logits,
+        const size_t n_vocab,
+        const struct rwkv_sampler_params * params,
+        uint64_t * rng
+    );
+
+    enum rwkv_speculation_mode {
+        // Tokens are drafted by a smaller model with the same vocabulary, see rwkv_speculation_params.draft_ctx.
+        RWKV_SPECULATION_DRAFT_MODEL = 0,
+        // Tokens that followed an earlier occurrence of the last tokens in the prompt or the sampled tokens are drafted,
+        // see rwkv_speculation_params.ngram_len. Works well when the output copies spans of the prompt, as in summaries and code edits.
+        // If the last tokens did not occur before, a single token is evaluated and sampled as in rwkv_generate.
+        RWKV_SPECULATION_PROMPT_LOOKUP = 1,
+        // Tokens are drafted by the model itself, evaluating only some of its layers, see rwkv_speculation_params.layer_mask.
+        // Needs no extra weights; the library keeps a clone of the context for drafting, which is freed with the context.
+        // The draft starts from the state after the prompt, then keeps its own state, in which skipped layers are unchanged.
+        RWKV_SPECULATION_LAYER_SKIP = 2
+    };
+
+    // Parameters of speculative generation in rwkv_generate_speculative.
+    struct rwkv_speculation_params {
+        enum rwkv_speculation_mode mode;
+        // Count of tokens drafted before each verification by the model; at least 1.
+        uint32_t n_draft;
+
+        // For RWKV_SPECULATION_DRAFT_MODEL: context of the draft model, which must not be the context of the model.
+        struct rwkv_context * draft_ctx;
+        // For RWKV_SPECULATION_DRAFT_MODEL: state of the draft model before the prompt, of size rwkv_get_state_len(draft_ctx);
+        // or NULL, if this is a first pass.
+        const float * draft_state_in;
+        // For RWKV_SPECULATION_DRAFT_MODEL: receives the state of the draft model after the prompt and all sampled tokens; may be NULL.
+        float * draft_state_out;
+
+        // For RWKV_SPECULATION_PROMPT_LOOKUP: count of last tokens to look up; at least 1.
+        // If they did not occur before, fewer last tokens are looked up, down to a single one.
+        uint32_t ngram_len;
+
+        // For RWKV_SPECULATION_LAYER_SKIP: array of n_layer flags, true for layers that drafting evaluates, for example
+        // the first few layers; at least one must be set. NULL evaluates every other layer, starting with the first one.
+        // ln_out and the head are always evaluated.
+        const bool * layer_mask;
+    };
+
+    // Counters of rwkv_generate_speculative, to tune n_draft.
+    struct rwkv_speculation_stats {
+        // Count of drafted tokens.
+        size_t drafted;
+        // Count of drafted tokens that were accepted by the model.
+        size_t accepted;
+        // Count of evaluations of the model that verified drafted tokens.
+        size_t verifications;
+    };
+
+    // Same as rwkv_generate, but drafts n_draft tokens at a time, and verifies them by evaluating the model on all of them at once,
+    // see rwkv_eval_sequence_per_token. Drafted tokens are accepted so that sampled tokens follow the same distribution
+    // as with rwkv_generate; with greedy sampling, the same tokens are generated, up to differences in rounding.
+    // Each verification gives at least one token, and up to n_draft + 1 if all drafted tokens are accepted.
+    // - speculation: how tokens are drafted.
+    // - stats: if non-NULL, receives counters of drafted and accepted tokens, also on failure.
+    // Other arguments are the same as for rwkv_generate.
+    RWKV_API bool rwkv_generate_speculative(
+        struct rwkv_context * ctx,
+        const struct rwkv_speculation_params * speculation,
+        struct rwkv_speculation_stats * stats,
+        const uint32_t * prompt_tokens,
+        const size_t prompt_len,
+        const size_t max_tokens,
+        const struct rwkv_sampler_params * params,
+        const struct rwkv_stop_sequence * stop_sequences,
+        const size_t n_stop_sequences,
+        const float * state_in,
+        float * state_out,
+        uint32_t * tokens_out,
+        size_t * generated_len,
+        rwkv_token_callback callback,
+        void * user_data
+    );
+
+    // Executor that runs asynchronous evaluations on a fixed set of worker threads owned by the library.
+    // A single executor can serve any number of contexts; each worker runs one evaluation at a time,
+    // which itself uses the thread count of its context.
+    struct rwkv_executor;
+
+    // Handle of an asynchronous evaluation, see rwkv_eval_async.
+    struct rwkv_async;
+
+    enum rwkv_async_status {
+        // Queued, and can be cancelled.
+        RWKV_ASYNC_PENDING = 0,
+        RWKV_ASYNC_RUNNING = 1,
+
+        // Final states. Once an evaluation reaches one of them, its callback is called.
+        RWKV_ASYNC_DONE = 2,
+        // Evaluation returned false; call rwkv_get_last_error on the context for details.
+        RWKV_ASYNC_FAILED = 3,
+        RWKV_ASYNC_CANCELLED = 4
+    };
+
+    // Called once an asynchronous evaluation reaches a final state: from a worker thread,
+    // or from rwkv_async_cancel, rwkv_async_free or rwkv_executor_free if the evaluation was cancelled.
+    // The context can already be used for the next evaluation when the callback is called.
+    // The handle stays valid during the callback, even if it was already freed by the caller.
+    typedef void (* rwkv_async_callback)(struct rwkv_async * handle, enum rwkv_async_status status, void * user_data);
+
+    // Creates an executor with the given count of worker threads. Returns NULL on any error.
+    RWKV_API struct rwkv_executor * rwkv_executor_new(const uint32_t n_workers);
+
+    // Returns a file descriptor that becomes readable every time an evaluation of the executor reaches a final state,
+    // so that event loops can wait for completions with poll/epoll/kqueue instead of callbacks.
+    // After it becomes readable, read and discard all available data, then check statuses of pending handles.
+    // On Linux this is a non-blocking eventfd, on other POSIX systems the read end of a non-blocking pipe. Returns -1 on Windows.
+    RWKV_API int rwkv_executor_get_fd(const struct rwkv_executor * executor);
+
+    // Cancels pending evaluations, waits for running ones, and frees the executor.
+    // Handles of its evaluations stay valid and must still be freed with rwkv_async_free.
+    RWKV_API void rwkv_executor_free(struct rwkv_executor * executor);
+
+    // Same as rwkv_eval, but queues the evaluation on the executor and returns immediately.
+    // A context can have only one asynchronous evaluation at a time; submitting another one before the previous one
+    // reaches a final state fails. The context must not be used or freed until then.
+    // Buffers are not copied: state_in, state_out and logits_out must stay valid until the evaluation reaches a final state.
+    // Returns NULL on any error.
+    // - callback: called when the evaluation reaches a final state; may be NULL.
+    // - user_data: passed to the callback.
+    RWKV_API struct rwkv_async * rwkv_eval_async(
+        struct rwkv_executor * executor,
+        struct rwkv_context * ctx,
+        const uint32_t token,
+        const float * state_in,
+        float * state_out,
+        float * logits_out,
+        rwkv_async_callback callback,
+        void * user_data
+    );
+
+    // Same as rwkv_eval_sequence, but asynchronous, see rwkv_eval_async. Tokens are copied and do not need to outlive the call.
+    RWKV_API struct rwkv_async * rwkv_eval_sequence_async(
+        struct rwkv_executor * executor,
+        struct rwkv_context * ctx,
+        const uint32_t * tokens,
+        const size_t sequence_len,
+        const float * state_in,
+        float * state_out,
+        float * logits_out,
+        rwkv_async_callback callback,
+        void * user_data
+    );
+
+    // Returns the current status of the evaluation.
+    RWKV_API enum rwkv_async_status rwkv_async_get_status(const struct rwkv_async * handle);
+
+    // Blocks until the evaluation reaches a final state, and returns it.
+    RWKV_API enum rwkv_async_status rwkv_async_wait(struct rwkv_async * handle);
+
+    // Cancels the evaluation if it has not started yet; its callback is then called before this function returns.
+    // Returns true if the evaluation was cancelled.
+    RWKV_API bool rwkv_async_cancel(struct rwkv_async * handle);
+
+    // Cancels the evaluation if it has not started yet, and frees the handle. Does not wait for a running evaluation:
+    // its buffers must stay valid until the callback is called. Can be called from the callback.
+    RWKV_API void rwkv_async_free(struct rwkv_async * handle);
+
+    // Continuous batching scheduler that evaluates many sessions on a few contexts of the same model.
+    // Each session has a queue of tokens and a state buffer owned by the caller. Every iteration evaluates one step
+    // for up to one session per context, in parallel: first a single token for each session that is decoding
+    // (has one token left), then chunks of chunk_len tokens, or the rest of the prompt if it is shorter, for sessions that are
+    // in prefill, while they fit into batch_tokens tokens. While a prompt waits, decoding leaves one context and the prompt's chunk
+    // for prefill; with a single context, or a chunk that takes the whole batch, decoding and prefill take turns.
+    // Sessions are taken in round-robin order, so long prompts never block decoding sessions for more than a chunk,
+    // many decoding sessions never block new prompts, and no session starves. Sessions join and leave between iterations.
+    // Chunks are not cut to fill the batch, and each step goes to a context that already has a graph for its length if there is one,
+    // so contexts rarely build graphs, see rwkv_eval_sequence.
+    // Functions that operate on rwkv_scheduler must not be called concurrently.
+    struct rwkv_scheduler;
+
+    // Called by rwkv_scheduler_step for every session whose tokens were all evaluated, or whose evaluation failed.
+    // The session is removed from the scheduler before the call, so the callback can submit the next tokens of the session.
+    typedef void (* rwkv_scheduler_callback)(const uint64_t session_id, const bool success, void * user_data);
+
+    // Occupancy of a single scheduler iteration.
+    struct rwkv_scheduler_stats {
+        // Count of sessions that evaluated a single token.
+        size_t decode_sessions;
+        // Count of sessions that evaluated a prompt chunk.
+        size_t prefill_sessions;
+        // Count of tokens evaluated in the iteration, at most batch_tokens.
+        size_t tokens;
+        // Count of sessions with tokens left that did not fit into the iteration.
+        size_t waiting_sessions;
+        int64_t duration_us;
+    };
+
+    // Creates a scheduler that evaluates sessions on the given contexts, which must be contexts of the same model,
+    // for example clones created with rwkv_clone_context. Contexts are not freed by the scheduler, and must not be used
+    // by the caller while rwkv_scheduler_step runs. Returns NULL on any error.
+    // - batch_tokens: largest count of tokens evaluated in one iteration.
+    // - chunk_len: largest count of tokens evaluated for one session in one iteration; at most batch_tokens are used.
+    // - callback: called when a session leaves the scheduler; may be NULL.
+    RWKV_API struct rwkv_scheduler * rwkv_scheduler_new(
+        struct rwkv_context ** contexts,
+        const size_t n_contexts,
+        const size_t batch_tokens,
+        const size_t chunk_len,
+        rwkv_scheduler_callback callback,
+        void * user_data
+    );
+
+    // Frees the scheduler. Sessions that are still queued are dropped without calling the callback.
+    RWKV_API void rwkv_scheduler_free(struct rwkv_scheduler * scheduler);
+
+    // Adds a session that evaluates the given tokens. Tokens are copied; buffers must stay valid until the session leaves.
+    // A session can only be submitted again after it left the scheduler. Returns false on any error.
+    // - state: FP32 buffer of size rwkv_get_state_len(), holding the state to start from; updated after every step.
+    // - logits_out: FP32 buffer of size rwkv_get_logits_len(), written after the last token; or NULL.
+    RWKV_API bool rwkv_scheduler_submit(
+        struct rwkv_scheduler * scheduler,
+        const uint64_t session_id,
+        const uint32_t * tokens,
+        const size_t n_tokens,
+        float * state,
+        float * logits_out
+    );
+
+    // Same as rwkv_scheduler_submit, but the last chunk gives the embedding of the last token, see rwkv_eval_sequence_embed.
+    // - embedding_out: FP32 buffer of size rwkv_get_n_embed(), written after the last token.
+    RWKV_API bool rwkv_scheduler_submit_embed(
+        struct rwkv_scheduler * scheduler,
+        const uint64_t session_id,
+        const uint32_t * tokens,
+        const size_t n_tokens,
+        float * state,
+        float * embedding_out
+    );
+
+    // Same as rwkv_scheduler_submit, but gives logits after every token, see rwkv_eval_sequence_per_token.
+    // This allows to score tokens of a text in prompt-sized chunks instead of one token per iteration.
+    // - logits_out: FP32 buffer of size n_tokens * rwkv_get_logits_len(); row i receives logits after token i.
+    RWKV_API bool rwkv_scheduler_submit_per_token(
+        struct rwkv_scheduler * scheduler,
+        const uint64_t session_id,
+        const uint32_t * tokens,
+        const size_t n_tokens,
+        float * state,
+        float * logits_out
+    );
+
+    // Removes the session without calling the callback. The state holds all tokens evaluated until then.
+    // Returns false if the scheduler does not contain the session.
+    RWKV_API bool rwkv_scheduler_cancel(struct rwkv_scheduler * scheduler, const uint64_t session_id);
+
+    // Returns the count of sessions in the scheduler.
+    RWKV_API size_t rwkv_scheduler_get_n_sessions(const struct rwkv_scheduler * scheduler);
+
+    // Runs one iteration, then calls the callback for sessions that left. Does nothing if there are no sessions.
+    // Returns false on any error; sessions whose evaluation failed are reported to the callback then.
+    // - stats: occupancy of the iteration; may be NULL.
+    RWKV_API bool rwkv_scheduler_step(struct rwkv_scheduler * scheduler, struct rwkv_scheduler_stats * stats);
+
     // Returns the number of tokens in the given model's vocabulary.
     // Useful for telling 20B_tokenizer models (n_vocab = 50277) apart from World models (n_vocab = 65536).
     RWKV_API size_t rwkv_get_n_vocab(const struct rwkv_context * ctx);
@@ -147,12 +616,237 @@ extern "C" {
     // This is currently always identical to n_vocab.
     RWKV_API size_t rwkv_get_logits_len(const struct rwkv_context * ctx);
 
+    // Returns the size in bytes of the model weights, which are shared by the context and all contexts cloned from it.
+    RWKV_API size_t rwkv_get_model_size(const struct rwkv_context * ctx);
+
+    // Returns the size in bytes of memory that a context of this model allocates, excluding model weights and the sequence graph:
+    // state buffers, logits, the adapter and the serial graph.
+    // - n_threads: thread count of the context; the serial graph work buffer grows with it.
+    //   This is also the size of a context created by rwkv_clone_context with the same thread count.
+    RWKV_API size_t rwkv_get_context_size(const struct rwkv_context * ctx, const uint32_t n_threads);
+
+    // Returns the size in bytes of the sequence graph that rwkv_eval_sequence builds for the given sequence length.
+    // A context keeps up to 4 sequence graphs, see rwkv_eval_sequence; under a memory limit, kept graphs are freed before
+    // a new graph would exceed it, so only the graph in use counts against the limit.
+    RWKV_API size_t rwkv_get_sequence_graph_size(const struct rwkv_context * ctx, const size_t sequence_len);
+
+    // Limits memory allocated by the context to rwkv_get_context_size plus rwkv_get_sequence_graph_size.
+    // Building a graph that would exceed the limit fails before allocating anything, with RWKV_ERROR_CTX | RWKV_ERROR_ALLOC;
+    // rwkv_eval_sequence fails in that case, but the context can still be used with shorter sequences.
+    // Cloned contexts inherit the limit, and rwkv_clone_context fails if the new context would exceed it.
+    // - limit: limit in bytes, or 0 to remove the limit. Already allocated memory is not affected.
+    RWKV_API void rwkv_set_memory_limit(struct rwkv_context * ctx, const size_t limit);
+
+    // Pins threads that compute graphs of the context, including the thread calling rwkv_eval, to the given CPUs.
+    // The calling thread gets its previous affinity back when the evaluation returns. Cloned contexts inherit the CPUs.
+    // Linux only. Returns false on any error; the context keeps its previous CPUs then.
+    // - cpus: indices of CPUs as numbered by the OS, or NULL to remove pinning.
+    // - n_cpus: count of elements in cpus.
+    RWKV_API bool rwkv_set_cpu_affinity(struct rwkv_context * ctx, const uint32_t * cpus, const size_t n_cpus);
+
+    // Same as rwkv_clone_context, but the new context gets its own copy of model weights placed on the given NUMA node,
+    // and is pinned to CPUs of that node, so that it never reads weights from another node.
+    // Contexts cloned from the new context share its copy. The adapter of the context is applied to the new context,
+    // and adapters loaded for either context can be used with both; adapter tensors are not copied.
+    // The memory limit of the context must fit both the new context and the copy of weights.
+    // Linux only. Returns NULL on any error.
+    RWKV_API struct rwkv_context * rwkv_clone_context_to_numa_node(struct rwkv_context * ctx, const uint32_t n_threads, const uint32_t node);
+
+    // Ways to evaluate the model, which usually have different optimal thread counts:
+    // serial evaluation is limited by memory bandwidth, and sequence evaluation by compute.
+    enum rwkv_eval_mode {
+        // rwkv_eval.
+        RWKV_EVAL_SERIAL = 0,
+        // rwkv_eval_sequence and functions built on it.
+        RWKV_EVAL_SEQUENCE = 1
+    };
+
+    // Sets the count of threads that evaluations in the given mode compute with. Can be called between any evaluations.
+    // Initially, serial evaluation uses the thread count passed when creating the context, and sequence evaluation uses 1 thread.
+    // Increasing the serial thread count above the largest one used so far rebuilds the serial graph, which can fail
+    // because of the memory limit; the context stays usable with its previous thread count then.
+    // Increasing the sequence thread count makes the next sequence evaluation rebuild its graph.
+    // Returns false on any error.
+    RWKV_API bool rwkv_set_n_threads(struct rwkv_context * ctx, const enum rwkv_eval_mode mode, const uint32_t n_threads);
+
+    // Returns the count of threads that evaluations in the given mode compute with.
+    RWKV_API uint32_t rwkv_get_n_threads(const struct rwkv_context * ctx, const enum rwkv_eval_mode mode);
+
+    // Measures evaluation time in the given mode with 1, 2, 4, ... and max_threads threads, and sets the fastest thread count.
+    // Takes a few evaluations per candidate, so it is intended to be called once after loading the model; the result
+    // can then be read with rwkv_get_n_threads and reused for other contexts of the same model on the same machine.
+    // Returns false on any error.
+    // - max_threads: largest thread count to try, or 0 to use the count of hardware threads.
+    // - sequence_len: count of tokens to evaluate in sequence mode, ideally the typical prompt chunk length. Ignored in serial mode.
+    RWKV_API bool rwkv_tune_n_threads(struct rwkv_context * ctx, const enum rwkv_eval_mode mode, const uint32_t max_threads, const size_t sequence_len);
+
+    // Pool of threads shared by contexts that run concurrently, so that the total count of threads computing graphs
+    // stays within the pool instead of growing with the count of contexts.
+    // Each evaluation of an attached context takes up to the thread count of the context from the budget,
+    // waits if none are available, and returns them once the graph is computed.
+    struct rwkv_thread_budget;
+
+    // Creates a thread budget. Returns NULL on any error.
+    // - n_threads: total count of threads, or 0 to use all hardware threads.
+    RWKV_API struct rwkv_thread_budget * rwkv_thread_budget_new(const uint32_t n_threads);
+
+    // Frees the thread budget. No contexts must be attached to it.
+    RWKV_API void rwkv_thread_budget_free(struct rwkv_thread_budget * budget);
+
+    // Attaches the context to the thread budget, or detaches it if budget is NULL. Must not be called during an evaluation.
+    // Cloned contexts are attached to the budget of the original context.
+    RWKV_API void rwkv_set_thread_budget(struct rwkv_context * ctx, struct rwkv_thread_budget * budget);
+
     // Initializes the given state so that passing it to rwkv_eval or rwkv_eval_sequence would be identical to passing NULL.
     // Useful in cases where tracking the first call to these functions may be annoying or expensive.
     // State must be initialized for behavior to be defined, passing a zeroed state to rwkv.cpp functions will result in NaNs.
     // - state: FP32 buffer of size rwkv_get_state_len() to initialize
     RWKV_API void rwkv_init_state(const struct rwkv_context * ctx, float * state);
 
+    // Encodings of serialized states. Each layer state consists of ffn_xx, att_xx, att_aa, att_bb and att_pp;
+    // att_pp is a log-scale exponent, where rounding errors would be amplified, so it is always kept in FP32.
+    enum rwkv_state_encoding {
+        // Lossless: all values in FP32.
+        RWKV_STATE_FP32 = 0,
+        // ffn_xx and att_xx in FP16; att_aa, att_bb and att_pp in FP32.
+        RWKV_STATE_FP16 = 1,
+        // ffn_xx and att_xx in FP16; att_aa and att_bb quantized to 8 bits in blocks of 32 values with an FP32 scale each;
+        // att_pp in FP32. About half the size of RWKV_STATE_FP32.
+        RWKV_STATE_Q8 = 2
+    };
+
+    // Returns the size in bytes of a state of the given model serialized with the given encoding, including the header;
+    // or 0 if the encoding is unknown.
+    RWKV_API size_t rwkv_state_serialized_size(const struct rwkv_context * ctx, const enum rwkv_state_encoding encoding);
+
+    // Serializes the state into a buffer that can be stored and later passed to rwkv_state_deserialize.
+    // The buffer starts with a versioned header holding the model dimensions and a fingerprint of the model, so that
+    // a state can not be restored into a different model. Fingerprints only depend on the model file the context
+    // was loaded from, not on the data type it is loaded in or on adapters.
+    // Returns false on any error.
+    // - state: FP32 buffer of size rwkv_get_state_len().
+    // - buffer: buffer of at least rwkv_state_serialized_size() bytes.
+    // - buffer_size: size of buffer in bytes.
+    RWKV_API bool rwkv_state_serialize(
+        struct rwkv_context * ctx,
+        const float * state,
+        const enum rwkv_state_encoding encoding,
+        void * buffer,
+        const size_t buffer_size
+    );
+
+    // Restores a state serialized by rwkv_state_serialize with any encoding.
+    // Fails with RWKV_ERROR_ARGS if the buffer is damaged, or was serialized by a different model or a newer version.
+    // Returns false on any error; state_out may be partially written then.
+    // - buffer: serialized state.
+    // - buffer_size: size of the serialized state in bytes.
+    // - state_out: FP32 buffer of size rwkv_get_state_len().
+    RWKV_API bool rwkv_state_deserialize(struct rwkv_context * ctx, const void * buffer, const size_t buffer_size, float * state_out);
+
+    // File of fixed-size slots, each holding one serialized state of a session, mapped into memory.
+    // An index of sessions is kept in memory, so finding a session never touches the disk. Loading a session
+    // decodes it straight from the mapping into the state buffer of the caller, which costs at most one page-in.
+    // Slots that were not used recently are written back and dropped from RAM once more than max_resident slots
+    // were used, so that idle sessions only take disk space. Not supported on Windows.
+    // All functions that operate on rwkv_session_store are thread-safe.
+    struct rwkv_session_store;
+
+    // Opens the session store in the given file, or creates it if the file does not exist.
+    // The store keeps states of the model of ctx in the given encoding, see rwkv_state_serialize; opening a store
+    // that was created for a model with other dimensions or with another encoding fails with RWKV_ERROR_ARGS | RWKV_ERROR_DIMENSION.
+    // Returns NULL on any error; call rwkv_get_last_error on ctx for details.
+    // - max_sessions: count of slots in a new store; ignored when opening an existing store.
+    // - max_resident: count of slots to keep in RAM, or 0 to leave paging to the OS.
+    RWKV_API struct rwkv_session_store * rwkv_session_store_open(
+        struct rwkv_context * ctx,
+        const char * path,
+        const enum rwkv_state_encoding encoding,
+        const size_t max_sessions,
+        const size_t max_resident
+    );
+
+    // Writes back all slots and closes the store.
+    RWKV_API void rwkv_session_store_close(struct rwkv_session_store * store);
+
+    // Returns whether the store contains a state of the given session.
+    RWKV_API bool rwkv_session_store_contains(struct rwkv_session_store * store, const uint64_t session_id);
+
+    // Returns the count of sessions in the store.
+    RWKV_API size_t rwkv_session_store_get_count(struct rwkv_session_store * store);
+
+    // Serializes the state of the session into its slot, replacing the previous state of the session.
+    // Fails with RWKV_ERROR_CTX | RWKV_ERROR_ALLOC if the session is new and all slots are taken.
+    // Returns false on any error; call rwkv_get_last_error on ctx for details.
+    // - state: FP32 buffer of size rwkv_get_state_len().
+    RWKV_API bool rwkv_session_store_save(struct rwkv_session_store * store, struct rwkv_context * ctx, const uint64_t session_id, const float * state);
+
+    // Restores the state of the session. ctx must be a context of the model the state was saved with.
+    // Fails with RWKV_ERROR_ARGS | RWKV_ERROR_KEY if the store does not contain the session.
+    // Returns false on any error; call rwkv_get_last_error on ctx for details.
+    // - state_out: FP32 buffer of size rwkv_get_state_len().
+    RWKV_API bool rwkv_session_store_load(struct rwkv_session_store * store, struct rwkv_context * ctx, const uint64_t session_id, float * state_out);
+
+    // Removes the session from the store, freeing its slot. Returns false if the store did not contain the session.
+    RWKV_API bool rwkv_session_store_remove(struct rwkv_session_store * store, const uint64_t session_id);
+
+    // Parts of a layer that profiling results are aggregated by.
+    enum rwkv_profile_category {
+        // Matrix multiplications, including products of adapters.
+        RWKV_PROFILE_MATMUL = 0,
+        // The WKV recurrence of attention.
+        RWKV_PROFILE_WKV = 1,
+        RWKV_PROFILE_LAYER_NORM = 2,
+        // Token shift, element-wise operations and state copies.
+        RWKV_PROFILE_OTHER = 3,
+
+        RWKV_PROFILE_CATEGORY_COUNT = 4
+    };
+
+    // Profiling modes. These are flags, so multiple modes can be combined.
+    enum rwkv_profile_flags {
+        RWKV_PROFILE_NONE = 0,
+
+        // Aggregates graph node executions by layer and category, see rwkv_get_profile.
+        RWKV_PROFILE_AGGREGATE = 1 << 0,
+
+        // Additionally records every evaluation and graph node execution for rwkv_dump_profile_trace.
+        // Memory usage grows with each evaluation until rwkv_reset_profile is called.
+        RWKV_PROFILE_TRACE = 1 << 1
+    };
+
+    // Profiling results for a single category of a single layer.
+    struct rwkv_profile_entry {
+        // Layer index; -1 for the embedding and blocks.0.ln0, n_layer for ln_out and the head.
+        int32_t layer;
+        enum rwkv_profile_category category;
+
+        // Count of graph node executions.
+        uint64_t calls;
+
+        // Wall time, and CPU time of all threads, in microseconds.
+        // Node times are measured by ggml only when rwkv.cpp is built with RWKV_PERF CMake option (GGML_PERF); otherwise they are zero.
+        uint64_t wall_us;
+        uint64_t cpu_us;
+    };
+
+    // Enables or disables profiling of following evaluations of the context. Profiling is disabled by default.
+    // Collected results are kept when profiling is disabled.
+    // - flags: bitwise combination of rwkv_profile_flags, or RWKV_PROFILE_NONE to disable profiling.
+    RWKV_API void rwkv_set_profiling(struct rwkv_context * ctx, const uint32_t flags);
+
+    // Copies profiling results into entries, ordered by layer, then by category.
+    // Returns the total count of entries, which is (n_layer + 2) * RWKV_PROFILE_CATEGORY_COUNT once profiling was enabled, or 0.
+    // - entries: buffer of max_entries elements, or NULL to only get the count.
+    RWKV_API size_t rwkv_get_profile(const struct rwkv_context * ctx, struct rwkv_profile_entry * entries, const size_t max_entries);
+
+    // Clears collected profiling results and the trace.
+    RWKV_API void rwkv_reset_profile(struct rwkv_context * ctx);
+
+    // Writes the recorded trace as Chrome trace event JSON, which can be opened in chrome://tracing or Perfetto.
+    // Each evaluation is an event with the count of tokens; graph nodes are events with layer indices, if node times are measured.
+    // Returns false on any error.
+    RWKV_API bool rwkv_dump_profile_trace(struct rwkv_context * ctx, const char * trace_file_path);
+
     // Frees all allocated memory and the context.
     // Does not need to be called on the same thread that created the rwkv_context.
     RWKV_API void rwkv_free(struct rwkv_context * ctx);
@@ -170,6 +864,20 @@ extern "C" {
     // - Q8_0
     RWKV_API bool rwkv_quantize_model_file(const char * model_file_path_in, const char * model_file_path_out, const char * format_name);
 
+    // Same as rwkv_quantize_model_file, but quantizes large tensors using multiple threads, and allows choosing format per tensor.
+    // Reading, quantizing and writing of successive tensors are overlapped, with at most 3 tensors held in memory at once.
+    // - recipe: either a single format name, or a quantization recipe.
+    //   A recipe is a list of items separated by commas, semicolons or new lines; text after '#' up to the end of line is ignored.
+    //   Each item is either a format name, which is used for all 2D tensors except emb.weight and head.weight;
+    //   or PATTERN=FORMAT, which is used for 2D tensors with names matching the pattern. The last matching item wins.
+    //   emb.weight may be quantized this way too: only embedding rows of evaluated tokens are dequantized at runtime.
+    //   In patterns, '*' matches any substring, '?' matches any character, and {...} matches a number from a list of numbers
+    //   and A..B ranges, where negative numbers count from the layer count. FP16 and FP32 are also allowed as formats.
+    //   Example: "Q5_1, *.ffn.key.weight=Q4_0, blocks.{0,-1}.*=Q8_0, *.att.output.weight=Q8_0, head.weight=Q8_0"
+    // - n_threads: count of threads to quantize a single tensor with; or 0 to use all hardware threads.
+    //   Tensors are quantized one at a time, so this is the total count of quantization threads.
+    RWKV_API bool rwkv_quantize_model_file_ex(const char * model_file_path_in, const char * model_file_path_out, const char * recipe, const uint32_t n_threads);
+
     // Returns system information string.
     RWKV_API const char * rwkv_get_system_info_string(void);
 
@@ -0,0 +1,99 @@
+# Converts a LoRA checkpoint in PyTorch format (.pth) into an rwkv.cpp adapter file, which can be applied at runtime with rwkv_lora_from_file.
+# Unlike merge_lora_into_ggml.py, this does not create a full copy of the model: many adapters can share a single loaded model.
+# Usage: python convert_lora_to_ggml.py C:\rwkv.cpp-169M.bin C:\my-lora.pth 32 C:\my-lora-169M.bin
+# LoRA format is compatible with https://github.com/Blealtan/RWKV-LM-LoRA
+# You need to know lora_alpha value to perform the conversion.
+# Source model can be in any format; it is used only to read model dimensions.
+
+import argparse
+import struct
+import torch
+from typing import Dict, Tuple
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Convert a PyTorch LoRA checkpoint (.pth) into an rwkv.cpp adapter file')
+    parser.add_argument('src_path', help='Path to rwkv.cpp model the LoRA was trained for')
+    parser.add_argument('lora_path', help='Path to LoRA checkpoint in PyTorch format')
+    parser.add_argument('lora_alpha', type=int, help='Value of lora_alpha parameter used when training this LoRA checkpoint')
+    parser.add_argument('dest_path', help='Path to destination adapter file, will be overwritten')
+    return parser.parse_args()
+
+def write_parameter(out_file, key: str, parameter: torch.Tensor) -> None:
+    parameter = parameter.float().contiguous()
+
+    key_encoded: bytes = key.encode('utf-8')
+
+    out_file.write(struct.pack('=iii', len(parameter.shape), len(key_encoded), 0))
+
+    # Dimension order is reversed here:
+    # * PyTorch shape is (x rows, y columns)
+    # * ggml shape is (y elements in a row, x elements in a column)
+    # Both shapes represent the same tensor.
+    for dim in reversed(parameter.shape):
+        out_file.write(struct.pack('=i', dim))
+
+    out_file.write(key_encoded)
+
+    parameter.numpy().tofile(out_file)
+
+def main() -> None:
+    args = parse_args()
+
+    with open(args.src_path, 'rb') as in_file:
+        # noinspection PyTypeChecker
+        header: Tuple[int, int, int, int, int, int] = struct.unpack('=iiiiii', in_file.read(6 * 4))
+
+    assert header[0] == 0x67676d66, 'Invalid magic value'
+    assert 100 <= header[1] <= 101, 'Invalid version number'
+
+    print(f'Reading {args.lora_path}')
+
+    lora_state_dict: Dict[str, torch.Tensor] = torch.load(args.lora_path, map_location='cpu')
+
+    print(f'Converting')
+
+    with open(args.dest_path, 'wb') as out_file:
+        # Same dimensions as the model; adapter tensors are always FP32.
+        out_file.write(struct.pack('=iiiiii', header[0], header[1], header[2], header[3], header[4], 0))
+
+        for key in list(lora_state_dict.keys()):
+            if key not in lora_state_dict:
+                continue
+
+            if '.lora_A' in key:
+                param_key: str = key.replace('.lora_A.weight', '').replace('.lora_A', '') + '.weight'
+                lora_A: torch.Tensor = lora_state_dict.pop(key).float()
+                lora_B: torch.Tensor = lora_state_dict.pop(key.replace('.lora_A', '.lora_B')).float()
+
+                assert lora_B.shape[1] == lora_A.shape[0], f'Invalid shape of LoRA matrices for {param_key}: ' \
+                                                           f'{lora_A.shape}, {lora_B.shape}'
+
+                lora_R: int = lora_B.shape[1]
+
+                # Same scaling as in merge_lora_into_ggml.py
+                write_parameter(out_file, param_key + '.lora_A', lora_A)
+                write_parameter(out_file, param_key + '.lora_B', lora_B * (args.lora_alpha / lora_R))
+
+                print(f'* {param_key}: lora_r = {lora_R}')
+            elif '.lora_B' not in key:
+                replacement: torch.Tensor = lora_state_dict.pop(key).float()
+
+                # Same processing as in convert_pytorch_to_ggml.py
+                if '.time_' in key:
+                    # (1, 1, n_embed) -> (n_embed)
+                    replacement = replacement.squeeze()
+
+                if '.time_decay' in key:
+                    replacement = -torch.exp(replacement)
+
+                write_parameter(out_file, key, replacement)
+
+                print(f'* {key}: replaced {list(replacement.shape)}')
+
+        for key in lora_state_dict:
+            print(f'WARNING: Unused parameter in LoRA state dict {key}')
+
+    print('Done')
+
+if __name__ == "__main__":
+    main()
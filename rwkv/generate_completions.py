@@ -1,8 +1,8 @@
 # Generates completions from RWKV model based on a prompt.
 
 import argparse
+import random
 import time
-import sampling
 import rwkv_cpp_model
 import rwkv_cpp_shared_library
 from rwkv_tokenizer import get_tokenizer
@@ -46,24 +46,27 @@ model = rwkv_cpp_model.RWKVModel(library, args.model_path)
 prompt_token_count = len(prompt_tokens)
 print(f'{prompt_token_count} tokens in prompt')
 
-init_logits, init_state = None, None
+# The last prompt token is evaluated by every generation, so that each of them starts sampling from the same logits.
+_, init_state = model.eval_sequence(prompt_tokens[:-1], None) if prompt_token_count > 1 else (None, None)
 
-for token in prompt_tokens:
-    init_logits, init_state = model.eval(token, init_state, init_state, init_logits)
+def print_token(token: int) -> bool:
+    print(tokenizer_decode([token]), end='', flush=True)
+    return False
 
 for GENERATION in range(generation_count):
     print(f'\n--- Generation {GENERATION} ---\n')
     print(prompt, end='[')
     start = time.time()
 
-    logits, state = init_logits.clone(), init_state.clone()
-
-    for i in range(tokens_per_generation):
-        token = sampling.sample_logits(logits, temperature, top_p)
-
-        print(tokenizer_decode([token]), end='', flush=True)
-
-        logits, state = model.eval(token, state, state, logits)
+    model.generate(
+        prompt_tokens[-1:],
+        tokens_per_generation,
+        state_in=init_state,
+        temperature=temperature,
+        top_p=top_p,
+        seed=random.getrandbits(64),
+        callback=print_token
+    )
 
     delay = time.time() - start
     print(']\n\nTook %.3f sec, %d ms per token' % (delay, delay / tokens_per_generation * 1000))
@@ -11,7 +11,9 @@ def parse_args():
     parser = argparse.ArgumentParser(description='Quantize rwkv.cpp model file from FP32 or FP16')
     parser.add_argument('src_path', help='Path to FP32/FP16 checkpoint file')
     parser.add_argument('dest_path', help='Path to resulting checkpoint file, will be overwritten')
-    parser.add_argument('format_name', help='Format name, one of ' + ', '.join(format_names), type=str, choices=format_names, default='Q5_1')
+    parser.add_argument('format_name', help='Format name, one of ' + ', '.join(format_names) + '; or a quantization recipe like "Q5_1,head.weight=Q8_0"', type=str, default='Q5_1')
+    parser.add_argument('--recipe_file', help='Path to a quantization recipe file, overrides format_name', type=str, default=None)
+    parser.add_argument('--thread_count', help='Count of threads to quantize with, 0 to use all hardware threads', type=int, default=0)
     return parser.parse_args()
 
 def main() -> None:
@@ -19,10 +21,17 @@ def main() -> None:
 
     library = rwkv_cpp_shared_library.load_rwkv_shared_library()
 
+    format_name: str = args.format_name
+
+    if args.recipe_file is not None:
+        with open(args.recipe_file, 'r') as f:
+            format_name = f.read()
+
     library.rwkv_quantize_model_file(
         args.src_path,
         args.dest_path,
-        args.format_name
+        format_name,
+        args.thread_count
     )
 
     print('Done')
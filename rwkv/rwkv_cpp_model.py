@@ -1,8 +1,13 @@
 import os
+import sys
+import ctypes
 import torch
 import multiprocessing
 import rwkv_cpp_shared_library
-from typing import Tuple, Optional, List
+from typing import Tuple, Optional, List, Callable, Dict, Any, Union
+
+# A CPU torch tensor, a numpy array, or another object supporting the buffer protocol.
+Buffer = Any
 
 class RWKVModel:
     """
@@ -15,6 +20,8 @@ class RWKVModel:
             model_path: str,
             thread_count: int = max(1, multiprocessing.cpu_count() // 2),
             gpu_layer_count: int = 0,
+            init_flags: int = rwkv_cpp_shared_library.RWKV_INIT_NONE,
+            format_name: Optional[str] = None,
             **kwargs
     ):
         """
@@ -31,6 +38,10 @@ class RWKVModel:
             Thread count to use. If not set, defaults to CPU count / 2.
         gpu_layer_count : int
             Count of layers to offload onto the GPU, must be >= 0.
+        init_flags : int
+            Bitwise combination of RWKV_INIT_* load options, for example RWKV_INIT_FOLD_LN0.
+        format_name : Optional[str]
+            Format to convert the model into while loading, for example Q5_1 or FP32. If not set, the model is used as stored.
         """
 
         if 'gpu_layers_count' in kwargs:
@@ -42,23 +53,69 @@ class RWKVModel:
 
         self._library = shared_library
 
-        self._ctx = self._library.rwkv_init_from_file(model_path, thread_count)
+        self._ctx = self._library.rwkv_init_from_file(model_path, thread_count, init_flags, format_name)
 
         if gpu_layer_count > 0:
             self._library.rwkv_gpu_offload_layers(self._ctx, gpu_layer_count)
 
         self._state_buffer_element_count = self._library.rwkv_get_state_buffer_element_count(self._ctx)
         self._logits_buffer_element_count = self._library.rwkv_get_logits_buffer_element_count(self._ctx)
+        self._n_embed = self._library.rwkv_get_n_embed(self._ctx)
+        self._thread_count = thread_count
+
+        # Created by the first eval_batch call.
+        self._batch_contexts: List[rwkv_cpp_shared_library.RWKVContext] = []
+        self._batch_executor: Optional[rwkv_cpp_shared_library.RWKVExecutor] = None
+        self._batch_budget: Optional[rwkv_cpp_shared_library.RWKVThreadBudget] = None
 
         self._valid = True
 
+    def clone(self, thread_count: Optional[int] = None) -> 'RWKVModel':
+        """
+        Creates a model that shares the weights with this one, but has its own context.
+        Evaluations release the GIL, so clones can be evaluated from several Python threads in parallel;
+        a single model must not be evaluated from several threads at once.
+        In case of any error, this method will throw an exception.
+
+        Parameters
+        ----------
+        thread_count : Optional[int]
+            Thread count to use. If not set, the thread count of this model is used.
+        """
+
+        assert self._valid, 'Model was freed'
+
+        if thread_count is None:
+            thread_count = self._thread_count
+
+        assert thread_count > 0, 'Thread count must be > 0'
+
+        model = RWKVModel.__new__(RWKVModel)
+        model._library = self._library
+        model._ctx = self._library.rwkv_clone_context(self._ctx, thread_count)
+
+        # Clones inherit the thread budget of eval_batch, which is freed together with this model.
+        if self._batch_budget is not None:
+            self._library.rwkv_set_thread_budget(model._ctx, None)
+
+        model._state_buffer_element_count = self._state_buffer_element_count
+        model._logits_buffer_element_count = self._logits_buffer_element_count
+        model._n_embed = self._n_embed
+        model._thread_count = thread_count
+        model._batch_contexts = []
+        model._batch_executor = None
+        model._batch_budget = None
+        model._valid = True
+
+        return model
+
     def eval(
             self,
             token: int,
-            state_in: Optional[torch.Tensor],
-            state_out: Optional[torch.Tensor] = None,
-            logits_out: Optional[torch.Tensor] = None
-    ) -> Tuple[torch.Tensor, torch.Tensor]:
+            state_in: Optional[Buffer],
+            state_out: Optional[Buffer] = None,
+            logits_out: Optional[Buffer] = None
+    ) -> Tuple[Buffer, Buffer]:
         """
         Evaluates the model for a single token.
         In case of any error, this method will throw an exception.
@@ -67,12 +124,12 @@ class RWKVModel:
         ----------
         token : int
             Index of next token to be seen by the model. Must be in range 0 <= token < n_vocab.
-        state_in : Optional[torch.Tensor]
+        state_in : Optional[Buffer]
             State from previous call of this method. If this is a first pass, set it to None.
-        state_out : Optional[torch.Tensor]
-            Optional output tensor for state. If provided, must be of type float32, contiguous and of shape (state_buffer_element_count).
-        logits_out : Optional[torch.Tensor]
-            Optional output tensor for logits. If provided, must be of type float32, contiguous and of shape (logits_buffer_element_count).
+        state_out : Optional[Buffer]
+            Optional output buffer for state. If provided, must be of type float32, contiguous and of shape (state_buffer_element_count).
+        logits_out : Optional[Buffer]
+            Optional output buffer for logits. If provided, must be of type float32, contiguous and of shape (logits_buffer_element_count).
 
         Returns
         -------
@@ -82,54 +139,47 @@ class RWKVModel:
 
         assert self._valid, 'Model was freed'
 
-        if state_in is not None:
-            validate_tensor(state_in, 'state_in', self._state_buffer_element_count)
+        state_in_ptr = 0 if state_in is None else buffer_address(state_in, 'state_in', self._state_buffer_element_count, writable=False)
 
-            state_in_ptr = state_in.data_ptr()
-        else:
-            state_in_ptr = 0
+        # Outputs are written completely, so new buffers need no initialization.
+        if state_out is None:
+            state_out = torch.empty(self._state_buffer_element_count, dtype=torch.float32, device='cpu')
 
-        if state_out is not None:
-            validate_tensor(state_out, 'state_out', self._state_buffer_element_count)
-        else:
-            state_out = torch.zeros(self._state_buffer_element_count, dtype=torch.float32, device='cpu')
-
-        if logits_out is not None:
-            validate_tensor(logits_out, 'logits_out', self._logits_buffer_element_count)
-        else:
-            logits_out = torch.zeros(self._logits_buffer_element_count, dtype=torch.float32, device='cpu')
+        if logits_out is None:
+            logits_out = torch.empty(self._logits_buffer_element_count, dtype=torch.float32, device='cpu')
 
         self._library.rwkv_eval(
             self._ctx,
             token,
             state_in_ptr,
-            state_out.data_ptr(),
-            logits_out.data_ptr()
+            buffer_address(state_out, 'state_out', self._state_buffer_element_count),
+            buffer_address(logits_out, 'logits_out', self._logits_buffer_element_count)
         )
 
         return logits_out, state_out
     
     def eval_sequence(
             self,
-            tokens: List[int],
-            state_in: Optional[torch.Tensor],
-            state_out: Optional[torch.Tensor] = None,
-            logits_out: Optional[torch.Tensor] = None
-    ) -> Tuple[torch.Tensor, torch.Tensor]:
+            tokens: Union[List[int], Buffer],
+            state_in: Optional[Buffer],
+            state_out: Optional[Buffer] = None,
+            logits_out: Optional[Buffer] = None
+    ) -> Tuple[Buffer, Buffer]:
         """
         Evaluates the model for a sequence of tokens.
         In case of any error, this method will throw an exception.
 
         Parameters
         ----------
-        tokens : List[int]
+        tokens : Union[List[int], Buffer]
             Indices of the next tokens to be seen by the model. Must be in range 0 <= token < n_vocab.
-        state_in : Optional[torch.Tensor]
+            An int32 numpy array is passed without copying.
+        state_in : Optional[Buffer]
             State from previous call of this method. If this is a first pass, set it to None.
-        state_out : Optional[torch.Tensor]
-            Optional output tensor for state. If provided, must be of type float32, contiguous and of shape (state_buffer_element_count).
-        logits_out : Optional[torch.Tensor]
-            Optional output tensor for logits. If provided, must be of type float32, contiguous and of shape (logits_buffer_element_count).
+        state_out : Optional[Buffer]
+            Optional output buffer for state. If provided, must be of type float32, contiguous and of shape (state_buffer_element_count).
+        logits_out : Optional[Buffer]
+            Optional output buffer for logits. If provided, must be of type float32, contiguous and of shape (logits_buffer_element_count).
 
         Returns
         -------
@@ -139,33 +189,358 @@ class RWKVModel:
 
         assert self._valid, 'Model was freed'
 
-        if state_in is not None:
-            validate_tensor(state_in, 'state_in', self._state_buffer_element_count)
+        state_in_ptr = 0 if state_in is None else buffer_address(state_in, 'state_in', self._state_buffer_element_count, writable=False)
 
-            state_in_ptr = state_in.data_ptr()
-        else:
-            state_in_ptr = 0
+        # Outputs are written completely, so new buffers need no initialization.
+        if state_out is None:
+            state_out = torch.empty(self._state_buffer_element_count, dtype=torch.float32, device='cpu')
 
-        if state_out is not None:
-            validate_tensor(state_out, 'state_out', self._state_buffer_element_count)
-        else:
-            state_out = torch.zeros(self._state_buffer_element_count, dtype=torch.float32, device='cpu')
-
-        if logits_out is not None:
-            validate_tensor(logits_out, 'logits_out', self._logits_buffer_element_count)
-        else:
-            logits_out = torch.zeros(self._logits_buffer_element_count, dtype=torch.float32, device='cpu')
+        if logits_out is None:
+            logits_out = torch.empty(self._logits_buffer_element_count, dtype=torch.float32, device='cpu')
 
         self._library.rwkv_eval_sequence(
             self._ctx,
             tokens,
             state_in_ptr,
-            state_out.data_ptr(),
-            logits_out.data_ptr()
+            buffer_address(state_out, 'state_out', self._state_buffer_element_count),
+            buffer_address(logits_out, 'logits_out', self._logits_buffer_element_count)
         )
 
         return logits_out, state_out
 
+    def eval_batch(
+            self,
+            sequences: List[Union[List[int], Buffer]],
+            states_in: Optional[Buffer] = None,
+            states_out: Optional[Buffer] = None,
+            logits_out: Optional[Buffer] = None
+    ) -> Tuple[Buffer, Buffer]:
+        """
+        Evaluates several independent sequences in parallel, each on its own clone of the context.
+        Clones share a budget of thread_count threads, so the batch uses no more threads than a single evaluation.
+        In case of any error, this method will throw an exception.
+
+        Parameters
+        ----------
+        sequences : List[Union[List[int], Buffer]]
+            Tokens of each sequence; a sequence of a single token is evaluated with rwkv_eval.
+        states_in : Optional[Buffer]
+            States to start from, of type float32, contiguous and of shape (len(sequences), state_buffer_element_count).
+            If this is a first pass, set it to None. May be the same buffer as states_out.
+        states_out : Optional[Buffer]
+            Optional output buffer for states, of shape (len(sequences), state_buffer_element_count).
+        logits_out : Optional[Buffer]
+            Optional output buffer for logits, of shape (len(sequences), logits_buffer_element_count).
+
+        Returns
+        -------
+        logits, states
+            Logits of shape (len(sequences), n_vocab); states for the next step.
+        """
+
+        assert self._valid, 'Model was freed'
+
+        count = len(sequences)
+        state_len = self._state_buffer_element_count
+        logits_len = self._logits_buffer_element_count
+
+        states_in_ptr = None if states_in is None else buffer_address(states_in, 'states_in', (count, state_len), writable=False)
+
+        if states_out is None:
+            states_out = torch.empty((count, state_len), dtype=torch.float32, device='cpu')
+
+        if logits_out is None:
+            logits_out = torch.empty((count, logits_len), dtype=torch.float32, device='cpu')
+
+        states_out_ptr = buffer_address(states_out, 'states_out', (count, state_len))
+        logits_out_ptr = buffer_address(logits_out, 'logits_out', (count, logits_len))
+
+        self._prepare_batch_contexts(count)
+
+        float_size = ctypes.sizeof(ctypes.c_float)
+        handles = []
+
+        try:
+            for i, tokens in enumerate(sequences):
+                state_in_ptr = None if states_in_ptr is None else states_in_ptr + i * state_len * float_size
+                state_out_ptr = states_out_ptr + i * state_len * float_size
+                sequence_logits_ptr = logits_out_ptr + i * logits_len * float_size
+
+                if len(tokens) == 1:
+                    handles.append(self._library.rwkv_eval_async(self._batch_executor, self._batch_contexts[i], int(tokens[0]), state_in_ptr, state_out_ptr, sequence_logits_ptr))
+                else:
+                    handles.append(self._library.rwkv_eval_sequence_async(self._batch_executor, self._batch_contexts[i], tokens, state_in_ptr, state_out_ptr, sequence_logits_ptr))
+
+            # Waiting releases the GIL.
+            statuses = [self._library.rwkv_async_wait(handle) for handle in handles]
+        finally:
+            for handle in handles:
+                self._library.rwkv_async_free(handle)
+
+        assert all(status == rwkv_cpp_shared_library.RWKV_ASYNC_DONE for status in statuses), 'Batch evaluation failed, check stderr'
+
+        return logits_out, states_out
+
+    def _prepare_batch_contexts(self, count: int) -> None:
+        if self._batch_budget is None:
+            self._batch_budget = self._library.rwkv_thread_budget_new(self._thread_count)
+            self._library.rwkv_set_thread_budget(self._ctx, self._batch_budget)
+            self._batch_contexts.append(self._ctx)
+
+        if len(self._batch_contexts) >= count:
+            return
+
+        if self._batch_executor is not None:
+            self._library.rwkv_executor_free(self._batch_executor)
+            self._batch_executor = None
+
+        # Clones are attached to the budget of this context.
+        while len(self._batch_contexts) < count:
+            self._batch_contexts.append(self._library.rwkv_clone_context(self._ctx, self._thread_count))
+
+        self._batch_executor = self._library.rwkv_executor_new(count)
+
+    def embed(
+            self,
+            tokens: List[int],
+            state_in: Optional[Buffer] = None,
+            state_out: Optional[Buffer] = None,
+            embedding_out: Optional[Buffer] = None,
+            mean_pool: bool = False
+    ) -> Tuple[Buffer, Buffer]:
+        """
+        Evaluates the model for a sequence of tokens and gives its embedding: the final hidden state normalized by ln_out.
+        The head of the model is not evaluated.
+        In case of any error, this method will throw an exception.
+
+        Parameters
+        ----------
+        tokens : List[int]
+            Indices of the tokens to embed; at least one. Must be in range 0 <= token < n_vocab.
+        state_in : Optional[Buffer]
+            State from previous call of this method. If this is a first pass, set it to None.
+        state_out : Optional[Buffer]
+            Optional output buffer for state. If provided, must be of type float32, contiguous and of shape (state_buffer_element_count).
+        embedding_out : Optional[Buffer]
+            Optional output buffer for the embedding. If provided, must be of type float32, contiguous and of shape (n_embed).
+        mean_pool : bool
+            If True, gives the mean of embeddings of all tokens; otherwise, the embedding of the last token.
+
+        Returns
+        -------
+        embedding, state
+            Embedding vector of shape (n_embed); state for the next step.
+        """
+
+        assert self._valid, 'Model was freed'
+
+        state_in_ptr = 0 if state_in is None else buffer_address(state_in, 'state_in', self._state_buffer_element_count, writable=False)
+
+        if state_out is None:
+            state_out = torch.empty(self._state_buffer_element_count, dtype=torch.float32, device='cpu')
+
+        if embedding_out is None:
+            embedding_out = torch.empty(self._n_embed, dtype=torch.float32, device='cpu')
+
+        self._library.rwkv_eval_sequence_embed(
+            self._ctx,
+            tokens,
+            state_in_ptr,
+            buffer_address(state_out, 'state_out', self._state_buffer_element_count),
+            buffer_address(embedding_out, 'embedding_out', self._n_embed),
+            mean_pool
+        )
+
+        return embedding_out, state_out
+
+    def embed_batch(
+            self,
+            sequences: List[List[int]],
+            chunk_length: int = 0,
+            state_in: Optional[Buffer] = None,
+            mean_pool: bool = False
+    ) -> torch.Tensor:
+        """
+        Gives embeddings of several independent sequences, see embed. Sequences are evaluated in padded chunks,
+        so that a single cached graph is reused whatever their lengths are.
+        In case of any error, this method will throw an exception.
+
+        Parameters
+        ----------
+        sequences : List[List[int]]
+            Tokens of each sequence; no sequence may be empty.
+        chunk_length : int
+            Count of tokens per chunk, or 0 for 64 tokens, or the length of the longest sequence if it is shorter.
+        state_in : Optional[Buffer]
+            State to start every sequence from, for example after a shared instruction. If None, the initial state is used.
+        mean_pool : bool
+            If True, gives the mean of embeddings of all tokens of a sequence; otherwise, the embedding of its last token.
+
+        Returns
+        -------
+        embeddings
+            Tensor of shape (len(sequences), n_embed).
+        """
+
+        assert self._valid, 'Model was freed'
+
+        embeddings_out = torch.empty((len(sequences), self._n_embed), dtype=torch.float32, device='cpu')
+
+        self._library.rwkv_eval_sequence_embed_batch(
+            self._ctx,
+            sequences,
+            chunk_length,
+            None if state_in is None else buffer_address(state_in, 'state_in', self._state_buffer_element_count, writable=False),
+            mean_pool,
+            embeddings_out.data_ptr()
+        )
+
+        return embeddings_out
+
+    def generate(
+            self,
+            prompt_tokens: List[int],
+            max_tokens: int,
+            state_in: Optional[Buffer] = None,
+            state_out: Optional[Buffer] = None,
+            temperature: float = 1.0,
+            top_p: float = 1.0,
+            top_k: int = 0,
+            presence_penalty: float = 0.0,
+            frequency_penalty: float = 0.0,
+            seed: int = 0,
+            stop_sequences: Optional[List[List[int]]] = None,
+            callback: Optional[Callable[[int], bool]] = None
+    ) -> List[int]:
+        """
+        Evaluates the prompt and samples up to max_tokens tokens. Sampling runs in the library, so no logits are copied per token.
+        In case of any error, this method will throw an exception.
+
+        Parameters
+        ----------
+        prompt_tokens : List[int]
+            Tokens to evaluate before sampling; at least one.
+        max_tokens : int
+            Largest count of tokens to sample.
+        state_in : Optional[Buffer]
+            State from a previous call. If this is a first pass, set it to None.
+        state_out : Optional[Buffer]
+            Optional output buffer for the state after the prompt and all sampled tokens.
+            If provided, must be of type float32, contiguous and of shape (state_buffer_element_count).
+        temperature, top_p, top_k, presence_penalty, frequency_penalty, seed
+            Sampling parameters, see RWKVSharedLibrary.rwkv_generate.
+        stop_sequences : Optional[List[List[int]]]
+            Token sequences that end generation, for example [[0]] for the end of text. They are not returned.
+        callback : Optional[Callable[[int], bool]]
+            Called with every generated token as soon as it is known; returning True stops generation.
+
+        Returns
+        -------
+        tokens
+            Generated tokens.
+        """
+
+        assert self._valid, 'Model was freed'
+
+        return self._library.rwkv_generate(
+            self._ctx,
+            prompt_tokens,
+            max_tokens,
+            temperature,
+            top_p,
+            top_k,
+            presence_penalty,
+            frequency_penalty,
+            seed,
+            stop_sequences,
+            None if state_in is None else buffer_address(state_in, 'state_in', self._state_buffer_element_count, writable=False),
+            None if state_out is None else buffer_address(state_out, 'state_out', self._state_buffer_element_count),
+            callback
+        )
+
+    def generate_speculative(
+            self,
+            draft_model: Optional['RWKVModel'],
+            prompt_tokens: List[int],
+            max_tokens: int,
+            n_draft: int = 4,
+            ngram_len: int = 3,
+            mode: Optional[int] = None,
+            layer_mask: Optional[List[bool]] = None,
+            state_in: Optional[Buffer] = None,
+            state_out: Optional[Buffer] = None,
+            draft_state_in: Optional[Buffer] = None,
+            draft_state_out: Optional[Buffer] = None,
+            temperature: float = 1.0,
+            top_p: float = 1.0,
+            top_k: int = 0,
+            presence_penalty: float = 0.0,
+            frequency_penalty: float = 0.0,
+            seed: int = 0,
+            stop_sequences: Optional[List[List[int]]] = None,
+            callback: Optional[Callable[[int], bool]] = None
+    ) -> Tuple[List[int], Dict[str, int]]:
+        """
+        Same as generate, but drafts n_draft tokens at a time with a smaller model of the same vocabulary,
+        by looking up continuations of the last tokens in the prompt, or with some layers of this model,
+        and verifies them with this model at once.
+        Sampled tokens follow the same distribution as with generate.
+        In case of any error, this method will throw an exception.
+
+        Parameters
+        ----------
+        draft_model : Optional[RWKVModel]
+            Smaller model with the same vocabulary; or None to draft by prompt lookup,
+            which works well when the output copies spans of the prompt.
+        n_draft : int
+            Count of tokens drafted before each verification.
+        ngram_len : int
+            For prompt lookup, count of last tokens to look up.
+        mode, layer_mask
+            Drafting mode and layers for drafting with skipped layers, see RWKVSharedLibrary.rwkv_generate_speculative.
+        draft_state_in, draft_state_out : Optional[Buffer]
+            Same as state_in and state_out, but for the draft model.
+
+        Other parameters are the same as for generate.
+
+        Returns
+        -------
+        tokens, stats
+            Generated tokens, and counts of drafted and accepted tokens and of verifications.
+        """
+
+        assert self._valid, 'Model was freed'
+        assert draft_model is None or draft_model._valid, 'Draft model was freed'
+
+        if draft_state_in is not None:
+            assert draft_model is not None, 'draft_state_in needs a draft model'
+
+        if draft_state_out is not None:
+            assert draft_model is not None, 'draft_state_out needs a draft model'
+
+        return self._library.rwkv_generate_speculative(
+            self._ctx,
+            None if draft_model is None else draft_model._ctx,
+            prompt_tokens,
+            max_tokens,
+            n_draft,
+            ngram_len,
+            mode,
+            layer_mask,
+            temperature,
+            top_p,
+            top_k,
+            presence_penalty,
+            frequency_penalty,
+            seed,
+            stop_sequences,
+            None if state_in is None else buffer_address(state_in, 'state_in', self._state_buffer_element_count, writable=False),
+            None if state_out is None else buffer_address(state_out, 'state_out', self._state_buffer_element_count),
+            None if draft_state_in is None else buffer_address(draft_state_in, 'draft_state_in', draft_model._state_buffer_element_count, writable=False),
+            None if draft_state_out is None else buffer_address(draft_state_out, 'draft_state_out', draft_model._state_buffer_element_count),
+            callback
+        )
+
     def free(self):
         """
         Frees all allocated resources.
@@ -177,6 +552,18 @@ class RWKVModel:
 
         self._valid = False
 
+        if self._batch_executor is not None:
+            self._library.rwkv_executor_free(self._batch_executor)
+
+        # The first batch context is the context of this model.
+        for ctx in self._batch_contexts[1:]:
+            self._library.rwkv_set_thread_budget(ctx, None)
+            self._library.rwkv_free(ctx)
+
+        if self._batch_budget is not None:
+            self._library.rwkv_set_thread_budget(self._ctx, None)
+            self._library.rwkv_thread_budget_free(self._batch_budget)
+
         self._library.rwkv_free(self._ctx)
 
     def __del__(self):
@@ -184,8 +571,45 @@ class RWKVModel:
         if hasattr(self, '_valid') and self._valid:
             self.free()
 
-def validate_tensor(buf: torch.Tensor, name: str, size: int) -> None:
+def validate_tensor(buf: torch.Tensor, name: str, size: Union[int, Tuple[int, ...]]) -> None:
+    shape = (size,) if isinstance(size, int) else tuple(size)
+
     assert buf.device == torch.device('cpu'), f'{name} is not on CPU'
     assert buf.dtype == torch.float32, f'{name} is not of type float32'
-    assert buf.shape == (size,), f'{name} has invalid shape {buf.shape}, expected ({size})'
+    assert tuple(buf.shape) == shape, f'{name} has invalid shape {tuple(buf.shape)}, expected {shape}'
     assert buf.is_contiguous(), f'{name} is not contiguous'
+
+def buffer_address(buf: Buffer, name: str, size: Union[int, Tuple[int, ...]], writable: bool = True) -> int:
+    """
+    Returns the address of the first element of a float32 buffer, which is passed to the library without copying.
+    Accepts CPU torch tensors, numpy arrays and other objects supporting the buffer protocol.
+    The buffer must stay alive while the library uses the address.
+    Outputs must be writable; inputs, for which writable is False, may also be read-only numpy arrays.
+    """
+
+    if isinstance(buf, torch.Tensor):
+        validate_tensor(buf, name, size)
+
+        return buf.data_ptr()
+
+    shape = (size,) if isinstance(size, int) else tuple(size)
+    interface = getattr(buf, '__array_interface__', None)
+
+    # Read-only numpy arrays can not be exported as writable buffers, but their address is available here.
+    if interface is not None:
+        assert interface['typestr'] == ('<f4' if sys.byteorder == 'little' else '>f4'), f'{name} is not of type float32'
+        assert tuple(interface['shape']) == shape, f'{name} has invalid shape {tuple(interface["shape"])}, expected {shape}'
+        assert interface.get('strides') is None, f'{name} is not contiguous'
+        assert not writable or not interface['data'][1], f'{name} is read-only'
+
+        return interface['data'][0]
+
+    view = memoryview(buf)
+
+    assert view.format == 'f', f'{name} is not of type float32'
+    assert tuple(view.shape) == shape, f'{name} has invalid shape {tuple(view.shape)}, expected {shape}'
+    assert view.c_contiguous, f'{name} is not contiguous'
+    # The address is only available through a writable export, also for inputs.
+    assert not view.readonly, f'{name} is read-only'
+
+    return ctypes.addressof((ctypes.c_float * (view.nbytes // 4)).from_buffer(view))
@@ -0,0 +1,80 @@
+import array
+import numpy as np
+import torch
+import rwkv_cpp_model
+import rwkv_cpp_shared_library
+
+MODEL_PATH = '../tests/tiny-rwkv-660K-FP32.bin'
+
+def expect_assertion(function) -> None:
+    try:
+        function()
+    except AssertionError:
+        return
+
+    raise Exception('Expected an AssertionError')
+
+def test_buffer_address() -> None:
+    tensor = torch.zeros(4, dtype=torch.float32)
+    assert rwkv_cpp_model.buffer_address(tensor, 'tensor', 4) == tensor.data_ptr()
+    expect_assertion(lambda: rwkv_cpp_model.buffer_address(tensor, 'tensor', 5))
+    expect_assertion(lambda: rwkv_cpp_model.buffer_address(torch.zeros(4, dtype=torch.float64), 'tensor', 4))
+
+    matrix = np.zeros((2, 3), dtype=np.float32)
+    assert rwkv_cpp_model.buffer_address(matrix, 'matrix', (2, 3)) == matrix.ctypes.data
+    expect_assertion(lambda: rwkv_cpp_model.buffer_address(matrix, 'matrix', 6))
+    expect_assertion(lambda: rwkv_cpp_model.buffer_address(matrix[:, 1:], 'matrix', (2, 2)))
+
+    # Read-only arrays are only accepted as inputs.
+    matrix.setflags(write=False)
+    assert rwkv_cpp_model.buffer_address(matrix, 'matrix', (2, 3), writable=False) == matrix.ctypes.data
+    expect_assertion(lambda: rwkv_cpp_model.buffer_address(matrix, 'matrix', (2, 3)))
+
+    values = array.array('f', [0.0] * 4)
+    assert rwkv_cpp_model.buffer_address(memoryview(values), 'values', 4) == values.buffer_info()[0]
+    expect_assertion(lambda: rwkv_cpp_model.buffer_address(memoryview(values).toreadonly(), 'values', 4, writable=False))
+    expect_assertion(lambda: rwkv_cpp_model.buffer_address(array.array('d', [0.0] * 4), 'values', 4))
+
+def test_model(library: rwkv_cpp_shared_library.RWKVSharedLibrary) -> None:
+    model = rwkv_cpp_model.RWKVModel(library, MODEL_PATH, thread_count=2)
+    clone = model.clone()
+
+    sequences = [[1, 2, 3, 4], [5], [6, 7]]
+    logits, states = model.eval_batch(sequences)
+
+    for i, tokens in enumerate(sequences):
+        expected_logits, expected_state = clone.eval_sequence(tokens, None)
+
+        assert torch.allclose(logits[i], expected_logits, atol=1e-3), f'Logits of sequence {i} differ'
+        assert torch.allclose(states[i], expected_state, atol=1e-3), f'State of sequence {i} differs'
+
+    # Outputs of numpy arrays are written in place, and read-only inputs are accepted.
+    states_in = states.numpy().copy()
+    states_in.setflags(write=False)
+    states_out = np.empty_like(states_in)
+    logits_out = np.empty((len(sequences), logits.shape[1]), dtype=np.float32)
+    model.eval_batch([[8]] * len(sequences), states_in, states_out, logits_out)
+
+    for i in range(len(sequences)):
+        expected_logits, expected_state = clone.eval(8, torch.from_numpy(states_in[i].copy()))
+
+        assert np.allclose(logits_out[i], expected_logits.numpy(), atol=1e-3), f'Logits of continued sequence {i} differ'
+        assert np.allclose(states_out[i], expected_state.numpy(), atol=1e-3), f'State of continued sequence {i} differs'
+
+    expect_assertion(lambda: model.eval_batch([[8]] * len(sequences), None, states_in))
+
+    # The clone keeps working after the model that it was cloned from is freed.
+    model.free()
+    clone.eval_sequence([1, 2], None)
+    clone.free()
+
+def test() -> None:
+    library = rwkv_cpp_shared_library.load_rwkv_shared_library()
+
+    test_buffer_address()
+    test_model(library)
+
+    print('All tests pass')
+
+if __name__ == "__main__":
+    test()
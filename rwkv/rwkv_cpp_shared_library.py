@@ -2,7 +2,7 @@ import os
 import sys
 import ctypes
 import pathlib
-from typing import Optional, List
+from typing import Optional, List, Callable, Tuple, Dict
 
 QUANTIZED_FORMAT_NAMES = (
     'Q4_0',
@@ -12,14 +12,172 @@ QUANTIZED_FORMAT_NAMES = (
     'Q8_0'
 )
 
+# See enum rwkv_init_flags in rwkv.h.
+RWKV_INIT_NONE = 0
+RWKV_INIT_FOLD_LN0 = 1 << 0
+RWKV_INIT_NUMA_INTERLEAVE = 1 << 1
+RWKV_INIT_HUGE_PAGES = 1 << 2
+RWKV_INIT_HUGETLB = 1 << 3
+RWKV_INIT_MLOCK = 1 << 4
+
+# See enum rwkv_profile_flags in rwkv.h.
+RWKV_PROFILE_NONE = 0
+RWKV_PROFILE_AGGREGATE = 1 << 0
+RWKV_PROFILE_TRACE = 1 << 1
+
+# See enum rwkv_profile_category in rwkv.h.
+RWKV_PROFILE_CATEGORY_NAMES = (
+    'matmul',
+    'wkv',
+    'layer_norm',
+    'other'
+)
+
+# See enum rwkv_eval_mode in rwkv.h.
+RWKV_EVAL_SERIAL = 0
+RWKV_EVAL_SEQUENCE = 1
+
+# See enum rwkv_error_flags in rwkv.h.
+RWKV_ERROR_CTX = 6 << 8
+RWKV_ERROR_CANCELLED = 15
+
+# See enum rwkv_state_encoding in rwkv.h.
+RWKV_STATE_FP32 = 0
+RWKV_STATE_FP16 = 1
+RWKV_STATE_Q8 = 2
+
+# See enum rwkv_async_status in rwkv.h.
+RWKV_ASYNC_PENDING = 0
+RWKV_ASYNC_RUNNING = 1
+RWKV_ASYNC_DONE = 2
+RWKV_ASYNC_FAILED = 3
+RWKV_ASYNC_CANCELLED = 4
+
+# See enum rwkv_speculation_mode in rwkv.h.
+RWKV_SPECULATION_DRAFT_MODEL = 0
+RWKV_SPECULATION_PROMPT_LOOKUP = 1
+RWKV_SPECULATION_LAYER_SKIP = 2
+
 P_FLOAT = ctypes.POINTER(ctypes.c_float)
 P_INT = ctypes.POINTER(ctypes.c_int32)
 
+def token_pointer(tokens) -> P_INT:
+    """
+    Returns a pointer to the tokens for passing to the library.
+    Lists are copied; int32 numpy arrays and other int32 buffers are passed without copying, and must stay alive during the call.
+    """
+
+    if isinstance(tokens, (list, tuple)):
+        return ctypes.cast((ctypes.c_int32 * len(tokens))(*tokens), P_INT)
+
+    interface = getattr(tokens, '__array_interface__', None)
+
+    if interface is not None:
+        assert interface['typestr'][1:] in ('i4', 'u4') and interface['typestr'][0] in ('|', '<' if sys.byteorder == 'little' else '>'), 'Tokens are not of type int32'
+        assert len(interface['shape']) == 1 and interface.get('strides') is None, 'Tokens are not a contiguous vector'
+
+        return ctypes.cast(interface['data'][0], P_INT)
+
+    view = memoryview(tokens)
+
+    assert view.format in ('i', 'I') and view.itemsize == 4, 'Tokens are not of type int32'
+    assert view.ndim == 1 and view.c_contiguous, 'Tokens are not a contiguous vector'
+
+    return ctypes.cast((ctypes.c_int32 * len(view)).from_buffer(view), P_INT)
+
 class RWKVContext:
 
     def __init__(self, ptr: ctypes.pointer):
         self.ptr = ptr
 
+class RWKVLoRA:
+
+    def __init__(self, ptr: ctypes.pointer):
+        self.ptr = ptr
+
+class RWKVThreadBudget:
+
+    def __init__(self, ptr: ctypes.pointer):
+        self.ptr = ptr
+
+class RWKVExecutor:
+
+    def __init__(self, ptr: ctypes.pointer):
+        self.ptr = ptr
+
+class RWKVSessionStore:
+
+    def __init__(self, ptr: ctypes.pointer):
+        self.ptr = ptr
+
+class RWKVAsync:
+
+    def __init__(self, ptr: ctypes.pointer):
+        self.ptr = ptr
+
+RWKV_SCHEDULER_CALLBACK = ctypes.CFUNCTYPE(None, ctypes.c_uint64, ctypes.c_bool, ctypes.c_void_p)
+
+class RWKVScheduler:
+
+    def __init__(self, ptr: ctypes.pointer, callback):
+        self.ptr = ptr
+        # Keeps the ctypes callback alive while the scheduler may call it.
+        self.callback = callback
+
+class RWKVSchedulerStats(ctypes.Structure):
+    _fields_ = [
+        ('decode_sessions', ctypes.c_size_t),
+        ('prefill_sessions', ctypes.c_size_t),
+        ('tokens', ctypes.c_size_t),
+        ('waiting_sessions', ctypes.c_size_t),
+        ('duration_us', ctypes.c_int64)
+    ]
+
+class RWKVSamplerParams(ctypes.Structure):
+    _fields_ = [
+        ('temperature', ctypes.c_float),
+        ('top_p', ctypes.c_float),
+        ('top_k', ctypes.c_uint32),
+        ('presence_penalty', ctypes.c_float),
+        ('frequency_penalty', ctypes.c_float),
+        ('seed', ctypes.c_uint64)
+    ]
+
+class RWKVStopSequence(ctypes.Structure):
+    _fields_ = [
+        ('tokens', P_INT),
+        ('len', ctypes.c_size_t)
+    ]
+
+RWKV_TOKEN_CALLBACK = ctypes.CFUNCTYPE(ctypes.c_bool, ctypes.c_uint32, ctypes.c_void_p)
+
+class RWKVSpeculationParams(ctypes.Structure):
+    _fields_ = [
+        ('mode', ctypes.c_int),
+        ('n_draft', ctypes.c_uint32),
+        ('draft_ctx', ctypes.c_void_p),
+        ('draft_state_in', P_FLOAT),
+        ('draft_state_out', P_FLOAT),
+        ('ngram_len', ctypes.c_uint32),
+        ('layer_mask', ctypes.POINTER(ctypes.c_bool))
+    ]
+
+class RWKVSpeculationStats(ctypes.Structure):
+    _fields_ = [
+        ('drafted', ctypes.c_size_t),
+        ('accepted', ctypes.c_size_t),
+        ('verifications', ctypes.c_size_t)
+    ]
+
+class RWKVProfileEntry(ctypes.Structure):
+    _fields_ = [
+        ('layer', ctypes.c_int32),
+        ('category', ctypes.c_int),
+        ('calls', ctypes.c_uint64),
+        ('wall_us', ctypes.c_uint64),
+        ('cpu_us', ctypes.c_uint64)
+    ]
+
 class RWKVSharedLibrary:
     """
     Python wrapper around rwkv.cpp shared library.
@@ -36,14 +194,31 @@ class RWKVSharedLibrary:
             Path to rwkv.cpp shared library. On Windows, it would look like 'rwkv.dll'. On UNIX, 'rwkv.so'.
         """
 
+        # Functions loaded with ctypes.cdll release the GIL for the duration of every call,
+        # so evaluations of different contexts run in parallel when called from several Python threads.
         self.library = ctypes.cdll.LoadLibrary(shared_library_path)
 
         self.library.rwkv_init_from_file.argtypes = [ctypes.c_char_p, ctypes.c_uint32]
         self.library.rwkv_init_from_file.restype = ctypes.c_void_p
 
+        self.library.rwkv_init_from_file_ex.argtypes = [ctypes.c_char_p, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_char_p]
+        self.library.rwkv_init_from_file_ex.restype = ctypes.c_void_p
+
+        self.library.rwkv_clone_context.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+        self.library.rwkv_clone_context.restype = ctypes.c_void_p
+
         self.library.rwkv_gpu_offload_layers.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
         self.library.rwkv_gpu_offload_layers.restype = ctypes.c_bool
 
+        self.library.rwkv_lora_from_file.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_float]
+        self.library.rwkv_lora_from_file.restype = ctypes.c_void_p
+
+        self.library.rwkv_set_lora.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        self.library.rwkv_set_lora.restype = ctypes.c_bool
+
+        self.library.rwkv_lora_free.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_lora_free.restype = None
+
         self.library.rwkv_eval.argtypes = [
             ctypes.c_void_p, # ctx
             ctypes.c_int32, # token
@@ -63,12 +238,265 @@ class RWKVSharedLibrary:
         ]
         self.library.rwkv_eval_sequence.restype = ctypes.c_bool
 
+        self.library.rwkv_eval_sequence_per_token.argtypes = [
+            ctypes.c_void_p, # ctx
+            P_INT, # tokens
+            ctypes.c_size_t, # token count
+            P_FLOAT, # state_in
+            P_FLOAT, # logits_out
+            P_FLOAT  # states_out
+        ]
+        self.library.rwkv_eval_sequence_per_token.restype = ctypes.c_bool
+
+        self.library.rwkv_eval_sequence_embed.argtypes = [
+            ctypes.c_void_p, # ctx
+            P_INT, # tokens
+            ctypes.c_size_t, # token count
+            P_FLOAT, # state_in
+            P_FLOAT, # state_out
+            P_FLOAT, # embedding_out
+            ctypes.c_bool # mean_pool
+        ]
+        self.library.rwkv_eval_sequence_embed.restype = ctypes.c_bool
+
+        self.library.rwkv_eval_sequence_embed_batch.argtypes = [
+            ctypes.c_void_p, # ctx
+            ctypes.POINTER(P_INT), # sequences
+            ctypes.POINTER(ctypes.c_size_t), # sequence lengths
+            ctypes.c_size_t, # sequence count
+            ctypes.c_size_t, # chunk length
+            P_FLOAT, # state_in
+            ctypes.c_bool, # mean_pool
+            P_FLOAT # embeddings_out
+        ]
+        self.library.rwkv_eval_sequence_embed_batch.restype = ctypes.c_bool
+
+        self.library.rwkv_time_us.argtypes = []
+        self.library.rwkv_time_us.restype = ctypes.c_int64
+
+        self.library.rwkv_eval_sequence_chunked.argtypes = [
+            ctypes.c_void_p, # ctx
+            P_INT, # tokens
+            ctypes.c_size_t, # token count
+            ctypes.c_size_t, # chunk length
+            P_FLOAT, # state_in
+            P_FLOAT, # state_out
+            P_FLOAT, # logits_out
+            ctypes.c_int64, # deadline_us
+            ctypes.c_void_p, # abort_callback
+            ctypes.c_void_p, # abort_user_data
+            ctypes.POINTER(ctypes.c_size_t) # processed_len
+        ]
+        self.library.rwkv_eval_sequence_chunked.restype = ctypes.c_bool
+
+        self.library.rwkv_generate.argtypes = [
+            ctypes.c_void_p, # ctx
+            P_INT, # prompt_tokens
+            ctypes.c_size_t, # prompt token count
+            ctypes.c_size_t, # max_tokens
+            ctypes.POINTER(RWKVSamplerParams), # params
+            ctypes.POINTER(RWKVStopSequence), # stop_sequences
+            ctypes.c_size_t, # stop sequence count
+            P_FLOAT, # state_in
+            P_FLOAT, # state_out
+            P_INT, # tokens_out
+            ctypes.POINTER(ctypes.c_size_t), # generated_len
+            RWKV_TOKEN_CALLBACK, # callback
+            ctypes.c_void_p  # user_data
+        ]
+        self.library.rwkv_generate.restype = ctypes.c_bool
+
+        self.library.rwkv_generate_speculative.argtypes = [
+            ctypes.c_void_p, # ctx
+            ctypes.POINTER(RWKVSpeculationParams), # speculation
+            ctypes.POINTER(RWKVSpeculationStats), # stats
+            P_INT, # prompt_tokens
+            ctypes.c_size_t, # prompt token count
+            ctypes.c_size_t, # max_tokens
+            ctypes.POINTER(RWKVSamplerParams), # params
+            ctypes.POINTER(RWKVStopSequence), # stop_sequences
+            ctypes.c_size_t, # stop sequence count
+            P_FLOAT, # state_in
+            P_FLOAT, # state_out
+            P_INT, # tokens_out
+            ctypes.POINTER(ctypes.c_size_t), # generated_len
+            RWKV_TOKEN_CALLBACK, # callback
+            ctypes.c_void_p  # user_data
+        ]
+        self.library.rwkv_generate_speculative.restype = ctypes.c_bool
+
+        self.library.rwkv_sample_logits.argtypes = [
+            P_FLOAT, # logits
+            ctypes.c_size_t, # n_vocab
+            ctypes.POINTER(RWKVSamplerParams), # params
+            ctypes.POINTER(ctypes.c_uint64) # rng
+        ]
+        self.library.rwkv_sample_logits.restype = ctypes.c_uint32
+
+        self.library.rwkv_get_last_error.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_get_last_error.restype = ctypes.c_int
+
+        self.library.rwkv_executor_new.argtypes = [ctypes.c_uint32]
+        self.library.rwkv_executor_new.restype = ctypes.c_void_p
+
+        self.library.rwkv_executor_get_fd.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_executor_get_fd.restype = ctypes.c_int
+
+        self.library.rwkv_executor_free.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_executor_free.restype = None
+
+        self.library.rwkv_eval_async.argtypes = [
+            ctypes.c_void_p, # executor
+            ctypes.c_void_p, # ctx
+            ctypes.c_int32, # token
+            P_FLOAT, # state_in
+            P_FLOAT, # state_out
+            P_FLOAT, # logits_out
+            ctypes.c_void_p, # callback
+            ctypes.c_void_p  # user_data
+        ]
+        self.library.rwkv_eval_async.restype = ctypes.c_void_p
+
+        self.library.rwkv_eval_sequence_async.argtypes = [
+            ctypes.c_void_p, # executor
+            ctypes.c_void_p, # ctx
+            P_INT, # tokens
+            ctypes.c_size_t, # token count
+            P_FLOAT, # state_in
+            P_FLOAT, # state_out
+            P_FLOAT, # logits_out
+            ctypes.c_void_p, # callback
+            ctypes.c_void_p  # user_data
+        ]
+        self.library.rwkv_eval_sequence_async.restype = ctypes.c_void_p
+
+        self.library.rwkv_async_get_status.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_async_get_status.restype = ctypes.c_int
+
+        self.library.rwkv_async_wait.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_async_wait.restype = ctypes.c_int
+
+        self.library.rwkv_async_cancel.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_async_cancel.restype = ctypes.c_bool
+
+        self.library.rwkv_async_free.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_async_free.restype = None
+
+        self.library.rwkv_scheduler_new.argtypes = [
+            ctypes.POINTER(ctypes.c_void_p), # contexts
+            ctypes.c_size_t, # context count
+            ctypes.c_size_t, # batch_tokens
+            ctypes.c_size_t, # chunk_len
+            RWKV_SCHEDULER_CALLBACK, # callback
+            ctypes.c_void_p  # user_data
+        ]
+        self.library.rwkv_scheduler_new.restype = ctypes.c_void_p
+
+        self.library.rwkv_scheduler_free.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_scheduler_free.restype = None
+
+        self.library.rwkv_scheduler_submit.argtypes = [ctypes.c_void_p, ctypes.c_uint64, P_INT, ctypes.c_size_t, P_FLOAT, P_FLOAT]
+        self.library.rwkv_scheduler_submit.restype = ctypes.c_bool
+
+        self.library.rwkv_scheduler_submit_embed.argtypes = [ctypes.c_void_p, ctypes.c_uint64, P_INT, ctypes.c_size_t, P_FLOAT, P_FLOAT]
+        self.library.rwkv_scheduler_submit_embed.restype = ctypes.c_bool
+
+        self.library.rwkv_scheduler_submit_per_token.argtypes = [ctypes.c_void_p, ctypes.c_uint64, P_INT, ctypes.c_size_t, P_FLOAT, P_FLOAT]
+        self.library.rwkv_scheduler_submit_per_token.restype = ctypes.c_bool
+
+        self.library.rwkv_scheduler_cancel.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+        self.library.rwkv_scheduler_cancel.restype = ctypes.c_bool
+
+        self.library.rwkv_scheduler_get_n_sessions.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_scheduler_get_n_sessions.restype = ctypes.c_size_t
+
+        self.library.rwkv_scheduler_step.argtypes = [ctypes.c_void_p, ctypes.POINTER(RWKVSchedulerStats)]
+        self.library.rwkv_scheduler_step.restype = ctypes.c_bool
+
         self.library.rwkv_get_state_buffer_element_count.argtypes = [ctypes.c_void_p]
         self.library.rwkv_get_state_buffer_element_count.restype = ctypes.c_uint32
 
         self.library.rwkv_get_logits_buffer_element_count.argtypes = [ctypes.c_void_p]
         self.library.rwkv_get_logits_buffer_element_count.restype = ctypes.c_uint32
 
+        self.library.rwkv_get_n_embed.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_get_n_embed.restype = ctypes.c_size_t
+
+        self.library.rwkv_get_model_size.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_get_model_size.restype = ctypes.c_size_t
+
+        self.library.rwkv_get_context_size.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+        self.library.rwkv_get_context_size.restype = ctypes.c_size_t
+
+        self.library.rwkv_get_sequence_graph_size.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+        self.library.rwkv_get_sequence_graph_size.restype = ctypes.c_size_t
+
+        self.library.rwkv_set_memory_limit.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+        self.library.rwkv_set_memory_limit.restype = None
+
+        self.library.rwkv_set_cpu_affinity.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32), ctypes.c_size_t]
+        self.library.rwkv_set_cpu_affinity.restype = ctypes.c_bool
+
+        self.library.rwkv_state_serialized_size.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        self.library.rwkv_state_serialized_size.restype = ctypes.c_size_t
+
+        self.library.rwkv_state_serialize.argtypes = [ctypes.c_void_p, P_FLOAT, ctypes.c_int, ctypes.c_void_p, ctypes.c_size_t]
+        self.library.rwkv_state_serialize.restype = ctypes.c_bool
+
+        self.library.rwkv_state_deserialize.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, P_FLOAT]
+        self.library.rwkv_state_deserialize.restype = ctypes.c_bool
+
+        self.library.rwkv_session_store_open.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int, ctypes.c_size_t, ctypes.c_size_t]
+        self.library.rwkv_session_store_open.restype = ctypes.c_void_p
+
+        self.library.rwkv_session_store_close.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_session_store_close.restype = None
+
+        self.library.rwkv_session_store_contains.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+        self.library.rwkv_session_store_contains.restype = ctypes.c_bool
+
+        self.library.rwkv_session_store_get_count.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_session_store_get_count.restype = ctypes.c_size_t
+
+        self.library.rwkv_session_store_save.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, P_FLOAT]
+        self.library.rwkv_session_store_save.restype = ctypes.c_bool
+
+        self.library.rwkv_session_store_load.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64, P_FLOAT]
+        self.library.rwkv_session_store_load.restype = ctypes.c_bool
+
+        self.library.rwkv_session_store_remove.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+        self.library.rwkv_session_store_remove.restype = ctypes.c_bool
+
+        self.library.rwkv_set_n_threads.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_uint32]
+        self.library.rwkv_set_n_threads.restype = ctypes.c_bool
+
+        self.library.rwkv_get_n_threads.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        self.library.rwkv_get_n_threads.restype = ctypes.c_uint32
+
+        self.library.rwkv_tune_n_threads.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_uint32, ctypes.c_size_t]
+        self.library.rwkv_tune_n_threads.restype = ctypes.c_bool
+
+        self.library.rwkv_thread_budget_new.argtypes = [ctypes.c_uint32]
+        self.library.rwkv_thread_budget_new.restype = ctypes.c_void_p
+
+        self.library.rwkv_thread_budget_free.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_thread_budget_free.restype = None
+
+        self.library.rwkv_set_thread_budget.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        self.library.rwkv_set_thread_budget.restype = None
+
+        self.library.rwkv_set_profiling.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+        self.library.rwkv_set_profiling.restype = None
+
+        self.library.rwkv_get_profile.argtypes = [ctypes.c_void_p, ctypes.POINTER(RWKVProfileEntry), ctypes.c_size_t]
+        self.library.rwkv_get_profile.restype = ctypes.c_size_t
+
+        self.library.rwkv_reset_profile.argtypes = [ctypes.c_void_p]
+        self.library.rwkv_reset_profile.restype = None
+
+        self.library.rwkv_dump_profile_trace.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        self.library.rwkv_dump_profile_trace.restype = ctypes.c_bool
+
         self.library.rwkv_free.argtypes = [ctypes.c_void_p]
         self.library.rwkv_free.restype = None
 
@@ -78,10 +506,19 @@ class RWKVSharedLibrary:
         self.library.rwkv_quantize_model_file.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p]
         self.library.rwkv_quantize_model_file.restype = ctypes.c_bool
 
+        self.library.rwkv_quantize_model_file_ex.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_uint32]
+        self.library.rwkv_quantize_model_file_ex.restype = ctypes.c_bool
+
         self.library.rwkv_get_system_info_string.argtypes = []
         self.library.rwkv_get_system_info_string.restype = ctypes.c_char_p
 
-    def rwkv_init_from_file(self, model_file_path: str, thread_count: int) -> RWKVContext:
+    def rwkv_init_from_file(
+            self,
+            model_file_path: str,
+            thread_count: int,
+            flags: int = RWKV_INIT_NONE,
+            format_name: Optional[str] = None
+    ) -> RWKVContext:
         """
         Loads the model from a file and prepares it for inference.
         Throws an exception in case of any error. Error messages would be printed to stderr.
@@ -92,11 +529,40 @@ class RWKVSharedLibrary:
             Path to model file in ggml format.
         thread_count : int
             Count of threads to use, must be positive.
+        flags : int
+            Bitwise combination of RWKV_INIT_* load options.
+        format_name : Optional[str]
+            Format to convert the model into while loading, for example Q5_1 or FP32; or a quantization recipe.
+            If not set, tensors are used as they are stored in the file.
+        """
+
+        ptr = self.library.rwkv_init_from_file_ex(
+            model_file_path.encode('utf-8'),
+            ctypes.c_uint32(thread_count),
+            ctypes.c_uint32(flags),
+            format_name.encode('utf-8') if format_name is not None else None
+        )
+
+        assert ptr is not None, 'rwkv_init_from_file_ex failed, check stderr'
+
+        return RWKVContext(ptr)
+
+    def rwkv_clone_context(self, ctx: RWKVContext, thread_count: int) -> RWKVContext:
+        """
+        Creates a new context that shares the model weights with the given one, to evaluate it from another thread.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        thread_count : int
+            Count of threads to use, must be positive.
         """
 
-        ptr = self.library.rwkv_init_from_file(model_file_path.encode('utf-8'), ctypes.c_uint32(thread_count))
+        ptr = self.library.rwkv_clone_context(ctx.ptr, ctypes.c_uint32(thread_count))
 
-        assert ptr is not None, 'rwkv_init_from_file failed, check stderr'
+        assert ptr is not None, 'rwkv_clone_context failed, check stderr'
 
         return RWKVContext(ptr)
 
@@ -118,6 +584,56 @@ class RWKVSharedLibrary:
 
         return self.library.rwkv_gpu_offload_layers(ctx.ptr, ctypes.c_uint32(layer_count))
 
+    def rwkv_lora_from_file(self, ctx: RWKVContext, lora_file_path: str, scale: float = 1.0) -> RWKVLoRA:
+        """
+        Loads a low-rank adapter created by convert_lora_to_ggml.py, to be applied at runtime with rwkv_set_lora.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file. The adapter can be used with this context and its clones.
+        lora_file_path : str
+            Path to adapter file.
+        scale : float
+            Multiplier of the adapter contribution; 1.0 applies the adapter as it was trained.
+        """
+
+        ptr = self.library.rwkv_lora_from_file(ctx.ptr, lora_file_path.encode('utf-8'), ctypes.c_float(scale))
+
+        assert ptr is not None, 'rwkv_lora_from_file failed, check stderr'
+
+        return RWKVLoRA(ptr)
+
+    def rwkv_set_lora(self, ctx: RWKVContext, lora: Optional[RWKVLoRA]) -> None:
+        """
+        Sets the adapter used by following evaluations of the context.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        lora : Optional[RWKVLoRA]
+            Adapter obtained from rwkv_lora_from_file, or None to disable the adapter.
+        """
+
+        assert self.library.rwkv_set_lora(ctx.ptr, lora.ptr if lora is not None else None), 'rwkv_set_lora failed, check stderr'
+
+    def rwkv_lora_free(self, lora: RWKVLoRA) -> None:
+        """
+        Frees the adapter. It must not be set for any context.
+
+        Parameters
+        ----------
+        lora : RWKVLoRA
+            Adapter obtained from rwkv_lora_from_file.
+        """
+
+        self.library.rwkv_lora_free(lora.ptr)
+
+        lora.ptr = ctypes.cast(0, ctypes.c_void_p)
+
     def rwkv_eval(
             self,
             ctx: RWKVContext,
@@ -169,7 +685,7 @@ class RWKVSharedLibrary:
         ctx : RWKVContext
             RWKV context obtained from rwkv_init_from_file.
         tokens : List[int]
-            Next token indices, in range 0 <= token < n_vocab.
+            Next token indices, in range 0 <= token < n_vocab. Lists are copied, int32 buffers are passed without copying.
         state_in_address : int
             Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count; or None, if this is a first pass.
         state_out_address : int
@@ -180,72 +696,1311 @@ class RWKVSharedLibrary:
 
         assert self.library.rwkv_eval_sequence(
             ctx.ptr,
-            ctypes.cast((ctypes.c_int32 * len(tokens))(*tokens), P_INT),
+            token_pointer(tokens),
             ctypes.c_size_t(len(tokens)),
             ctypes.cast(0 if state_in_address is None else state_in_address, P_FLOAT),
             ctypes.cast(state_out_address, P_FLOAT),
             ctypes.cast(logits_out_address, P_FLOAT)
         ), 'rwkv_eval failed, check stderr'
 
-    def rwkv_get_state_buffer_element_count(self, ctx: RWKVContext) -> int:
+    def rwkv_eval_sequence_per_token(
+            self,
+            ctx: RWKVContext,
+            tokens: List[int],
+            state_in_address: Optional[int],
+            logits_out_address: Optional[int],
+            states_out_address: Optional[int]
+    ) -> None:
         """
-        Returns count of FP32 elements in state buffer.
+        Evaluates the model for a sequence of tokens, giving logits and state after every token.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
 
         Parameters
         ----------
         ctx : RWKVContext
             RWKV context obtained from rwkv_init_from_file.
+        tokens : List[int]
+            Next token indices, in range 0 <= token < n_vocab; at least one. Lists are copied, int32 buffers are passed without copying.
+        state_in_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count; or None, if this is a first pass.
+        logits_out_address : int
+            Address of the first element of a FP32 buffer of len(tokens) * rwkv_get_logits_buffer_element_count elements; or None.
+        states_out_address : int
+            Address of the first element of a FP32 buffer of len(tokens) * rwkv_get_state_buffer_element_count elements; or None.
         """
 
-        return self.library.rwkv_get_state_buffer_element_count(ctx.ptr)
+        assert self.library.rwkv_eval_sequence_per_token(
+            ctx.ptr,
+            token_pointer(tokens),
+            ctypes.c_size_t(len(tokens)),
+            ctypes.cast(0 if state_in_address is None else state_in_address, P_FLOAT),
+            ctypes.cast(0 if logits_out_address is None else logits_out_address, P_FLOAT),
+            ctypes.cast(0 if states_out_address is None else states_out_address, P_FLOAT)
+        ), 'rwkv_eval_sequence_per_token failed, check stderr'
 
-    def rwkv_get_logits_buffer_element_count(self, ctx: RWKVContext) -> int:
+    def rwkv_eval_sequence_embed(
+            self,
+            ctx: RWKVContext,
+            tokens: List[int],
+            state_in_address: Optional[int],
+            state_out_address: Optional[int],
+            embedding_out_address: int,
+            mean_pool: bool = False
+    ) -> None:
         """
-        Returns count of FP32 elements in logits buffer.
+        Evaluates the model for a sequence of tokens, giving the final hidden state normalized by ln_out instead of logits.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
 
         Parameters
         ----------
         ctx : RWKVContext
             RWKV context obtained from rwkv_init_from_file.
+        tokens : List[int]
+            Next token indices, in range 0 <= token < n_vocab; at least one. Lists are copied, int32 buffers are passed without copying.
+        state_in_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count; or None, if this is a first pass.
+        state_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count; or None.
+        embedding_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_n_embed. This buffer will be written to.
+        mean_pool : bool
+            If True, gives the mean of embeddings of all tokens; otherwise, the embedding of the last token.
         """
 
-        return self.library.rwkv_get_logits_buffer_element_count(ctx.ptr)
+        assert self.library.rwkv_eval_sequence_embed(
+            ctx.ptr,
+            token_pointer(tokens),
+            ctypes.c_size_t(len(tokens)),
+            ctypes.cast(0 if state_in_address is None else state_in_address, P_FLOAT),
+            ctypes.cast(0 if state_out_address is None else state_out_address, P_FLOAT),
+            ctypes.cast(embedding_out_address, P_FLOAT),
+            ctypes.c_bool(mean_pool)
+        ), 'rwkv_eval_sequence_embed failed, check stderr'
 
-    def rwkv_free(self, ctx: RWKVContext) -> None:
+    def rwkv_eval_sequence_embed_batch(
+            self,
+            ctx: RWKVContext,
+            sequences: List[List[int]],
+            chunk_length: int,
+            state_in_address: Optional[int],
+            mean_pool: bool,
+            embeddings_out_address: int
+    ) -> None:
         """
-        Frees all allocated memory and the context.
+        Gives embeddings of several independent sequences, reusing a single cached graph for all of them.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
 
         Parameters
         ----------
         ctx : RWKVContext
             RWKV context obtained from rwkv_init_from_file.
+        sequences : List[List[int]]
+            Token indices of each sequence, in range 0 <= token < n_vocab; no sequence may be empty.
+        chunk_length : int
+            Count of tokens per chunk, or 0 for 64 tokens, or the length of the longest sequence if it is shorter.
+        state_in_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count; or None, to start from the initial state.
+        mean_pool : bool
+            If True, gives the mean of embeddings of all tokens of a sequence; otherwise, the embedding of its last token.
+        embeddings_out_address : int
+            Address of the first element of a FP32 buffer of len(sequences) * rwkv_get_n_embed elements. This buffer will be written to.
         """
 
-        self.library.rwkv_free(ctx.ptr)
+        arrays = [(ctypes.c_int32 * len(sequence))(*sequence) for sequence in sequences]
 
-        ctx.ptr = ctypes.cast(0, ctypes.c_void_p)
+        assert self.library.rwkv_eval_sequence_embed_batch(
+            ctx.ptr,
+            (P_INT * len(arrays))(*[ctypes.cast(array, P_INT) for array in arrays]),
+            (ctypes.c_size_t * len(sequences))(*[len(sequence) for sequence in sequences]),
+            ctypes.c_size_t(len(sequences)),
+            ctypes.c_size_t(chunk_length),
+            ctypes.cast(0 if state_in_address is None else state_in_address, P_FLOAT),
+            ctypes.c_bool(mean_pool),
+            ctypes.cast(embeddings_out_address, P_FLOAT)
+        ), 'rwkv_eval_sequence_embed_batch failed, check stderr'
 
-    def rwkv_quantize_model_file(self, model_file_path_in: str, model_file_path_out: str, format_name: str) -> None:
+    def rwkv_time_us(self) -> int:
         """
-        Quantizes FP32 or FP16 model to one of INT4 formats.
-        Throws an exception in case of any error. Error messages would be printed to stderr.
-
-        Parameters
-        ----------
-        model_file_path_in : str
-            Path to model file in ggml format, must be either FP32 or FP16.
-        model_file_path_out : str
-            Quantized model will be written here.
-        format_name : str
-            One of QUANTIZED_FORMAT_NAMES.
+        Returns current time of a monotonic clock in microseconds, for computing deadlines of rwkv_eval_sequence_chunked.
         """
 
-        assert format_name in QUANTIZED_FORMAT_NAMES, f'Unknown format name {format_name}, use one of {QUANTIZED_FORMAT_NAMES}'
+        return self.library.rwkv_time_us()
+
+    def rwkv_eval_sequence_chunked(
+            self,
+            ctx: RWKVContext,
+            tokens: List[int],
+            chunk_length: int,
+            state_in_address: Optional[int],
+            state_out_address: int,
+            logits_out_address: Optional[int],
+            deadline_us: int = 0
+    ) -> int:
+        """
+        Evaluates the model for a sequence of tokens in chunks, stopping before a chunk if the deadline has passed.
+        Returns the count of evaluated tokens: if it is less than the count of tokens, the state buffer contains
+        the state after the last evaluated chunk, and logits were not written.
+        Throws an exception in case of any other error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        tokens : List[int]
+            Next token indices, in range 0 <= token < n_vocab.
+        chunk_length : int
+            Count of tokens per chunk, or 0 to evaluate the sequence as a single chunk.
+        state_in_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count; or None, if this is a first pass.
+        state_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count. This buffer will be written to.
+        logits_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_logits_buffer_element_count; or None, if logits are not needed.
+        deadline_us : int
+            rwkv_time_us value after which evaluation stops, or 0 for no deadline.
+        """
+
+        processed = ctypes.c_size_t(0)
+
+        result: bool = self.library.rwkv_eval_sequence_chunked(
+            ctx.ptr,
+            ctypes.cast((ctypes.c_int32 * len(tokens))(*tokens), P_INT),
+            ctypes.c_size_t(len(tokens)),
+            ctypes.c_size_t(chunk_length),
+            ctypes.cast(0 if state_in_address is None else state_in_address, P_FLOAT),
+            ctypes.cast(state_out_address, P_FLOAT),
+            ctypes.cast(0 if logits_out_address is None else logits_out_address, P_FLOAT),
+            ctypes.c_int64(deadline_us),
+            None,
+            None,
+            ctypes.byref(processed)
+        )
+
+        assert result or self.library.rwkv_get_last_error(ctx.ptr) == RWKV_ERROR_CTX | RWKV_ERROR_CANCELLED, 'rwkv_eval_sequence_chunked failed, check stderr'
+
+        return processed.value
+
+    def rwkv_generate(
+            self,
+            ctx: RWKVContext,
+            prompt_tokens: List[int],
+            max_tokens: int,
+            temperature: float = 1.0,
+            top_p: float = 1.0,
+            top_k: int = 0,
+            presence_penalty: float = 0.0,
+            frequency_penalty: float = 0.0,
+            seed: int = 0,
+            stop_sequences: Optional[List[List[int]]] = None,
+            state_in_address: Optional[int] = None,
+            state_out_address: Optional[int] = None,
+            callback: Optional[Callable[[int], bool]] = None
+    ) -> List[int]:
+        """
+        Evaluates the prompt, then samples up to max_tokens tokens, all in the library, and returns the generated tokens.
+        Generation stops after a stop sequence, which is not returned.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        prompt_tokens : List[int]
+            Tokens to evaluate before sampling; at least one.
+        max_tokens : int
+            Largest count of tokens to sample.
+        temperature : float
+            Logits are divided by the temperature before softmax; 0 always picks the most likely token.
+        top_p : float
+            Only the most likely tokens whose probabilities add up to top_p are kept; 1 disables nucleus sampling.
+        top_k : int
+            Only the top_k most likely tokens are kept; 0 disables it.
+        presence_penalty : float
+            Subtracted from logits of every token that was already generated.
+        frequency_penalty : float
+            Subtracted from logits of every token once for each time it was already generated.
+        seed : int
+            Seed of the random generator.
+        stop_sequences : Optional[List[List[int]]]
+            Token sequences that end generation, for example [[0]] for the end of text.
+        state_in_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count; or None, if this is a first pass.
+        state_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count, which receives the state
+            after the prompt and all sampled tokens; or None.
+        callback : Callable[[int], bool]
+            Called with every generated token as soon as it is known; returning True stops generation.
+        """
+
+        params = RWKVSamplerParams(temperature, top_p, top_k, presence_penalty, frequency_penalty, seed)
+
+        stop_sequences = stop_sequences or []
+        stop_buffers = [(ctypes.c_int32 * len(sequence))(*sequence) for sequence in stop_sequences]
+        stops = (RWKVStopSequence * len(stop_buffers))(*[
+            RWKVStopSequence(ctypes.cast(buffer, P_INT), len(buffer)) for buffer in stop_buffers
+        ])
+
+        tokens_out = (ctypes.c_int32 * max_tokens)()
+        generated_len = ctypes.c_size_t(0)
+        c_callback = RWKV_TOKEN_CALLBACK(lambda token, _: bool(callback(token))) if callback else RWKV_TOKEN_CALLBACK()
+
+        assert self.library.rwkv_generate(
+            ctx.ptr,
+            ctypes.cast((ctypes.c_int32 * len(prompt_tokens))(*prompt_tokens), P_INT),
+            ctypes.c_size_t(len(prompt_tokens)),
+            ctypes.c_size_t(max_tokens),
+            ctypes.byref(params),
+            stops,
+            ctypes.c_size_t(len(stop_buffers)),
+            ctypes.cast(0 if state_in_address is None else state_in_address, P_FLOAT),
+            ctypes.cast(0 if state_out_address is None else state_out_address, P_FLOAT),
+            ctypes.cast(tokens_out, P_INT),
+            ctypes.byref(generated_len),
+            c_callback,
+            None
+        ), 'rwkv_generate failed, check stderr'
+
+        return list(tokens_out[:generated_len.value])
+
+    def rwkv_sample_logits(
+            self,
+            logits_address: int,
+            n_vocab: int,
+            rng: ctypes.c_uint64,
+            temperature: float = 1.0,
+            top_p: float = 1.0,
+            top_k: int = 0,
+            seed: int = 0
+    ) -> int:
+        """
+        Samples a token from logits in the same way as rwkv_generate, without penalties, and returns it.
+
+        Parameters
+        ----------
+        logits_address : int
+            Address of the first element of a FP32 buffer of n_vocab logits.
+        n_vocab : int
+            Count of logits.
+        rng : ctypes.c_uint64
+            State of the random generator, updated by every call. If it is 0, it is started from seed.
+        temperature : float
+            Logits are divided by the temperature before softmax; 0 always picks the most likely token.
+        top_p : float
+            Only the most likely tokens whose probabilities add up to top_p are kept; 1 disables nucleus sampling.
+        top_k : int
+            Only the top_k most likely tokens are kept; 0 disables it.
+        seed : int
+            Seed of the random generator, used when rng is 0.
+        """
+
+        params = RWKVSamplerParams(temperature, top_p, top_k, 0.0, 0.0, seed)
+
+        return self.library.rwkv_sample_logits(
+            ctypes.cast(logits_address, P_FLOAT),
+            ctypes.c_size_t(n_vocab),
+            ctypes.byref(params),
+            ctypes.byref(rng)
+        )
+
+    def rwkv_generate_speculative(
+            self,
+            ctx: RWKVContext,
+            draft_ctx: Optional[RWKVContext],
+            prompt_tokens: List[int],
+            max_tokens: int,
+            n_draft: int = 4,
+            ngram_len: int = 3,
+            mode: Optional[int] = None,
+            layer_mask: Optional[List[bool]] = None,
+            temperature: float = 1.0,
+            top_p: float = 1.0,
+            top_k: int = 0,
+            presence_penalty: float = 0.0,
+            frequency_penalty: float = 0.0,
+            seed: int = 0,
+            stop_sequences: Optional[List[List[int]]] = None,
+            state_in_address: Optional[int] = None,
+            state_out_address: Optional[int] = None,
+            draft_state_in_address: Optional[int] = None,
+            draft_state_out_address: Optional[int] = None,
+            callback: Optional[Callable[[int], bool]] = None
+    ) -> Tuple[List[int], Dict[str, int]]:
+        """
+        Same as rwkv_generate, but drafts n_draft tokens at a time, and verifies them with the model at once.
+        Tokens are drafted with the draft model; or, if it is None, by looking up the last tokens in the prompt and the sampled tokens.
+        Returns the generated tokens, and counts of drafted and accepted tokens and of verifications.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        draft_ctx : Optional[RWKVContext]
+            Context of a smaller model with the same vocabulary; or None to draft by prompt lookup.
+        n_draft : int
+            Count of tokens drafted before each verification; at least 1.
+        ngram_len : int
+            For prompt lookup, count of last tokens to look up; fewer are looked up if they did not occur before.
+        mode : Optional[int]
+            One of RWKV_SPECULATION_* constants; None selects the draft model if it is set, and prompt lookup otherwise.
+        layer_mask : Optional[List[bool]]
+            For RWKV_SPECULATION_LAYER_SKIP, n_layer flags, True for layers that drafting evaluates; None for every other layer.
+        draft_state_in_address : int
+            Address of the first element of a FP32 buffer with the state of the draft model; or None, if this is a first pass.
+        draft_state_out_address : int
+            Address of the first element of a FP32 buffer, which receives the state of the draft model
+            after the prompt and all sampled tokens; or None.
+
+        Other parameters are the same as for rwkv_generate.
+        """
+
+        if mode is None:
+            mode = RWKV_SPECULATION_PROMPT_LOOKUP if draft_ctx is None else RWKV_SPECULATION_DRAFT_MODEL
+
+        mask = None if layer_mask is None else (ctypes.c_bool * len(layer_mask))(*layer_mask)
+
+        speculation = RWKVSpeculationParams(
+            mode,
+            n_draft,
+            None if draft_ctx is None else draft_ctx.ptr,
+            ctypes.cast(0 if draft_state_in_address is None else draft_state_in_address, P_FLOAT),
+            ctypes.cast(0 if draft_state_out_address is None else draft_state_out_address, P_FLOAT),
+            ngram_len,
+            ctypes.cast(mask, ctypes.POINTER(ctypes.c_bool))
+        )
+        stats = RWKVSpeculationStats()
+        params = RWKVSamplerParams(temperature, top_p, top_k, presence_penalty, frequency_penalty, seed)
+
+        stop_sequences = stop_sequences or []
+        stop_buffers = [(ctypes.c_int32 * len(sequence))(*sequence) for sequence in stop_sequences]
+        stops = (RWKVStopSequence * len(stop_buffers))(*[
+            RWKVStopSequence(ctypes.cast(buffer, P_INT), len(buffer)) for buffer in stop_buffers
+        ])
+
+        tokens_out = (ctypes.c_int32 * max_tokens)()
+        generated_len = ctypes.c_size_t(0)
+        c_callback = RWKV_TOKEN_CALLBACK(lambda token, _: bool(callback(token))) if callback else RWKV_TOKEN_CALLBACK()
+
+        assert self.library.rwkv_generate_speculative(
+            ctx.ptr,
+            ctypes.byref(speculation),
+            ctypes.byref(stats),
+            ctypes.cast((ctypes.c_int32 * len(prompt_tokens))(*prompt_tokens), P_INT),
+            ctypes.c_size_t(len(prompt_tokens)),
+            ctypes.c_size_t(max_tokens),
+            ctypes.byref(params),
+            stops,
+            ctypes.c_size_t(len(stop_buffers)),
+            ctypes.cast(0 if state_in_address is None else state_in_address, P_FLOAT),
+            ctypes.cast(0 if state_out_address is None else state_out_address, P_FLOAT),
+            ctypes.cast(tokens_out, P_INT),
+            ctypes.byref(generated_len),
+            c_callback,
+            None
+        ), 'rwkv_generate_speculative failed, check stderr'
+
+        return list(tokens_out[:generated_len.value]), {name: getattr(stats, name) for name, _ in RWKVSpeculationStats._fields_}
+
+    def rwkv_executor_new(self, worker_count: int) -> RWKVExecutor:
+        """
+        Creates an executor that runs asynchronous evaluations on a fixed set of worker threads.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        worker_count : int
+            Count of worker threads, must be positive.
+        """
+
+        ptr = self.library.rwkv_executor_new(ctypes.c_uint32(worker_count))
+
+        assert ptr is not None, 'rwkv_executor_new failed, check stderr'
+
+        return RWKVExecutor(ptr)
+
+    def rwkv_executor_get_fd(self, executor: RWKVExecutor) -> int:
+        """
+        Returns a file descriptor that becomes readable when an evaluation completes, or -1 if not supported.
+        It can be registered in selectors or asyncio event loops.
+
+        Parameters
+        ----------
+        executor : RWKVExecutor
+            Executor obtained from rwkv_executor_new.
+        """
+
+        return self.library.rwkv_executor_get_fd(executor.ptr)
+
+    def rwkv_executor_free(self, executor: RWKVExecutor) -> None:
+        """
+        Cancels pending evaluations, waits for running ones and frees the executor.
+
+        Parameters
+        ----------
+        executor : RWKVExecutor
+            Executor obtained from rwkv_executor_new.
+        """
+
+        self.library.rwkv_executor_free(executor.ptr)
+
+        executor.ptr = ctypes.cast(0, ctypes.c_void_p)
+
+    def rwkv_eval_async(
+            self,
+            executor: RWKVExecutor,
+            ctx: RWKVContext,
+            token: int,
+            state_in_address: Optional[int],
+            state_out_address: int,
+            logits_out_address: int
+    ) -> RWKVAsync:
+        """
+        Queues evaluation of a single token, see rwkv_eval. Buffers must stay valid until the evaluation completes.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        executor : RWKVExecutor
+            Executor obtained from rwkv_executor_new.
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file. It must not have another asynchronous evaluation in progress.
+        token : int
+            Next token index, in range 0 <= token < n_vocab.
+        state_in_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count; or None, if this is a first pass.
+        state_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count. This buffer will be written to.
+        logits_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_logits_buffer_element_count. This buffer will be written to.
+        """
+
+        ptr = self.library.rwkv_eval_async(
+            executor.ptr,
+            ctx.ptr,
+            ctypes.c_int32(token),
+            ctypes.cast(0 if state_in_address is None else state_in_address, P_FLOAT),
+            ctypes.cast(state_out_address, P_FLOAT),
+            ctypes.cast(logits_out_address, P_FLOAT),
+            None,
+            None
+        )
+
+        assert ptr is not None, 'rwkv_eval_async failed, check stderr'
+
+        return RWKVAsync(ptr)
+
+    def rwkv_eval_sequence_async(
+            self,
+            executor: RWKVExecutor,
+            ctx: RWKVContext,
+            tokens: List[int],
+            state_in_address: Optional[int],
+            state_out_address: int,
+            logits_out_address: int
+    ) -> RWKVAsync:
+        """
+        Queues evaluation of a sequence of tokens, see rwkv_eval_sequence. Buffers must stay valid until the evaluation completes.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        executor : RWKVExecutor
+            Executor obtained from rwkv_executor_new.
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file. It must not have another asynchronous evaluation in progress.
+        tokens : List[int]
+            Next token indices, in range 0 <= token < n_vocab. Lists are copied, int32 buffers are passed without copying.
+        state_in_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count; or None, if this is a first pass.
+        state_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count. This buffer will be written to.
+        logits_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_logits_buffer_element_count. This buffer will be written to.
+        """
+
+        ptr = self.library.rwkv_eval_sequence_async(
+            executor.ptr,
+            ctx.ptr,
+            token_pointer(tokens),
+            ctypes.c_size_t(len(tokens)),
+            ctypes.cast(0 if state_in_address is None else state_in_address, P_FLOAT),
+            ctypes.cast(state_out_address, P_FLOAT),
+            ctypes.cast(logits_out_address, P_FLOAT),
+            None,
+            None
+        )
+
+        assert ptr is not None, 'rwkv_eval_sequence_async failed, check stderr'
+
+        return RWKVAsync(ptr)
+
+    def rwkv_async_get_status(self, handle: RWKVAsync) -> int:
+        """
+        Returns one of RWKV_ASYNC_* statuses of the evaluation.
+
+        Parameters
+        ----------
+        handle : RWKVAsync
+            Handle obtained from rwkv_eval_async or rwkv_eval_sequence_async.
+        """
+
+        return self.library.rwkv_async_get_status(handle.ptr)
+
+    def rwkv_async_wait(self, handle: RWKVAsync) -> int:
+        """
+        Blocks until the evaluation completes, and returns its final RWKV_ASYNC_* status.
+
+        Parameters
+        ----------
+        handle : RWKVAsync
+            Handle obtained from rwkv_eval_async or rwkv_eval_sequence_async.
+        """
+
+        return self.library.rwkv_async_wait(handle.ptr)
+
+    def rwkv_async_cancel(self, handle: RWKVAsync) -> bool:
+        """
+        Cancels the evaluation if it has not started yet. Returns whether it was cancelled.
+
+        Parameters
+        ----------
+        handle : RWKVAsync
+            Handle obtained from rwkv_eval_async or rwkv_eval_sequence_async.
+        """
+
+        return self.library.rwkv_async_cancel(handle.ptr)
+
+    def rwkv_async_free(self, handle: RWKVAsync) -> None:
+        """
+        Frees the handle. A pending evaluation is cancelled; a running one completes, but its result can no longer be observed through the handle.
+
+        Parameters
+        ----------
+        handle : RWKVAsync
+            Handle obtained from rwkv_eval_async or rwkv_eval_sequence_async.
+        """
+
+        self.library.rwkv_async_free(handle.ptr)
+
+        handle.ptr = ctypes.cast(0, ctypes.c_void_p)
+
+    def rwkv_scheduler_new(
+            self,
+            contexts: List[RWKVContext],
+            batch_tokens: int = 256,
+            chunk_len: int = 64,
+            callback: Optional[Callable[[int, bool], None]] = None
+    ) -> RWKVScheduler:
+        """
+        Creates a continuous batching scheduler that evaluates many sessions on the given contexts of the same model.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        contexts : List[RWKVContext]
+            Contexts of the same model, for example clones created with rwkv_clone_context. They are not freed by the scheduler.
+        batch_tokens : int
+            Largest count of tokens evaluated in one iteration.
+        chunk_len : int
+            Largest count of tokens evaluated for one session in one iteration.
+        callback : Callable[[int, bool], None]
+            Called with the session id and success flag when a session leaves the scheduler; or None.
+        """
+
+        c_callback = RWKV_SCHEDULER_CALLBACK(lambda session_id, success, _: callback(session_id, success)) if callback else RWKV_SCHEDULER_CALLBACK()
+
+        ptr = self.library.rwkv_scheduler_new(
+            (ctypes.c_void_p * len(contexts))(*[ctx.ptr for ctx in contexts]),
+            ctypes.c_size_t(len(contexts)),
+            ctypes.c_size_t(batch_tokens),
+            ctypes.c_size_t(chunk_len),
+            c_callback,
+            None
+        )
+
+        assert ptr is not None, 'rwkv_scheduler_new failed, check stderr'
+
+        return RWKVScheduler(ptr, c_callback)
+
+    def rwkv_scheduler_free(self, scheduler: RWKVScheduler) -> None:
+        """
+        Frees the scheduler. Sessions that are still queued are dropped without calling the callback.
+
+        Parameters
+        ----------
+        scheduler : RWKVScheduler
+            Scheduler obtained from rwkv_scheduler_new.
+        """
+
+        self.library.rwkv_scheduler_free(scheduler.ptr)
+
+        scheduler.ptr = ctypes.cast(0, ctypes.c_void_p)
+        scheduler.callback = None
+
+    def rwkv_scheduler_submit(
+            self,
+            scheduler: RWKVScheduler,
+            session_id: int,
+            tokens: List[int],
+            state_address: int,
+            logits_out_address: Optional[int]
+    ) -> None:
+        """
+        Adds a session that evaluates the given tokens. Buffers must stay valid until the session leaves the scheduler.
+        Throws an exception in case of any error, including a session that is already queued. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        scheduler : RWKVScheduler
+            Scheduler obtained from rwkv_scheduler_new.
+        session_id : int
+            Unsigned 64-bit session identifier.
+        tokens : List[int]
+            Token indices to evaluate, in range 0 <= token < n_vocab; at least one.
+        state_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count, holding the state to start from.
+            This buffer will be written to.
+        logits_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_logits_buffer_element_count, written after the last token; or None.
+        """
+
+        assert self.library.rwkv_scheduler_submit(
+            scheduler.ptr,
+            ctypes.c_uint64(session_id),
+            ctypes.cast((ctypes.c_int32 * len(tokens))(*tokens), P_INT),
+            ctypes.c_size_t(len(tokens)),
+            ctypes.cast(state_address, P_FLOAT),
+            ctypes.cast(0 if logits_out_address is None else logits_out_address, P_FLOAT)
+        ), 'rwkv_scheduler_submit failed, check stderr'
+
+    def rwkv_scheduler_submit_embed(
+            self,
+            scheduler: RWKVScheduler,
+            session_id: int,
+            tokens: List[int],
+            state_address: int,
+            embedding_out_address: int
+    ) -> None:
+        """
+        Same as rwkv_scheduler_submit, but the last chunk gives the embedding of the last token instead of logits.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        scheduler : RWKVScheduler
+            Scheduler obtained from rwkv_scheduler_new.
+        session_id : int
+            Unsigned 64-bit session identifier.
+        tokens : List[int]
+            Token indices to evaluate, in range 0 <= token < n_vocab; at least one.
+        state_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count, holding the state to start from.
+            This buffer will be written to.
+        embedding_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_n_embed, written after the last token.
+        """
+
+        assert self.library.rwkv_scheduler_submit_embed(
+            scheduler.ptr,
+            ctypes.c_uint64(session_id),
+            ctypes.cast((ctypes.c_int32 * len(tokens))(*tokens), P_INT),
+            ctypes.c_size_t(len(tokens)),
+            ctypes.cast(state_address, P_FLOAT),
+            ctypes.cast(embedding_out_address, P_FLOAT)
+        ), 'rwkv_scheduler_submit_embed failed, check stderr'
+
+    def rwkv_scheduler_submit_per_token(
+            self,
+            scheduler: RWKVScheduler,
+            session_id: int,
+            tokens: List[int],
+            state_address: int,
+            logits_out_address: int
+    ) -> None:
+        """
+        Same as rwkv_scheduler_submit, but gives logits after every token, see rwkv_eval_sequence_per_token.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        scheduler : RWKVScheduler
+            Scheduler obtained from rwkv_scheduler_new.
+        session_id : int
+            Unsigned 64-bit session identifier.
+        tokens : List[int]
+            Token indices to evaluate, in range 0 <= token < n_vocab; at least one.
+        state_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count, holding the state to start from.
+            This buffer will be written to.
+        logits_out_address : int
+            Address of the first element of a FP32 buffer of size len(tokens) * rwkv_get_logits_buffer_element_count;
+            row i receives logits after token i.
+        """
+
+        assert self.library.rwkv_scheduler_submit_per_token(
+            scheduler.ptr,
+            ctypes.c_uint64(session_id),
+            ctypes.cast((ctypes.c_int32 * len(tokens))(*tokens), P_INT),
+            ctypes.c_size_t(len(tokens)),
+            ctypes.cast(state_address, P_FLOAT),
+            ctypes.cast(logits_out_address, P_FLOAT)
+        ), 'rwkv_scheduler_submit_per_token failed, check stderr'
+
+    def rwkv_scheduler_cancel(self, scheduler: RWKVScheduler, session_id: int) -> bool:
+        """
+        Removes the session without calling the callback. Returns False if the scheduler did not contain the session.
+
+        Parameters
+        ----------
+        scheduler : RWKVScheduler
+            Scheduler obtained from rwkv_scheduler_new.
+        session_id : int
+            Unsigned 64-bit session identifier.
+        """
+
+        return self.library.rwkv_scheduler_cancel(scheduler.ptr, ctypes.c_uint64(session_id))
+
+    def rwkv_scheduler_get_n_sessions(self, scheduler: RWKVScheduler) -> int:
+        """
+        Returns the count of sessions in the scheduler.
+
+        Parameters
+        ----------
+        scheduler : RWKVScheduler
+            Scheduler obtained from rwkv_scheduler_new.
+        """
+
+        return self.library.rwkv_scheduler_get_n_sessions(scheduler.ptr)
+
+    def rwkv_scheduler_step(self, scheduler: RWKVScheduler) -> dict:
+        """
+        Runs one iteration, calling the callback for sessions that left, and returns its occupancy as a dict with keys
+        decode_sessions, prefill_sessions, tokens, waiting_sessions and duration_us.
+        Throws an exception if evaluation of any session failed. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        scheduler : RWKVScheduler
+            Scheduler obtained from rwkv_scheduler_new.
+        """
+
+        stats = RWKVSchedulerStats()
+
+        assert self.library.rwkv_scheduler_step(scheduler.ptr, ctypes.byref(stats)), 'rwkv_scheduler_step failed, check stderr'
+
+        return {name: getattr(stats, name) for name, _ in RWKVSchedulerStats._fields_}
+
+    def rwkv_get_state_buffer_element_count(self, ctx: RWKVContext) -> int:
+        """
+        Returns count of FP32 elements in state buffer.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        """
+
+        return self.library.rwkv_get_state_buffer_element_count(ctx.ptr)
+
+    def rwkv_get_logits_buffer_element_count(self, ctx: RWKVContext) -> int:
+        """
+        Returns count of FP32 elements in logits buffer.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        """
+
+        return self.library.rwkv_get_logits_buffer_element_count(ctx.ptr)
+
+    def rwkv_get_n_embed(self, ctx: RWKVContext) -> int:
+        """
+        Returns count of FP32 elements in an embedding, see rwkv_eval_sequence_embed.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        """
+
+        return self.library.rwkv_get_n_embed(ctx.ptr)
+
+    def rwkv_get_model_size(self, ctx: RWKVContext) -> int:
+        """
+        Returns the size in bytes of the model weights, which are shared by all contexts of the model.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        """
+
+        return self.library.rwkv_get_model_size(ctx.ptr)
+
+    def rwkv_get_context_size(self, ctx: RWKVContext, thread_count: int) -> int:
+        """
+        Returns the size in bytes of memory that a context of this model with given thread count allocates,
+        excluding model weights and the sequence graph.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        thread_count : int
+            Thread count of the context.
+        """
+
+        return self.library.rwkv_get_context_size(ctx.ptr, ctypes.c_uint32(thread_count))
+
+    def rwkv_get_sequence_graph_size(self, ctx: RWKVContext, sequence_length: int) -> int:
+        """
+        Returns the size in bytes of the graph that rwkv_eval_sequence builds for the given sequence length.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        sequence_length : int
+            Count of tokens in the sequence.
+        """
+
+        return self.library.rwkv_get_sequence_graph_size(ctx.ptr, ctypes.c_size_t(sequence_length))
+
+    def rwkv_set_memory_limit(self, ctx: RWKVContext, limit: int) -> None:
+        """
+        Limits memory allocated by the context; building graphs that would exceed the limit fails.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        limit : int
+            Limit in bytes, or 0 to remove the limit.
+        """
+
+        self.library.rwkv_set_memory_limit(ctx.ptr, ctypes.c_size_t(limit))
+
+    def rwkv_set_cpu_affinity(self, ctx: RWKVContext, cpus: Optional[List[int]]) -> None:
+        """
+        Pins threads that compute graphs of the context to the given CPUs. Linux only.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        cpus : List[int]
+            Indices of CPUs as numbered by the OS, or None to remove pinning.
+        """
+
+        count: int = 0 if cpus is None else len(cpus)
+
+        assert self.library.rwkv_set_cpu_affinity(
+            ctx.ptr,
+            (ctypes.c_uint32 * count)(*cpus) if count > 0 else None,
+            ctypes.c_size_t(count)
+        ), 'rwkv_set_cpu_affinity failed, check stderr'
+
+    def rwkv_state_serialize(self, ctx: RWKVContext, state_address: int, encoding: int = RWKV_STATE_FP32) -> bytes:
+        """
+        Serializes the state into bytes that can be stored and later passed to rwkv_state_deserialize.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        state_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count.
+        encoding : int
+            One of RWKV_STATE_* encodings. RWKV_STATE_FP16 and RWKV_STATE_Q8 are lossy, but smaller.
+        """
+
+        size: int = self.library.rwkv_state_serialized_size(ctx.ptr, ctypes.c_int(encoding))
+        assert size > 0, f'Unknown state encoding {encoding}'
+
+        buffer = ctypes.create_string_buffer(size)
+
+        assert self.library.rwkv_state_serialize(
+            ctx.ptr,
+            ctypes.cast(state_address, P_FLOAT),
+            ctypes.c_int(encoding),
+            buffer,
+            ctypes.c_size_t(size)
+        ), 'rwkv_state_serialize failed, check stderr'
+
+        return buffer.raw
+
+    def rwkv_state_deserialize(self, ctx: RWKVContext, data: bytes, state_out_address: int) -> None:
+        """
+        Restores a state serialized by rwkv_state_serialize with the same model.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        data : bytes
+            Serialized state.
+        state_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count. This buffer will be written to.
+        """
+
+        assert self.library.rwkv_state_deserialize(
+            ctx.ptr,
+            data,
+            ctypes.c_size_t(len(data)),
+            ctypes.cast(state_out_address, P_FLOAT)
+        ), 'rwkv_state_deserialize failed, check stderr'
+
+    def rwkv_session_store_open(
+            self,
+            ctx: RWKVContext,
+            path: str,
+            encoding: int = RWKV_STATE_FP32,
+            max_sessions: int = 1024,
+            max_resident: int = 0
+    ) -> RWKVSessionStore:
+        """
+        Opens a memory-mapped file of session states, or creates it if the file does not exist.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context of the model whose states will be stored.
+        path : str
+            Path to the store file.
+        encoding : int
+            One of RWKV_STATE_* encodings, see rwkv_state_serialize.
+        max_sessions : int
+            Count of slots in a new store; ignored when opening an existing store.
+        max_resident : int
+            Count of recently used slots to keep in RAM, or 0 to leave paging to the OS.
+        """
+
+        ptr = self.library.rwkv_session_store_open(
+            ctx.ptr,
+            path.encode('utf-8'),
+            ctypes.c_int(encoding),
+            ctypes.c_size_t(max_sessions),
+            ctypes.c_size_t(max_resident)
+        )
+
+        assert ptr is not None, 'rwkv_session_store_open failed, check stderr'
+
+        return RWKVSessionStore(ptr)
+
+    def rwkv_session_store_close(self, store: RWKVSessionStore) -> None:
+        """
+        Writes back all slots and closes the store.
+
+        Parameters
+        ----------
+        store : RWKVSessionStore
+            Store obtained from rwkv_session_store_open.
+        """
+
+        self.library.rwkv_session_store_close(store.ptr)
+
+        store.ptr = ctypes.cast(0, ctypes.c_void_p)
+
+    def rwkv_session_store_contains(self, store: RWKVSessionStore, session_id: int) -> bool:
+        """
+        Returns whether the store contains a state of the given session.
+
+        Parameters
+        ----------
+        store : RWKVSessionStore
+            Store obtained from rwkv_session_store_open.
+        session_id : int
+            Unsigned 64-bit session identifier.
+        """
+
+        return self.library.rwkv_session_store_contains(store.ptr, ctypes.c_uint64(session_id))
+
+    def rwkv_session_store_get_count(self, store: RWKVSessionStore) -> int:
+        """
+        Returns the count of sessions in the store.
+
+        Parameters
+        ----------
+        store : RWKVSessionStore
+            Store obtained from rwkv_session_store_open.
+        """
+
+        return self.library.rwkv_session_store_get_count(store.ptr)
+
+    def rwkv_session_store_save(self, store: RWKVSessionStore, ctx: RWKVContext, session_id: int, state_address: int) -> None:
+        """
+        Saves the state of the session, replacing its previous state.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        store : RWKVSessionStore
+            Store obtained from rwkv_session_store_open.
+        ctx : RWKVContext
+            RWKV context of the model the store was opened for.
+        session_id : int
+            Unsigned 64-bit session identifier.
+        state_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count.
+        """
+
+        assert self.library.rwkv_session_store_save(
+            store.ptr,
+            ctx.ptr,
+            ctypes.c_uint64(session_id),
+            ctypes.cast(state_address, P_FLOAT)
+        ), 'rwkv_session_store_save failed, check stderr'
+
+    def rwkv_session_store_load(self, store: RWKVSessionStore, ctx: RWKVContext, session_id: int, state_out_address: int) -> None:
+        """
+        Restores the state of the session.
+        Throws an exception in case of any error, including a missing session. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        store : RWKVSessionStore
+            Store obtained from rwkv_session_store_open.
+        ctx : RWKVContext
+            RWKV context of the model the store was opened for.
+        session_id : int
+            Unsigned 64-bit session identifier.
+        state_out_address : int
+            Address of the first element of a FP32 buffer of size rwkv_get_state_buffer_element_count. This buffer will be written to.
+        """
+
+        assert self.library.rwkv_session_store_load(
+            store.ptr,
+            ctx.ptr,
+            ctypes.c_uint64(session_id),
+            ctypes.cast(state_out_address, P_FLOAT)
+        ), 'rwkv_session_store_load failed, check stderr'
+
+    def rwkv_session_store_remove(self, store: RWKVSessionStore, session_id: int) -> bool:
+        """
+        Removes the session from the store. Returns False if the store did not contain the session.
+
+        Parameters
+        ----------
+        store : RWKVSessionStore
+            Store obtained from rwkv_session_store_open.
+        session_id : int
+            Unsigned 64-bit session identifier.
+        """
+
+        return self.library.rwkv_session_store_remove(store.ptr, ctypes.c_uint64(session_id))
+
+    def rwkv_set_n_threads(self, ctx: RWKVContext, mode: int, thread_count: int) -> None:
+        """
+        Sets the count of threads that evaluations in the given mode compute with.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        mode : int
+            RWKV_EVAL_SERIAL or RWKV_EVAL_SEQUENCE.
+        thread_count : int
+            Count of threads, must be positive.
+        """
+
+        assert self.library.rwkv_set_n_threads(ctx.ptr, mode, ctypes.c_uint32(thread_count)), 'rwkv_set_n_threads failed, check stderr'
+
+    def rwkv_get_n_threads(self, ctx: RWKVContext, mode: int) -> int:
+        """
+        Returns the count of threads that evaluations in the given mode compute with.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        mode : int
+            RWKV_EVAL_SERIAL or RWKV_EVAL_SEQUENCE.
+        """
+
+        return self.library.rwkv_get_n_threads(ctx.ptr, mode)
+
+    def rwkv_tune_n_threads(self, ctx: RWKVContext, mode: int, max_thread_count: int = 0, sequence_length: int = 64) -> int:
+        """
+        Measures evaluation time in the given mode with several thread counts, sets the fastest one and returns it.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        mode : int
+            RWKV_EVAL_SERIAL or RWKV_EVAL_SEQUENCE.
+        max_thread_count : int
+            Largest thread count to try, or 0 to use the count of hardware threads.
+        sequence_length : int
+            Count of tokens to evaluate in sequence mode. Ignored in serial mode.
+        """
+
+        assert self.library.rwkv_tune_n_threads(
+            ctx.ptr,
+            mode,
+            ctypes.c_uint32(max_thread_count),
+            ctypes.c_size_t(sequence_length)
+        ), 'rwkv_tune_n_threads failed, check stderr'
+
+        return self.rwkv_get_n_threads(ctx, mode)
+
+    def rwkv_thread_budget_new(self, thread_count: int = 0) -> RWKVThreadBudget:
+        """
+        Creates a pool of threads shared by contexts that run concurrently.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        thread_count : int
+            Total count of threads, or 0 to use all hardware threads.
+        """
+
+        ptr = self.library.rwkv_thread_budget_new(ctypes.c_uint32(thread_count))
+
+        assert ptr is not None, 'rwkv_thread_budget_new failed, check stderr'
+
+        return RWKVThreadBudget(ptr)
+
+    def rwkv_thread_budget_free(self, budget: RWKVThreadBudget) -> None:
+        """
+        Frees the thread budget. No contexts must be attached to it.
+
+        Parameters
+        ----------
+        budget : RWKVThreadBudget
+            Thread budget obtained from rwkv_thread_budget_new.
+        """
+
+        self.library.rwkv_thread_budget_free(budget.ptr)
+
+        budget.ptr = ctypes.cast(0, ctypes.c_void_p)
+
+    def rwkv_set_thread_budget(self, ctx: RWKVContext, budget: Optional[RWKVThreadBudget]) -> None:
+        """
+        Attaches the context to the thread budget, or detaches it if budget is None.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        budget : RWKVThreadBudget
+            Thread budget obtained from rwkv_thread_budget_new, or None.
+        """
+
+        self.library.rwkv_set_thread_budget(ctx.ptr, budget.ptr if budget is not None else None)
+
+    def rwkv_set_profiling(self, ctx: RWKVContext, flags: int) -> None:
+        """
+        Enables or disables profiling of following evaluations of the context.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        flags : int
+            Bitwise combination of RWKV_PROFILE_* flags, or RWKV_PROFILE_NONE to disable profiling.
+        """
+
+        self.library.rwkv_set_profiling(ctx.ptr, ctypes.c_uint32(flags))
+
+    def rwkv_get_profile(self, ctx: RWKVContext) -> List[dict]:
+        """
+        Returns profiling results aggregated by layer and category, as a list of dicts with keys
+        layer, category, calls, wall_us and cpu_us. Layer -1 is the embedding, layer n_layer is the head.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        """
+
+        count: int = self.library.rwkv_get_profile(ctx.ptr, None, 0)
+        entries = (RWKVProfileEntry * count)()
+        self.library.rwkv_get_profile(ctx.ptr, entries, count)
+
+        return [
+            {
+                'layer': entry.layer,
+                'category': RWKV_PROFILE_CATEGORY_NAMES[entry.category],
+                'calls': entry.calls,
+                'wall_us': entry.wall_us,
+                'cpu_us': entry.cpu_us
+            } for entry in entries
+        ]
+
+    def rwkv_reset_profile(self, ctx: RWKVContext) -> None:
+        """
+        Clears collected profiling results and the trace.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        """
+
+        self.library.rwkv_reset_profile(ctx.ptr)
+
+    def rwkv_dump_profile_trace(self, ctx: RWKVContext, trace_file_path: str) -> None:
+        """
+        Writes the recorded trace as Chrome trace event JSON.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        trace_file_path : str
+            Path to the trace file, will be overwritten.
+        """
+
+        assert self.library.rwkv_dump_profile_trace(ctx.ptr, trace_file_path.encode('utf-8')), 'rwkv_dump_profile_trace failed, check stderr'
+
+    def rwkv_free(self, ctx: RWKVContext) -> None:
+        """
+        Frees all allocated memory and the context.
+
+        Parameters
+        ----------
+        ctx : RWKVContext
+            RWKV context obtained from rwkv_init_from_file.
+        """
+
+        self.library.rwkv_free(ctx.ptr)
+
+        ctx.ptr = ctypes.cast(0, ctypes.c_void_p)
+
+    def rwkv_quantize_model_file(self, model_file_path_in: str, model_file_path_out: str, format_name: str, thread_count: int = 1) -> None:
+        """
+        Quantizes FP32 or FP16 model to one of INT4 formats.
+        Throws an exception in case of any error. Error messages would be printed to stderr.
+
+        Parameters
+        ----------
+        model_file_path_in : str
+            Path to model file in ggml format, must be either FP32 or FP16.
+        model_file_path_out : str
+            Quantized model will be written here.
+        format_name : str
+            One of QUANTIZED_FORMAT_NAMES, or a quantization recipe; see rwkv_quantize_model_file_ex in rwkv.h for syntax.
+        thread_count : int
+            Count of threads to quantize with, or 0 to use all hardware threads.
+        """
+
+        is_recipe: bool = any(c in format_name for c in '=,;\n')
+
+        assert is_recipe or format_name in QUANTIZED_FORMAT_NAMES, f'Unknown format name {format_name}, use one of {QUANTIZED_FORMAT_NAMES}'
+        assert thread_count >= 0, 'Thread count must be >= 0'
 
-        assert self.library.rwkv_quantize_model_file(
+        assert self.library.rwkv_quantize_model_file_ex(
             model_file_path_in.encode('utf-8'),
             model_file_path_out.encode('utf-8'),
-            format_name.encode('utf-8')
+            format_name.encode('utf-8'),
+            ctypes.c_uint32(thread_count)
         ), 'rwkv_quantize_model_file failed, check stderr'
 
     def rwkv_get_system_info_string(self) -> str:
@@ -0,0 +1,142 @@
+// Tests that asynchronous evaluations give the same results as synchronous ones, and that pending evaluations can be cancelled.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+
+// Set by the main thread to let the blocking callback return.
+volatile int release_worker = 0;
+volatile int blocking_callback_started = 0;
+
+int callback_calls = 0;
+enum rwkv_async_status last_status = RWKV_ASYNC_PENDING;
+
+void blocking_callback(struct rwkv_async * handle, enum rwkv_async_status status, void * user_data) {
+    (void) handle;
+    (void) user_data;
+
+    ASSERT(status == RWKV_ASYNC_DONE, "Unexpected status %d", status);
+
+    blocking_callback_started = 1;
+
+    while (!release_worker) {
+        // Keep the only worker busy.
+    }
+}
+
+void counting_callback(struct rwkv_async * handle, enum rwkv_async_status status, void * user_data) {
+    (void) handle;
+
+    ASSERT(user_data == &callback_calls, "Unexpected user data");
+
+    callback_calls++;
+    last_status = status;
+}
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    struct rwkv_context * ctx2 = rwkv_clone_context(ctx, N_THREADS);
+    ASSERT(ctx2 != NULL, "Failed to clone the context");
+
+    rwkv_set_print_errors(ctx2, false);
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    const size_t state_len = rwkv_get_state_len(ctx);
+    float * expected_state = malloc(sizeof(float) * state_len);
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * state = malloc(sizeof(float) * state_len);
+    float * logits = malloc(sizeof(float) * n_vocab);
+
+    const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o' };
+    const size_t prompt_len = sizeof(prompt) / sizeof(prompt[0]);
+
+    ASSERT(rwkv_eval_sequence(ctx, prompt, prompt_len, NULL, expected_state, expected_logits), "rwkv_eval_sequence failed");
+
+    struct rwkv_executor * executor = rwkv_executor_new(1);
+    ASSERT(executor != NULL, "Failed to create the executor");
+
+    // Block the only worker in the callback of the first evaluation.
+    struct rwkv_async * blocking = rwkv_eval_async(executor, ctx, prompt[0], NULL, state, logits, blocking_callback, NULL);
+    ASSERT(blocking != NULL, "rwkv_eval_async failed");
+
+    while (!blocking_callback_started) {
+        // Wait for the worker.
+    }
+
+    ASSERT(rwkv_async_get_status(blocking) == RWKV_ASYNC_DONE, "Status is not final in the callback");
+
+    // The second evaluation stays pending, and its context accepts no more evaluations.
+    struct rwkv_async * pending = rwkv_eval_async(executor, ctx2, prompt[0], NULL, state, logits, counting_callback, &callback_calls);
+    ASSERT(pending != NULL, "rwkv_eval_async failed");
+    ASSERT(rwkv_async_get_status(pending) == RWKV_ASYNC_PENDING, "Evaluation is not pending");
+    ASSERT(rwkv_eval_async(executor, ctx2, prompt[0], NULL, state, logits, NULL, NULL) == NULL, "Second evaluation of a busy context was accepted");
+    ASSERT(rwkv_get_last_error(ctx2) == RWKV_ERROR_ARGS, "Unexpected error");
+
+    // Cancellation completes the evaluation before returning, and frees the context.
+    ASSERT(rwkv_async_cancel(pending), "Failed to cancel a pending evaluation");
+    ASSERT(callback_calls == 1 && last_status == RWKV_ASYNC_CANCELLED, "Callback was not called on cancellation");
+    ASSERT(rwkv_async_wait(pending) == RWKV_ASYNC_CANCELLED, "Unexpected status after cancellation");
+    ASSERT(!rwkv_async_cancel(pending), "Evaluation was cancelled twice");
+    rwkv_async_free(pending);
+
+    release_worker = 1;
+    ASSERT(rwkv_async_wait(blocking) == RWKV_ASYNC_DONE, "Blocking evaluation failed");
+    rwkv_async_free(blocking);
+
+    // Results match synchronous evaluation; tokens are copied, so the array can be changed right after submission.
+    uint32_t tokens[sizeof(prompt) / sizeof(prompt[0])];
+    memcpy(tokens, prompt, sizeof(prompt));
+
+    struct rwkv_async * sequence = rwkv_eval_sequence_async(executor, ctx2, tokens, prompt_len, NULL, state, logits, NULL, NULL);
+    ASSERT(sequence != NULL, "rwkv_eval_sequence_async failed");
+    memset(tokens, 0, sizeof(tokens));
+    ASSERT(rwkv_async_wait(sequence) == RWKV_ASYNC_DONE, "Sequence evaluation failed");
+    rwkv_async_free(sequence);
+
+    ASSERT(memcmp(expected_logits, logits, sizeof(float) * n_vocab) == 0, "Asynchronous logits differ");
+    ASSERT(memcmp(expected_state, state, sizeof(float) * state_len) == 0, "Asynchronous state differs");
+
+    // Failures are reported through the status.
+    struct rwkv_async * failing = rwkv_eval_async(executor, ctx2, (uint32_t) n_vocab, NULL, state, logits, NULL, NULL);
+    ASSERT(failing != NULL, "rwkv_eval_async failed");
+    ASSERT(rwkv_async_wait(failing) == RWKV_ASYNC_FAILED, "Evaluation of an invalid token did not fail");
+    rwkv_async_free(failing);
+
+#if defined(__linux__)
+    // Every completion above incremented the eventfd counter.
+    uint64_t completions = 0;
+    ASSERT(read(rwkv_executor_get_fd(executor), &completions, sizeof(completions)) == sizeof(completions), "Failed to read the completion fd");
+    ASSERT(completions == 4, "Unexpected count of completions %d", (int) completions);
+#endif
+
+    rwkv_executor_free(executor);
+
+    rwkv_free(ctx2);
+    rwkv_free(ctx);
+
+    free(expected_state);
+    free(expected_logits);
+    free(state);
+    free(logits);
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Tests that embeddings agree between single sequences, continued sequences and batches,
+// and that mean pooling averages embeddings of all prefixes.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+
+const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o' };
+#define PROMPT_LEN (sizeof(prompt) / sizeof(prompt[0]))
+
+const uint32_t other_prompt[] = { 'w', 'o', 'r', 'l', 'd', '!', '!' };
+#define OTHER_PROMPT_LEN (sizeof(other_prompt) / sizeof(other_prompt[0]))
+
+float max_difference(const float * expected, const float * actual, const size_t n) {
+    float max_diff = 0.0F;
+
+    for (size_t i = 0; i < n; i++) {
+        max_diff = fmaxf(max_diff, fabsf(actual[i] - expected[i]));
+    }
+
+    return max_diff;
+}
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    const size_t n_embed = rwkv_get_n_embed(ctx);
+    const size_t state_len = rwkv_get_state_len(ctx);
+    float * expected_state = malloc(sizeof(float) * state_len);
+    float * state = malloc(sizeof(float) * state_len);
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * logits = malloc(sizeof(float) * n_vocab);
+    float * embedding = malloc(sizeof(float) * n_embed);
+    float * pooled = malloc(sizeof(float) * n_embed);
+    float * expected_pooled = calloc(n_embed, sizeof(float));
+    float * embeddings = malloc(sizeof(float) * n_embed * 2);
+
+    ASSERT(rwkv_eval_sequence(ctx, prompt, PROMPT_LEN, NULL, expected_state, expected_logits), "rwkv_eval_sequence failed");
+
+    // The state is the same as without embeddings.
+    ASSERT(rwkv_eval_sequence_embed(ctx, prompt, PROMPT_LEN, NULL, state, embedding, false), "rwkv_eval_sequence_embed failed");
+    ASSERT(max_difference(expected_state, state, state_len) < 0.01F, "State differs too much");
+    ASSERT(fabsf(embedding[0]) + fabsf(embedding[n_embed - 1]) > 0.0F, "Embedding is empty");
+
+    // The mean pool is the mean of last-token embeddings of all prefixes.
+    for (size_t i = 0; i < PROMPT_LEN; i++) {
+        float * prefix_embedding = embeddings;
+        ASSERT(rwkv_eval_sequence_embed(ctx, prompt, i + 1, NULL, NULL, prefix_embedding, false), "rwkv_eval_sequence_embed failed");
+
+        for (size_t j = 0; j < n_embed; j++) {
+            expected_pooled[j] += prefix_embedding[j] / PROMPT_LEN;
+        }
+    }
+
+    ASSERT(rwkv_eval_sequence_embed(ctx, prompt, PROMPT_LEN, NULL, NULL, pooled, true), "rwkv_eval_sequence_embed failed");
+    ASSERT(max_difference(expected_pooled, pooled, n_embed) < 0.01F, "Mean pool differs too much");
+
+    // Continuing from a state gives the same embedding of the last token.
+    ASSERT(rwkv_eval_sequence_embed(ctx, prompt, 2, NULL, state, NULL, false), "rwkv_eval_sequence_embed failed");
+    ASSERT(rwkv_eval_sequence_embed(ctx, prompt + 2, PROMPT_LEN - 2, state, NULL, embeddings, false), "rwkv_eval_sequence_embed failed");
+    ASSERT(max_difference(embedding, embeddings, n_embed) < 0.01F, "Embedding differs too much after continuing");
+
+    // Padding of the last chunk does not change embeddings of batched sequences.
+    const uint32_t * sequences[] = { prompt, other_prompt };
+    const size_t sequence_lens[] = { PROMPT_LEN, OTHER_PROMPT_LEN };
+    float * other_embedding = malloc(sizeof(float) * n_embed);
+
+    for (int mean_pool = 0; mean_pool < 2; mean_pool++) {
+        ASSERT(rwkv_eval_sequence_embed(ctx, other_prompt, OTHER_PROMPT_LEN, NULL, NULL, other_embedding, mean_pool), "rwkv_eval_sequence_embed failed");
+        const float * expected = mean_pool ? pooled : embedding;
+
+        for (size_t chunk_len = 0; chunk_len <= 3; chunk_len += 3) {
+            ASSERT(rwkv_eval_sequence_embed_batch(ctx, sequences, sequence_lens, 2, chunk_len, NULL, mean_pool, embeddings), "rwkv_eval_sequence_embed_batch failed");
+            ASSERT(max_difference(expected, embeddings, n_embed) < 0.01F, "Embedding of the first sequence differs too much with chunk length %zu", chunk_len);
+            ASSERT(max_difference(other_embedding, embeddings + n_embed, n_embed) < 0.01F, "Embedding of the second sequence differs too much with chunk length %zu", chunk_len);
+        }
+    }
+
+    // The default chunk length is bounded, so a long sequence is split into chunks instead of padding short ones to its length.
+    uint32_t long_prompt[70];
+
+    for (size_t i = 0; i < 70; i++) {
+        long_prompt[i] = prompt[i % PROMPT_LEN];
+    }
+
+    const uint32_t * long_sequences[] = { long_prompt, prompt };
+    const size_t long_sequence_lens[] = { 70, PROMPT_LEN };
+    ASSERT(rwkv_eval_sequence_embed(ctx, long_prompt, 70, NULL, NULL, other_embedding, false), "rwkv_eval_sequence_embed failed");
+    ASSERT(rwkv_eval_sequence_embed_batch(ctx, long_sequences, long_sequence_lens, 2, 0, NULL, false, embeddings), "rwkv_eval_sequence_embed_batch failed");
+    ASSERT(max_difference(other_embedding, embeddings, n_embed) < 0.01F, "Embedding of the long sequence differs too much");
+    ASSERT(max_difference(embedding, embeddings + n_embed, n_embed) < 0.01F, "Embedding of the short sequence differs too much");
+
+    // The sequence graph is rebuilt for plain evaluation, which still gives the same logits.
+    ASSERT(rwkv_eval_sequence(ctx, prompt, PROMPT_LEN, NULL, NULL, logits), "rwkv_eval_sequence failed");
+    ASSERT(max_difference(expected_logits, logits, n_vocab) < 0.01F, "Logits differ after rebuilding the graph");
+
+    rwkv_set_print_errors(ctx, false);
+    ASSERT(!rwkv_eval_sequence_embed(ctx, prompt, 0, NULL, NULL, embedding, false), "Empty sequence was accepted");
+    ASSERT(rwkv_get_last_error(ctx) == RWKV_ERROR_ARGS, "Unexpected error");
+
+    const uint32_t invalid_token = (uint32_t) n_vocab;
+    ASSERT(!rwkv_eval_sequence_embed(ctx, &invalid_token, 1, NULL, NULL, embedding, false), "Invalid token was accepted");
+    ASSERT(rwkv_get_last_error(ctx) == RWKV_ERROR_ARGS, "Unexpected error");
+
+    const size_t empty_lens[] = { PROMPT_LEN, 0 };
+    ASSERT(!rwkv_eval_sequence_embed_batch(ctx, sequences, empty_lens, 2, 0, NULL, false, embeddings), "Empty sequence in a batch was accepted");
+    ASSERT(rwkv_get_last_error(ctx) == RWKV_ERROR_ARGS, "Unexpected error");
+
+    rwkv_free(ctx);
+
+    free(expected_state);
+    free(state);
+    free(expected_logits);
+    free(logits);
+    free(embedding);
+    free(pooled);
+    free(expected_pooled);
+    free(embeddings);
+    free(other_embedding);
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+// Tests that chunked sequence evaluation stops at chunk boundaries, and that it can be resumed from the state it leaves.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+#define SEQUENCE_LEN 12
+#define CHUNK_LEN 4
+
+// Allows the given count of chunks, then aborts.
+bool abort_after(void * user_data) {
+    int * chunks_left = (int *) user_data;
+    return (*chunks_left)-- <= 0;
+}
+
+float max_difference(const float * expected, const float * actual, const size_t n) {
+    float max_diff = 0.0F;
+
+    for (size_t i = 0; i < n; i++) {
+        max_diff = fmaxf(max_diff, fabsf(actual[i] - expected[i]));
+    }
+
+    return max_diff;
+}
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    const size_t state_len = rwkv_get_state_len(ctx);
+    float * expected_state = malloc(sizeof(float) * state_len);
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * state = malloc(sizeof(float) * state_len);
+    float * logits = malloc(sizeof(float) * n_vocab);
+
+    uint32_t tokens[SEQUENCE_LEN];
+
+    for (size_t i = 0; i < SEQUENCE_LEN; i++) {
+        tokens[i] = (uint32_t) ('a' + i);
+    }
+
+    // Chunked evaluation without interruption agrees with a single sequence.
+    size_t processed = 0;
+    ASSERT(rwkv_eval_sequence(ctx, tokens, SEQUENCE_LEN, NULL, state, logits), "rwkv_eval_sequence failed");
+    ASSERT(rwkv_eval_sequence_chunked(ctx, tokens, SEQUENCE_LEN, CHUNK_LEN, NULL, expected_state, expected_logits, 0, NULL, NULL, &processed), "Chunked evaluation failed");
+    ASSERT(processed == SEQUENCE_LEN, "Unexpected count of processed tokens %d", (int) processed);
+    ASSERT(max_difference(logits, expected_logits, n_vocab) < 0.01F, "Chunked logits differ too much");
+
+    rwkv_set_print_errors(ctx, false);
+
+    // Abort after two chunks; the state is left after the second chunk, and logits are not written.
+    int chunks_left = 2;
+    memset(logits, 0, sizeof(float) * n_vocab);
+    ASSERT(!rwkv_eval_sequence_chunked(ctx, tokens, SEQUENCE_LEN, CHUNK_LEN, NULL, state, logits, 0, abort_after, &chunks_left, &processed), "Evaluation was not aborted");
+    ASSERT(rwkv_get_last_error(ctx) == (RWKV_ERROR_CTX | RWKV_ERROR_CANCELLED), "Unexpected error");
+    ASSERT(processed == 2 * CHUNK_LEN, "Unexpected count of processed tokens %d", (int) processed);
+    ASSERT(logits[0] == 0.0F, "Logits were written");
+
+    // Resuming from the left state gives exactly the same results.
+    ASSERT(rwkv_eval_sequence_chunked(ctx, tokens + processed, SEQUENCE_LEN - processed, CHUNK_LEN, state, state, logits, 0, NULL, NULL, NULL), "Resumed evaluation failed");
+    ASSERT(memcmp(expected_logits, logits, sizeof(float) * n_vocab) == 0, "Resumed logits differ");
+    ASSERT(memcmp(expected_state, state, sizeof(float) * state_len) == 0, "Resumed state differs");
+
+    // A deadline in the past stops evaluation before the first chunk, and leaves the initial state.
+    ASSERT(!rwkv_eval_sequence_chunked(ctx, tokens, SEQUENCE_LEN, CHUNK_LEN, NULL, state, NULL, rwkv_time_us() - 1, NULL, NULL, &processed), "Deadline was ignored");
+    ASSERT(processed == 0, "Tokens were processed after the deadline");
+    rwkv_init_state(ctx, expected_state);
+    ASSERT(memcmp(expected_state, state, sizeof(float) * state_len) == 0, "State is not initial");
+
+    // A deadline in the future does not interrupt anything.
+    ASSERT(rwkv_eval_sequence_chunked(ctx, tokens, SEQUENCE_LEN, 0, NULL, state, NULL, rwkv_time_us() + 60 * 1000 * 1000, NULL, NULL, &processed), "Evaluation failed");
+    ASSERT(processed == SEQUENCE_LEN, "Unexpected count of processed tokens %d", (int) processed);
+
+    for (size_t chunk_len = 0; chunk_len <= CHUNK_LEN; chunk_len += CHUNK_LEN) {
+        ASSERT(!rwkv_eval_sequence_chunked(ctx, tokens, 0, chunk_len, NULL, state, NULL, 0, NULL, NULL, NULL), "Empty sequence was accepted");
+        ASSERT(rwkv_get_last_error(ctx) == RWKV_ERROR_ARGS, "Unexpected error");
+    }
+
+    rwkv_free(ctx);
+
+    free(expected_state);
+    free(expected_logits);
+    free(state);
+    free(logits);
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Tests that folding ln0 into emb.weight at load time does not change the logits.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+
+void eval_prompt(const char * model_path, const uint32_t flags, float * logits, float * sequence_logits) {
+    struct rwkv_context * ctx = rwkv_init_from_file_ex(model_path, N_THREADS, flags, NULL);
+    ASSERT(ctx != NULL, "Failed to load %s", model_path);
+
+    float * state = calloc(rwkv_get_state_len(ctx), sizeof(float));
+    ASSERT(state != NULL, "Failed to allocate state");
+
+    const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o' };
+    const size_t prompt_len = sizeof(prompt) / sizeof(prompt[0]);
+
+    rwkv_init_state(ctx, state);
+
+    for (size_t i = 0; i < prompt_len; i++) {
+        ASSERT(rwkv_eval(ctx, prompt[i], state, state, logits), "rwkv_eval failed");
+    }
+
+    ASSERT(rwkv_eval_sequence(ctx, prompt, prompt_len, NULL, state, sequence_logits), "rwkv_eval_sequence failed");
+
+    rwkv_free(ctx);
+    free(state);
+}
+
+float max_difference(const float * reference, const float * actual, const size_t n) {
+    float max_diff = 0.0F;
+
+    for (size_t i = 0; i < n; i++) {
+        max_diff = fmaxf(max_diff, fabsf(actual[i] - reference[i]));
+    }
+
+    return max_diff;
+}
+
+void test_model(const char * model_path, const float max_allowed_diff) {
+    const size_t n_vocab = 256;
+
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * expected_sequence_logits = malloc(sizeof(float) * n_vocab);
+    float * logits = malloc(sizeof(float) * n_vocab);
+    float * sequence_logits = malloc(sizeof(float) * n_vocab);
+
+    eval_prompt(model_path, RWKV_INIT_NONE, expected_logits, expected_sequence_logits);
+    eval_prompt(model_path, RWKV_INIT_FOLD_LN0, logits, sequence_logits);
+
+    float diff = max_difference(expected_logits, logits, n_vocab);
+    float sequence_diff = max_difference(expected_sequence_logits, sequence_logits, n_vocab);
+
+    fprintf(stderr, "%s: max difference %f, sequence: %f\n", model_path, (double) diff, (double) sequence_diff);
+
+    ASSERT(diff <= max_allowed_diff, "Too big difference %f", (double) diff);
+    ASSERT(sequence_diff <= max_allowed_diff, "Too big sequence difference %f", (double) sequence_diff);
+
+    free(expected_logits);
+    free(expected_sequence_logits);
+    free(logits);
+    free(sequence_logits);
+}
+
+int main(void) {
+    test_model("tiny-rwkv-660K-FP32.bin", 0.0005F);
+    // Folded rows are rounded to FP16 once more.
+    test_model("tiny-rwkv-660K-FP16.bin", 0.01F);
+
+    // Quantized emb.weight can not be folded.
+    ASSERT(rwkv_quantize_model_file_ex("tiny-rwkv-660K-FP16.bin", "tiny-rwkv-660K-FP16-emb-Q8_0.bin", "emb.weight=Q8_0", N_THREADS), "Failed to quantize");
+    rwkv_set_print_errors(NULL, false);
+    ASSERT(rwkv_init_from_file_ex("tiny-rwkv-660K-FP16-emb-Q8_0.bin", N_THREADS, RWKV_INIT_FOLD_LN0, NULL) == NULL, "Loaded a model with quantized emb.weight");
+    ASSERT((rwkv_get_last_error(NULL) & 0xFF) == RWKV_ERROR_UNSUPPORTED, "Unexpected error");
+
+    return 0;
+}
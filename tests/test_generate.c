@@ -0,0 +1,137 @@
+// Tests that native generation agrees with a loop of rwkv_eval calls, and that stop sequences and the callback end it.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+#define N_TOKENS 8
+
+const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o' };
+#define PROMPT_LEN (sizeof(prompt) / sizeof(prompt[0]))
+
+struct received {
+    uint32_t tokens[N_TOKENS];
+    size_t count;
+    // Generation is stopped after this count of tokens.
+    size_t limit;
+};
+
+bool on_token(const uint32_t token, void * user_data) {
+    struct received * received = (struct received *) user_data;
+    received->tokens[received->count++] = token;
+    return received->count == received->limit;
+}
+
+uint32_t argmax(const float * logits, const size_t n_vocab) {
+    uint32_t best = 0;
+
+    for (uint32_t i = 1; i < n_vocab; i++) {
+        best = logits[i] > logits[best] ? i : best;
+    }
+
+    return best;
+}
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    const size_t state_len = rwkv_get_state_len(ctx);
+    float * expected_state = malloc(sizeof(float) * state_len);
+    float * state = malloc(sizeof(float) * state_len);
+    float * logits = malloc(sizeof(float) * n_vocab);
+
+    // Greedy decoding with single token evaluations.
+    uint32_t expected[N_TOKENS];
+    ASSERT(rwkv_eval_sequence(ctx, prompt, PROMPT_LEN, NULL, expected_state, logits), "rwkv_eval_sequence failed");
+
+    for (size_t i = 0; i < N_TOKENS; i++) {
+        expected[i] = argmax(logits, n_vocab);
+        ASSERT(rwkv_eval(ctx, expected[i], expected_state, expected_state, logits), "rwkv_eval failed");
+    }
+
+    uint32_t tokens[N_TOKENS];
+    size_t generated_len;
+    struct received received;
+    memset(&received, 0, sizeof(received));
+
+    ASSERT(rwkv_generate(ctx, prompt, PROMPT_LEN, N_TOKENS, NULL, NULL, 0, NULL, state, tokens, &generated_len, on_token, &received), "rwkv_generate failed");
+    ASSERT(generated_len == N_TOKENS && received.count == N_TOKENS, "Unexpected count of tokens %d", (int) generated_len);
+    ASSERT(memcmp(expected, tokens, sizeof(expected)) == 0, "Tokens differ");
+    ASSERT(memcmp(expected, received.tokens, sizeof(expected)) == 0, "Streamed tokens differ");
+    ASSERT(memcmp(expected_state, state, sizeof(float) * state_len) == 0, "State differs");
+
+    // Generation ends at the first occurrence of the stop sequence, which is not returned.
+    struct rwkv_stop_sequence stop = { expected + 3, 2 };
+    size_t stop_position = 0;
+
+    while (expected[stop_position] != expected[3] || expected[stop_position + 1] != expected[4]) {
+        stop_position++;
+    }
+
+    memset(&received, 0, sizeof(received));
+    ASSERT(rwkv_generate(ctx, prompt, PROMPT_LEN, N_TOKENS, NULL, &stop, 1, NULL, NULL, tokens, &generated_len, on_token, &received), "rwkv_generate failed");
+    ASSERT(generated_len == stop_position && received.count == stop_position, "Unexpected count of tokens %d before the stop sequence", (int) generated_len);
+    ASSERT(memcmp(expected, received.tokens, sizeof(uint32_t) * stop_position) == 0, "Streamed tokens differ");
+
+    // Tokens held back as a possible start of a stop sequence are returned when generation ends.
+    const uint32_t never_completed[] = { expected[N_TOKENS - 1], UINT32_MAX };
+    stop.tokens = never_completed;
+    memset(&received, 0, sizeof(received));
+    ASSERT(rwkv_generate(ctx, prompt, PROMPT_LEN, N_TOKENS, NULL, &stop, 1, NULL, NULL, NULL, &generated_len, on_token, &received), "rwkv_generate failed");
+    ASSERT(generated_len == N_TOKENS && received.count == N_TOKENS, "Held back tokens were dropped");
+    ASSERT(memcmp(expected, received.tokens, sizeof(expected)) == 0, "Streamed tokens differ");
+
+    // The callback stops generation.
+    memset(&received, 0, sizeof(received));
+    received.limit = 2;
+    ASSERT(rwkv_generate(ctx, prompt, PROMPT_LEN, N_TOKENS, NULL, NULL, 0, NULL, NULL, NULL, &generated_len, on_token, &received), "rwkv_generate failed");
+    ASSERT(generated_len == 2 && received.count == 2, "Callback did not stop generation");
+
+    // The same seed gives the same tokens.
+    struct rwkv_sampler_params params = { 1.0F, 0.9F, 10, 0.2F, 0.2F, 42 };
+    uint32_t sampled[N_TOKENS];
+    ASSERT(rwkv_generate(ctx, prompt, PROMPT_LEN, N_TOKENS, &params, NULL, 0, NULL, NULL, sampled, NULL, NULL, NULL), "rwkv_generate failed");
+    ASSERT(rwkv_generate(ctx, prompt, PROMPT_LEN, N_TOKENS, &params, NULL, 0, NULL, NULL, tokens, NULL, NULL, NULL), "rwkv_generate failed");
+    ASSERT(memcmp(sampled, tokens, sizeof(sampled)) == 0, "Sampling with the same seed differs");
+
+    // rwkv_sample_logits samples the same tokens as rwkv_generate without penalties, when tokens are evaluated by the caller.
+    params.presence_penalty = 0.0F;
+    params.frequency_penalty = 0.0F;
+    ASSERT(rwkv_generate(ctx, prompt, PROMPT_LEN, N_TOKENS, &params, NULL, 0, NULL, NULL, sampled, NULL, NULL, NULL), "rwkv_generate failed");
+    ASSERT(rwkv_eval_sequence(ctx, prompt, PROMPT_LEN, NULL, state, logits), "rwkv_eval_sequence failed");
+    uint64_t rng = 0;
+
+    for (size_t i = 0; i < N_TOKENS; i++) {
+        tokens[i] = rwkv_sample_logits(logits, n_vocab, &params, &rng);
+        ASSERT(rwkv_eval(ctx, tokens[i], state, state, logits), "rwkv_eval failed");
+    }
+
+    ASSERT(memcmp(sampled, tokens, sizeof(sampled)) == 0, "rwkv_sample_logits differs from rwkv_generate");
+    ASSERT(rwkv_sample_logits(logits, n_vocab, NULL, &rng) == argmax(logits, n_vocab), "Sampling without parameters is not greedy");
+
+    rwkv_set_print_errors(ctx, false);
+    ASSERT(!rwkv_generate(ctx, prompt, 0, N_TOKENS, NULL, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL), "Empty prompt was accepted");
+    ASSERT(rwkv_get_last_error(ctx) == RWKV_ERROR_ARGS, "Unexpected error");
+
+    rwkv_free(ctx);
+
+    free(expected_state);
+    free(state);
+    free(logits);
+
+    return 0;
+}
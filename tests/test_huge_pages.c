@@ -0,0 +1,66 @@
+// Tests that weights backed by huge pages or locked in memory give the same results.
+// These options depend on configuration of the host, so unsupported ones are skipped.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+
+void check_flags(const uint32_t flags, const char * name, const float * expected_logits, float * logits) {
+    struct rwkv_context * ctx = rwkv_init_from_file_ex("tiny-rwkv-660K-FP32.bin", N_THREADS, flags, NULL);
+
+    if (!ctx) {
+        const enum rwkv_error_flags error = rwkv_get_last_error(NULL);
+        ASSERT(error == (RWKV_ERROR_CTX | RWKV_ERROR_ALLOC) || error == (RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED), "Unexpected error %d with %s", (int) error, name);
+        fprintf(stderr, "Skipping %s: not supported here\n", name);
+        return;
+    }
+
+    ASSERT(rwkv_eval(ctx, 'h', NULL, NULL, logits), "rwkv_eval failed with %s", name);
+    ASSERT(memcmp(expected_logits, logits, sizeof(float) * rwkv_get_logits_len(ctx)) == 0, "Logits differ with %s", name);
+
+    // Clones share the weights.
+    struct rwkv_context * clone = rwkv_clone_context(ctx, N_THREADS);
+    ASSERT(clone != NULL, "Failed to clone the context");
+    ASSERT(rwkv_eval(clone, 'h', NULL, NULL, logits), "rwkv_eval failed with %s", name);
+    ASSERT(memcmp(expected_logits, logits, sizeof(float) * rwkv_get_logits_len(ctx)) == 0, "Logits of the clone differ with %s", name);
+
+    rwkv_free(clone);
+    rwkv_free(ctx);
+}
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * logits = malloc(sizeof(float) * n_vocab);
+
+    ASSERT(rwkv_eval(ctx, 'h', NULL, NULL, expected_logits), "rwkv_eval failed");
+    rwkv_free(ctx);
+
+    rwkv_set_print_errors(NULL, false);
+
+    check_flags(RWKV_INIT_HUGE_PAGES, "transparent huge pages", expected_logits, logits);
+    check_flags(RWKV_INIT_HUGETLB, "explicit huge pages", expected_logits, logits);
+    check_flags(RWKV_INIT_MLOCK, "locked weights", expected_logits, logits);
+    check_flags(RWKV_INIT_HUGE_PAGES | RWKV_INIT_MLOCK, "locked transparent huge pages", expected_logits, logits);
+
+    free(expected_logits);
+    free(logits);
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+// Tests that low-rank adapters are applied at runtime, and that switching between them gives the same results as a fresh context.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+#define LORA_RANK 4
+
+void write_uint32(FILE * file, const uint32_t value) {
+    ASSERT(fwrite(&value, sizeof(uint32_t), 1, file) == 1, "Failed to write");
+}
+
+// Writes a 2D FP32 tensor filled with pseudo-random values in range [-amplitude, amplitude].
+void write_tensor(FILE * file, const char * name, const uint32_t width, const uint32_t height, const float amplitude, uint32_t * seed) {
+    write_uint32(file, 2);
+    write_uint32(file, (uint32_t) strlen(name));
+    write_uint32(file, 0);
+    write_uint32(file, width);
+    write_uint32(file, height);
+    ASSERT(fwrite(name, 1, strlen(name), file) == strlen(name), "Failed to write");
+
+    for (size_t i = 0; i < (size_t) width * height; i++) {
+        *seed = *seed * 1664525 + 1013904223;
+        const float value = amplitude * ((float) (*seed >> 8) / (float) (1 << 24) * 2.0F - 1.0F);
+        ASSERT(fwrite(&value, sizeof(float), 1, file) == 1, "Failed to write");
+    }
+}
+
+// Writes an adapter of blocks.0.att.key.weight and head.weight. If b_amplitude is 0, the adapter does not change anything.
+void write_adapter(const char * path, struct rwkv_context * ctx, const float b_amplitude, uint32_t seed) {
+    const uint32_t n_vocab = (uint32_t) rwkv_get_n_vocab(ctx);
+    const uint32_t n_embed = (uint32_t) rwkv_get_n_embed(ctx);
+
+    FILE * file = fopen(path, "wb");
+    ASSERT(file != NULL, "Failed to open %s", path);
+
+    write_uint32(file, RWKV_FILE_MAGIC);
+    write_uint32(file, RWKV_FILE_VERSION);
+    write_uint32(file, n_vocab);
+    write_uint32(file, n_embed);
+    write_uint32(file, (uint32_t) rwkv_get_n_layer(ctx));
+    write_uint32(file, 0);
+
+    write_tensor(file, "blocks.0.att.key.weight.lora_A", n_embed, LORA_RANK, 0.5F, &seed);
+    write_tensor(file, "blocks.0.att.key.weight.lora_B", LORA_RANK, n_embed, b_amplitude, &seed);
+    write_tensor(file, "head.weight.lora_A", n_embed, LORA_RANK, 0.5F, &seed);
+    write_tensor(file, "head.weight.lora_B", LORA_RANK, n_vocab, b_amplitude, &seed);
+
+    fclose(file);
+}
+
+void eval_prompt(struct rwkv_context * ctx, float * state, float * logits, float * sequence_logits) {
+    const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o' };
+    const size_t prompt_len = sizeof(prompt) / sizeof(prompt[0]);
+
+    rwkv_init_state(ctx, state);
+
+    for (size_t i = 0; i < prompt_len; i++) {
+        ASSERT(rwkv_eval(ctx, prompt[i], state, state, logits), "rwkv_eval failed");
+    }
+
+    ASSERT(rwkv_eval_sequence(ctx, prompt, prompt_len, NULL, state, sequence_logits), "rwkv_eval_sequence failed");
+}
+
+float max_difference(const float * expected, const float * actual, const size_t n) {
+    float max_diff = 0.0F;
+
+    for (size_t i = 0; i < n; i++) {
+        max_diff = fmaxf(max_diff, fabsf(actual[i] - expected[i]));
+    }
+
+    return max_diff;
+}
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    float * state = malloc(sizeof(float) * rwkv_get_state_len(ctx));
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * expected_sequence_logits = malloc(sizeof(float) * n_vocab);
+    float * logits = malloc(sizeof(float) * n_vocab);
+    float * sequence_logits = malloc(sizeof(float) * n_vocab);
+
+    write_adapter("tiny-rwkv-660K-lora-zero.bin", ctx, 0.0F, 1);
+    write_adapter("tiny-rwkv-660K-lora-1.bin", ctx, 0.5F, 2);
+    write_adapter("tiny-rwkv-660K-lora-2.bin", ctx, 0.5F, 3);
+
+    struct rwkv_lora * lora_zero = rwkv_lora_from_file(ctx, "tiny-rwkv-660K-lora-zero.bin", 1.0F);
+    struct rwkv_lora * lora_1 = rwkv_lora_from_file(ctx, "tiny-rwkv-660K-lora-1.bin", 1.0F);
+    struct rwkv_lora * lora_2 = rwkv_lora_from_file(ctx, "tiny-rwkv-660K-lora-2.bin", 1.0F);
+    ASSERT(lora_zero != NULL && lora_1 != NULL && lora_2 != NULL, "Failed to load adapters");
+
+    eval_prompt(ctx, state, expected_logits, expected_sequence_logits);
+
+    // An adapter with zero B matrices must not change anything.
+    ASSERT(rwkv_set_lora(ctx, lora_zero), "Failed to set adapter");
+    eval_prompt(ctx, state, logits, sequence_logits);
+    ASSERT(max_difference(expected_logits, logits, n_vocab) == 0.0F, "Zero adapter changed logits");
+    ASSERT(max_difference(expected_sequence_logits, sequence_logits, n_vocab) == 0.0F, "Zero adapter changed sequence logits");
+
+    // A real adapter must change logits, and serial and sequence modes must agree.
+    ASSERT(rwkv_set_lora(ctx, lora_1), "Failed to set adapter");
+    eval_prompt(ctx, state, logits, sequence_logits);
+    ASSERT(max_difference(expected_logits, logits, n_vocab) > 0.01F, "Adapter did not change logits");
+    ASSERT(max_difference(logits, sequence_logits, n_vocab) < 0.01F, "Serial and sequence logits differ too much");
+
+    // Switching between adapters of the same layout only updates views; results must match a fresh context.
+    ASSERT(rwkv_set_lora(ctx, lora_2), "Failed to set adapter");
+    eval_prompt(ctx, state, logits, sequence_logits);
+
+    struct rwkv_context * fresh_ctx = rwkv_clone_context(ctx, N_THREADS);
+    ASSERT(fresh_ctx != NULL, "Failed to clone the context");
+    ASSERT(rwkv_set_lora(fresh_ctx, NULL), "Failed to unset adapter");
+    ASSERT(rwkv_set_lora(fresh_ctx, lora_2), "Failed to set adapter");
+    eval_prompt(fresh_ctx, state, expected_logits, expected_sequence_logits);
+    ASSERT(max_difference(expected_logits, logits, n_vocab) == 0.0F, "Switched adapter gives different logits");
+    ASSERT(max_difference(expected_sequence_logits, sequence_logits, n_vocab) == 0.0F, "Switched adapter gives different sequence logits");
+
+    // A copy of weights on a NUMA node keeps the adapter. Placement depends on permissions of the process, so it may be skipped.
+    rwkv_set_print_errors(NULL, false);
+    struct rwkv_context * node_ctx = rwkv_clone_context_to_numa_node(ctx, N_THREADS, 0);
+    rwkv_set_print_errors(NULL, true);
+
+    if (node_ctx) {
+        eval_prompt(node_ctx, state, expected_logits, expected_sequence_logits);
+        ASSERT(max_difference(expected_logits, logits, n_vocab) == 0.0F, "Copy of weights gives different logits with the adapter");
+        rwkv_free(node_ctx);
+    } else {
+        fprintf(stderr, "Skipping NUMA node copy: not supported here\n");
+    }
+
+    // Disabling the adapter restores the original model.
+    ASSERT(rwkv_set_lora(ctx, NULL), "Failed to unset adapter");
+    ASSERT(rwkv_set_lora(fresh_ctx, NULL), "Failed to unset adapter");
+    eval_prompt(ctx, state, logits, sequence_logits);
+    eval_prompt(fresh_ctx, state, expected_logits, expected_sequence_logits);
+    ASSERT(max_difference(expected_logits, logits, n_vocab) == 0.0F, "Logits differ after disabling the adapter");
+
+    rwkv_free(fresh_ctx);
+    rwkv_free(ctx);
+
+    rwkv_lora_free(lora_zero);
+    rwkv_lora_free(lora_1);
+    rwkv_lora_free(lora_2);
+
+    free(state);
+    free(expected_logits);
+    free(expected_sequence_logits);
+    free(logits);
+    free(sequence_logits);
+
+    return 0;
+}
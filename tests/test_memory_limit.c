@@ -0,0 +1,83 @@
+// Tests memory size reporting, and that the memory limit makes graph creation fail without breaking the context.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+#define SHORT_LEN 4
+#define LONG_LEN 32
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    rwkv_set_print_errors(ctx, false);
+    rwkv_set_print_errors(NULL, false);
+
+    // The tiny model has about 660K FP32 parameters.
+    const size_t model_size = rwkv_get_model_size(ctx);
+    ASSERT(model_size > 660000 * sizeof(float) / 2 && model_size < 660000 * sizeof(float) * 2, "Unexpected model size %zu", model_size);
+
+    const size_t context_size = rwkv_get_context_size(ctx, N_THREADS);
+    ASSERT(context_size > rwkv_get_state_len(ctx) * 2 * sizeof(float), "Context is smaller than its state buffers: %zu", context_size);
+    ASSERT(rwkv_get_context_size(ctx, 8) > context_size, "Work buffer does not grow with thread count");
+
+    const size_t short_size = rwkv_get_sequence_graph_size(ctx, SHORT_LEN);
+    const size_t long_size = rwkv_get_sequence_graph_size(ctx, LONG_LEN);
+    ASSERT(short_size > 0 && long_size > short_size, "Unexpected sequence graph sizes %zu and %zu", short_size, long_size);
+
+    uint32_t tokens[LONG_LEN];
+
+    for (size_t i = 0; i < LONG_LEN; i++) {
+        tokens[i] = (uint32_t) i;
+    }
+
+    float * logits = malloc(sizeof(float) * rwkv_get_logits_len(ctx));
+
+    // The limit allows only the short sequence graph.
+    rwkv_set_memory_limit(ctx, context_size + short_size);
+    ASSERT(rwkv_eval_sequence(ctx, tokens, SHORT_LEN, NULL, NULL, logits), "Short sequence failed under the limit");
+    ASSERT(!rwkv_eval_sequence(ctx, tokens, LONG_LEN, NULL, NULL, logits), "Long sequence did not fail under the limit");
+    ASSERT(rwkv_get_last_error(ctx) == (RWKV_ERROR_CTX | RWKV_ERROR_ALLOC), "Unexpected error");
+
+    // The context stays usable.
+    ASSERT(rwkv_eval_sequence(ctx, tokens, SHORT_LEN, NULL, NULL, logits), "Short sequence failed after exceeding the limit");
+
+    // Graphs kept for reuse are freed when another graph would not fit next to them.
+    ASSERT(rwkv_eval_sequence(ctx, tokens, SHORT_LEN - 1, NULL, NULL, logits), "Shorter sequence failed next to a kept graph");
+    ASSERT(rwkv_eval_sequence(ctx, tokens, SHORT_LEN, NULL, NULL, logits), "Short sequence failed after switching graphs");
+    ASSERT(rwkv_eval(ctx, tokens[0], NULL, NULL, logits), "rwkv_eval failed after exceeding the limit");
+
+    // Clones inherit the limit.
+    struct rwkv_context * clone = rwkv_clone_context(ctx, N_THREADS);
+    ASSERT(clone != NULL, "Failed to clone the context");
+    ASSERT(rwkv_get_context_size(clone, N_THREADS) == context_size, "Clone has a different size");
+    rwkv_set_print_errors(clone, false);
+    ASSERT(!rwkv_eval_sequence(clone, tokens, LONG_LEN, NULL, NULL, logits), "Long sequence did not fail in the clone");
+    rwkv_free(clone);
+
+    // Cloning fails fast if the new context alone exceeds the limit.
+    rwkv_set_memory_limit(ctx, context_size - 1);
+    ASSERT(rwkv_clone_context(ctx, N_THREADS) == NULL, "Clone exceeding the limit was created");
+    ASSERT(rwkv_get_last_error(NULL) == (RWKV_ERROR_CTX | RWKV_ERROR_ALLOC), "Unexpected error");
+
+    // Removing the limit allows long sequences again.
+    rwkv_set_memory_limit(ctx, 0);
+    ASSERT(rwkv_eval_sequence(ctx, tokens, LONG_LEN, NULL, NULL, logits), "Long sequence failed without the limit");
+
+    rwkv_free(ctx);
+    free(logits);
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+// Tests that thread counts can be changed and tuned per evaluation mode without changing results.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+
+const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o' };
+#define PROMPT_LEN (sizeof(prompt) / sizeof(prompt[0]))
+
+void eval(struct rwkv_context * ctx, float * logits, float * sequence_logits) {
+    ASSERT(rwkv_eval(ctx, prompt[0], NULL, NULL, logits), "rwkv_eval failed");
+    ASSERT(rwkv_eval_sequence(ctx, prompt, PROMPT_LEN, NULL, NULL, sequence_logits), "rwkv_eval_sequence failed");
+}
+
+void check(struct rwkv_context * ctx, const float * expected_logits, const float * expected_sequence_logits, float * logits, float * sequence_logits) {
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+
+    eval(ctx, logits, sequence_logits);
+    ASSERT(memcmp(expected_logits, logits, sizeof(float) * n_vocab) == 0, "Logits differ with %d threads", (int) rwkv_get_n_threads(ctx, RWKV_EVAL_SERIAL));
+    ASSERT(memcmp(expected_sequence_logits, sequence_logits, sizeof(float) * n_vocab) == 0, "Sequence logits differ with %d threads", (int) rwkv_get_n_threads(ctx, RWKV_EVAL_SEQUENCE));
+}
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * expected_sequence_logits = malloc(sizeof(float) * n_vocab);
+    float * logits = malloc(sizeof(float) * n_vocab);
+    float * sequence_logits = malloc(sizeof(float) * n_vocab);
+
+    ASSERT(rwkv_get_n_threads(ctx, RWKV_EVAL_SERIAL) == N_THREADS, "Unexpected serial thread count");
+    ASSERT(rwkv_get_n_threads(ctx, RWKV_EVAL_SEQUENCE) == 1, "Unexpected sequence thread count");
+
+    eval(ctx, expected_logits, expected_sequence_logits);
+
+    // Fewer serial threads reuse the graph, more serial threads rebuild it.
+    ASSERT(rwkv_set_n_threads(ctx, RWKV_EVAL_SERIAL, 1), "Failed to set thread count");
+    check(ctx, expected_logits, expected_sequence_logits, logits, sequence_logits);
+    ASSERT(rwkv_set_n_threads(ctx, RWKV_EVAL_SERIAL, 4), "Failed to set thread count");
+    check(ctx, expected_logits, expected_sequence_logits, logits, sequence_logits);
+
+    ASSERT(rwkv_set_n_threads(ctx, RWKV_EVAL_SEQUENCE, 3), "Failed to set thread count");
+    check(ctx, expected_logits, expected_sequence_logits, logits, sequence_logits);
+    ASSERT(rwkv_get_n_threads(ctx, RWKV_EVAL_SEQUENCE) == 3, "Sequence thread count was not set");
+
+    rwkv_set_print_errors(ctx, false);
+    ASSERT(!rwkv_set_n_threads(ctx, RWKV_EVAL_SERIAL, 0), "Zero threads were accepted");
+    ASSERT(rwkv_get_last_error(ctx) == RWKV_ERROR_ARGS, "Unexpected error");
+
+    // A serial graph for more threads does not fit into the memory used now, and the context keeps its thread count.
+    rwkv_set_memory_limit(ctx, rwkv_get_context_size(ctx, 4) + rwkv_get_sequence_graph_size(ctx, PROMPT_LEN));
+    ASSERT(!rwkv_set_n_threads(ctx, RWKV_EVAL_SERIAL, 64), "Thread count exceeding the memory limit was accepted");
+    ASSERT(rwkv_get_last_error(ctx) == (RWKV_ERROR_CTX | RWKV_ERROR_ALLOC), "Unexpected error");
+    ASSERT(rwkv_get_n_threads(ctx, RWKV_EVAL_SERIAL) == 4, "Thread count changed after a failure");
+    check(ctx, expected_logits, expected_sequence_logits, logits, sequence_logits);
+    rwkv_set_memory_limit(ctx, 0);
+
+    // Tuning picks one of the candidates, and results stay the same.
+    ASSERT(rwkv_tune_n_threads(ctx, RWKV_EVAL_SERIAL, 4, 0), "Failed to tune serial thread count");
+    const uint32_t serial_n_threads = rwkv_get_n_threads(ctx, RWKV_EVAL_SERIAL);
+    ASSERT(serial_n_threads == 1 || serial_n_threads == 2 || serial_n_threads == 4, "Unexpected serial thread count %d", (int) serial_n_threads);
+
+    ASSERT(rwkv_tune_n_threads(ctx, RWKV_EVAL_SEQUENCE, 3, PROMPT_LEN), "Failed to tune sequence thread count");
+    const uint32_t sequence_n_threads = rwkv_get_n_threads(ctx, RWKV_EVAL_SEQUENCE);
+    ASSERT(sequence_n_threads >= 1 && sequence_n_threads <= 3, "Unexpected sequence thread count %d", (int) sequence_n_threads);
+
+    check(ctx, expected_logits, expected_sequence_logits, logits, sequence_logits);
+
+    rwkv_free(ctx);
+
+    free(expected_logits);
+    free(expected_sequence_logits);
+    free(logits);
+    free(sequence_logits);
+
+    return 0;
+}
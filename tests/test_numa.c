@@ -0,0 +1,103 @@
+// Tests that pinning threads to CPUs and placing weights on NUMA nodes do not change results.
+// Placement depends on permissions of the process, so unsupported operations are skipped.
+
+#define _GNU_SOURCE
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+
+void check_logits(struct rwkv_context * ctx, const float * expected_logits, float * logits) {
+    ASSERT(rwkv_eval(ctx, 'h', NULL, NULL, logits), "rwkv_eval failed");
+    ASSERT(memcmp(expected_logits, logits, sizeof(float) * rwkv_get_logits_len(ctx)) == 0, "Logits differ");
+}
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * logits = malloc(sizeof(float) * n_vocab);
+
+    ASSERT(rwkv_eval(ctx, 'h', NULL, NULL, expected_logits), "rwkv_eval failed");
+
+    rwkv_set_print_errors(ctx, false);
+    rwkv_set_print_errors(NULL, false);
+
+#if defined(__linux__)
+    cpu_set_t previous_set;
+    ASSERT(sched_getaffinity(0, sizeof(previous_set), &previous_set) == 0, "sched_getaffinity failed");
+
+    // The CPU this thread runs on is always allowed.
+    const uint32_t cpu = (uint32_t) sched_getcpu();
+    ASSERT(rwkv_set_cpu_affinity(ctx, &cpu, 1), "Failed to pin threads to CPU %d", (int) cpu);
+    check_logits(ctx, expected_logits, logits);
+
+    // Evaluation restores affinity of the calling thread.
+    cpu_set_t set;
+    ASSERT(sched_getaffinity(0, sizeof(set), &set) == 0, "sched_getaffinity failed");
+    ASSERT(CPU_EQUAL(&set, &previous_set), "Affinity of the calling thread was not restored");
+
+    const uint32_t invalid_cpu = 1 << 20;
+    ASSERT(!rwkv_set_cpu_affinity(ctx, &invalid_cpu, 1), "Invalid CPU was accepted");
+    ASSERT(rwkv_get_last_error(ctx) == RWKV_ERROR_ARGS, "Unexpected error");
+    check_logits(ctx, expected_logits, logits);
+
+    ASSERT(rwkv_set_cpu_affinity(ctx, NULL, 0), "Failed to remove pinning");
+
+    // A copy of weights on node 0 gives the same results, and is shared by its clones.
+    struct rwkv_context * node_ctx = rwkv_clone_context_to_numa_node(ctx, N_THREADS, 0);
+
+    if (node_ctx) {
+        check_logits(node_ctx, expected_logits, logits);
+
+        struct rwkv_context * node_clone = rwkv_clone_context(node_ctx, N_THREADS);
+        ASSERT(node_clone != NULL, "Failed to clone the context");
+        check_logits(node_clone, expected_logits, logits);
+
+        rwkv_free(node_clone);
+        rwkv_free(node_ctx);
+    } else {
+        fprintf(stderr, "Skipping NUMA node copy: not supported here\n");
+    }
+
+    struct rwkv_context * interleaved_ctx = rwkv_init_from_file_ex("tiny-rwkv-660K-FP32.bin", N_THREADS, RWKV_INIT_NUMA_INTERLEAVE, NULL);
+
+    if (interleaved_ctx) {
+        check_logits(interleaved_ctx, expected_logits, logits);
+        rwkv_free(interleaved_ctx);
+    } else {
+        ASSERT(rwkv_get_last_error(NULL) == (RWKV_ERROR_CTX | RWKV_ERROR_UNSUPPORTED), "Unexpected error");
+        fprintf(stderr, "Skipping NUMA interleaving: not supported here\n");
+    }
+#else
+    const uint32_t cpu = 0;
+    ASSERT(!rwkv_set_cpu_affinity(ctx, &cpu, 1), "CPU affinity is not expected to be supported");
+    ASSERT(rwkv_clone_context_to_numa_node(ctx, N_THREADS, 0) == NULL, "NUMA placement is not expected to be supported");
+#endif
+
+    rwkv_free(ctx);
+
+    free(expected_logits);
+    free(logits);
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+// Tests that profiling attributes graph nodes to layers and categories, and that the trace can be written.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+
+// Count of weight matrices in a layer: receptance, key, value and output of attention, and key, value and receptance of FFN.
+#define LAYER_MATMULS 7
+
+const struct rwkv_profile_entry * find_entry(const struct rwkv_profile_entry * entries, const size_t count, const int32_t layer, const enum rwkv_profile_category category) {
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].layer == layer && entries[i].category == category) {
+            return &entries[i];
+        }
+    }
+
+    ASSERT(false, "No entry for layer %d, category %d", layer, category);
+    return NULL;
+}
+
+void eval(struct rwkv_context * ctx, float * state, float * logits) {
+    const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o' };
+
+    rwkv_init_state(ctx, state);
+
+    for (size_t i = 0; i < 3; i++) {
+        ASSERT(rwkv_eval(ctx, prompt[i], state, state, logits), "rwkv_eval failed");
+    }
+
+    ASSERT(rwkv_eval_sequence(ctx, prompt, sizeof(prompt) / sizeof(prompt[0]), state, state, logits), "rwkv_eval_sequence failed");
+}
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const int32_t n_layer = (int32_t) rwkv_get_n_layer(ctx);
+    float * state = malloc(sizeof(float) * rwkv_get_state_len(ctx));
+    float * logits = malloc(sizeof(float) * rwkv_get_logits_len(ctx));
+
+    ASSERT(rwkv_get_profile(ctx, NULL, 0) == 0, "Profile is not empty before profiling was enabled");
+
+    rwkv_set_profiling(ctx, RWKV_PROFILE_AGGREGATE | RWKV_PROFILE_TRACE);
+    eval(ctx, state, logits);
+
+    const size_t count = rwkv_get_profile(ctx, NULL, 0);
+    ASSERT(count == (size_t) (n_layer + 2) * RWKV_PROFILE_CATEGORY_COUNT, "Unexpected count of entries %zu", count);
+
+    struct rwkv_profile_entry * entries = calloc(count, sizeof(struct rwkv_profile_entry));
+    ASSERT(rwkv_get_profile(ctx, entries, count) == count, "rwkv_get_profile failed");
+
+    // 3 serial evaluations and 1 sequence evaluation.
+    const uint64_t n_evals = 4;
+
+    for (int32_t layer = 0; layer < n_layer; layer++) {
+        const struct rwkv_profile_entry * matmul = find_entry(entries, count, layer, RWKV_PROFILE_MATMUL);
+        ASSERT(matmul->calls == n_evals * LAYER_MATMULS, "Unexpected count of matmuls in layer %d: %d", layer, (int) matmul->calls);
+        ASSERT(find_entry(entries, count, layer, RWKV_PROFILE_WKV)->calls > 0, "No WKV nodes in layer %d", layer);
+        ASSERT(find_entry(entries, count, layer, RWKV_PROFILE_LAYER_NORM)->calls > 0, "No layer norm nodes in layer %d", layer);
+    }
+
+    ASSERT(find_entry(entries, count, -1, RWKV_PROFILE_MATMUL)->calls == 0, "Matmul nodes attributed to the embedding");
+    ASSERT(find_entry(entries, count, -1, RWKV_PROFILE_LAYER_NORM)->calls > 0, "No ln0 nodes");
+    ASSERT(find_entry(entries, count, n_layer, RWKV_PROFILE_MATMUL)->calls == n_evals, "Unexpected count of head matmuls");
+    ASSERT(find_entry(entries, count, n_layer, RWKV_PROFILE_LAYER_NORM)->calls > 0, "No ln_out nodes");
+
+    ASSERT(rwkv_dump_profile_trace(ctx, "tiny-rwkv-660K-trace.json"), "Failed to write the trace");
+
+    FILE * file = fopen("tiny-rwkv-660K-trace.json", "rb");
+    ASSERT(file != NULL, "Failed to open the trace");
+    char buffer[256] = { 0 };
+    ASSERT(fread(buffer, 1, sizeof(buffer) - 1, file) > 0, "Failed to read the trace");
+    fclose(file);
+    ASSERT(strstr(buffer, "\"traceEvents\"") != NULL && strstr(buffer, "\"rwkv_eval\"") != NULL, "Unexpected trace contents: %s", buffer);
+
+    // Results are cleared on reset, and not collected when profiling is disabled.
+    rwkv_reset_profile(ctx);
+    rwkv_set_profiling(ctx, RWKV_PROFILE_NONE);
+    eval(ctx, state, logits);
+    ASSERT(rwkv_get_profile(ctx, entries, count) == count, "rwkv_get_profile failed");
+
+    for (size_t i = 0; i < count; i++) {
+        ASSERT(entries[i].calls == 0 && entries[i].wall_us == 0 && entries[i].cpu_us == 0, "Entry %zu is not empty", i);
+    }
+
+    // Counters accumulated by ggml while profiling was disabled are discarded.
+    rwkv_set_profiling(ctx, RWKV_PROFILE_AGGREGATE);
+    ASSERT(rwkv_eval(ctx, 'h', state, state, logits), "rwkv_eval failed");
+    ASSERT(rwkv_get_profile(ctx, entries, count) == count, "rwkv_get_profile failed");
+    ASSERT(find_entry(entries, count, 0, RWKV_PROFILE_MATMUL)->calls == LAYER_MATMULS, "Counters were not cleared");
+
+    rwkv_free(ctx);
+
+    free(entries);
+    free(state);
+    free(logits);
+
+    return 0;
+}
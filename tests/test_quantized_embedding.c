@@ -0,0 +1,84 @@
+// Tests that a model with quantized emb.weight produces nearly the same logits as a model with FP16 emb.weight.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+
+void eval_prompt(const char * model_path, float * logits, float * sequence_logits) {
+    struct rwkv_context * ctx = rwkv_init_from_file(model_path, N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load %s", model_path);
+
+    float * state = calloc(rwkv_get_state_len(ctx), sizeof(float));
+    ASSERT(state != NULL, "Failed to allocate state");
+
+    const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o' };
+    const size_t prompt_len = sizeof(prompt) / sizeof(prompt[0]);
+
+    rwkv_init_state(ctx, state);
+
+    for (size_t i = 0; i < prompt_len; i++) {
+        ASSERT(rwkv_eval(ctx, prompt[i], state, state, logits), "rwkv_eval failed");
+    }
+
+    ASSERT(rwkv_eval_sequence(ctx, prompt, prompt_len, NULL, state, sequence_logits), "rwkv_eval_sequence failed");
+
+    rwkv_free(ctx);
+    free(state);
+}
+
+// Returns sum of absolute differences divided by sum of absolute values of the reference.
+float relative_difference(const float * reference, const float * actual, const size_t n) {
+    float diff_sum = 0.0F;
+    float reference_sum = 0.0F;
+
+    for (size_t i = 0; i < n; i++) {
+        diff_sum += fabsf(actual[i] - reference[i]);
+        reference_sum += fabsf(reference[i]);
+    }
+
+    return diff_sum / reference_sum;
+}
+
+int main(void) {
+    ASSERT(rwkv_quantize_model_file_ex("tiny-rwkv-660K-FP16.bin", "tiny-rwkv-660K-FP16-Q8_0-emb-FP16.bin", "Q8_0", N_THREADS), "Failed to quantize");
+    ASSERT(rwkv_quantize_model_file_ex("tiny-rwkv-660K-FP16.bin", "tiny-rwkv-660K-FP16-Q8_0-emb-Q8_0.bin", "Q8_0, emb.weight=Q8_0", N_THREADS), "Failed to quantize");
+
+    const size_t n_vocab = 256;
+
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * expected_sequence_logits = malloc(sizeof(float) * n_vocab);
+    float * logits = malloc(sizeof(float) * n_vocab);
+    float * sequence_logits = malloc(sizeof(float) * n_vocab);
+
+    eval_prompt("tiny-rwkv-660K-FP16-Q8_0-emb-FP16.bin", expected_logits, expected_sequence_logits);
+    eval_prompt("tiny-rwkv-660K-FP16-Q8_0-emb-Q8_0.bin", logits, sequence_logits);
+
+    float diff = relative_difference(expected_logits, logits, n_vocab);
+    float sequence_diff = relative_difference(expected_sequence_logits, sequence_logits, n_vocab);
+
+    fprintf(stderr, "Relative difference: %f, sequence: %f\n", (double) diff, (double) sequence_diff);
+
+    // Q8_0 is almost lossless, and the embedding passes through ln0 right away.
+    ASSERT(diff < 0.05F, "Too big difference %f", (double) diff);
+    ASSERT(sequence_diff < 0.05F, "Too big sequence difference %f", (double) sequence_diff);
+
+    free(expected_logits);
+    free(expected_sequence_logits);
+    free(logits);
+    free(sequence_logits);
+
+    return 0;
+}
@@ -0,0 +1,235 @@
+// Tests that sessions evaluated by the scheduler in mixed batches of decode steps and prefill chunks
+// give the same results as evaluating each of them on its own, also with logits of every token,
+// and that new prompts are prefilled while more sessions decode than there are contexts.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+#define N_CONTEXTS 2
+#define N_SESSIONS 3
+#define BATCH_TOKENS 6
+#define CHUNK_LEN 4
+
+const uint32_t prompts[N_SESSIONS][12] = {
+    { 'T', 'h', 'e', ' ', 'q', 'u', 'i', 'c', 'k', ' ', 'f', 'o' },
+    { 'h', 'e', 'y' },
+    { 'a' }
+};
+
+const size_t prompt_lens[N_SESSIONS] = { 12, 3, 1 };
+
+// Token that the callback submits for the last session when it leaves for the first time.
+#define NEXT_TOKEN 'b'
+
+struct test_state {
+    struct rwkv_scheduler * scheduler;
+    float * states[N_SESSIONS];
+    float * logits[N_SESSIONS];
+    size_t finished[N_SESSIONS];
+};
+
+void on_finished(const uint64_t session_id, const bool success, void * user_data) {
+    struct test_state * test = (struct test_state *) user_data;
+
+    ASSERT(success, "Session %d failed", (int) session_id);
+    ASSERT(rwkv_scheduler_get_n_sessions(test->scheduler) < N_SESSIONS, "Session was not removed before the callback");
+
+    // A decoding session continues with the next token, as a sampler would do.
+    if (session_id == N_SESSIONS - 1 && test->finished[session_id] == 0) {
+        const uint32_t token = NEXT_TOKEN;
+        ASSERT(rwkv_scheduler_submit(test->scheduler, session_id, &token, 1, test->states[session_id], test->logits[session_id]), "Failed to submit from the callback");
+    }
+
+    test->finished[session_id]++;
+}
+
+// Keeps sessions other than the prompt decoding, and counts how often the prompt session finished.
+void on_decoded(const uint64_t session_id, const bool success, void * user_data) {
+    struct test_state * test = (struct test_state *) user_data;
+
+    ASSERT(success, "Session %d failed", (int) session_id);
+
+    if (session_id == N_SESSIONS) {
+        test->finished[0]++;
+        return;
+    }
+
+    const uint32_t token = NEXT_TOKEN;
+    ASSERT(rwkv_scheduler_submit(test->scheduler, session_id, &token, 1, test->states[session_id], test->logits[session_id]), "Failed to submit from the callback");
+}
+
+float max_difference(const float * expected, const float * actual, const size_t n) {
+    float max_diff = 0.0F;
+
+    for (size_t i = 0; i < n; i++) {
+        max_diff = fmaxf(max_diff, fabsf(actual[i] - expected[i]));
+    }
+
+    return max_diff;
+}
+
+int main(void) {
+    struct rwkv_context * contexts[N_CONTEXTS];
+    contexts[0] = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(contexts[0] != NULL, "Failed to load the model");
+
+    for (size_t i = 1; i < N_CONTEXTS; i++) {
+        contexts[i] = rwkv_clone_context(contexts[0], N_THREADS);
+        ASSERT(contexts[i] != NULL, "Failed to clone the context");
+    }
+
+    struct rwkv_context * ctx = contexts[0];
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    const size_t state_len = rwkv_get_state_len(ctx);
+    float * expected_state = malloc(sizeof(float) * state_len);
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+
+    struct test_state test;
+    memset(&test, 0, sizeof(test));
+
+    test.scheduler = rwkv_scheduler_new(contexts, N_CONTEXTS, BATCH_TOKENS, CHUNK_LEN, on_finished, &test);
+    ASSERT(test.scheduler != NULL, "Failed to create the scheduler");
+
+    for (size_t i = 0; i < N_SESSIONS; i++) {
+        test.states[i] = malloc(sizeof(float) * state_len);
+        test.logits[i] = malloc(sizeof(float) * n_vocab);
+        rwkv_init_state(ctx, test.states[i]);
+        ASSERT(rwkv_scheduler_submit(test.scheduler, i, prompts[i], prompt_lens[i], test.states[i], test.logits[i]), "Failed to submit session %d", (int) i);
+    }
+
+    rwkv_set_print_errors(NULL, false);
+    ASSERT(!rwkv_scheduler_submit(test.scheduler, 0, prompts[0], 1, test.states[0], NULL), "Session was submitted twice");
+    ASSERT(rwkv_get_last_error(NULL) == (RWKV_ERROR_ARGS | RWKV_ERROR_KEY), "Unexpected error");
+
+    // The decoding session and a chunk of the longest prompt take both contexts; the short prompt waits.
+    struct rwkv_scheduler_stats stats;
+    ASSERT(rwkv_scheduler_step(test.scheduler, &stats), "rwkv_scheduler_step failed");
+    ASSERT(stats.decode_sessions == 1 && stats.prefill_sessions == 1, "Unexpected batch of %d decode and %d prefill sessions", (int) stats.decode_sessions, (int) stats.prefill_sessions);
+    ASSERT(stats.tokens == 1 + CHUNK_LEN, "Unexpected count of tokens %d", (int) stats.tokens);
+    ASSERT(stats.waiting_sessions == 1, "Unexpected count of waiting sessions %d", (int) stats.waiting_sessions);
+
+    int iterations = 1;
+
+    while (rwkv_scheduler_get_n_sessions(test.scheduler) > 0) {
+        ASSERT(rwkv_scheduler_step(test.scheduler, &stats), "rwkv_scheduler_step failed");
+        ASSERT(stats.tokens <= BATCH_TOKENS, "Batch is larger than the budget");
+        ASSERT(stats.decode_sessions + stats.prefill_sessions <= N_CONTEXTS, "Batch has more sessions than contexts");
+        ASSERT(++iterations < 100, "Scheduler does not make progress");
+    }
+
+    ASSERT(test.finished[0] == 1 && test.finished[1] == 1 && test.finished[2] == 2, "Unexpected callbacks");
+
+    for (size_t i = 0; i < N_SESSIONS; i++) {
+        ASSERT(rwkv_eval_sequence(ctx, prompts[i], prompt_lens[i], NULL, expected_state, expected_logits), "rwkv_eval_sequence failed");
+
+        if (i == N_SESSIONS - 1) {
+            ASSERT(rwkv_eval(ctx, NEXT_TOKEN, expected_state, expected_state, expected_logits), "rwkv_eval failed");
+        }
+
+        // Chunks evaluate in a different order of operations than a single sequence.
+        ASSERT(max_difference(expected_logits, test.logits[i], n_vocab) < 0.01F, "Logits of session %d differ too much", (int) i);
+        ASSERT(max_difference(expected_state, test.states[i], state_len) < 0.01F, "State of session %d differs too much", (int) i);
+    }
+
+    // Cancelled sessions leave without the callback.
+    rwkv_init_state(ctx, test.states[0]);
+    ASSERT(rwkv_scheduler_submit(test.scheduler, 0, prompts[0], prompt_lens[0], test.states[0], NULL), "Failed to submit the session");
+    ASSERT(rwkv_scheduler_cancel(test.scheduler, 0), "Failed to cancel the session");
+    ASSERT(!rwkv_scheduler_cancel(test.scheduler, 0), "Session was cancelled twice");
+    ASSERT(rwkv_scheduler_step(test.scheduler, &stats) && stats.tokens == 0, "Empty iteration evaluated tokens");
+    ASSERT(test.finished[0] == 1, "Callback was called for a cancelled session");
+
+    // Per-token sessions get logits of every token, also when their prompt is split into chunks.
+    const size_t rows = prompt_lens[0];
+    float * expected_token_logits = malloc(sizeof(float) * rows * n_vocab);
+    float * token_logits = malloc(sizeof(float) * rows * n_vocab);
+    ASSERT(rwkv_eval_sequence_per_token(ctx, prompts[0], rows, NULL, expected_token_logits, NULL), "rwkv_eval_sequence_per_token failed");
+    ASSERT(rwkv_eval_sequence(ctx, prompts[0], rows, NULL, expected_state, NULL), "rwkv_eval_sequence failed");
+
+    rwkv_init_state(ctx, test.states[0]);
+    ASSERT(rwkv_scheduler_submit_per_token(test.scheduler, 0, prompts[0], rows, test.states[0], token_logits), "Failed to submit the session");
+
+    while (rwkv_scheduler_get_n_sessions(test.scheduler) > 0) {
+        ASSERT(rwkv_scheduler_step(test.scheduler, &stats), "rwkv_scheduler_step failed");
+    }
+
+    ASSERT(test.finished[0] == 2, "Per-token session did not finish");
+    ASSERT(max_difference(expected_token_logits, token_logits, rows * n_vocab) < 0.01F, "Per-token logits differ too much");
+    ASSERT(max_difference(expected_state, test.states[0], state_len) < 0.01F, "State of the per-token session differs too much");
+
+    free(expected_token_logits);
+    free(token_logits);
+
+    // Chunks are not cut to fill the budget: a second chunk does not fit next to the first one, so it waits.
+    for (size_t i = 0; i < 2; i++) {
+        rwkv_init_state(ctx, test.states[i]);
+        ASSERT(rwkv_scheduler_submit(test.scheduler, i, prompts[0], 2 * CHUNK_LEN, test.states[i], test.logits[i]), "Failed to submit session %d", (int) i);
+    }
+
+    ASSERT(rwkv_scheduler_step(test.scheduler, &stats), "rwkv_scheduler_step failed");
+    ASSERT(stats.prefill_sessions == 1 && stats.tokens == CHUNK_LEN, "Unexpected batch of %d tokens", (int) stats.tokens);
+
+    while (rwkv_scheduler_get_n_sessions(test.scheduler) > 0) {
+        ASSERT(rwkv_scheduler_step(test.scheduler, &stats), "rwkv_scheduler_step failed");
+        ASSERT(stats.tokens == CHUNK_LEN, "Unexpected count of tokens %d", (int) stats.tokens);
+    }
+
+    ASSERT(rwkv_eval_sequence(ctx, prompts[0], 2 * CHUNK_LEN, NULL, expected_state, expected_logits), "rwkv_eval_sequence failed");
+
+    for (size_t i = 0; i < 2; i++) {
+        ASSERT(max_difference(expected_logits, test.logits[i], n_vocab) < 0.01F, "Logits of session %d differ too much", (int) i);
+        ASSERT(max_difference(expected_state, test.states[i], state_len) < 0.01F, "State of session %d differs too much", (int) i);
+    }
+
+    rwkv_scheduler_free(test.scheduler);
+
+    // More sessions decode than there are contexts, and a new prompt still gets a chunk in every iteration.
+    test.scheduler = rwkv_scheduler_new(contexts, N_CONTEXTS, BATCH_TOKENS, CHUNK_LEN, on_decoded, &test);
+    ASSERT(test.scheduler != NULL, "Failed to create the scheduler");
+    memset(test.finished, 0, sizeof(test.finished));
+
+    for (size_t i = 0; i < N_SESSIONS; i++) {
+        rwkv_init_state(ctx, test.states[i]);
+        ASSERT(rwkv_scheduler_submit(test.scheduler, i, prompts[2], 1, test.states[i], test.logits[i]), "Failed to submit session %d", (int) i);
+    }
+
+    rwkv_init_state(ctx, expected_state);
+    ASSERT(rwkv_scheduler_submit(test.scheduler, N_SESSIONS, prompts[0], prompt_lens[0], expected_state, expected_logits), "Failed to submit the prompt");
+
+    for (size_t i = 0; i * CHUNK_LEN < prompt_lens[0]; i++) {
+        ASSERT(rwkv_scheduler_step(test.scheduler, &stats), "rwkv_scheduler_step failed");
+        ASSERT(stats.decode_sessions == N_CONTEXTS - 1 && stats.prefill_sessions == 1, "Unexpected batch of %d decode and %d prefill sessions", (int) stats.decode_sessions, (int) stats.prefill_sessions);
+    }
+
+    ASSERT(test.finished[0] == 1, "Prompt did not finish while other sessions were decoding");
+
+    rwkv_scheduler_free(test.scheduler);
+
+    for (size_t i = 0; i < N_SESSIONS; i++) {
+        free(test.states[i]);
+        free(test.logits[i]);
+    }
+
+    for (size_t i = 0; i < N_CONTEXTS; i++) {
+        rwkv_free(contexts[i]);
+    }
+
+    free(expected_state);
+    free(expected_logits);
+
+    return 0;
+}
@@ -0,0 +1,276 @@
+// Starts the server on the tiny model, sends GENERATE, SCORE and EMBED requests over its socket,
+// and checks the responses against evaluating the model directly. Takes the path to rwkv_server as its argument.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+#ifndef _WIN32
+
+pid_t server_pid = 0;
+
+// The server is stopped before aborting, so that a failed test does not leave it running.
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            if (server_pid > 0) {\
+                kill(server_pid, SIGKILL);\
+            }\
+            abort();\
+        }\
+    }
+
+#define MODEL_PATH "tiny-rwkv-660K-FP32.bin"
+#define SOCKET_PATH "test_server.sock"
+
+// Prompts are longer than the chunk length of the server, so that they are split into chunks.
+#define CHUNK_LEN "4"
+
+#define REQUEST_GENERATE 1
+#define REQUEST_SCORE 2
+#define REQUEST_EMBED 3
+
+#define RESPONSE_TOKEN 1
+#define RESPONSE_DONE 2
+#define RESPONSE_SCORES 3
+#define RESPONSE_EMBEDDING 4
+#define RESPONSE_ERROR 5
+
+#define N_TOKENS 4
+
+const uint32_t prompt[] = { 'T', 'h', 'e', ' ', 'q', 'u', 'i', 'c', 'k' };
+#define PROMPT_LEN (sizeof(prompt) / sizeof(prompt[0]))
+
+struct response {
+    uint32_t type;
+    uint32_t count;
+    uint64_t session_id;
+    uint8_t payload[4096];
+};
+
+void read_exactly(const int fd, void * data, const size_t len) {
+    size_t received = 0;
+
+    while (received < len) {
+        const ssize_t result = recv(fd, (uint8_t *) data + received, len - received, 0);
+        ASSERT(result > 0, "Failed to read a response");
+        received += (size_t) result;
+    }
+}
+
+void send_request(const int fd, const uint32_t type, const uint64_t session_id, const uint32_t * tokens, const uint32_t n_tokens, const uint32_t max_tokens) {
+    uint8_t frame[32 + sizeof(prompt)];
+    const uint32_t size = 28 + n_tokens * (uint32_t) sizeof(uint32_t);
+    const float temperature = 0.0F;
+    const float top_p = 1.0F;
+
+    memcpy(frame, &size, 4);
+    memcpy(frame + 4, &type, 4);
+    memcpy(frame + 8, &n_tokens, 4);
+    memcpy(frame + 12, &session_id, 8);
+    memcpy(frame + 20, &max_tokens, 4);
+    memcpy(frame + 24, &temperature, 4);
+    memcpy(frame + 28, &top_p, 4);
+    memcpy(frame + 32, tokens, n_tokens * sizeof(uint32_t));
+
+    ASSERT(send(fd, frame, 4 + size, 0) == (ssize_t) (4 + size), "Failed to send a request");
+}
+
+void read_response(const int fd, struct response * response) {
+    uint32_t size;
+    read_exactly(fd, &size, sizeof(size));
+    ASSERT(size >= 16 && size - 16 <= sizeof(response->payload), "Unexpected response size %u", size);
+
+    read_exactly(fd, &response->type, sizeof(response->type));
+    read_exactly(fd, &response->count, sizeof(response->count));
+    read_exactly(fd, &response->session_id, sizeof(response->session_id));
+    read_exactly(fd, response->payload, size - 16);
+}
+
+int connect_to_server(void) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, SOCKET_PATH);
+
+    // The server is ready once it loaded the model and listens.
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ASSERT(fd >= 0, "Failed to create a socket");
+
+        if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) {
+            // A server that stopped responding fails the test instead of blocking it.
+            struct timeval timeout = { 30, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            return fd;
+        }
+
+        close(fd);
+        usleep(10000);
+    }
+
+    ASSERT(false, "Failed to connect to the server");
+    return -1;
+}
+
+uint32_t argmax(const float * logits, const size_t n_vocab) {
+    uint32_t best = 0;
+
+    for (uint32_t i = 1; i < n_vocab; i++) {
+        best = logits[i] > logits[best] ? i : best;
+    }
+
+    return best;
+}
+
+float log_softmax(const float * logits, const size_t n_vocab, const uint32_t token) {
+    float max = logits[0];
+
+    for (size_t i = 1; i < n_vocab; i++) {
+        max = fmaxf(max, logits[i]);
+    }
+
+    double sum = 0.0;
+
+    for (size_t i = 0; i < n_vocab; i++) {
+        sum += exp((double) (logits[i] - max));
+    }
+
+    return logits[token] - max - (float) log(sum);
+}
+
+int main(int argc, char * argv[]) {
+    ASSERT(argc == 2, "Usage: %s SERVER", argv[0]);
+
+    struct rwkv_context * ctx = rwkv_init_from_file(MODEL_PATH, 2);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    const size_t n_embed = rwkv_get_n_embed(ctx);
+    const size_t state_len = rwkv_get_state_len(ctx);
+    float * state = malloc(sizeof(float) * state_len);
+    float * logits = malloc(sizeof(float) * n_vocab);
+    float * token_logits = malloc(sizeof(float) * PROMPT_LEN * n_vocab);
+    float * embedding = malloc(sizeof(float) * n_embed);
+
+    // Greedy generation, which ends early at the end of text.
+    uint32_t expected_tokens[N_TOKENS];
+    size_t expected_len = 0;
+    ASSERT(rwkv_eval_sequence(ctx, prompt, PROMPT_LEN, NULL, state, logits), "rwkv_eval_sequence failed");
+
+    while (expected_len < N_TOKENS) {
+        const uint32_t token = argmax(logits, n_vocab);
+        expected_tokens[expected_len++] = token;
+
+        if (token == 0) {
+            break;
+        }
+
+        ASSERT(rwkv_eval(ctx, token, state, state, logits), "rwkv_eval failed");
+    }
+
+    ASSERT(rwkv_eval_sequence_per_token(ctx, prompt, PROMPT_LEN, NULL, token_logits, NULL), "rwkv_eval_sequence_per_token failed");
+    ASSERT(rwkv_eval_sequence_embed(ctx, prompt, PROMPT_LEN, NULL, NULL, embedding, false), "rwkv_eval_sequence_embed failed");
+
+    // Two sessions at most, so that the third one replaces the least recently used one.
+    server_pid = fork();
+    ASSERT(server_pid >= 0, "Failed to start the server");
+
+    if (server_pid == 0) {
+        execl(argv[1], argv[1], MODEL_PATH, SOCKET_PATH, "--threads", "2", "--workers", "2", "--chunk", CHUNK_LEN, "--max-sessions", "2", (char *) NULL);
+        perror("execl");
+        _exit(EXIT_FAILURE);
+    }
+
+    const int fd = connect_to_server();
+    struct response response;
+
+    send_request(fd, REQUEST_GENERATE, 1, prompt, PROMPT_LEN, N_TOKENS);
+
+    for (size_t i = 0; i < expected_len; i++) {
+        read_response(fd, &response);
+        ASSERT(response.type == RESPONSE_TOKEN && response.count == 1 && response.session_id == 1, "Unexpected response %u to GENERATE", response.type);
+
+        uint32_t token;
+        memcpy(&token, response.payload, sizeof(token));
+        ASSERT(token == expected_tokens[i], "Token %d differs", (int) i);
+    }
+
+    read_response(fd, &response);
+    ASSERT(response.type == RESPONSE_DONE, "GENERATE did not end with RESPONSE_DONE");
+
+    send_request(fd, REQUEST_SCORE, 2, prompt, PROMPT_LEN, 0);
+    read_response(fd, &response);
+    ASSERT(response.type == RESPONSE_SCORES && response.count == PROMPT_LEN && response.session_id == 2, "Unexpected response %u to SCORE", response.type);
+
+    float scores[PROMPT_LEN];
+    memcpy(scores, response.payload, sizeof(scores));
+    ASSERT(isnan(scores[0]), "First token of a new session was scored");
+
+    for (size_t i = 1; i < PROMPT_LEN; i++) {
+        const float expected = log_softmax(token_logits + (i - 1) * n_vocab, n_vocab, prompt[i]);
+        ASSERT(fabsf(expected - scores[i]) < 0.01F, "Score of token %d differs too much", (int) i);
+    }
+
+    // Replaces session 1, which was used least recently.
+    send_request(fd, REQUEST_EMBED, 3, prompt, PROMPT_LEN, 0);
+    read_response(fd, &response);
+    ASSERT(response.type == RESPONSE_EMBEDDING && response.count == n_embed && response.session_id == 3, "Unexpected response %u to EMBED", response.type);
+
+    float * received_embedding = malloc(sizeof(float) * n_embed);
+    memcpy(received_embedding, response.payload, sizeof(float) * n_embed);
+
+    for (size_t i = 0; i < n_embed; i++) {
+        ASSERT(fabsf(embedding[i] - received_embedding[i]) < 0.01F, "Embedding differs too much at %d", (int) i);
+    }
+
+    // Session 1 was replaced, so it has nothing to generate from.
+    send_request(fd, REQUEST_GENERATE, 1, prompt, 0, N_TOKENS);
+    read_response(fd, &response);
+    ASSERT(response.type == RESPONSE_ERROR, "Replaced session kept its state");
+
+    send_request(fd, REQUEST_EMBED, 3, prompt, 0, 0);
+    read_response(fd, &response);
+    ASSERT(response.type == RESPONSE_ERROR, "Empty EMBED was accepted");
+
+    close(fd);
+
+    int status;
+    kill(server_pid, SIGTERM);
+    ASSERT(waitpid(server_pid, &status, 0) == server_pid, "Failed to wait for the server");
+    server_pid = 0;
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS, "Server did not stop cleanly");
+
+    rwkv_free(ctx);
+
+    free(state);
+    free(logits);
+    free(token_logits);
+    free(embedding);
+    free(received_embedding);
+
+    return 0;
+}
+
+#else
+
+// Unix domain sockets are not supported on Windows, and neither is the server.
+int main(void) {
+    return 0;
+}
+
+#endif
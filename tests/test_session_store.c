@@ -0,0 +1,102 @@
+// Tests that the session store keeps states of sessions across spills to disk and reopening, and reports a full store.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+#define N_SESSIONS 4
+#define MAX_RESIDENT 2
+#define STORE_PATH "tiny-rwkv-660K-sessions.bin"
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t state_len = rwkv_get_state_len(ctx);
+    float * states = malloc(sizeof(float) * state_len * N_SESSIONS);
+    float * state = malloc(sizeof(float) * state_len);
+
+    // Every session gets a different state.
+    for (size_t i = 0; i < N_SESSIONS; i++) {
+        const uint32_t tokens[] = { 'a' + (uint32_t) i, 'b', 'c' };
+        ASSERT(rwkv_eval_sequence(ctx, tokens, 3, NULL, states + i * state_len, NULL), "rwkv_eval_sequence failed");
+    }
+
+    remove(STORE_PATH);
+
+    struct rwkv_session_store * store = rwkv_session_store_open(ctx, STORE_PATH, RWKV_STATE_FP32, N_SESSIONS, MAX_RESIDENT);
+
+#if defined(_WIN32)
+    ASSERT(store == NULL, "Session stores are not expected to be supported");
+#else
+    ASSERT(store != NULL, "Failed to open the session store");
+
+    // Saving more sessions than may stay resident spills the least recently used ones.
+    for (size_t i = 0; i < N_SESSIONS; i++) {
+        ASSERT(rwkv_session_store_save(store, ctx, 1000 + i, states + i * state_len), "Failed to save session %zu", i);
+    }
+
+    ASSERT(rwkv_session_store_get_count(store) == N_SESSIONS, "Unexpected count of sessions");
+
+    for (size_t i = 0; i < N_SESSIONS; i++) {
+        ASSERT(rwkv_session_store_load(store, ctx, 1000 + i, state), "Failed to load session %zu", i);
+        ASSERT(memcmp(states + i * state_len, state, sizeof(float) * state_len) == 0, "State of session %zu differs", i);
+    }
+
+    rwkv_set_print_errors(ctx, false);
+
+    ASSERT(!rwkv_session_store_save(store, ctx, 2000, state), "Saved a session into a full store");
+    ASSERT(rwkv_get_last_error(ctx) == (RWKV_ERROR_CTX | RWKV_ERROR_ALLOC), "Unexpected error");
+
+    ASSERT(!rwkv_session_store_load(store, ctx, 2000, state), "Loaded a missing session");
+    ASSERT(rwkv_get_last_error(ctx) == (RWKV_ERROR_ARGS | RWKV_ERROR_KEY), "Unexpected error");
+
+    // A removed session frees its slot for a new one; existing sessions are overwritten in place.
+    ASSERT(rwkv_session_store_remove(store, 1001), "Failed to remove a session");
+    ASSERT(!rwkv_session_store_remove(store, 1001), "Removed a session twice");
+    ASSERT(!rwkv_session_store_contains(store, 1001), "Removed session is still in the store");
+    ASSERT(rwkv_session_store_save(store, ctx, 2000, states + 1 * state_len), "Failed to save into a freed slot");
+    ASSERT(rwkv_session_store_save(store, ctx, 1000, states + 3 * state_len), "Failed to overwrite a session");
+
+    rwkv_session_store_close(store);
+
+    // Sessions survive reopening; the capacity of an existing store is kept.
+    store = rwkv_session_store_open(ctx, STORE_PATH, RWKV_STATE_FP32, 1, 0);
+    ASSERT(store != NULL, "Failed to reopen the session store");
+    ASSERT(rwkv_session_store_get_count(store) == N_SESSIONS, "Unexpected count of sessions after reopening");
+
+    ASSERT(rwkv_session_store_load(store, ctx, 1000, state), "Failed to load an overwritten session");
+    ASSERT(memcmp(states + 3 * state_len, state, sizeof(float) * state_len) == 0, "State of the overwritten session differs");
+    ASSERT(rwkv_session_store_load(store, ctx, 2000, state), "Failed to load a session from a freed slot");
+    ASSERT(memcmp(states + 1 * state_len, state, sizeof(float) * state_len) == 0, "State of the new session differs");
+    ASSERT(rwkv_session_store_load(store, ctx, 1002, state), "Failed to load a session");
+    ASSERT(memcmp(states + 2 * state_len, state, sizeof(float) * state_len) == 0, "State of session 2 differs");
+
+    rwkv_session_store_close(store);
+
+    // A store can only be reopened with the encoding it was created with.
+    ASSERT(rwkv_session_store_open(ctx, STORE_PATH, RWKV_STATE_Q8, N_SESSIONS, 0) == NULL, "Opened a store with another encoding");
+    ASSERT(rwkv_get_last_error(ctx) == (RWKV_ERROR_ARGS | RWKV_ERROR_DIMENSION), "Unexpected error");
+
+    remove(STORE_PATH);
+#endif
+
+    rwkv_free(ctx);
+
+    free(states);
+    free(state);
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+// Tests that per-token sequence evaluation agrees with evaluating each prefix, and that speculative generation
+// with a draft model, with prompt lookup or with skipped layers gives the same tokens as rwkv_generate with greedy sampling.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+#define N_TOKENS 12
+#define N_DRAFT 3
+
+const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o' };
+#define PROMPT_LEN (sizeof(prompt) / sizeof(prompt[0]))
+
+float max_difference(const float * expected, const float * actual, const size_t n) {
+    float max_diff = 0.0F;
+
+    for (size_t i = 0; i < n; i++) {
+        max_diff = fmaxf(max_diff, fabsf(actual[i] - expected[i]));
+    }
+
+    return max_diff;
+}
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    struct rwkv_context * draft_ctx = rwkv_init_from_file("tiny-rwkv-660K-FP16.bin", N_THREADS);
+    ASSERT(draft_ctx != NULL, "Failed to load the draft model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    const size_t state_len = rwkv_get_state_len(ctx);
+    float * token_logits = malloc(sizeof(float) * n_vocab * PROMPT_LEN);
+    float * token_states = malloc(sizeof(float) * state_len * PROMPT_LEN);
+    float * expected_state = malloc(sizeof(float) * state_len);
+    float * state = malloc(sizeof(float) * state_len);
+    float * logits = malloc(sizeof(float) * n_vocab);
+
+    // Row i has the logits and state after the first i + 1 tokens.
+    ASSERT(rwkv_eval_sequence_per_token(ctx, prompt, PROMPT_LEN, NULL, token_logits, token_states), "rwkv_eval_sequence_per_token failed");
+
+    for (size_t i = 0; i < PROMPT_LEN; i++) {
+        ASSERT(rwkv_eval_sequence(ctx, prompt, i + 1, NULL, state, logits), "rwkv_eval_sequence failed");
+        ASSERT(max_difference(logits, token_logits + i * n_vocab, n_vocab) < 0.01F, "Logits after token %zu differ too much", i);
+        ASSERT(max_difference(state, token_states + i * state_len, state_len) < 0.01F, "State after token %zu differs too much", i);
+    }
+
+    // The sequence graph is rebuilt for plain evaluation, which still gives the same logits.
+    ASSERT(rwkv_eval_sequence(ctx, prompt, PROMPT_LEN, NULL, NULL, logits), "rwkv_eval_sequence failed");
+    ASSERT(max_difference(logits, token_logits + (PROMPT_LEN - 1) * n_vocab, n_vocab) < 0.01F, "Logits differ after rebuilding the graph");
+
+    uint32_t expected[N_TOKENS];
+    size_t generated_len;
+    ASSERT(rwkv_generate(ctx, prompt, PROMPT_LEN, N_TOKENS, NULL, NULL, 0, NULL, expected_state, expected, &generated_len, NULL, NULL), "rwkv_generate failed");
+
+    // With greedy sampling, drafted tokens only change how many tokens are verified at once.
+    struct rwkv_speculation_params speculation = { RWKV_SPECULATION_DRAFT_MODEL, N_DRAFT, draft_ctx, NULL, NULL, 0, NULL };
+    struct rwkv_speculation_stats stats;
+    uint32_t tokens[N_TOKENS];
+
+    ASSERT(rwkv_generate_speculative(ctx, &speculation, &stats, prompt, PROMPT_LEN, N_TOKENS, NULL, NULL, 0, NULL, state, tokens, &generated_len, NULL, NULL), "rwkv_generate_speculative failed");
+    ASSERT(generated_len == N_TOKENS, "Unexpected count of tokens %d", (int) generated_len);
+    ASSERT(memcmp(expected, tokens, sizeof(expected)) == 0, "Tokens differ");
+    ASSERT(max_difference(expected_state, state, state_len) < 0.01F, "State differs too much");
+    ASSERT(stats.drafted == stats.verifications * N_DRAFT && stats.accepted <= stats.drafted, "Unexpected stats");
+    ASSERT(stats.verifications < N_TOKENS, "No drafted token was accepted");
+
+    // Generation ends at the first occurrence of the stop sequence.
+    const struct rwkv_stop_sequence stop = { expected + 5, 2 };
+    size_t stop_position = 0;
+
+    while (expected[stop_position] != expected[5] || expected[stop_position + 1] != expected[6]) {
+        stop_position++;
+    }
+
+    ASSERT(rwkv_generate_speculative(ctx, &speculation, NULL, prompt, PROMPT_LEN, N_TOKENS, NULL, &stop, 1, NULL, NULL, tokens, &generated_len, NULL, NULL), "rwkv_generate_speculative failed");
+    ASSERT(generated_len == stop_position, "Unexpected count of tokens %d before the stop sequence", (int) generated_len);
+
+    // The same seed gives the same tokens.
+    const struct rwkv_sampler_params params = { 1.0F, 0.9F, 10, 0.2F, 0.2F, 42 };
+    uint32_t sampled[N_TOKENS];
+    ASSERT(rwkv_generate_speculative(ctx, &speculation, NULL, prompt, PROMPT_LEN, N_TOKENS, &params, NULL, 0, NULL, NULL, sampled, NULL, NULL, NULL), "rwkv_generate_speculative failed");
+    ASSERT(rwkv_generate_speculative(ctx, &speculation, NULL, prompt, PROMPT_LEN, N_TOKENS, &params, NULL, 0, NULL, NULL, tokens, NULL, NULL, NULL), "rwkv_generate_speculative failed");
+    ASSERT(memcmp(sampled, tokens, sizeof(sampled)) == 0, "Sampling with the same seed differs");
+
+    // Penalties of each verified token count only the tokens before it, so greedy sampling with penalties gives the same tokens too.
+    const struct rwkv_sampler_params penalized = { 0.0F, 1.0F, 0, 1.0F, 1.0F, 0 };
+    uint32_t expected_penalized[N_TOKENS];
+    ASSERT(rwkv_generate(ctx, prompt, PROMPT_LEN, N_TOKENS, &penalized, NULL, 0, NULL, NULL, expected_penalized, NULL, NULL, NULL), "rwkv_generate failed");
+    ASSERT(rwkv_generate_speculative(ctx, &speculation, NULL, prompt, PROMPT_LEN, N_TOKENS, &penalized, NULL, 0, NULL, NULL, tokens, &generated_len, NULL, NULL), "rwkv_generate_speculative failed");
+    ASSERT(generated_len == N_TOKENS, "Unexpected count of tokens %d", (int) generated_len);
+    ASSERT(memcmp(expected_penalized, tokens, sizeof(expected_penalized)) == 0, "Tokens differ with penalties");
+
+    // The prompt repeats, so its last tokens occurred before and their continuation is drafted from the first call on.
+    uint32_t repeated_prompt[PROMPT_LEN * 2 + N_TOKENS];
+    memcpy(repeated_prompt, prompt, sizeof(prompt));
+    memcpy(repeated_prompt + PROMPT_LEN, expected, sizeof(expected));
+    memcpy(repeated_prompt + PROMPT_LEN + N_TOKENS, prompt, sizeof(prompt));
+    const size_t repeated_len = sizeof(repeated_prompt) / sizeof(repeated_prompt[0]);
+
+    ASSERT(rwkv_generate(ctx, repeated_prompt, repeated_len, N_TOKENS, NULL, NULL, 0, NULL, expected_state, expected, NULL, NULL, NULL), "rwkv_generate failed");
+
+    const struct rwkv_speculation_params lookup = { RWKV_SPECULATION_PROMPT_LOOKUP, N_DRAFT, NULL, NULL, NULL, 2, NULL };
+    ASSERT(rwkv_generate_speculative(ctx, &lookup, &stats, repeated_prompt, repeated_len, N_TOKENS, NULL, NULL, 0, NULL, state, tokens, &generated_len, NULL, NULL), "rwkv_generate_speculative failed");
+    ASSERT(generated_len == N_TOKENS, "Unexpected count of tokens %d", (int) generated_len);
+    ASSERT(memcmp(expected, tokens, sizeof(expected)) == 0, "Tokens differ with prompt lookup");
+    ASSERT(max_difference(expected_state, state, state_len) < 0.01F, "State differs too much with prompt lookup");
+    ASSERT(stats.verifications > 0 && stats.accepted <= stats.drafted, "Unexpected stats");
+
+    // Every other layer drafts tokens by default.
+    ASSERT(rwkv_generate(ctx, prompt, PROMPT_LEN, N_TOKENS, NULL, NULL, 0, NULL, expected_state, expected, NULL, NULL, NULL), "rwkv_generate failed");
+
+    struct rwkv_speculation_params layer_skip = { RWKV_SPECULATION_LAYER_SKIP, N_DRAFT, NULL, NULL, NULL, 0, NULL };
+    ASSERT(rwkv_generate_speculative(ctx, &layer_skip, &stats, prompt, PROMPT_LEN, N_TOKENS, NULL, NULL, 0, NULL, state, tokens, &generated_len, NULL, NULL), "rwkv_generate_speculative failed");
+    ASSERT(generated_len == N_TOKENS, "Unexpected count of tokens %d", (int) generated_len);
+    ASSERT(memcmp(expected, tokens, sizeof(expected)) == 0, "Tokens differ with skipped layers");
+    ASSERT(max_difference(expected_state, state, state_len) < 0.01F, "State differs too much with skipped layers");
+
+    ASSERT(rwkv_generate_speculative(ctx, &layer_skip, NULL, prompt, PROMPT_LEN, N_TOKENS, &penalized, NULL, 0, NULL, NULL, tokens, NULL, NULL, NULL), "rwkv_generate_speculative failed");
+    ASSERT(memcmp(expected_penalized, tokens, sizeof(expected_penalized)) == 0, "Tokens differ with penalties and skipped layers");
+
+    // Without skipped layers, the draft is the model itself, so drafted tokens are accepted.
+    bool layer_mask[64];
+    ASSERT(rwkv_get_n_layer(ctx) <= 64, "Too many layers");
+    memset(layer_mask, 1, sizeof(layer_mask));
+    layer_skip.layer_mask = layer_mask;
+
+    ASSERT(rwkv_generate_speculative(ctx, &layer_skip, &stats, prompt, PROMPT_LEN, N_TOKENS, NULL, NULL, 0, NULL, NULL, tokens, NULL, NULL, NULL), "rwkv_generate_speculative failed");
+    ASSERT(memcmp(expected, tokens, sizeof(expected)) == 0, "Tokens differ without skipped layers");
+    ASSERT(stats.accepted > 0, "No drafted token was accepted");
+
+    rwkv_set_print_errors(ctx, false);
+    memset(layer_mask, 0, sizeof(layer_mask));
+    ASSERT(!rwkv_generate_speculative(ctx, &layer_skip, NULL, prompt, PROMPT_LEN, N_TOKENS, NULL, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL), "Empty layer mask was accepted");
+    ASSERT(rwkv_get_last_error(ctx) == RWKV_ERROR_ARGS, "Unexpected error");
+
+    speculation.draft_ctx = ctx;
+    ASSERT(!rwkv_generate_speculative(ctx, &speculation, NULL, prompt, PROMPT_LEN, N_TOKENS, NULL, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL), "Model was accepted as its own draft model");
+    ASSERT(rwkv_get_last_error(ctx) == RWKV_ERROR_ARGS, "Unexpected error");
+
+    speculation.mode = RWKV_SPECULATION_PROMPT_LOOKUP;
+    ASSERT(!rwkv_generate_speculative(ctx, &speculation, NULL, prompt, PROMPT_LEN, N_TOKENS, NULL, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL), "Empty n-grams were accepted");
+    ASSERT(rwkv_get_last_error(ctx) == RWKV_ERROR_ARGS, "Unexpected error");
+
+    rwkv_free(draft_ctx);
+    rwkv_free(ctx);
+
+    free(token_logits);
+    free(token_states);
+    free(expected_state);
+    free(state);
+    free(logits);
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+// Tests that serialized states restore evaluation accurately in all encodings, and that invalid states are rejected.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 2
+
+// The header consists of six 32-bit fields followed by the 64-bit model fingerprint.
+#define FINGERPRINT_OFFSET 24
+
+const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o', ' ', 'w', 'o', 'r', 'l', 'd' };
+#define PROMPT_LEN (sizeof(prompt) / sizeof(prompt[0]))
+
+const uint32_t continuation[] = { ',', ' ', 'h', 'i' };
+#define CONTINUATION_LEN (sizeof(continuation) / sizeof(continuation[0]))
+
+float max_difference(const float * expected, const float * actual, const size_t n) {
+    float max_diff = 0.0F;
+
+    for (size_t i = 0; i < n; i++) {
+        max_diff = fmaxf(max_diff, fabsf(actual[i] - expected[i]));
+    }
+
+    return max_diff;
+}
+
+// Continues evaluation from the given state, token by token, and returns the last logits.
+void continue_eval(struct rwkv_context * ctx, float * state, float * logits) {
+    for (size_t i = 0; i < CONTINUATION_LEN; i++) {
+        ASSERT(rwkv_eval(ctx, continuation[i], state, state, logits), "rwkv_eval failed");
+    }
+}
+
+void test_encoding(struct rwkv_context * ctx, const enum rwkv_state_encoding encoding, const float * prompt_state, const float * expected_logits, const float max_diff) {
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    const size_t state_len = rwkv_get_state_len(ctx);
+    float * state = malloc(sizeof(float) * state_len);
+    float * logits = malloc(sizeof(float) * n_vocab);
+
+    const size_t size = rwkv_state_serialized_size(ctx, encoding);
+    ASSERT(size > 0, "Unknown encoding %d", encoding);
+    void * buffer = malloc(size);
+
+    ASSERT(rwkv_state_serialize(ctx, prompt_state, encoding, buffer, size), "Failed to serialize with encoding %d", encoding);
+    ASSERT(rwkv_state_deserialize(ctx, buffer, size, state), "Failed to deserialize with encoding %d", encoding);
+
+    continue_eval(ctx, state, logits);
+
+    const float diff = max_difference(expected_logits, logits, n_vocab);
+    fprintf(stderr, "Encoding %d: %zu bytes, max logit difference %f\n", encoding, size, (double) diff);
+    ASSERT(diff <= max_diff, "Too big difference %f with encoding %d, expected no more than %f", (double) diff, encoding, (double) max_diff);
+
+    free(buffer);
+    free(state);
+    free(logits);
+}
+
+void test_model(const char * model_path) {
+    fprintf(stderr, "Testing %s\n", model_path);
+
+    struct rwkv_context * ctx = rwkv_init_from_file(model_path, N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    const size_t state_len = rwkv_get_state_len(ctx);
+    float * prompt_state = malloc(sizeof(float) * state_len);
+    float * state = malloc(sizeof(float) * state_len);
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * logits = malloc(sizeof(float) * n_vocab);
+
+    ASSERT(rwkv_eval_sequence(ctx, prompt, PROMPT_LEN, NULL, prompt_state, logits), "rwkv_eval_sequence failed");
+    memcpy(state, prompt_state, sizeof(float) * state_len);
+    continue_eval(ctx, state, expected_logits);
+
+    // FP32 is lossless; lossy encodings are much smaller and stay close.
+    test_encoding(ctx, RWKV_STATE_FP32, prompt_state, expected_logits, 0.0F);
+    test_encoding(ctx, RWKV_STATE_FP16, prompt_state, expected_logits, 0.05F);
+    test_encoding(ctx, RWKV_STATE_Q8, prompt_state, expected_logits, 0.25F);
+
+    const size_t fp32_size = rwkv_state_serialized_size(ctx, RWKV_STATE_FP32);
+    ASSERT(fp32_size > sizeof(float) * state_len, "Serialized state has no header");
+    ASSERT(rwkv_state_serialized_size(ctx, RWKV_STATE_Q8) < fp32_size * 11 / 20, "Q8 encoding is too large");
+
+    // Damaged states are rejected.
+    const size_t size = rwkv_state_serialized_size(ctx, RWKV_STATE_Q8);
+    unsigned char * buffer = malloc(size);
+    ASSERT(rwkv_state_serialize(ctx, prompt_state, RWKV_STATE_Q8, buffer, size), "Failed to serialize");
+
+    rwkv_set_print_errors(ctx, false);
+
+    ASSERT(!rwkv_state_serialize(ctx, prompt_state, RWKV_STATE_Q8, buffer, size - 1), "Serialized into a too small buffer");
+    ASSERT(rwkv_get_last_error(ctx) == (RWKV_ERROR_ARGS | RWKV_ERROR_SHAPE), "Unexpected error");
+
+    ASSERT(!rwkv_state_deserialize(ctx, buffer, size - 1, state), "Deserialized a truncated state");
+    ASSERT(rwkv_get_last_error(ctx) == (RWKV_ERROR_ARGS | RWKV_ERROR_SHAPE), "Unexpected error");
+
+    buffer[FINGERPRINT_OFFSET] ^= 1;
+    ASSERT(!rwkv_state_deserialize(ctx, buffer, size, state), "Deserialized a state of a different model");
+    ASSERT(rwkv_get_last_error(ctx) == (RWKV_ERROR_ARGS | RWKV_ERROR_KEY), "Unexpected error");
+    buffer[FINGERPRINT_OFFSET] ^= 1;
+
+    buffer[0] ^= 1;
+    ASSERT(!rwkv_state_deserialize(ctx, buffer, size, state), "Deserialized a buffer without a state");
+    ASSERT(rwkv_get_last_error(ctx) == (RWKV_ERROR_ARGS | RWKV_ERROR_FILE_MAGIC), "Unexpected error");
+    buffer[0] ^= 1;
+
+    ASSERT(rwkv_state_deserialize(ctx, buffer, size, state), "Failed to deserialize a restored state");
+
+    free(buffer);
+    rwkv_free(ctx);
+
+    free(prompt_state);
+    free(state);
+    free(expected_logits);
+    free(logits);
+}
+
+int main(void) {
+    test_model("tiny-rwkv-660K-FP32.bin");
+    test_model("tiny-rwkv-660K-FP16.bin");
+
+    // Fingerprints do not depend on the data type, so states can move between the FP32 and FP16 models.
+    struct rwkv_context * fp32_ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    struct rwkv_context * fp16_ctx = rwkv_init_from_file("tiny-rwkv-660K-FP16.bin", N_THREADS);
+    ASSERT(fp32_ctx != NULL && fp16_ctx != NULL, "Failed to load the models");
+
+    const size_t state_len = rwkv_get_state_len(fp32_ctx);
+    float * state = malloc(sizeof(float) * state_len);
+    float * restored_state = malloc(sizeof(float) * state_len);
+
+    ASSERT(rwkv_eval_sequence(fp32_ctx, prompt, PROMPT_LEN, NULL, state, NULL), "rwkv_eval_sequence failed");
+
+    const size_t size = rwkv_state_serialized_size(fp32_ctx, RWKV_STATE_FP32);
+    void * buffer = malloc(size);
+    ASSERT(rwkv_state_serialize(fp32_ctx, state, RWKV_STATE_FP32, buffer, size), "Failed to serialize");
+    ASSERT(rwkv_state_deserialize(fp16_ctx, buffer, size, restored_state), "Failed to deserialize into the FP16 model");
+    ASSERT(memcmp(state, restored_state, sizeof(float) * state_len) == 0, "Restored state differs");
+
+    free(buffer);
+    free(state);
+    free(restored_state);
+
+    rwkv_free(fp32_ctx);
+    rwkv_free(fp16_ctx);
+
+    return 0;
+}
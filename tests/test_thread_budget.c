@@ -0,0 +1,118 @@
+// Tests that contexts sharing a thread budget give the same results as contexts computing with their own threads.
+
+#include "rwkv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASSERT(x, ...) {\
+        if (!(x)) {\
+            fprintf(stderr, "*** Assertion failed ***\n");\
+            fprintf(stderr, __VA_ARGS__);\
+            fprintf(stderr, "\n%s:%d\n", __FILE__, __LINE__);\
+            abort();\
+        }\
+    }
+
+#define N_THREADS 4
+#define N_CONTEXTS 3
+
+int main(void) {
+    struct rwkv_context * ctx = rwkv_init_from_file("tiny-rwkv-660K-FP32.bin", N_THREADS);
+    ASSERT(ctx != NULL, "Failed to load the model");
+
+    const size_t n_vocab = rwkv_get_logits_len(ctx);
+    float * state = malloc(sizeof(float) * rwkv_get_state_len(ctx));
+    float * expected_logits = malloc(sizeof(float) * n_vocab);
+    float * expected_sequence_logits = malloc(sizeof(float) * n_vocab);
+    float * logits = malloc(sizeof(float) * n_vocab * N_CONTEXTS);
+
+    const uint32_t prompt[] = { 'h', 'e', 'l', 'l', 'o' };
+    const size_t prompt_len = sizeof(prompt) / sizeof(prompt[0]);
+
+    ASSERT(rwkv_eval(ctx, prompt[0], NULL, state, expected_logits), "rwkv_eval failed");
+    ASSERT(rwkv_eval_sequence(ctx, prompt, prompt_len, NULL, state, expected_sequence_logits), "rwkv_eval_sequence failed");
+
+    // A single thread is shared by all contexts, so every evaluation computes with fewer threads than its context has.
+    struct rwkv_thread_budget * budget = rwkv_thread_budget_new(1);
+    ASSERT(budget != NULL, "Failed to create the thread budget");
+    rwkv_set_thread_budget(ctx, budget);
+
+    struct rwkv_context * contexts[N_CONTEXTS];
+    contexts[0] = ctx;
+
+    for (size_t i = 1; i < N_CONTEXTS; i++) {
+        contexts[i] = rwkv_clone_context(ctx, N_THREADS);
+        ASSERT(contexts[i] != NULL, "Failed to clone the context");
+    }
+
+    // Evaluate all contexts concurrently.
+    struct rwkv_executor * executor = rwkv_executor_new(N_CONTEXTS);
+    ASSERT(executor != NULL, "Failed to create the executor");
+
+    struct rwkv_async * handles[N_CONTEXTS];
+
+    for (size_t i = 0; i < N_CONTEXTS; i++) {
+        handles[i] = rwkv_eval_async(executor, contexts[i], prompt[0], NULL, NULL, logits + i * n_vocab, NULL, NULL);
+        ASSERT(handles[i] != NULL, "rwkv_eval_async failed");
+    }
+
+    for (size_t i = 0; i < N_CONTEXTS; i++) {
+        ASSERT(rwkv_async_wait(handles[i]) == RWKV_ASYNC_DONE, "Evaluation %zu failed", i);
+        rwkv_async_free(handles[i]);
+        ASSERT(memcmp(expected_logits, logits + i * n_vocab, sizeof(float) * n_vocab) == 0, "Logits of context %zu differ", i);
+    }
+
+    for (size_t i = 0; i < N_CONTEXTS; i++) {
+        handles[i] = rwkv_eval_sequence_async(executor, contexts[i], prompt, prompt_len, NULL, NULL, logits + i * n_vocab, NULL, NULL);
+        ASSERT(handles[i] != NULL, "rwkv_eval_sequence_async failed");
+    }
+
+    for (size_t i = 0; i < N_CONTEXTS; i++) {
+        ASSERT(rwkv_async_wait(handles[i]) == RWKV_ASYNC_DONE, "Sequence evaluation %zu failed", i);
+        rwkv_async_free(handles[i]);
+        ASSERT(memcmp(expected_sequence_logits, logits + i * n_vocab, sizeof(float) * n_vocab) == 0, "Sequence logits of context %zu differ", i);
+    }
+
+    rwkv_executor_free(executor);
+
+    // Detached contexts compute with their own threads again.
+    for (size_t i = 0; i < N_CONTEXTS; i++) {
+        rwkv_set_thread_budget(contexts[i], NULL);
+    }
+
+    rwkv_thread_budget_free(budget);
+
+    ASSERT(rwkv_eval(ctx, prompt[0], NULL, state, logits), "rwkv_eval failed");
+    ASSERT(memcmp(expected_logits, logits, sizeof(float) * n_vocab) == 0, "Logits differ after detaching");
+
+    // A sequence graph first computed with fewer threads from the budget still has a large enough work buffer
+    // for all threads of the context. FP16 matrices need a work buffer, unlike FP32 ones.
+    struct rwkv_context * fp16_ctx = rwkv_init_from_file("tiny-rwkv-660K-FP16.bin", N_THREADS);
+    ASSERT(fp16_ctx != NULL, "Failed to load the FP16 model");
+    ASSERT(rwkv_set_n_threads(fp16_ctx, RWKV_EVAL_SEQUENCE, N_THREADS), "rwkv_set_n_threads failed");
+
+    budget = rwkv_thread_budget_new(1);
+    ASSERT(budget != NULL, "Failed to create the thread budget");
+    rwkv_set_thread_budget(fp16_ctx, budget);
+    ASSERT(rwkv_eval_sequence(fp16_ctx, prompt, prompt_len, NULL, NULL, expected_sequence_logits), "rwkv_eval_sequence failed");
+
+    rwkv_set_thread_budget(fp16_ctx, NULL);
+    rwkv_thread_budget_free(budget);
+    ASSERT(rwkv_eval_sequence(fp16_ctx, prompt, prompt_len, NULL, NULL, logits), "rwkv_eval_sequence failed with all threads");
+    ASSERT(memcmp(expected_sequence_logits, logits, sizeof(float) * n_vocab) == 0, "Sequence logits differ with all threads");
+
+    rwkv_free(fp16_ctx);
+
+    for (size_t i = 0; i < N_CONTEXTS; i++) {
+        rwkv_free(contexts[i]);
+    }
+
+    free(state);
+    free(expected_logits);
+    free(expected_sequence_logits);
+    free(logits);
+
+    return 0;
+}
@@ -22,10 +22,29 @@
 #define N_VOCAB 256
 #define N_THREADS 2
 
-void test_model(const char * model_path, const float * expected_logits, const float max_diff) {
-    fprintf(stderr, "Testing %s\n", model_path);
+bool files_equal(const char * path_a, const char * path_b) {
+    FILE * a = fopen(path_a, "rb");
+    FILE * b = fopen(path_b, "rb");
+    ASSERT(a != NULL && b != NULL, "Failed to open %s or %s", path_a, path_b);
 
-    struct rwkv_context * model = rwkv_init_from_file(model_path, N_THREADS);
+    int byte_a;
+    int byte_b;
+
+    do {
+        byte_a = fgetc(a);
+        byte_b = fgetc(b);
+    } while (byte_a == byte_b && byte_a != EOF);
+
+    fclose(a);
+    fclose(b);
+
+    return byte_a == byte_b;
+}
+
+void test_model(const char * model_path, const char * format, const float * expected_logits, const float max_diff) {
+    fprintf(stderr, "Testing %s%s%s\n", model_path, format ? " converted to " : "", format ? format : "");
+
+    struct rwkv_context * model = rwkv_init_from_file_ex(model_path, N_THREADS, RWKV_INIT_NONE, format);
     enum rwkv_error_flags error = rwkv_get_last_error(NULL);
     ASSERT(error == 0, "Unexpected error %d", error);
 
@@ -118,8 +137,8 @@ int main(void) {
         0.065571F,
     };
 
-    test_model("tiny-rwkv-660K-FP32.bin", expected_logits, expected_difference_sum[0]);
-    test_model("tiny-rwkv-660K-FP16.bin", expected_logits, expected_difference_sum[1]);
+    test_model("tiny-rwkv-660K-FP32.bin", NULL, expected_logits, expected_difference_sum[0]);
+    test_model("tiny-rwkv-660K-FP16.bin", NULL, expected_logits, expected_difference_sum[1]);
 
     rwkv_quantize_model_file("tiny-rwkv-660K-FP32.bin", "tiny-rwkv-660K-FP32-Q4_0.bin", "Q4_0");
     rwkv_quantize_model_file("tiny-rwkv-660K-FP32.bin", "tiny-rwkv-660K-FP32-Q4_1.bin", "Q4_1");
@@ -127,11 +146,11 @@ int main(void) {
     rwkv_quantize_model_file("tiny-rwkv-660K-FP32.bin", "tiny-rwkv-660K-FP32-Q5_1.bin", "Q5_1");
     rwkv_quantize_model_file("tiny-rwkv-660K-FP32.bin", "tiny-rwkv-660K-FP32-Q8_0.bin", "Q8_0");
 
-    test_model("tiny-rwkv-660K-FP32-Q4_0.bin", expected_logits, expected_difference_sum[2]);
-    test_model("tiny-rwkv-660K-FP32-Q4_1.bin", expected_logits, expected_difference_sum[3]);
-    test_model("tiny-rwkv-660K-FP32-Q5_0.bin", expected_logits, expected_difference_sum[4]);
-    test_model("tiny-rwkv-660K-FP32-Q5_1.bin", expected_logits, expected_difference_sum[5]);
-    test_model("tiny-rwkv-660K-FP32-Q8_0.bin", expected_logits, expected_difference_sum[6]);
+    test_model("tiny-rwkv-660K-FP32-Q4_0.bin", NULL, expected_logits, expected_difference_sum[2]);
+    test_model("tiny-rwkv-660K-FP32-Q4_1.bin", NULL, expected_logits, expected_difference_sum[3]);
+    test_model("tiny-rwkv-660K-FP32-Q5_0.bin", NULL, expected_logits, expected_difference_sum[4]);
+    test_model("tiny-rwkv-660K-FP32-Q5_1.bin", NULL, expected_logits, expected_difference_sum[5]);
+    test_model("tiny-rwkv-660K-FP32-Q8_0.bin", NULL, expected_logits, expected_difference_sum[6]);
 
     rwkv_quantize_model_file("tiny-rwkv-660K-FP16.bin", "tiny-rwkv-660K-FP16-Q4_0.bin", "Q4_0");
     rwkv_quantize_model_file("tiny-rwkv-660K-FP16.bin", "tiny-rwkv-660K-FP16-Q4_1.bin", "Q4_1");
@@ -139,11 +158,31 @@ int main(void) {
     rwkv_quantize_model_file("tiny-rwkv-660K-FP16.bin", "tiny-rwkv-660K-FP16-Q5_1.bin", "Q5_1");
     rwkv_quantize_model_file("tiny-rwkv-660K-FP16.bin", "tiny-rwkv-660K-FP16-Q8_0.bin", "Q8_0");
 
-    test_model("tiny-rwkv-660K-FP16-Q4_0.bin", expected_logits, expected_difference_sum[7]);
-    test_model("tiny-rwkv-660K-FP16-Q4_1.bin", expected_logits, expected_difference_sum[8]);
-    test_model("tiny-rwkv-660K-FP16-Q5_0.bin", expected_logits, expected_difference_sum[9]);
-    test_model("tiny-rwkv-660K-FP16-Q5_1.bin", expected_logits, expected_difference_sum[10]);
-    test_model("tiny-rwkv-660K-FP16-Q8_0.bin", expected_logits, expected_difference_sum[11]);
+    test_model("tiny-rwkv-660K-FP16-Q4_0.bin", NULL, expected_logits, expected_difference_sum[7]);
+    test_model("tiny-rwkv-660K-FP16-Q4_1.bin", NULL, expected_logits, expected_difference_sum[8]);
+    test_model("tiny-rwkv-660K-FP16-Q5_0.bin", NULL, expected_logits, expected_difference_sum[9]);
+    test_model("tiny-rwkv-660K-FP16-Q5_1.bin", NULL, expected_logits, expected_difference_sum[10]);
+    test_model("tiny-rwkv-660K-FP16-Q8_0.bin", NULL, expected_logits, expected_difference_sum[11]);
+
+    // Rows are quantized independently, so splitting them between threads gives the same file.
+    const char * formats[] = { "Q4_0", "Q4_1", "Q5_0", "Q5_1", "Q8_0" };
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        char path[64];
+        char threaded_path[64];
+        snprintf(path, sizeof(path), "tiny-rwkv-660K-FP16-%s.bin", formats[i]);
+        snprintf(threaded_path, sizeof(threaded_path), "tiny-rwkv-660K-FP16-%s-threaded.bin", formats[i]);
+
+        ASSERT(rwkv_quantize_model_file_ex("tiny-rwkv-660K-FP16.bin", threaded_path, formats[i], N_THREADS), "Failed to quantize to %s with %d threads", formats[i], N_THREADS);
+        ASSERT(files_equal(path, threaded_path), "Quantizing to %s with %d threads gives a different file", formats[i], N_THREADS);
+    }
+
+    // Converting on load must give the same results as converting the file.
+    test_model("tiny-rwkv-660K-FP16.bin", "Q5_1", expected_logits, expected_difference_sum[10]);
+    test_model("tiny-rwkv-660K-FP16.bin", "Q8_0", expected_logits, expected_difference_sum[11]);
+    test_model("tiny-rwkv-660K-FP32.bin", "Q5_1", expected_logits, expected_difference_sum[5]);
+    // FP16 weights upcast to FP32 are exact, only the rounding of activations differs.
+    test_model("tiny-rwkv-660K-FP16.bin", "FP32", expected_logits, expected_difference_sum[1]);
 
     free(expected_logits);
 